@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <core/optional.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Count-min sketch with four-bit counters that estimates how often each key
+// was requested recently. Once the number of recorded requests reaches ten times
+// the capacity, all counters are halved, so popularity fades over time.
+//
+// The first request for a key only sets its bits in a Bloom filter (the "doorkeeper"),
+// and the sketch counts the requests after that. Most keys are requested just once,
+// so this keeps them from filling up the sketch and inflating the estimates for
+// everything else. The doorkeeper is cleared whenever the counters are halved.
+//
+// The service doesn't run for long, so the sketch can be saved and loaded again,
+// to carry the request history across restarts.
+//
+// All methods are thread-safe.
+
+class FrequencySketch final
+{
+public:
+    typedef std::unique_ptr<FrequencySketch> UPtr;
+
+    explicit FrequencySketch(int64_t capacity);
+    ~FrequencySketch();
+
+    FrequencySketch(FrequencySketch const&) = delete;
+    FrequencySketch& operator=(FrequencySketch const&) = delete;
+
+    void record(std::string const& key);
+    int frequency(std::string const& key) const;  // 0 to 15
+    void clear();
+
+    int64_t size_in_bytes() const;
+
+    // Returns the state of the sketch as a string that can be written to disk.
+    std::string serialize() const;
+
+    // Replaces the state of the sketch with data returned by serialize().
+    // Returns false (and leaves the sketch unchanged) if data is malformed
+    // or comes from a sketch with a different capacity.
+    bool deserialize(std::string const& data);
+
+private:
+    template<typename F> void for_each_counter(uint64_t hash, F f) const;
+    template<typename F> void for_each_doorkeeper_bit(uint64_t hash, F f) const;
+    int counter(uint64_t index) const;
+    void set_counter(uint64_t index, int value);
+    int estimate(uint64_t hash) const;
+    bool in_doorkeeper(uint64_t hash) const;
+
+    uint64_t const width_;           // Counters per row, a power of two.
+    uint64_t const doorkeeper_bits_;  // A power of two.
+    int64_t const sample_size_;      // Number of records after which we age the counters.
+    mutable std::mutex mutex_;
+    std::vector<uint8_t> counters_;  // Two counters per byte.
+    std::vector<uint64_t> doorkeeper_;
+    int64_t records_;
+};
+
+// Admission policy in the style of W-TinyLFU for a persistent cache.
+//
+// The cache is split into a large main cache and a small window cache. New entries
+// go into the main cache while it has room. Once it is full, a new entry goes into
+// the main cache only if its key was requested often enough recently. Otherwise,
+// it goes into the window cache, where it stays until it is evicted or requested
+// again, in which case it moves to the main cache. That way, a scan over many
+// files that are requested once each only churns the window, and the entries in
+// the main cache that are requested again and again stay where they are.
+//
+// We don't get to see which entry the main cache would evict, so instead of
+// comparing the frequency of the new entry with that of the victim, we admit
+// entries that were requested at least ADMISSION_FREQUENCY times.
+//
+// This is a template so we can run it over a simulated cache for benchmarking.
+
+template<typename CacheT>
+class AdmissionFilter final
+{
+public:
+    typedef std::unique_ptr<AdmissionFilter<CacheT>> UPtr;
+
+    static int const ADMISSION_FREQUENCY = 2;
+    static int const WINDOW_PERCENT = 5;  // Size of the window cache relative to the main cache.
+
+    struct Stats
+    {
+        int64_t window_hits;  // Lookups that found the entry in the window cache.
+        int64_t admitted;     // Entries added to the main cache, including the ones moved from the window.
+        int64_t rejected;     // Entries that went into the window cache because the main cache was full.
+        int64_t sketch_size_in_bytes;
+    };
+
+    AdmissionFilter(CacheT& main, CacheT& window, int64_t capacity);
+
+    AdmissionFilter(AdmissionFilter const&) = delete;
+    AdmissionFilter& operator=(AdmissionFilter const&) = delete;
+
+    // Records the request for key, and returns the value from the main or the window cache.
+    // A value from the window cache is due to move to the main cache. If promote is null,
+    // get() moves it right away. Otherwise, get() leaves it where it is and sets *promote,
+    // so the caller can pass the value to put() later, off the request path.
+    core::Optional<std::string> get(std::string const& key, bool* promote = nullptr);
+
+    // Like get(), but doesn't count as a request for key. This is for lookups
+    // that only check whether some other entry is around.
+    core::Optional<std::string> probe(std::string const& key, bool* promote = nullptr);
+
+    // Records a request for key that was answered without asking us, such as from a memory cache.
+    void record(std::string const& key);
+
+    // Adds the entry to the main or the window cache. An entry that goes
+    // into the main cache is removed from the window cache.
+    bool put(std::string const& key,
+             std::string const& value,
+             std::chrono::system_clock::time_point expiry_time = std::chrono::system_clock::time_point());
+
+    Stats stats() const;
+    void clear_stats();
+    void clear();  // Forgets the request history. Does not clear the caches.
+
+    // Save and restore the request history, see FrequencySketch.
+    std::string serialize() const;
+    bool deserialize(std::string const& data);
+
+private:
+    bool admit(std::string const& key, int64_t size) const;
+
+    CacheT& main_;
+    CacheT& window_;
+    FrequencySketch sketch_;
+    std::atomic<int64_t> window_hits_;
+    std::atomic<int64_t> admitted_;
+    std::atomic<int64_t> rejected_;
+};
+
+template<typename CacheT>
+int const AdmissionFilter<CacheT>::ADMISSION_FREQUENCY;
+
+template<typename CacheT>
+int const AdmissionFilter<CacheT>::WINDOW_PERCENT;
+
+template<typename CacheT>
+AdmissionFilter<CacheT>::AdmissionFilter(CacheT& main, CacheT& window, int64_t capacity)
+    : main_(main)
+    , window_(window)
+    , sketch_(capacity)
+    , window_hits_(0)
+    , admitted_(0)
+    , rejected_(0)
+{
+}
+
+template<typename CacheT>
+core::Optional<std::string> AdmissionFilter<CacheT>::get(std::string const& key, bool* promote)
+{
+    sketch_.record(key);
+    return probe(key, promote);
+}
+
+template<typename CacheT>
+core::Optional<std::string> AdmissionFilter<CacheT>::probe(std::string const& key, bool* promote)
+{
+    auto value = main_.get(key);
+    if (value)
+    {
+        return value;
+    }
+    value = window_.get(key);
+    if (value)
+    {
+        ++window_hits_;
+        if (promote)
+        {
+            *promote = true;
+        }
+        else
+        {
+            put(key, *value);  // Stays in the window if it still doesn't qualify for the main cache.
+        }
+    }
+    return value;
+}
+
+template<typename CacheT>
+void AdmissionFilter<CacheT>::record(std::string const& key)
+{
+    sketch_.record(key);
+}
+
+template<typename CacheT>
+bool AdmissionFilter<CacheT>::put(std::string const& key,
+                                  std::string const& value,
+                                  std::chrono::system_clock::time_point expiry_time)
+{
+    if (admit(key, int64_t(key.size() + value.size())))
+    {
+        ++admitted_;
+        bool const added = main_.put(key, value, expiry_time);
+        if (window_.contains_key(key))
+        {
+            window_.take(key);
+        }
+        return added;
+    }
+    ++rejected_;
+    return window_.put(key, value, expiry_time);
+}
+
+template<typename CacheT>
+bool AdmissionFilter<CacheT>::admit(std::string const& key, int64_t size) const
+{
+    auto const stats = main_.stats();
+    if (stats.size_in_bytes() + size <= stats.max_size_in_bytes())
+    {
+        return true;  // Nothing gets evicted, so there is nothing to protect.
+    }
+    return sketch_.frequency(key) >= ADMISSION_FREQUENCY;
+}
+
+template<typename CacheT>
+typename AdmissionFilter<CacheT>::Stats AdmissionFilter<CacheT>::stats() const
+{
+    return Stats{window_hits_, admitted_, rejected_, sketch_.size_in_bytes()};
+}
+
+template<typename CacheT>
+void AdmissionFilter<CacheT>::clear_stats()
+{
+    window_hits_ = 0;
+    admitted_ = 0;
+    rejected_ = 0;
+}
+
+template<typename CacheT>
+void AdmissionFilter<CacheT>::clear()
+{
+    sketch_.clear();
+}
+
+template<typename CacheT>
+std::string AdmissionFilter<CacheT>::serialize() const
+{
+    return sketch_.serialize();
+}
+
+template<typename CacheT>
+bool AdmissionFilter<CacheT>::deserialize(std::string const& data)
+{
+    return sketch_.deserialize(data);
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -18,12 +18,21 @@
 
 #pragma once
 
+#include <internal/file_io.h>
+
 #include <core/persistent_string_cache.h>
 
 #include <boost/filesystem.hpp>
 #include <QDebug>
 
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <utility>
 
 namespace unity
 {
@@ -34,14 +43,90 @@ namespace thumbnailer
 namespace internal
 {
 
+// Backends that can repair a corrupt DB specialize CacheRepair. repair() is called
+// on a background thread for a DB that is no longer in use and returns false if
+// the DB is beyond repair. count() returns the number of entries in a DB that is
+// not open, and size() returns the number of entries in an open cache. size() can
+// be a cheap estimate; count() must be exact.
+
+template<typename CacheT>
+struct CacheRepair
+{
+    static bool supported()
+    {
+        return false;
+    }
+
+    static bool repair(std::string const& /* cache_path */)
+    {
+        return false;
+    }
+
+    static int64_t count(std::string const& /* cache_path */)
+    {
+        return 0;
+    }
+
+    static int64_t size(CacheT const& /* c */)
+    {
+        return 0;
+    }
+};
+
+template<>
+struct CacheRepair<core::PersistentStringCache>
+{
+    static bool supported()
+    {
+        return true;
+    }
+
+    static bool repair(std::string const& cache_path);  // Runs leveldb::RepairDB().
+
+    static int64_t count(std::string const& cache_path);  // Iterates over the leveldb data records.
+
+    static int64_t size(core::PersistentStringCache const& c)
+    {
+        return c.size();
+    }
+};
+
 // Helper class to wrap access to a persistent cache. We use this
 // to handle database corruption: if the DB reports that it is corrupt
 // (with code 666), we delete the cache files and re-create the cache,
 // then retry the call one more time.
 //
+// If the backend supports repair (see CacheRepair above), we don't delete an LRU-only
+// cache. Instead, we move it aside to <cache_path>.salvage and carry on with an empty
+// cache while a background thread repairs the old DB. Once that is done, a miss in the
+// new cache moves the entry from the salvaged DB into the new cache if the entry survived.
+// The salvaged DB is removed once it is empty, when the cache is invalidated, or when
+// the cache is opened and the salvaged DB is more than a week old.
+//
 // In addition, the constructor also deals with caches that are re-sized when opened.
 //
-// This is a template so we can inject a mock cache for testing.
+// This is a template so we can inject a mock cache for testing, and so we can
+// use a different backend (such as SegmentStore) instead of leveldb. A backend
+// must provide:
+//
+//   typedef ... UPtr;               // std::unique_ptr to the backend
+//   typedef ... EventCallback;      // Callback for set_handler()
+//   static UPtr open(std::string const& cache_path, int64_t max_size_in_bytes, core::CacheDiscardPolicy policy);
+//   static UPtr open(std::string const& cache_path);
+//   core::Optional<std::string> get(std::string const& key);
+//   core::Optional<std::string> take(std::string const& key);
+//   bool put(std::string const& key, std::string const& value, std::chrono::time_point<std::chrono::system_clock> expiry_time);
+//   bool contains_key(std::string const& key) const;
+//   ... stats() const;
+//   void clear_stats();
+//   void invalidate();
+//   void compact();
+//   void resize(int64_t size_in_bytes);
+//   void set_handler(core::CacheEvent events, EventCallback cb);
+//
+// open() with a size throws logic_error if the backend wants to be re-sized via resize() instead.
+// A backend reports a corrupt DB by throwing system_error with code 666.
+// Backends that can return values without copying them also provide get_view().
 
 template<typename CacheT>
 class CacheHelper final
@@ -51,6 +136,8 @@ public:
 
     using UPtr = std::unique_ptr<CacheHelper<CacheT>>;  // Convenience definition for clients.
 
+    ~CacheHelper();
+
     CacheT& cache() const
     {
         return *c_;
@@ -64,15 +151,50 @@ public:
     // Methods below pass through to the underlying cache, but with retry after
     // recovery if the underlying cache reports a corrupt DB.
     core::Optional<std::string> get(std::string const& key) const;
+    core::Optional<std::string> take(std::string const& key);
     bool put(std::string const& key,
              std::string const& value,
              std::chrono::time_point<std::chrono::system_clock> expiry_time = std::chrono::system_clock::time_point());
     bool contains_key(std::string const& key) const;
-    core::PersistentCacheStats stats() const;
+
+    // Returns whatever the backend's stats() returns, core::PersistentCacheStats for leveldb.
+    template<typename C = CacheT>
+    auto stats() const -> decltype(std::declval<C const&>().stats())
+    {
+        return c_->stats();
+    }
+
+    // Returns a value that refers to the data in the backend instead of a copy,
+    // for backends that support this.
+    template<typename C = CacheT>
+    auto get_view(std::string const& key) const -> decltype(std::declval<C&>().get_view(key))
+    {
+        typedef decltype(std::declval<C&>().get_view(key)) ViewT;
+        return call<ViewT>([&]{ return c_->get_view(key); });
+    }
+
     void clear_stats();
     void invalidate();
     void compact();
 
+    // Installs an event handler on the underlying cache. The handler stays
+    // installed if the cache is re-created during recovery.
+    void set_handler(core::CacheEvent events, typename CacheT::EventCallback cb);
+
+    // Counters for the repair of corrupt DBs, reset by clear_stats().
+    struct RepairStats
+    {
+        int64_t repairs;           // Corrupt DBs we repaired instead of deleting them.
+        int64_t entries_salvaged;  // Entries that were still readable after the repair.
+        int64_t entries_lost;      // Entries that the repair could not recover.
+        int64_t entries_restored;  // Salvaged entries moved back into the cache on a miss.
+    };
+
+    RepairStats repair_stats() const;
+
+    // Returns once a repair that is in progress has finished.
+    void wait_for_repair();
+
 private:
     CacheHelper<CacheT>(std::string const& cache_path,
                         int64_t max_size_in_bytes,
@@ -113,10 +235,36 @@ private:
     void recover() const;
     void init_cache();
 
+    // Salvaged DB handling, see the class comment.
+    bool salvage_supported() const;
+    void start_salvage(bool repair, int64_t entries_before) const;
+    void run_salvage(bool repair, int64_t entries_before) const;
+    void resume_salvage();
+    void drop_salvage() const;
+    core::Optional<std::string> take_salvaged(std::string const& key) const;
+    core::Optional<std::string> restore(std::string const& key) const;
+    bool salvaged_contains_key(std::string const& key) const;
+
+    static int const SALVAGE_MAX_AGE_DAYS = 7;
+
     std::string const path_;
+    std::string const salvage_path_;   // Where a corrupt DB is repaired.
+    std::string const marker_path_;    // Exists once the repair has completed.
+    mutable std::unique_ptr<CacheT> c_;
     int64_t const size_;
     core::CacheDiscardPolicy const policy_;
-    mutable std::unique_ptr<CacheT> c_;
+    core::CacheEvent handler_events_;
+    typename CacheT::EventCallback handler_;
+    mutable std::mutex salvage_mutex_;                // Protects salvage_.
+    mutable std::shared_ptr<CacheT> salvage_;         // Repaired DB, null if none.
+    mutable std::atomic<bool> have_salvage_;          // Saves locking the mutex on every miss.
+    mutable std::atomic<int64_t> salvage_remaining_;  // Entries in salvage_ that haven't been taken yet.
+    mutable std::mutex thread_mutex_;                 // Protects repair_thread_.
+    mutable std::thread repair_thread_;
+    mutable std::atomic<int64_t> repairs_;
+    mutable std::atomic<int64_t> entries_salvaged_;
+    mutable std::atomic<int64_t> entries_lost_;
+    mutable std::atomic<int64_t> entries_restored_;
 };
 
 // Convenience definition for the normal use case with a real cache.
@@ -144,51 +292,96 @@ CacheHelper<CacheT>::CacheHelper(std::string const& cache_path,
                                  int64_t max_size_in_bytes,
                                  core::CacheDiscardPolicy policy)
     : path_(cache_path)
+    , salvage_path_(cache_path + ".salvage")
+    , marker_path_(cache_path + ".salvaged")
     , size_(max_size_in_bytes)
     , policy_(policy)
+    , handler_events_()
+    , have_salvage_(false)
+    , salvage_remaining_(0)
+    , repairs_(0)
+    , entries_salvaged_(0)
+    , entries_lost_(0)
+    , entries_restored_(0)
 {
     call<void>([&]{ init_cache(); });
+    resume_salvage();
 }
 
 template<typename CacheT>
 inline
 CacheHelper<CacheT>::CacheHelper(std::string const& cache_path)
     : path_(cache_path)
-    , c_(move(CacheT::open(path_)))
+    , salvage_path_(cache_path + ".salvage")
+    , marker_path_(cache_path + ".salvaged")
+    , c_(CacheT::open(path_))
+    , size_(c_->stats().max_size_in_bytes())
+    , policy_(c_->stats().policy())
+    , handler_events_()
+    , have_salvage_(false)
+    , salvage_remaining_(0)
+    , repairs_(0)
+    , entries_salvaged_(0)
+    , entries_lost_(0)
+    , entries_restored_(0)
+{
+}
+
+template<typename CacheT>
+inline
+CacheHelper<CacheT>::~CacheHelper()
 {
-    auto stats = c_->stats();
-    size_ = stats->max_size_in_bytes();
-    policy_ = stats->policy();
+    wait_for_repair();
 }
 
 template<typename CacheT>
 inline
 core::Optional<std::string> CacheHelper<CacheT>::get(std::string const& key) const
 {
-    return call<core::Optional<std::string>>([&]{ return c_->get(key); });
+    auto value = call<core::Optional<std::string>>([&]{ return c_->get(key); });
+    if (!value && have_salvage_)
+    {
+        value = restore(key);
+    }
+    return value;
 }
 
 template<typename CacheT>
 inline
-bool CacheHelper<CacheT>::put(std::string const& key,
-                              std::string const& value,
-                              std::chrono::time_point<std::chrono::system_clock> expiry_time)
+core::Optional<std::string> CacheHelper<CacheT>::take(std::string const& key)
 {
-    return call<bool>([&]{ return c_->put(key, value, expiry_time); });
+    auto value = call<core::Optional<std::string>>([&]{ return c_->take(key); });
+    if (have_salvage_)
+    {
+        // Remove the salvaged copy too, so it can't come back on the next miss.
+        auto salvaged = take_salvaged(key);
+        if (!value)
+        {
+            value = salvaged;
+        }
+    }
+    return value;
 }
 
 template<typename CacheT>
 inline
-bool CacheHelper<CacheT>::contains_key(std::string const& key) const
+bool CacheHelper<CacheT>::put(std::string const& key,
+                              std::string const& value,
+                              std::chrono::time_point<std::chrono::system_clock> expiry_time)
 {
-    return c_->contains_key(key);
+    bool added = call<bool>([&]{ return c_->put(key, value, expiry_time); });
+    if (have_salvage_)
+    {
+        take_salvaged(key);  // Outdated now.
+    }
+    return added;
 }
 
 template<typename CacheT>
 inline
-core::PersistentCacheStats CacheHelper<CacheT>::stats() const
+bool CacheHelper<CacheT>::contains_key(std::string const& key) const
 {
-    return c_->stats();
+    return c_->contains_key(key) || (have_salvage_ && salvaged_contains_key(key));
 }
 
 template<typename CacheT>
@@ -196,12 +389,18 @@ inline
 void CacheHelper<CacheT>::clear_stats()
 {
     c_->clear_stats();
+    repairs_ = 0;
+    entries_salvaged_ = 0;
+    entries_lost_ = 0;
+    entries_restored_ = 0;
 }
 
 template<typename CacheT>
 inline
 void CacheHelper<CacheT>::invalidate()
 {
+    wait_for_repair();
+    drop_salvage();
     call<void>([&]{ c_->invalidate(); });
 }
 
@@ -212,11 +411,39 @@ void CacheHelper<CacheT>::compact()
     call<void>([&]{ c_->compact(); });
 }
 
+template<typename CacheT>
+inline
+void CacheHelper<CacheT>::set_handler(core::CacheEvent events, typename CacheT::EventCallback cb)
+{
+    handler_events_ = events;
+    handler_ = cb;
+    c_->set_handler(handler_events_, handler_);
+}
+
+template<typename CacheT>
+inline
+typename CacheHelper<CacheT>::RepairStats CacheHelper<CacheT>::repair_stats() const
+{
+    return RepairStats{ repairs_, entries_salvaged_, entries_lost_, entries_restored_ };
+}
+
+template<typename CacheT>
+inline
+void CacheHelper<CacheT>::wait_for_repair()
+{
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    if (repair_thread_.joinable())
+    {
+        repair_thread_.join();
+    }
+}
+
 // Called if a call on the underlying cache throws an exception.
 // If the exception was not a system_error, or was a system error with
 // any code other than 666, we just let it escape. Otherwise, if the
 // exception was a system error with code 666, leveldb detected
-// DB corruption, and we delete the physical DB files and reinitialize the DB.
+// DB corruption, and we either move the DB aside for repair or delete
+// the physical DB files, and reinitialize the DB.
 
 template<typename CacheT>
 void CacheHelper<CacheT>::recover() const
@@ -237,14 +464,40 @@ void CacheHelper<CacheT>::recover() const
             throw;
         }
 
-        // DB is corrupt. Blow away the cache directory and reinitialize the cache.
+        // DB is corrupt. If we can, we repair it in the background. We don't do this if
+        // we still have the result of a previous repair, so there is at most one copy.
+        bool salvage = salvage_supported() && !boost::filesystem::exists(salvage_path_);
         qCritical() << "CacheHelper: corrupt database:" << se.what()
-                    << ": deleting" << QString::fromStdString(path_);
+                    << (salvage ? ": repairing" : ": deleting") << QString::fromStdString(path_);
         try
         {
+            int64_t entries_before = 0;
+            if (salvage)
+            {
+                try
+                {
+                    entries_before = CacheRepair<CacheT>::size(*c_);
+                    c_.reset();
+                    boost::filesystem::rename(path_, salvage_path_);
+                }
+                // LCOV_EXCL_START
+                catch (std::exception const& inner)
+                {
+                    qCritical() << "CacheHelper: cannot move corrupt database aside:" << inner.what();
+                    salvage = false;
+                }
+                // LCOV_EXCL_STOP
+            }
             c_.reset();
-            boost::filesystem::remove_all(path_);
+            if (!salvage)
+            {
+                boost::filesystem::remove_all(path_);
+            }
             const_cast<CacheHelper*>(this)->init_cache();
+            if (salvage)
+            {
+                start_salvage(true, entries_before);
+            }
         }
         catch (std::exception const& inner)
         {
@@ -276,6 +529,207 @@ using namespace std;
         c_ = move(CacheT::open(path_));
         c_->resize(size_);
     }
+    if (handler_)
+    {
+        c_->set_handler(handler_events_, handler_);
+    }
+}
+
+// Entries in a cache with expiry times can't be moved back without their expiry
+// time, so we only repair LRU-only caches.
+
+template<typename CacheT>
+bool CacheHelper<CacheT>::salvage_supported() const
+{
+    return CacheRepair<CacheT>::supported() && policy_ == core::CacheDiscardPolicy::lru_only;
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::start_salvage(bool repair, int64_t entries_before) const
+{
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    if (repair_thread_.joinable())
+    {
+        repair_thread_.join();  // Finished already, we only start a repair if there is no salvaged DB.
+    }
+    repair_thread_ = std::thread([this, repair, entries_before]{ run_salvage(repair, entries_before); });
+}
+
+// Repairs the DB in salvage_path_ if repair is true, and makes it available for restore().
+// Runs on repair_thread_.
+
+template<typename CacheT>
+void CacheHelper<CacheT>::run_salvage(bool repair, int64_t entries_before) const
+{
+    using namespace std;
+
+    try
+    {
+        if (repair)
+        {
+            ++repairs_;
+            if (!CacheRepair<CacheT>::repair(salvage_path_))
+            {
+                qCritical() << "CacheHelper: cannot repair" << QString::fromStdString(salvage_path_)
+                            << ": lost" << entries_before << "entries";
+                entries_lost_ += entries_before;
+                boost::filesystem::remove_all(salvage_path_);
+                return;
+            }
+            write_file(marker_path_, string());
+        }
+        // The stored size of the DB can include entries that the repair lost,
+        // so we count what is actually left.
+        int64_t const salvaged = CacheRepair<CacheT>::count(salvage_path_);
+        shared_ptr<CacheT> s(CacheT::open(salvage_path_));
+        if (repair)
+        {
+            int64_t const lost = max(int64_t(0), entries_before - salvaged);
+            entries_salvaged_ += salvaged;
+            entries_lost_ += lost;
+            qDebug() << "CacheHelper: repaired" << QString::fromStdString(path_) << ": salvaged"
+                     << salvaged << "entries, lost" << lost << "entries";
+        }
+        if (salvaged == 0)
+        {
+            s.reset();
+            drop_salvage();
+            return;
+        }
+        lock_guard<mutex> lock(salvage_mutex_);
+        salvage_ = move(s);
+        salvage_remaining_ = salvaged;
+        have_salvage_ = true;
+    }
+    catch (std::exception const& e)
+    {
+        qCritical() << "CacheHelper: cannot open salvaged database" << QString::fromStdString(salvage_path_)
+                    << ":" << e.what();
+        if (repair)
+        {
+            entries_lost_ += entries_before;
+        }
+        drop_salvage();
+    }
+}
+
+// Picks up the salvaged DB left by a previous run. If that run was interrupted
+// while repairing, we repair again.
+
+template<typename CacheT>
+void CacheHelper<CacheT>::resume_salvage()
+{
+    namespace fs = boost::filesystem;
+
+    if (!salvage_supported())
+    {
+        return;
+    }
+    try
+    {
+        if (!fs::exists(salvage_path_))
+        {
+            fs::remove(marker_path_);
+            return;
+        }
+        if (!fs::exists(marker_path_))
+        {
+            start_salvage(true, 0);
+            return;
+        }
+        if (fs::last_write_time(marker_path_) < time(nullptr) - SALVAGE_MAX_AGE_DAYS * 24 * 60 * 60)
+        {
+            qDebug() << "CacheHelper: removing old salvaged database" << QString::fromStdString(salvage_path_);
+            drop_salvage();
+            return;
+        }
+        start_salvage(false, 0);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qCritical() << "CacheHelper: cannot resume repair of" << QString::fromStdString(salvage_path_)
+                    << ":" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::drop_salvage() const
+{
+    std::lock_guard<std::mutex> lock(salvage_mutex_);
+    salvage_.reset();
+    have_salvage_ = false;
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(salvage_path_, ec);
+    boost::filesystem::remove(marker_path_, ec);
+}
+
+// Removes key from the salvaged DB and returns its value. We give up on
+// the salvaged DB if it gives us any trouble, and remove it once it is empty.
+
+template<typename CacheT>
+core::Optional<std::string> CacheHelper<CacheT>::take_salvaged(std::string const& key) const
+{
+    std::shared_ptr<CacheT> s;
+    {
+        std::lock_guard<std::mutex> lock(salvage_mutex_);
+        s = salvage_;
+    }
+    if (!s)
+    {
+        return core::Optional<std::string>();
+    }
+    try
+    {
+        auto value = s->take(key);
+        if (value && --salvage_remaining_ <= 0)
+        {
+            qDebug() << "CacheHelper: all salvaged entries restored for" << QString::fromStdString(path_);
+            drop_salvage();
+        }
+        return value;
+    }
+    catch (std::exception const& e)
+    {
+        qCritical() << "CacheHelper: error reading salvaged database" << QString::fromStdString(salvage_path_)
+                    << ":" << e.what();
+        drop_salvage();
+        return core::Optional<std::string>();
+    }
+}
+
+template<typename CacheT>
+core::Optional<std::string> CacheHelper<CacheT>::restore(std::string const& key) const
+{
+    auto value = take_salvaged(key);
+    if (value)
+    {
+        call<bool>([&]{ return c_->put(key, *value, std::chrono::system_clock::time_point()); });
+        ++entries_restored_;
+    }
+    return value;
+}
+
+template<typename CacheT>
+bool CacheHelper<CacheT>::salvaged_contains_key(std::string const& key) const
+{
+    std::shared_ptr<CacheT> s;
+    {
+        std::lock_guard<std::mutex> lock(salvage_mutex_);
+        s = salvage_;
+    }
+    try
+    {
+        return s && s->contains_key(key);
+    }
+    catch (std::exception const& e)
+    {
+        qCritical() << "CacheHelper: error reading salvaged database" << QString::fromStdString(salvage_path_)
+                    << ":" << e.what();
+        drop_salvage();
+        return false;
+    }
 }
 
 }  // namespace internal
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Hashes are binary strings of HASH_SIZE bytes (the first 128 bits of a SHA-256).
+
+int const HASH_SIZE = 16;
+
+// Returns an identifier for the contents of a file, so we can recognize
+// copies and hard links of the same file. To keep this cheap for large
+// videos, the hash covers the file size and a sample of 64 kB each from
+// the start, the middle, and the end of the file, rather than every byte.
+// Files of up to 192 kB are hashed in full. Throws if the file cannot be read.
+
+std::string content_hash(std::string const& filename);
+
+// Returns the hash of the given string. We use this to turn the variable-length
+// identity of a request into a fixed-size cache key.
+
+std::string key_hash(std::string const& identity);
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Counting Bloom filter over strings. may_contain() never returns false
+// for a key that was added (and not removed since), but may return true
+// for a key that was never added.
+//
+// Each slot is a four-bit counter, so keys can be removed again. A counter
+// that reaches its maximum sticks there, which can only cause false positives.
+// The filter is sized for the expected number of entries and target
+// false-positive rate passed to the constructor. It keeps working with more
+// entries than that, but the false-positive rate goes up.
+//
+// All methods are thread-safe.
+
+class CountingBloomFilter final
+{
+public:
+    typedef std::unique_ptr<CountingBloomFilter> UPtr;
+
+    struct Stats
+    {
+        int64_t size_in_bytes = 0;          // Memory used by the counters.
+        int64_t entries = 0;                // Number of keys added minus number of keys removed.
+        double false_positive_rate = 0.0;   // Estimated for the current number of entries.
+    };
+
+    CountingBloomFilter(int64_t capacity, double false_positive_rate);
+    ~CountingBloomFilter();
+
+    CountingBloomFilter(CountingBloomFilter const&) = delete;
+    CountingBloomFilter& operator=(CountingBloomFilter const&) = delete;
+
+    void add(std::string const& key);
+    void remove(std::string const& key);
+    bool may_contain(std::string const& key) const;
+    void clear();
+
+    Stats stats() const;
+
+    // Returns the state of the filter as a string that can be written to disk.
+    std::string serialize() const;
+
+    // Replaces the state of the filter with data returned by serialize().
+    // Returns false (and leaves the filter unchanged) if data is malformed
+    // or comes from a filter with different dimensions.
+    bool deserialize(std::string const& data);
+
+private:
+    int counter(uint64_t slot) const;
+    void set_counter(uint64_t slot, int value);
+    template<typename F> void for_each_slot(std::string const& key, F f) const;
+
+    uint64_t const num_slots_;
+    int const num_hashes_;
+    mutable std::mutex mutex_;
+    std::vector<uint8_t> counters_;  // Two counters per byte.
+    int64_t entries_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/cachehelper.h>
+#include <internal/segment_store.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// A persistent cache on one of the backends that CacheHelper supports,
+// chosen when the cache is opened. This lets the Thumbnailer pick the
+// backend for each of its caches from the settings.
+//
+// The leveldb backend (persistent-cache) is LRU and supports expiry times.
+// The segments backend (SegmentStore) is FIFO and faster to read from. It has
+// no expiry times of its own, so for a cache with the lru_ttl policy we store
+// the expiry time in front of each value, and drop an expired entry when it
+// is looked up. Stats are in the format of core::PersistentCacheStats.
+// SegmentStore doesn't track hit and miss runs or a size histogram, so these
+// are zero for it.
+//
+// The two backends use different files. If the cache directory holds a cache
+// for the other backend, open() deletes it and starts over.
+//
+// All methods are thread-safe.
+
+class DiskCache final
+{
+public:
+    typedef std::unique_ptr<DiskCache> UPtr;
+
+    enum class Backend
+    {
+        leveldb,
+        segments
+    };
+
+    // Returns the backend for its name in the settings ("leveldb" or "segments").
+    // Throws domain_error for any other name.
+    static Backend backend_for_name(std::string const& name);
+
+    class Stats
+    {
+    public:
+        typedef std::chrono::time_point<std::chrono::system_clock> TimePoint;
+
+        Stats() = default;
+        explicit Stats(core::PersistentCacheStats const& st);
+        Stats(SegmentStore::Stats const& st, core::CacheDiscardPolicy policy, int64_t ttl_evictions);
+
+        std::string cache_path() const;
+        core::CacheDiscardPolicy policy() const;
+        int64_t size() const;
+        int64_t size_in_bytes() const;
+        int64_t max_size_in_bytes() const;
+        int64_t hits() const;
+        int64_t misses() const;
+        int64_t hits_since_last_miss() const;
+        int64_t misses_since_last_hit() const;
+        int64_t longest_hit_run() const;
+        int64_t longest_miss_run() const;
+        double avg_hit_run_length() const;
+        double avg_miss_run_length() const;
+        int64_t ttl_evictions() const;
+        int64_t lru_evictions() const;
+        TimePoint most_recent_hit_time() const;
+        TimePoint most_recent_miss_time() const;
+        TimePoint longest_hit_run_time() const;
+        TimePoint longest_miss_run_time() const;
+        core::PersistentCacheStats::Histogram histogram() const;
+
+    private:
+        std::string cache_path_;
+        core::CacheDiscardPolicy policy_ = core::CacheDiscardPolicy::lru_only;
+        int64_t size_ = 0;
+        int64_t size_in_bytes_ = 0;
+        int64_t max_size_in_bytes_ = 0;
+        int64_t hits_ = 0;
+        int64_t misses_ = 0;
+        int64_t hits_since_last_miss_ = 0;
+        int64_t misses_since_last_hit_ = 0;
+        int64_t longest_hit_run_ = 0;
+        int64_t longest_miss_run_ = 0;
+        double avg_hit_run_length_ = 0.0;
+        double avg_miss_run_length_ = 0.0;
+        int64_t ttl_evictions_ = 0;
+        int64_t lru_evictions_ = 0;
+        TimePoint most_recent_hit_time_;
+        TimePoint most_recent_miss_time_;
+        TimePoint longest_hit_run_time_;
+        TimePoint longest_miss_run_time_;
+        core::PersistentCacheStats::Histogram histogram_;
+    };
+
+    typedef PersistentCacheHelper::RepairStats RepairStats;
+
+    typedef std::function<void(std::string const& key, core::CacheEvent ev)> EventCallback;
+
+    static UPtr open(Backend backend,
+                     std::string const& cache_path,
+                     int64_t max_size_in_bytes,
+                     core::CacheDiscardPolicy policy);
+
+    ~DiskCache();
+
+    DiskCache(DiskCache const&) = delete;
+    DiskCache& operator=(DiskCache const&) = delete;
+
+    Backend backend() const;
+
+    core::Optional<std::string> get(std::string const& key) const;
+    core::Optional<std::string> take(std::string const& key);
+    bool put(std::string const& key,
+             std::string const& value,
+             std::chrono::time_point<std::chrono::system_clock> expiry_time = std::chrono::system_clock::time_point());
+    bool contains_key(std::string const& key) const;
+    Stats stats() const;
+    void clear_stats();
+    void invalidate();
+    void compact();
+
+    // Supports the put, evict_ttl, and evict_lru events. The handler stays installed
+    // if the cache is re-created during recovery.
+    void set_handler(core::CacheEvent events, EventCallback cb);
+
+    RepairStats repair_stats() const;
+    void wait_for_repair();
+
+private:
+    DiskCache(Backend backend, core::CacheDiscardPolicy policy);
+
+    core::Optional<std::string> unwrap(std::string const& key, core::Optional<std::string> value, bool remove) const;
+    void notify(std::string const& key, core::CacheEvent ev) const;
+
+    Backend const backend_;
+    bool const expiring_;  // True if segment values start with their expiry time.
+    PersistentCacheHelper::UPtr leveldb_;
+    CacheHelper<SegmentStore>::UPtr segments_;
+    mutable std::atomic<int64_t> ttl_evictions_;
+    mutable std::mutex handler_mutex_;  // Protects handler_events_ and handler_.
+    core::CacheEvent handler_events_;
+    EventCallback handler_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Separable image downscaler for 8-bit RGB and RGBA data.
+//
+// Each output row is produced by a vertical pass that combines the
+// contributing source rows into a single row, followed by a horizontal pass
+// over that row. The vertical pass touches most of the data and has SSE2,
+// AVX2, and NEON versions. The fastest one supported by the CPU is chosen at
+// run time. All kernels use the same fixed-point arithmetic, so they produce
+// identical output.
+//
+// RGBA data is premultiplied by alpha for the duration of the scaling so that
+// fully transparent pixels don't bleed their colour into their neighbours.
+
+enum class ScaleFilter
+{
+    box,       // Area average. Fast, and free of aliasing for large reductions.
+    lanczos3   // Sharper, at the cost of more taps per pixel.
+};
+
+enum class ScaleKernel
+{
+    automatic,  // Fastest kernel supported by this CPU.
+    scalar,
+    sse2,
+    avx2,
+    neon
+};
+
+// Returns true if the kernel can be used on this machine.
+bool scale_kernel_supported(ScaleKernel kernel);
+
+// Returns the kernel used for ScaleKernel::automatic.
+ScaleKernel best_scale_kernel();
+
+char const* scale_kernel_name(ScaleKernel kernel);
+
+// Scales the image at src to the size of the image at dst. The strides are the
+// number of bytes from the start of one row to the start of the next.
+// channels must be 3 (RGB) or 4 (RGBA). The output can be larger than the input
+// in either direction, but the filters are designed for reduction.
+// Throws invalid_argument if the parameters are invalid or if the requested
+// kernel is not supported.
+void downscale(uint8_t const* src, int src_width, int src_height, int src_stride,
+               uint8_t* dst, int dst_width, int dst_height, int dst_stride,
+               int channels,
+               ScaleFilter filter = ScaleFilter::box,
+               ScaleKernel kernel = ScaleKernel::automatic);
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Looks for cover art in the container of a video file without decoding anything,
+// so we don't have to run vs-thumb for videos that carry their own artwork.
+// Understands the iTunes "covr" item in MP4 files (moov/udta/meta/ilst/covr)
+// and cover attachments in Matroska and WebM files.
+//
+// Returns the encoded image, or the empty string if the file does not contain
+// cover art or is not in a format we understand. Covers larger than
+// MAX_EMBEDDED_ART_SIZE are ignored. Throws if the file cannot be read.
+
+constexpr size_t MAX_EMBEDDED_ART_SIZE = 16 * 1024 * 1024;
+
+std::string extract_embedded_art(std::string const& filename);
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QObject>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Pool of long-lived vs-thumb processes that extract images from video files.
+//
+// Gstreamer pipelines are unstable, so extraction runs in a separate process.
+// Starting a new vs-thumb for every video is costly: exec, gst_init(), loading the
+// plugin registry, and setting up the pipeline take far longer than decoding a
+// single frame. Instead, the pool keeps up to max_workers vs-thumb processes
+// running and sends them jobs over a socket (see vs_thumb_protocol.h).
+//
+// To retain the isolation that the separate process provides, a worker is replaced
+// after it has completed max_jobs_per_worker jobs, after a job whose pipeline failed, if it crashes,
+// or if a job takes longer than its timeout (in which case the worker is killed).
+// Replacement workers are started on demand.
+//
+// Jobs that are submitted while all workers are busy wait in a queue.
+// The pool must be used from the thread that created it.
+
+class ExtractorPool final : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::function<void(std::string const& error)> DoneFunc;
+
+    static int const MAX_JOBS_PER_WORKER = 50;
+
+    ExtractorPool(int max_workers, int max_jobs_per_worker = MAX_JOBS_PER_WORKER);
+    ~ExtractorPool();
+
+    ExtractorPool(ExtractorPool const&) = delete;
+    ExtractorPool& operator=(ExtractorPool const&) = delete;
+
+    // Queues extraction of a still frame or embedded cover art from filename.
+    // A still frame is scaled down to fit into max_size x max_size, unless
+    // max_size is 0. The image is written to out_fd. The pool takes ownership of out_fd and
+    // closes it once the worker has received it.
+    // Once the job completes, done_func is called with an empty string on success,
+    // or with an error message otherwise.
+    // Returns an id that can be passed to cancel().
+    int64_t submit(std::string const& filename,
+                   int max_size,
+                   int out_fd,
+                   std::chrono::milliseconds timeout,
+                   DoneFunc const& done_func);
+
+    // Cancels a job. If the job is running, its worker is killed. done_func is not called.
+    // Cancelling a job that has completed already has no effect.
+    void cancel(int64_t job_id);
+
+    int num_workers() const;         // Number of running workers, including ones that are exiting.
+    int64_t workers_started() const; // Total number of workers started so far.
+
+private:
+    struct Job;
+    class Worker;
+
+    void dispatch();
+    Worker* spawn_worker();
+    void run_job(Worker* w, std::unique_ptr<Job> job);
+    void worker_readable(Worker* w);
+    void worker_timeout(Worker* w);
+    void worker_exited(Worker* w, std::string const& error);
+    void retire(Worker* w);
+
+    int const max_workers_;
+    int const max_jobs_per_worker_;
+    int64_t next_job_id_;
+    int64_t workers_started_;
+    std::deque<std::unique_ptr<Job>> pending_;
+    std::vector<Worker*> workers_;   // Workers that accept jobs. Owned by the pool (as QObject children).
+    std::vector<Worker*> retiring_;  // Workers we no longer use that have not exited yet.
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -23,6 +23,7 @@
 #include <QByteArray>
 #include <QSize>
 
+#include <functional>
 #include <string>
 
 struct _GdkPixbuf;
@@ -51,6 +52,14 @@ public:
     Image(QByteArray const& ba, QSize requested_size = QSize());
     Image(int fd, QSize requested_size = QSize());
 
+    // Wraps height rows of 8-bit RGB pixels without copying them. release_func
+    // is called once the image (and all copies of it) no longer need the pixels.
+    Image(unsigned char const* rgb_data,
+          int width,
+          int height,
+          int rowstride,
+          std::function<void()> const& release_func);
+
     Image(Image const&) = default;
     Image& operator=(Image const&) = default;
     Image(Image&&) = default;
@@ -19,18 +19,16 @@
 
 #pragma once
 
-#include <unity/util/ResourcePtr.h>
+#include <internal/extractorpool.h>
+#include <internal/image.h>
+#include <internal/raii.h>
 
-#include <QSocketNotifier>
-#include <QProcess>
-#include <QTimer>
+#include <QObject>
 
 #include <chrono>
 #include <memory>
 #include <string>
 
-#include <unistd.h>
-
 namespace unity
 {
 
@@ -40,44 +38,46 @@ namespace thumbnailer
 namespace internal
 {
 
+// ImageExtractor runs an extraction in the ExtractorPool. vs-thumb writes the image into
+// a memfd that we create. A still frame arrives as raw pixels that we map and wrap
+// without copying; cover art arrives as encoded image data that we decode from the mapping.
+
 class ImageExtractor final : public QObject
 {
     Q_OBJECT
 public:
-    ImageExtractor(std::string const& filename, std::chrono::milliseconds timeout);
+    ImageExtractor(std::string const& filename,
+                   std::chrono::milliseconds timeout,
+                   std::shared_ptr<ExtractorPool> const& pool);
     ~ImageExtractor();
 
     ImageExtractor(ImageExtractor const& t) = delete;
     ImageExtractor& operator=(ImageExtractor const& t) = delete;
 
-    void extract();
-    QByteArray read();
+    // A still frame is scaled down to fit into max_size x max_size while it is
+    // being extracted. If max_size is 0, the frame is returned at full resolution.
+    void extract(int max_size = 0);
+    Image read();
+
+    // Cancels the extraction. If vs-thumb is working on it already, the worker is killed.
+    // Returns false if the extraction is not in progress. finished() is not emitted.
+    bool cancel();
 
 Q_SIGNALS:
     void finished();
 
-private Q_SLOTS:
-    void processFinished();
-    void timeout();
-    void error();
-    void started();
-    void readFromPipe();
-    void pipeError();
-
 private:
+    void jobFinished(std::string const& error);
+    Image load_image();
+
     std::string const filename_;
-    int const timeout_ms_;
+    std::chrono::milliseconds const timeout_;
+    std::shared_ptr<ExtractorPool> const pool_;
+    int64_t job_id_;  // -1 unless a job is in progress.
     bool read_called_;
-    QString exe_path_;
     std::string error_;
-    unity::util::ResourcePtr<int, decltype(&::close)> pipe_read_fd_;
-    unity::util::ResourcePtr<int, decltype(&::close)> pipe_write_fd_;
-    std::unique_ptr<QSocketNotifier> read_notifier_;
-    std::unique_ptr<QSocketNotifier> error_notifier_;
-    QByteArray image_data_;
-
-    QProcess process_;
-    QTimer timer_;
+    FdPtr memfd_;
+    Image image_;
 };
 
 }  // namespace internal
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Returns a file descriptor for an anonymous in-memory file that contains
+// a copy of data. Where the kernel supports it, the file is a memfd that is
+// sealed against modification; otherwise, it is an unlinked temporary file
+// and the returned descriptor is read-only. Either way, the descriptor
+// can be passed to another process, which can mmap it.
+// The caller is responsible for closing the returned descriptor.
+// Throws runtime_error if the file cannot be created.
+
+int make_sealed_memfd(char const* name, void const* data, size_t size);
+
+// Returns a file descriptor for an empty anonymous in-memory file that is open
+// for reading and writing. The file is a memfd or, on older kernels, an unlinked
+// temporary file. The caller is responsible for closing the returned descriptor.
+// Throws runtime_error if the file cannot be created.
+
+int make_memfd(char const* name);
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
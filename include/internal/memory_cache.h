@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <core/optional.h>
+
+#include <QByteArray>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// In-process LRU cache that sits in front of a persistent cache.
+//
+// Values are QByteArrays. Because QByteArray is implicitly shared,
+// get() returns a reference to the cached buffer instead of a copy.
+// Callers must not modify the returned data in place (which they can't
+// anyway without detaching).
+//
+// The cache is split into a number of shards, each with its own lock
+// and LRU list, so concurrent lookups from the thread pool rarely contend.
+// The byte budget is divided evenly among the shards. Each entry is charged
+// for its key, its value, and a fixed per-entry overhead.
+//
+// A max_size_in_bytes of zero disables the cache: get() always misses
+// and put() does nothing.
+//
+// The cache counts the hits for each entry. snapshot() uses the counts to
+// save the keys of the most popular entries, so they can be loaded again
+// after a restart.
+
+class MemoryCache final
+{
+public:
+    typedef std::unique_ptr<MemoryCache> UPtr;
+
+    struct Stats
+    {
+        int64_t size = 0;               // Number of entries.
+        int64_t size_in_bytes = 0;      // Bytes charged for all entries.
+        int64_t max_size_in_bytes = 0;
+        int64_t hits = 0;
+        int64_t misses = 0;
+        int64_t evictions = 0;          // Entries dropped to make room or because they expired.
+    };
+
+    MemoryCache(int64_t max_size_in_bytes, int num_shards = 16);
+    ~MemoryCache();
+
+    MemoryCache(MemoryCache const&) = delete;
+    MemoryCache& operator=(MemoryCache const&) = delete;
+
+    // Returns the value for key, or an empty Optional if the key is not in the cache
+    // or its entry has expired. On a hit, source (if not null) is set to the source
+    // of the entry, and hits (if not null) to the number of hits for the entry so far.
+    core::Optional<QByteArray> get(std::string const& key, std::string* source = nullptr, int64_t* hits = nullptr);
+
+    // Adds or replaces the entry for key. An expiry_time of time_point() means
+    // that the entry never expires. source is the key of the persistent cache
+    // entry that the value was made from, if any. Returns false if the entry was
+    // not added because it would exceed the byte budget of its shard on its own.
+    bool put(std::string const& key,
+             QByteArray const& value,
+             std::chrono::system_clock::time_point expiry_time = std::chrono::system_clock::time_point(),
+             std::string const& source = std::string());
+
+    void invalidate(std::string const& key);
+    void invalidate();  // Removes all entries.
+
+    // Removes the entries for which pred(key, source) returns true, and returns how many
+    // it removed. pred is called with the shard lock held, so it must not call back into the cache.
+    int invalidate_if(std::function<bool(std::string const& key, std::string const& source)> const& pred);
+
+    Stats stats() const;
+    void clear_stats();
+
+    struct SnapshotEntry
+    {
+        std::string key;
+        std::string source;
+        int64_t hits;
+    };
+
+    // Returns the keys and sources (but not the values) of up to max_entries entries
+    // that have a source, with the most frequently used entries first.
+    std::string snapshot(int max_entries) const;
+
+    // Returns the entries of a snapshot, or an empty vector if data is not a valid snapshot.
+    static std::vector<SnapshotEntry> parse_snapshot(std::string const& data);
+
+private:
+    struct Entry
+    {
+        std::string key;
+        QByteArray value;
+        std::chrono::system_clock::time_point expiry_time;
+        int64_t charge;
+        std::string source;
+        int64_t hits;
+    };
+    typedef std::list<Entry> LRUList;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        LRUList lru;  // Most-recently used entry at the front.
+        std::unordered_map<std::string, LRUList::iterator> index;
+        int64_t size_in_bytes = 0;
+    };
+
+    Shard& shard_for(std::string const& key);
+    void erase(Shard& shard, LRUList::iterator it);
+
+    int64_t const max_size_in_bytes_;
+    int64_t const max_shard_size_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<int64_t> hits_;
+    std::atomic<int64_t> misses_;
+    std::atomic<int64_t> evictions_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Estimates the miss ratio curve of an LRU cache, that is, the miss ratio
+// the cache would have at each size, from the stream of requests it sees.
+//
+// This uses the SHARDS technique (Waldspurger et al., "Efficient MRC
+// Construction with SHARDS", FAST '15): only keys whose hash falls below a
+// threshold are tracked, and the reuse distances of the tracked keys are
+// scaled up by the inverse of the sampling rate. The reuse distance of a
+// request is the number of bytes of distinct entries that were accessed
+// since the previous request for the same key, so an LRU cache of at least
+// that size would have had the entry. To find it without walking the tracked
+// keys, each key remembers when it was last accessed, and a Fenwick tree over
+// those times sums the sizes of the keys that were accessed since.
+//
+// The number of tracked keys is bounded. Once the bound is reached, the
+// threshold is lowered and the keys above it are dropped, so memory use stays
+// fixed and the sampling rate adapts to the size of the working set.
+// Older requests are gradually aged out, so the curve follows changes in the
+// workload.
+//
+// All methods are thread-safe.
+
+class MissRatioEstimator final
+{
+public:
+    typedef std::unique_ptr<MissRatioEstimator> UPtr;
+
+    struct Point
+    {
+        int64_t size_in_bytes;
+        double miss_ratio;
+    };
+
+    explicit MissRatioEstimator(int max_keys = 8192);
+    ~MissRatioEstimator();
+
+    MissRatioEstimator(MissRatioEstimator const&) = delete;
+    MissRatioEstimator& operator=(MissRatioEstimator const&) = delete;
+
+    // Records an access to key. size is the size of the value.
+    void record(std::string const& key, int64_t size);
+
+    // Records another access to key, with the same size as before. This is for
+    // requests that were answered from a copy. Does nothing if we don't know key.
+    void record_repeat(std::string const& key);
+
+    // Returns the estimated miss ratio for a cache of the given size, or 1.0 if we haven't seen any requests.
+    double miss_ratio(int64_t size_in_bytes) const;
+
+    // Returns num_points points, evenly spaced from max_size_in_bytes / num_points to max_size_in_bytes.
+    std::vector<Point> curve(int64_t max_size_in_bytes, int num_points) const;
+
+    // Returns the smallest cache size that gets the miss ratio down to target.
+    // Some misses happen at any size (for keys that are requested for the first time).
+    // If that puts target out of reach, returns the size beyond which a larger
+    // cache no longer helps. Returns -1 if we haven't seen any requests.
+    int64_t size_for_miss_ratio(double target) const;
+
+    double requests() const;       // Estimated number of requests, with aging applied.
+    double sampling_rate() const;
+    void clear();
+
+    // Returns the state of the estimator as a string that can be written to disk.
+    std::string serialize() const;
+
+    // Replaces the state of the estimator with data returned by serialize().
+    // Returns false (and leaves the estimator unchanged) if data is malformed
+    // or comes from an estimator with a different bound on the number of keys.
+    bool deserialize(std::string const& data);
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        int64_t size;
+        size_t slot;                     // Time of the last access, indexes tree_.
+    };
+    typedef std::list<Entry> EntryList;
+
+    void record_hash(uint64_t hash, int64_t size);
+    void lower_threshold();
+    void age();
+    void place(Entry& e);
+    void renumber();
+    void tree_add(size_t slot, int64_t delta);
+    int64_t tree_sum(size_t slot) const;
+
+    size_t const max_keys_;
+    mutable std::mutex mutex_;
+    uint64_t threshold_;                 // Keys with a hash below this are sampled.
+    EntryList lru_;                      // Tracked keys, most recently used first.
+    std::unordered_map<uint64_t, EntryList::iterator> index_;
+    std::vector<int64_t> tree_;          // Fenwick tree of entry sizes by slot.
+    size_t next_slot_;                   // Slot for the next access.
+    int64_t total_size_;                 // Sum of the sizes in tree_.
+    std::vector<double> histogram_;      // Estimated number of requests per reuse distance bucket.
+    double cold_misses_;                 // Requests for keys that we hadn't seen before.
+    double requests_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
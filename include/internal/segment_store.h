@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <core/cache_discard_policy.h>
+#include <core/cache_events.h>
+#include <core/optional.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// A cache backend for large values that are written once and read many times,
+// such as thumbnails. It can be used with CacheHelper in place of
+// core::PersistentStringCache.
+//
+// Values are appended to segment files that are mapped into memory. The
+// location of each entry is kept in a hash table in a separate, also mapped,
+// index file. A lookup is a probe into the index plus a key comparison, and
+// get_view() returns a pointer straight into the segment instead of a copy.
+//
+// When the segments take up more than the maximum size, the oldest segment is
+// deleted as a whole, so eviction is FIFO rather than LRU. Entries that are
+// replaced or taken leave dead space in their segment until it is deleted or
+// the store is compacted. take() appends a small tombstone record, so the
+// entry stays gone if the index has to be rebuilt. Expiry times are not supported.
+//
+// Only one SegmentStore at a time can have a store open. open() takes a lock
+// on a file in the store directory and throws runtime_error if the store is
+// in use, whether by this or another process.
+//
+// If the index is missing or damaged, it is rebuilt from the segments.
+// A damaged segment is reported as a system_error with code 666, which is
+// what leveldb reports for a corrupt DB, so CacheHelper deletes and recreates
+// the store.
+//
+// All methods are thread-safe.
+
+class SegmentStore final
+{
+private:
+    struct Segment;
+
+public:
+    typedef std::unique_ptr<SegmentStore> UPtr;
+
+    // A value in a segment. The segment stays mapped for as long as a Value for it exists,
+    // even if the entry is replaced or the segment is deleted in the mean time.
+    class Value
+    {
+    public:
+        char const* data() const
+        {
+            return data_;
+        }
+        size_t size() const
+        {
+            return size_;
+        }
+        std::string to_string() const
+        {
+            return std::string(data_, size_);
+        }
+
+    private:
+        Value(std::shared_ptr<Segment const> const& segment, char const* data, size_t size);
+
+        std::shared_ptr<Segment const> segment_;
+        char const* data_;
+        size_t size_;
+
+        friend class SegmentStore;
+    };
+
+    struct Stats
+    {
+        std::string cache_path;
+        int64_t size;                // Number of entries.
+        int64_t size_in_bytes;       // Size of the keys and values of the entries.
+        int64_t max_size_in_bytes;
+        int64_t disk_size_in_bytes;  // Size of the segments, including dead space.
+        int64_t segments;
+        int64_t hits;
+        int64_t misses;
+        int64_t segments_evicted;
+        int64_t entries_evicted;
+    };
+
+    typedef std::function<void(std::string const& key, core::CacheEvent ev, Stats const& stats)> EventCallback;
+
+    // Opens or creates the store in the directory cache_path.
+    // policy must be lru_only. An existing store is re-sized to max_size_in_bytes.
+    static UPtr open(std::string const& cache_path, int64_t max_size_in_bytes, core::CacheDiscardPolicy policy);
+
+    // Opens an existing store with the size it was created with.
+    static UPtr open(std::string const& cache_path);
+
+    ~SegmentStore();
+
+    SegmentStore(SegmentStore const&) = delete;
+    SegmentStore& operator=(SegmentStore const&) = delete;
+
+    core::Optional<Value> get_view(std::string const& key);
+    core::Optional<std::string> get(std::string const& key);
+    core::Optional<std::string> take(std::string const& key);
+
+    // Returns false if the entry is larger than a segment, or if there is no disk space
+    // for a new segment. expiry_time must be the default.
+    bool put(std::string const& key,
+             std::string const& value,
+             std::chrono::time_point<std::chrono::system_clock> expiry_time = std::chrono::system_clock::time_point());
+
+    bool contains_key(std::string const& key) const;
+    Stats stats() const;
+    void clear_stats();
+    void invalidate();
+    // Rewrites the live entries into new segments, dropping the dead space.
+    // If that fails (for example, because the disk is full), the store is left
+    // as it was and the exception is passed on.
+    void compact();
+    void resize(int64_t size_in_bytes);
+
+    // Returns copies of up to max_entries entries, starting at position cursor in the
+    // index, and advances cursor past them. cursor is 0 again once the whole index has
+    // been visited. If the store changes between calls, an entry may be missed or
+    // returned twice during a walk.
+    std::vector<std::pair<std::string, std::string>> scan(uint64_t& cursor, int max_entries) const;
+
+    // Supports the get, put, miss, invalidate, and evict_lru events. When a segment
+    // is deleted, evict_lru is sent for each entry in it. The handler is called with
+    // the store locked, so it must not call back into the store.
+    void set_handler(core::CacheEvent events, EventCallback cb);
+
+private:
+    struct Slot
+    {
+        uint64_t hash;  // 0 for an empty slot.
+        uint32_t segment_id;
+        uint32_t offset;
+    };
+
+    struct Record
+    {
+        Segment const* segment;
+        char const* key;
+        uint32_t key_size;
+        char const* value;
+        uint32_t value_size;  // 0 for a tombstone.
+        bool tombstone;
+    };
+
+    SegmentStore(std::string const& cache_path, int64_t max_size_in_bytes);
+
+    void lock();
+    void unlock();
+    int64_t segment_capacity() const;
+    void load_segments();
+    bool load_index();
+    void rebuild_index();
+    void create_index(uint64_t capacity);
+    void commit_index();
+    void unmap_index();
+
+    std::shared_ptr<Segment> new_segment();
+    void drop_segment(uint32_t id);
+    void evict();
+
+    bool read_record(uint32_t segment_id, uint32_t offset, Record& r) const;
+    bool find(std::string const& key, uint64_t hash, uint64_t& slot) const;
+    void insert_slot(Slot const& s);
+    void erase_slot(uint64_t slot);
+    void append(std::string const& key, char const* value, size_t value_size, Slot& s);
+    Stats stats_locked() const;
+    void notify(std::string const& key, core::CacheEvent ev);
+
+    std::string const path_;
+    mutable std::mutex mutex_;
+    int64_t max_size_;
+    std::map<uint32_t, std::shared_ptr<Segment>> segments_;  // Oldest first. The last one is appended to.
+    uint32_t next_segment_id_;
+    int lock_fd_;                                          // Holds the lock on the store.
+    void* index_map_;                                      // Mapped index file.
+    Slot* slots_;                                          // Hash table in index_map_.
+    uint64_t index_capacity_;                              // Number of slots; a power of two.
+    int64_t entries_;
+    int64_t live_bytes_;
+    int64_t disk_bytes_;
+    int64_t hits_;
+    int64_t misses_;
+    int64_t segments_evicted_;
+    int64_t entries_evicted_;
+    core::CacheEvent handler_events_;
+    EventCallback handler_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 typedef struct _GSettings GSettings;
 typedef struct _GSettingsSchema GSettingsSchema;
@@ -47,7 +48,18 @@ public:
     int full_size_cache_size() const;
     int thumbnail_cache_size() const;
     int failure_cache_size() const;
+    std::string full_size_cache_backend() const;  // "leveldb" or "segments"
+    std::string thumbnail_cache_backend() const;
+    std::string failure_cache_backend() const;
+    int memory_cache_size() const;
+    int warm_restart_entries() const;
+    int target_hit_rate() const;  // 0 or a percentage < 100
+    int full_size_cache_min_size() const;
+    int full_size_cache_max_size() const;
+    int thumbnail_cache_min_size() const;
+    int thumbnail_cache_max_size() const;
     int max_thumbnail_size() const;
+    int thumbnail_size_ladder() const;  // 0 or a percentage > 100
     int retry_not_found_hours() const;
     int retry_error_max_seconds() const;
     int max_downloads() const;
@@ -56,9 +68,12 @@ public:
     int max_backlog() const;
     bool trace_client() const;
     int log_level() const;
+    bool background_indexing() const;
+    std::vector<int> background_indexing_sizes() const;
 
 private:
     std::string get_string(char const* key, std::string const& default_value) const;
+    std::string get_backend(char const* key, std::string const& default_value) const;
     int get_positive_int(char const* key, int default_value) const;
     int get_positive_or_zero_int(char const* key, int default_value) const;
     int get_int(char const* key, int default_value) const;
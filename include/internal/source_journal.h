@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/segment_store.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Remembers which local files the cache entries were made for, so we can find
+// the entries for files that were modified or deleted. persistent-cache cannot
+// enumerate its keys, so without the journal, such entries stay around until
+// they are evicted.
+//
+// A source is identified by the hash of its identity (path name, device, inode,
+// modification time, and size), and refers to the cache key of its contents.
+// Copies of a file share the same cache key, so the journal counts the sources
+// for each cache key, and reports the entries for a cache key as garbage only
+// once its last source has gone. If the journal runs out of space, it forgets
+// the oldest records. We never report entries as garbage that we don't know
+// about, so this only means that some garbage is left to the eviction policy.
+//
+// All methods are thread-safe.
+
+class SourceJournal final
+{
+public:
+    typedef std::unique_ptr<SourceJournal> UPtr;
+
+    // Returns false if the file with the given identity no longer exists, or has changed.
+    typedef std::function<bool(std::string const& identity)> IsCurrentFunc;
+
+    struct Garbage
+    {
+        std::string source_key;               // The source that is gone.
+        std::string cache_key;                // The cache key it referred to.
+        bool last_source;                     // True if no other source refers to cache_key.
+        std::vector<std::string> entry_keys;  // Entries recorded for cache_key, if last_source is true.
+    };
+
+    struct SweepResult
+    {
+        int sources_checked;
+        bool pass_complete;  // True if this sweep reached the end of the journal.
+        std::vector<Garbage> garbage;
+    };
+
+    // Opens or creates the journal in the directory path. If the journal is damaged, it starts out empty.
+    SourceJournal(std::string const& path, int64_t max_size_in_bytes);
+    ~SourceJournal();
+
+    SourceJournal(SourceJournal const&) = delete;
+    SourceJournal& operator=(SourceJournal const&) = delete;
+
+    // Records that the file with the given identity has its entries under cache_key.
+    // Does nothing if the source is known already.
+    void add_source(std::string const& source_key, std::string const& identity, std::string const& cache_key);
+
+    // Records that entry_key holds an entry for cache_key, such as a thumbnail
+    // of a particular size. Does nothing unless cache_key has a source.
+    void add_entry(std::string const& cache_key, std::string const& entry_key);
+
+    // Checks up to max_sources sources, continuing where the previous sweep left off,
+    // and removes those for which is_current returns false. Where we stopped is
+    // remembered across restarts, so repeated small sweeps eventually visit every source.
+    SweepResult sweep(int max_sources, IsCurrentFunc const& is_current);
+
+    void clear();
+
+private:
+    void open();
+    bool release_source(std::string const& cache_key, std::vector<std::string>& entry_keys);
+
+    std::string const path_;
+    int64_t const max_size_;
+    SegmentStore::UPtr store_;
+    std::mutex mutex_;  // Serializes updates of the records for a cache key.
+    uint64_t cursor_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
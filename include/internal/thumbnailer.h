@@ -18,16 +18,29 @@
 
 #pragma once
 
+#include <internal/admission_filter.h>
 #include <internal/artdownloader.h>
 #include <internal/backoff_adjuster.h>
-#include <internal/cachehelper.h>
+#include <internal/counting_bloom_filter.h>
+#include <internal/disk_cache.h>
+#include <internal/extractorpool.h>
+#include <internal/memory_cache.h>
+#include <internal/miss_ratio_estimator.h>
+#include <internal/source_journal.h>
+#include <internal/write_behind_queue.h>
 
 #include <QObject>
 #include <QSize>
 
+#include <atomic>
 #include <chrono>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 namespace unity
 {
@@ -51,6 +64,7 @@ public:
     {
         cache_hit,
         scaled_from_fullsize,
+        scaled_from_larger,
         cached_failure,
         needs_download,
         downloaded,
@@ -68,6 +82,11 @@ public:
     virtual QByteArray thumbnail() = 0;
     virtual void download(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) = 0;
 
+    // Abandons a download() that is still in progress. Returns true if the
+    // download was stopped, in which case downloadFinished is not emitted.
+    // Returns false if nothing is in progress or the download cannot be interrupted.
+    virtual bool cancel_download() = 0;
+
     // Returns status of thumbnail() set by thumbnail();
     virtual FetchStatus status() const = 0;
 
@@ -77,15 +96,29 @@ public:
     // exception on authentication failure.
     virtual void check_client_credentials(uid_t user, std::string const& apparmor_label) = 0;
 
+    // Asks this request to also produce the thumbnail for other (which must have
+    // the same key) from the same decoded image, and to add it to the cache.
+    // Returns false if this request has progressed too far for that, in which
+    // case other has to do its own decoding. Thread-safe.
+    virtual bool coalesce(ThumbnailRequest const& other) = 0;
+
+    // Undoes a successful coalesce(other), for example because other was cancelled.
+    // Has no effect if this request has started decoding already. Thread-safe.
+    virtual void uncoalesce(ThumbnailRequest const& other) = 0;
+
 Q_SIGNALS:
     void downloadFinished();
 };
 
 class RequestBase;
 
+using PersistentAdmissionFilter = AdmissionFilter<DiskCache>;
+
 class Thumbnailer
 {
 public:
+    // Returns before the caches are open. The public methods wait until they are,
+    // and throw runtime_error if a cache could not be opened.
     Thumbnailer();
     ~Thumbnailer();
 
@@ -103,13 +136,58 @@ public:
                                                      std::string const& album,
                                                      QSize const& requested_size);
 
+    // Counters for local files with the same contents as another file, such as
+    // copies and hard links. The counts are since the service started.
+    struct DedupStats
+    {
+        int64_t duplicate_files;  // Files that turned out to be a duplicate of a file we had seen before.
+        int64_t duplicate_hits;   // Requests for duplicates that we answered from the other file's cache entries.
+        int64_t bytes_saved;      // Size of the thumbnails we did not have to produce for these requests.
+    };
+
+    // The failure filter is an in-memory summary of the keys in the failure cache.
+    // For keys that the filter knows are not in the failure cache, we don't look
+    // in the failure cache at all.
+    struct FilterStats
+    {
+        int64_t size_in_bytes;       // Memory used by the filter.
+        int64_t entries;             // Number of failure cache entries the filter knows about.
+        double false_positive_rate;  // Estimated fraction of absent keys that we still look up.
+        int64_t lookups_skipped;     // Failure cache lookups avoided since the service started.
+    };
+
+    // Counters for collect_garbage(), since the service started.
+    struct GcStats
+    {
+        int64_t files_checked;    // Local files we checked for modification or removal.
+        int64_t stale_files;      // Files that were modified or removed.
+        int64_t entries_removed;  // Cache entries we removed for these files.
+        int64_t bytes_reclaimed;  // Size of the keys and values of the removed entries.
+        int64_t compactions;      // Caches we compacted afterwards.
+    };
+
     struct AllStats
     {
-        core::PersistentCacheStats full_size_stats;
-        core::PersistentCacheStats thumbnail_stats;
-        core::PersistentCacheStats failure_stats;
+        DiskCache::Stats full_size_stats;
+        DiskCache::Stats thumbnail_stats;
+        DiskCache::Stats failure_stats;
+        MemoryCache::Stats thumbnail_memory_stats;
+        MemoryCache::Stats failure_memory_stats;
+        DiskCache::Stats alias_stats;
+        DedupStats dedup_stats;
+        FilterStats failure_filter_stats;
+        DiskCache::Stats full_size_window_stats;
+        DiskCache::Stats thumbnail_window_stats;
+        PersistentAdmissionFilter::Stats full_size_admission_stats;
+        PersistentAdmissionFilter::Stats thumbnail_admission_stats;
+        GcStats gc_stats;
+        DiskCache::RepairStats repair_stats;  // Totals for all caches.
+        WriteBehindQueue::Stats full_size_write_queue_stats;
+        WriteBehindQueue::Stats thumbnail_write_queue_stats;
     };
 
+    // Entries that are still waiting in a write queue are not yet counted by
+    // the cache stats; the write queue stats report them instead.
     AllStats stats() const;
 
     enum class CacheSelector { all, full_size_cache, thumbnail_cache, failure_cache, LAST__ };
@@ -118,24 +196,111 @@ public:
     void clear(CacheSelector selector);
     void compact(CacheSelector selector);
 
+    // Returns the estimated miss ratio of the image or the thumbnail cache at
+    // num_points sizes, up to twice the current size of the cache.
+    std::vector<MissRatioEstimator::Point> miss_ratio_curve(CacheSelector selector, int num_points) const;
+
+    // Thumbnails and full-size images are written to disk in the background.
+    // Returns once everything that is still queued has been written, and the
+    // failure filter has been saved.
+    void flush();
+
+    // Does a bounded amount of maintenance work. Checks up to max_files of the local
+    // files we have cache entries for, continuing where the previous call left off,
+    // and removes the entries of files that were modified or deleted. Returns false
+    // once there is nothing left to do for this pass; the next call then starts
+    // another pass.
+    bool collect_garbage(int max_files);
+
+    // Compacts one of the caches that collect_garbage() removed entries from, so the
+    // space is returned to the file system. Readers of that cache wait until the
+    // compaction is done, which can take a while, so this is only for when the
+    // service has been idle for some time. Returns true if more caches are waiting.
+    bool compact_garbage();
+
+    // The destructor saves the keys of the thumbnails in the memory cache that were
+    // requested most often. After the next start, these thumbnails are loaded into
+    // the memory cache in the background. Returns once that is done, with the number
+    // of thumbnails that were loaded.
+    int wait_for_prefetch();
+
 private:
-    ArtDownloader* downloader() const
-    {
-        return downloader_.get();
-    }
+    void init(std::string const& cache_dir);
+    void wait_for_init() const;
+    void clear_caches(CacheSelector selector);
+    ArtDownloader* downloader() const;
     void apply_upgrade_actions(std::string const& cache_dir);
-
-    typedef std::vector<PersistentCacheHelper*> CacheVec;
+    void init_failure_filter(std::string const& cache_dir);
+    void track_failure_key(std::string const& key);
+    void finish_failure_filter_rebuild();
+    void failure_filter_changed();
+    void save_failure_filter();
+    void prefetch();
+
+    typedef std::vector<DiskCache*> CacheVec;
     CacheVec select_caches(CacheSelector selector) const;
-
-    PersistentCacheHelper::UPtr full_size_cache_;         // Small cache of full (original) size images.
-    PersistentCacheHelper::UPtr thumbnail_cache_;         // Large cache of scaled images.
-    PersistentCacheHelper::UPtr failure_cache_;           // Cache for failed attempts (value is always empty).
+    typedef std::vector<MemoryCache*> MemoryCacheVec;
+    MemoryCacheVec select_memory_caches(CacheSelector selector) const;
+    typedef std::vector<PersistentAdmissionFilter*> AdmissionFilterVec;
+    AdmissionFilterVec select_admission_filters(CacheSelector selector) const;
+    typedef std::vector<WriteBehindQueue*> WriteQueueVec;
+    WriteQueueVec select_write_queues(CacheSelector selector) const;
+
+    DiskCache::UPtr full_size_cache_;                     // Small cache of full (original) size images.
+    DiskCache::UPtr thumbnail_cache_;                     // Large cache of scaled images.
+    DiskCache::UPtr failure_cache_;                       // Cache for failed attempts (value is always empty).
+    DiskCache::UPtr alias_cache_;                         // Maps local file keys to content ids.
+    SourceJournal::UPtr source_journal_;                  // Local files we have cache entries for.
+    DiskCache::UPtr full_size_window_cache_;              // Recent full-size images that weren't admitted yet.
+    DiskCache::UPtr thumbnail_window_cache_;              // Recent thumbnails that weren't admitted yet.
+    PersistentAdmissionFilter::UPtr full_size_admission_; // Decides what goes into full_size_cache_.
+    PersistentAdmissionFilter::UPtr thumbnail_admission_; // Decides what goes into thumbnail_cache_.
+    WriteBehindQueue::UPtr full_size_write_queue_;        // Pending writes to full_size_admission_.
+    WriteBehindQueue::UPtr thumbnail_write_queue_;        // Pending writes to thumbnail_admission_.
+    MemoryCache::UPtr thumbnail_memory_cache_;            // Hot tier in front of thumbnail_cache_.
+    MemoryCache::UPtr failure_memory_cache_;              // Hot tier in front of failure_cache_.
+    CountingBloomFilter::UPtr failure_filter_;            // Keys that may be in failure_cache_.
+    std::string failure_filter_path_;                     // Where we keep failure_filter_ across restarts.
+    std::atomic<bool> failure_filter_valid_;              // False until failure_filter_ knows all keys in failure_cache_.
+    std::mutex failure_filter_mutex_;                     // Protects the rebuild state below.
+    std::unordered_set<std::string> failure_keys_seen_;   // Keys added to failure_filter_ during the rebuild.
+    int64_t failure_keys_untracked_;                      // Entries in failure_cache_ the rebuild hasn't seen yet.
+    std::chrono::system_clock::time_point failure_filter_deadline_;  // When the unseen entries have expired.
+    bool failure_filter_saved_;                           // failure_filter_path_ matches failure_filter_.
+    MissRatioEstimator::UPtr full_size_mrc_;              // Requests seen by full_size_cache_.
+    MissRatioEstimator::UPtr thumbnail_mrc_;              // Requests seen by thumbnail_cache_.
+    std::string full_size_mrc_path_;                      // Where we keep full_size_mrc_ across restarts.
+    std::string thumbnail_mrc_path_;                      // Where we keep thumbnail_mrc_ across restarts.
+    std::string full_size_sketch_path_;                   // Where we keep the history of full_size_admission_.
+    std::string thumbnail_sketch_path_;                   // Where we keep the history of thumbnail_admission_.
+    std::string warm_set_path_;                           // Where we keep the keys of popular thumbnails.
+    int warm_restart_entries_;                            // Max number of keys we keep there.
+    std::thread prefetch_thread_;                         // Loads the popular thumbnails after start-up.
+    std::mutex prefetch_mutex_;                           // Protects prefetch_thread_.
+    std::atomic<bool> stop_prefetch_;
+    std::atomic<int> prefetched_;                         // Thumbnails loaded by prefetch_thread_.
     int max_size_;                                        // Max thumbnail size in pixels.
+    int size_ladder_step_;                                // Percentage between ladder sizes, 0 if disabled.
     int retry_not_found_hours_;                           // Retry wait time for authoritative "no artwork" answer.
     std::chrono::milliseconds extraction_timeout_;        // How long to wait before giving up during extraction.
-    std::unique_ptr<ArtDownloader> downloader_;
+    mutable std::unique_ptr<ArtDownloader> downloader_;  // Created on the first remote request.
+    mutable std::mutex downloader_mutex_;                 // Protects downloader_.
+    std::shared_ptr<ExtractorPool> extractor_pool_;       // vs-thumb workers for video extraction.
     BackoffAdjuster backoff_;
+    std::atomic<int64_t> duplicate_files_;
+    std::atomic<int64_t> duplicate_hits_;
+    std::atomic<int64_t> bytes_saved_;
+    std::atomic<int64_t> failure_lookups_skipped_;
+    std::atomic<bool> migrate_legacy_keys_;               // Look for entries with version 2 keys on a miss.
+    std::mutex gc_mutex_;                                 // Serializes collect_garbage() and prefetch().
+    CacheVec gc_dirty_caches_;                            // Caches we removed entries from during this pass.
+    CacheVec gc_compactions_pending_;                     // Caches for compact_garbage().
+    std::atomic<int64_t> gc_files_checked_;
+    std::atomic<int64_t> gc_stale_files_;
+    std::atomic<int64_t> gc_entries_removed_;
+    std::atomic<int64_t> gc_bytes_reclaimed_;
+    std::atomic<int64_t> gc_compactions_;
+    std::shared_future<void> init_;                       // Opens the caches after the constructor returns.
 
     friend class RequestBase;
 };
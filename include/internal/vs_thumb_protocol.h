@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Protocol between the ExtractorPool and vs-thumb processes that run in worker mode
+// ("vs-thumb --worker <fd>"). The two sides are connected by a SOCK_SEQPACKET socket.
+//
+// For each job, the pool sends one packet that contains a JobHeader, followed by the
+// file URL of the input, with the descriptor of an empty memfd attached as SCM_RIGHTS. The worker writes
+// the image to the memfd, closes its copy of the descriptor, and replies with a single
+// status byte. When the pool closes its end of the socket, the worker exits.
+//
+// Embedded cover art is written as is (that is, as JPEG, PNG, etc.). A still frame
+// from a video is written as raw pixels, so neither side has to encode or decode it:
+// the memfd contains a RawFrameHeader, followed by height rows of rowstride bytes,
+// with three bytes (R, G, B) per pixel. The last row need not be padded to rowstride.
+
+namespace vs_thumb_protocol
+{
+
+struct JobHeader
+{
+    int32_t max_size;    // Still frames are scaled to fit into max_size x max_size. 0 means no scaling.
+};
+
+struct RawFrameHeader
+{
+    char magic[4];       // RAW_FRAME_MAGIC, which does not clash with the signature of any image format.
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowstride;
+};
+
+char const RAW_FRAME_MAGIC[4] = { '\0', 'R', 'G', 'B' };
+
+// Status byte returned for each job. The values match the exit status of vs-thumb when
+// run as a one-shot process.
+enum Status : char
+{
+    success = 0,
+    no_artwork = 1,
+    extraction_failed = 2
+};
+
+int const MAX_JOB_SIZE = 64 * 1024;  // Longest job packet (header and input URL) we accept.
+
+// Sends a packet containing len bytes at buf. If fd is not -1, fd is passed
+// along with the data. Returns the result of sendmsg().
+ssize_t send_packet(int sock, void const* buf, size_t len, int fd = -1);
+
+// Receives a packet into buf. If the packet has a file descriptor attached, *fd
+// is set to it, otherwise *fd is set to -1. Returns the result of recvmsg()
+// (0 if the peer closed the socket).
+ssize_t recv_packet(int sock, void* buf, size_t len, int* fd);
+
+}  // namespace vs_thumb_protocol
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
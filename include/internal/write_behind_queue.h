@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <core/optional.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Takes cache writes off the request path. put() queues the entry and returns
+// immediately; a writer thread hands the queued entries to the write function,
+// so a request doesn't wait for leveldb (or for a compaction that leveldb
+// decides to do) before it can reply.
+//
+// The writer takes everything that is queued at once and writes it back to back.
+// A put() for a key that is still queued replaces the queued value, so a key
+// that is written repeatedly in quick succession is written only once.
+// Until an entry has been written, get() returns it, so readers never miss
+// an entry that is on its way into the cache.
+//
+// The queue holds at most max_bytes of keys and values. Once it is full,
+// put() blocks until the writer has caught up.
+//
+// All methods are thread-safe.
+
+class WriteBehindQueue final
+{
+public:
+    typedef std::unique_ptr<WriteBehindQueue> UPtr;
+    typedef std::function<void(std::string const& key, std::string const& value)> WriteFunc;
+
+    struct Stats
+    {
+        int64_t queued;        // Entries that haven't been written yet.
+        int64_t queued_bytes;  // Size of the keys and values of these entries.
+        int64_t written;       // Entries handed to the write function.
+        int64_t batches;       // Number of times the writer emptied the queue.
+        int64_t coalesced;     // Puts that replaced a value that was still queued.
+        int64_t stalls;        // Puts that had to wait because the queue was full.
+        int64_t failures;      // Writes that threw an exception.
+    };
+
+    // write must be safe to call from the writer thread. If it throws, the entry is dropped.
+    WriteBehindQueue(WriteFunc const& write, int64_t max_bytes);
+    ~WriteBehindQueue();  // Writes whatever is still queued.
+
+    WriteBehindQueue(WriteBehindQueue const&) = delete;
+    WriteBehindQueue& operator=(WriteBehindQueue const&) = delete;
+
+    void put(std::string const& key, std::string const& value);
+
+    // Returns the most recent queued value for key, or nothing if key isn't queued.
+    core::Optional<std::string> get(std::string const& key) const;
+
+    // Waits until the queue is empty and the writer is idle.
+    void flush();
+
+    // Drops the entries that the writer hasn't started on yet.
+    void clear();
+
+    Stats stats() const;
+
+private:
+    typedef std::list<std::pair<std::string, std::string>> EntryList;
+
+    struct Batch
+    {
+        EntryList entries;
+        std::unordered_map<std::string, EntryList::iterator> index;
+        int64_t bytes = 0;
+
+        void swap(Batch& other);
+        void clear();
+    };
+
+    void run();
+
+    WriteFunc const write_;
+    int64_t const max_bytes_;
+    mutable std::mutex mutex_;
+    std::condition_variable work_cond_;   // Signals the writer that there is work, or that we are done.
+    std::condition_variable space_cond_;  // Signals waiting put() and flush() calls that a batch was written.
+    Batch pending_;                       // Entries waiting for the writer.
+    Batch writing_;                       // Entries the writer is working on. Written to only by the writer.
+    bool done_;
+    int64_t written_;
+    int64_t batches_;
+    int64_t coalesced_;
+    int64_t stalls_;
+    int64_t failures_;
+    std::thread writer_;                  // Must be last, so everything else is initialized when the thread starts.
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
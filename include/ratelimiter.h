@@ -19,9 +19,12 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
-#include <list>
 
 namespace unity
 {
@@ -32,17 +35,42 @@ namespace thumbnailer
 // RateLimiter is a simple class to control the level of concurrency
 // of asynchronous jobs.  It performs no locking because it is only
 // intended to be run from the event loop thread.
+//
+// Queued jobs are started in order of priority. Among jobs with the same
+// priority, the most recently scheduled job is started first, because it is
+// most likely the one the user is waiting for. To make sure that low-priority
+// jobs are not starved, a waiting job is promoted by one priority class for
+// each aging_interval it spends in the queue.
+//
+// Once a job has waited for at least aging_interval, the order within its
+// priority class changes: the promoted jobs are started oldest first, ahead of
+// the jobs of that class that were scheduled more recently. Without this, a
+// steady stream of new requests would keep the oldest job waiting forever.
+// If a promoted job ties with a job from a higher priority class, the more
+// recently scheduled of the two is started first.
+//
+// Scheduling, cancelling, changing the priority of, and starting a job are
+// O(log n) in the number of queued jobs, so a client can queue thousands
+// of requests, such as a large batch of thumbnails.
 
 class RateLimiter
 {
 public:
-    RateLimiter(int concurrency);
+    enum class Priority
+    {
+        interactive,  // Someone is looking at the result right now.
+        prefetch,     // Likely to be needed soon, such as items just off-screen.
+        background    // Nobody is waiting for the result.
+    };
+
+    RateLimiter(int concurrency, std::chrono::milliseconds aging_interval = std::chrono::milliseconds(2000));
     ~RateLimiter();
 
     RateLimiter(RateLimiter const&) = delete;
     RateLimiter& operator=(RateLimiter const&) = delete;
 
     typedef std::function<bool() noexcept> CancelFunc;
+    typedef std::function<bool(Priority) noexcept> PriorityFunc;
 
     // Schedule a job to run.  If the concurrency limit has not been
     // reached, the job will be run immediately.  Otherwise it will be
@@ -50,24 +78,44 @@ public:
     // called, cancels the job in the queue (if it's still in the queue).
     // The cancel function returns true if the request could be cancelled because
     // it was still waiting, false otherwise.
-    CancelFunc schedule(std::function<void()> job);
+    CancelFunc schedule(std::function<void()> job, Priority priority = Priority::interactive);
+
+    // Same as above, but also sets priority_func to a function that changes the
+    // priority of the job. Like the cancel function, it returns true if the job was
+    // still waiting, false otherwise. Time already spent in the queue still counts
+    // towards promotion of the job.
+    CancelFunc schedule(std::function<void()> job, Priority priority, PriorityFunc& priority_func);
 
     // Schedule a job to run immediately, regardless of the concurrency limit.
     CancelFunc schedule_now(std::function<void()> job);
 
     // Notify that a job has completed. If there are queued jobs,
-    // start the one at the head of the queue. Every call to schedule()
+    // start the one with the highest priority. Every call to schedule()
     // and schedule_now() *must* be matched by exactly one call to done(),
     // unless the call is cancelled. If the call is cancelled, done() must
     // be called only if the cancel function returns false.
     void done();
 
 private:
+    struct Job
+    {
+        std::function<void()> func;
+        Priority priority;
+        std::chrono::steady_clock::time_point queued_time;
+        int64_t seq;  // Increases with each queued job, so it orders the jobs by queued_time.
+    };
+
+    // One bucket of waiting jobs per priority class, each in the order in which the jobs were queued.
+    // The buckets are shared with the cancel and priority functions, which may outlive the limiter.
+    // We store a shared_ptr to each job, so those functions can tell whether the job is still queued.
+    typedef std::map<int64_t, std::shared_ptr<Job>> Bucket;
+    typedef std::array<Bucket, 3> Buckets;  // Indexed by Priority.
+
     int const concurrency_;  // Max number of outstanding requests.
+    std::chrono::steady_clock::duration const aging_interval_;
     int running_;            // Actual number of outstanding requests.
-    // We store a shared_ptr so we can detect on cancellation
-    // whether a job completed before it was cancelled.
-    std::list<std::shared_ptr<std::function<void()>>> list_;
+    int64_t next_seq_;
+    std::shared_ptr<Buckets> buckets_;
 };
 
 }  // namespace thumbnailer
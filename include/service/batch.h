@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QDBusArgument>
+#include <QList>
+#include <QSize>
+#include <QString>
+
+#include <cstdint>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+// One entry in the argument to GetThumbnails().
+
+struct BatchItem
+{
+    QString filename;
+    QSize requested_size;
+};
+
+typedef QList<BatchItem> BatchItems;
+
+// Upper limit on the number of items in a single GetThumbnails() call.
+
+constexpr int MAX_BATCH_SIZE = 1000;
+
+// GetThumbnails() returns the read end of a stream socket. The service
+// writes one record per item as soon as the result for that item is known,
+// so records arrive in completion order, not in request order. Each record
+// is a BatchRecordHeader (in host byte order), followed by size bytes of payload.
+// If error is zero, the payload is the thumbnail; otherwise, it is a UTF-8
+// error message. The service closes the socket once it has written a record
+// for every item.
+
+struct BatchRecordHeader
+{
+    uint32_t index;  // Position of the item in the GetThumbnails() argument.
+    uint32_t error;
+    uint32_t size;
+};
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
+
+Q_DECLARE_METATYPE(unity::thumbnailer::service::BatchItem)
+Q_DECLARE_METATYPE(unity::thumbnailer::service::BatchItems)
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::BatchItem const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::BatchItem& s);
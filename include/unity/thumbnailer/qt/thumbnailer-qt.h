@@ -18,7 +18,9 @@
 #pragma once
 
 #include <QImage>
+#include <QList>
 #include <QObject>
+#include <QPair>
 #include <QSharedPointer>
 
 class QDBusConnection;
@@ -38,6 +40,22 @@ class ThumbnailerImpl;
 class RequestImpl;
 }
 
+/**
+\brief Priority of a thumbnail request.
+
+If many thumbnails need to be extracted at once, requests with a higher priority are
+sent to the thumbnailer service, and processed by the service, before requests with
+a lower priority. Requests that have been waiting for a while are gradually promoted,
+so requests with lower priority still complete eventually.
+*/
+
+enum class Priority
+{
+    Interactive,  ///< The thumbnail is needed right away, for example, because it is visible on screen.
+    Prefetch,     ///< The thumbnail will likely be needed soon, for example, because it is just off-screen.
+    Background    ///< Nobody is waiting for the thumbnail.
+};
+
 /**
 \brief Holds a thumbnailer request.
 
@@ -109,6 +127,10 @@ public:
 
     Cancels the request if it has not completed yet and emits the finished() signal.
     Calling cancel() more than once or on a request that has already completed does nothing.
+
+    For thumbnails of local files, the thumbnailer service is told about the cancellation
+    (as well as when a request is destroyed while in progress), so it stops working
+    on a thumbnail that is no longer needed.
     */
     void cancel();
 
@@ -235,6 +257,32 @@ public:
     */
     QSharedPointer<Request> getThumbnail(QString const& filePath, QSize const& requestedSize);
 
+    /**
+    \brief Extracts a thumbnail from a media file, with the given priority.
+
+    Requests made with the two-argument version of getThumbnail() have
+    Priority::Interactive. Use Priority::Prefetch for thumbnails that are not visible yet,
+    so they do not hold up thumbnails that the user is looking at.
+    \param filePath The path to the file to extract the thumbnail from.
+    \param requestedSize The bounding box for the thumbnail.
+    \param priority The priority of the request.
+    \return A `QSharedPointer` to a unity::thumbnailer::qt::Request holding the request state.
+    */
+    QSharedPointer<Request> getThumbnail(QString const& filePath, QSize const& requestedSize, Priority priority);
+
+    /**
+    \brief Extracts thumbnails from a number of media files with a single call to the thumbnailer service.
+
+    This is more efficient than calling getThumbnail() once for each file, for example, when
+    populating a page of a photo gallery. Each request in the returned list completes
+    independently and emits its finished() signal as soon as its thumbnail is available,
+    so thumbnails that are already cached do not wait for thumbnails that need to be extracted.
+    \param requests A list of pairs, each holding the path to a file and the bounding box for its thumbnail.
+    \return A list of `QSharedPointer`s to unity::thumbnailer::qt::Request instances, in the same
+    order as `requests`.
+    */
+    QList<QSharedPointer<Request>> getThumbnails(QList<QPair<QString, QSize>> const& requests);
+
 private:
     QScopedPointer<internal::ThumbnailerImpl> p_;
 };
@@ -20,6 +20,7 @@
 
 #include <QDebug>
 #include <QUrl>
+#include <QUrlQuery>
 
 #include "thumbnailerimageresponse.h"
 
@@ -49,9 +50,25 @@ QQuickImageResponse* ThumbnailGenerator::requestImageResponse(const QString& id,
      * The only "solution" is setting Image.cache = false, but in some
      * cases we don't want to do that for performance reasons, so this
      * is the only way around the issue for now. */
-    QString src_path = QUrl(id).path();
+    QUrl url(id);
+    QString src_path = url.path();
 
-    auto request = thumbnailer->getThumbnail(src_path, requestedSize);
+    /* The one query item we do look at is "priority". Delegates that
+     * are created off-screen (for example, in the cacheBuffer of a
+     * ListView) can append ?priority=prefetch, so their thumbnails do
+     * not delay the thumbnails that are currently visible. */
+    auto priority = unity::thumbnailer::qt::Priority::Interactive;
+    QString priority_str = QUrlQuery(url).queryItemValue(QStringLiteral("priority"));
+    if (priority_str == QLatin1String("prefetch"))
+    {
+        priority = unity::thumbnailer::qt::Priority::Prefetch;
+    }
+    else if (priority_str == QLatin1String("background"))
+    {
+        priority = unity::thumbnailer::qt::Priority::Background;
+    }
+
+    auto request = thumbnailer->getThumbnail(src_path, requestedSize, priority);
     return new ThumbnailerImageResponse(request);
 }
 
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/admission_filter.h>
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+int const DEPTH = 4;
+int const DOORKEEPER_HASHES = 2;
+int const MAX_COUNT = 15;
+
+string const MAGIC = "TLF1";
+
+uint64_t power_of_two_at_least(uint64_t n)
+{
+    uint64_t p = 64;
+    while (p < n)
+    {
+        p *= 2;
+    }
+    return p;
+}
+
+// The sketch is saved across restarts, so we need a hash that doesn't change
+// between builds, which std::hash doesn't promise.
+
+uint64_t fnv1a(string const& key)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Finalizer from splitmix64. FNV-1a on its own doesn't mix its bits well.
+
+uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+void append_uint64(string& s, uint64_t val)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        s += char(val >> shift);
+    }
+}
+
+uint64_t read_uint64(string const& s, size_t pos)
+{
+    uint64_t val = 0;
+    for (size_t i = pos; i < pos + 8; ++i)
+    {
+        val = val << 8 | static_cast<unsigned char>(s[i]);
+    }
+    return val;
+}
+
+}  // namespace
+
+// The doorkeeper has eight bits for each key we may see before it is cleared,
+// which keeps its false-positive rate at around 5%.
+
+FrequencySketch::FrequencySketch(int64_t capacity)
+    : width_(power_of_two_at_least(uint64_t(capacity)))
+    , doorkeeper_bits_(power_of_two_at_least(uint64_t(80 * capacity)))
+    , sample_size_(10 * capacity)
+    , counters_(width_ * DEPTH / 2, 0)
+    , doorkeeper_(doorkeeper_bits_ / 64, 0)
+    , records_(0)
+{
+    assert(capacity > 0);
+}
+
+FrequencySketch::~FrequencySketch() = default;
+
+// Calls f with the index of the counter for the key with the given hash in each row.
+
+template<typename F>
+void FrequencySketch::for_each_counter(uint64_t hash, F f) const
+{
+    for (int row = 0; row < DEPTH; ++row)
+    {
+        f(uint64_t(row) * width_ + (mix(hash + uint64_t(row)) & (width_ - 1)));
+    }
+}
+
+template<typename F>
+void FrequencySketch::for_each_doorkeeper_bit(uint64_t hash, F f) const
+{
+    for (int i = 0; i < DOORKEEPER_HASHES; ++i)
+    {
+        f(mix(hash + uint64_t(DEPTH + i)) & (doorkeeper_bits_ - 1));
+    }
+}
+
+int FrequencySketch::counter(uint64_t index) const
+{
+    uint8_t byte = counters_[index / 2];
+    return index % 2 == 0 ? byte & 0x0f : byte >> 4;
+}
+
+void FrequencySketch::set_counter(uint64_t index, int value)
+{
+    uint8_t& byte = counters_[index / 2];
+    if (index % 2 == 0)
+    {
+        byte = uint8_t((byte & 0xf0) | value);
+    }
+    else
+    {
+        byte = uint8_t((byte & 0x0f) | value << 4);
+    }
+}
+
+int FrequencySketch::estimate(uint64_t hash) const
+{
+    int estimate = MAX_COUNT;
+    for_each_counter(hash, [this, &estimate](uint64_t index)
+    {
+        estimate = min(estimate, counter(index));
+    });
+    return estimate;
+}
+
+bool FrequencySketch::in_doorkeeper(uint64_t hash) const
+{
+    bool found = true;
+    for_each_doorkeeper_bit(hash, [this, &found](uint64_t bit)
+    {
+        found = found && (doorkeeper_[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+    });
+    return found;
+}
+
+void FrequencySketch::record(string const& key)
+{
+    uint64_t const h = fnv1a(key);
+
+    lock_guard<mutex> lock(mutex_);
+
+    if (!in_doorkeeper(h))
+    {
+        for_each_doorkeeper_bit(h, [this](uint64_t bit)
+        {
+            doorkeeper_[bit / 64] |= uint64_t(1) << (bit % 64);
+        });
+    }
+    else
+    {
+        // Conservative update: we only increment the counters that are at the
+        // current estimate, which makes collisions inflate the estimate less.
+        int const current = estimate(h);
+        if (current < MAX_COUNT)
+        {
+            for_each_counter(h, [this, current](uint64_t index)
+            {
+                if (counter(index) == current)
+                {
+                    set_counter(index, current + 1);
+                }
+            });
+        }
+    }
+
+    if (++records_ >= sample_size_)
+    {
+        for (auto& byte : counters_)
+        {
+            byte = uint8_t((byte >> 1) & 0x77);  // Halves both counters in the byte.
+        }
+        fill(doorkeeper_.begin(), doorkeeper_.end(), 0);
+        records_ /= 2;
+    }
+}
+
+int FrequencySketch::frequency(string const& key) const
+{
+    uint64_t const h = fnv1a(key);
+
+    lock_guard<mutex> lock(mutex_);
+
+    return min(estimate(h) + (in_doorkeeper(h) ? 1 : 0), MAX_COUNT);
+}
+
+void FrequencySketch::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    fill(counters_.begin(), counters_.end(), 0);
+    fill(doorkeeper_.begin(), doorkeeper_.end(), 0);
+    records_ = 0;
+}
+
+int64_t FrequencySketch::size_in_bytes() const
+{
+    return int64_t(counters_.size() + doorkeeper_.size() * sizeof(uint64_t));
+}
+
+string FrequencySketch::serialize() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    string data = MAGIC;
+    append_uint64(data, width_);
+    append_uint64(data, doorkeeper_bits_);
+    append_uint64(data, uint64_t(records_));
+    data.append(reinterpret_cast<char const*>(counters_.data()), counters_.size());
+    for (auto word : doorkeeper_)
+    {
+        append_uint64(data, word);
+    }
+    return data;
+}
+
+bool FrequencySketch::deserialize(string const& data)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    size_t const header_size = MAGIC.size() + 3 * 8;
+    if (data.size() != header_size + counters_.size() + doorkeeper_.size() * 8
+        || data.compare(0, MAGIC.size(), MAGIC) != 0)
+    {
+        return false;
+    }
+    if (read_uint64(data, MAGIC.size()) != width_ || read_uint64(data, MAGIC.size() + 8) != doorkeeper_bits_)
+    {
+        return false;
+    }
+    uint64_t const records = read_uint64(data, MAGIC.size() + 16);
+    if (records >= uint64_t(sample_size_))
+    {
+        return false;
+    }
+    records_ = int64_t(records);
+    auto const counters_begin = data.begin() + header_size;
+    copy(counters_begin, counters_begin + counters_.size(), counters_.begin());
+    size_t pos = header_size + counters_.size();
+    for (auto& word : doorkeeper_)
+    {
+        word = read_uint64(data, pos);
+        pos += 8;
+    }
+    return true;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/cachehelper.h>
+
+#include <leveldb/db.h>
+
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// persistent-cache stores the value of each entry under the entry's key prefixed
+// with "A". Its access times, expiry times, metadata, and stats use other prefixes.
+// This layout is private to persistent-cache (see the key prefixes in its
+// persistent_string_cache_impl.cpp), so we depend on it not changing. The
+// RepairTest.count_leveldb_entries test fails if it does.
+
+char const DATA_BEGIN[] = "A";
+char const DATA_END[] = "B";
+
+}  // namespace
+
+// RepairDB() keeps whatever it can read from the log and table files, and moves
+// the files it can't make sense of into a "lost" subdirectory.
+
+bool CacheRepair<core::PersistentStringCache>::repair(string const& cache_path)
+{
+    leveldb::Status status = leveldb::RepairDB(cache_path, leveldb::Options());
+    if (!status.ok())
+    {
+        qCritical() << "CacheRepair: cannot repair" << QString::fromStdString(cache_path)
+                    << ":" << QString::fromStdString(status.ToString());
+        return false;
+    }
+    return true;
+}
+
+// The stats that persistent-cache keeps in the DB survive a repair unchanged, so
+// we count the data records that are actually left in the files.
+
+int64_t CacheRepair<core::PersistentStringCache>::count(string const& cache_path)
+{
+    leveldb::DB* db;
+    leveldb::Status status = leveldb::DB::Open(leveldb::Options(), cache_path, &db);
+    if (!status.ok())
+    {
+        throw runtime_error("CacheRepair: cannot open " + cache_path + ": " + status.ToString());
+    }
+    unique_ptr<leveldb::DB> db_guard(db);
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    unique_ptr<leveldb::Iterator> it(db->NewIterator(options));
+    int64_t n = 0;
+    for (it->Seek(DATA_BEGIN); it->Valid() && it->key().compare(DATA_END) < 0; it->Next())
+    {
+        ++n;
+    }
+    if (!it->status().ok())
+    {
+        throw runtime_error("CacheRepair: cannot read " + cache_path + ": " + it->status().ToString());
+    }
+    return n;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
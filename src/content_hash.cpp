@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/content_hash.h>
+
+#include <internal/raii.h>
+#include <internal/safe_strerror.h>
+
+#include <glib.h>
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+int64_t const SAMPLE_SIZE = 64 * 1024;
+
+typedef unique_ptr<GChecksum, decltype(&g_checksum_free)> ChecksumPtr;
+
+ChecksumPtr new_checksum()
+{
+    return ChecksumPtr(g_checksum_new(G_CHECKSUM_SHA256), g_checksum_free);
+}
+
+string truncated_digest(GChecksum* checksum)
+{
+    guint8 digest[32];
+    gsize len = sizeof(digest);
+    g_checksum_get_digest(checksum, digest, &len);
+    return string(reinterpret_cast<char const*>(digest), HASH_SIZE);
+}
+
+}  // namespace
+
+string content_hash(string const& filename)
+{
+    FdPtr fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC), do_close);
+    if (fd.get() == -1)
+    {
+        throw runtime_error("content_hash(): cannot open " + filename + ": " + safe_strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+    {
+        throw runtime_error("content_hash(): cannot stat " + filename + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    int64_t const size = st.st_size;
+
+    auto checksum = new_checksum();
+    string const size_str = to_string(size);
+    g_checksum_update(checksum.get(), reinterpret_cast<guchar const*>(size_str.data()), size_str.size());
+
+    // Small files are hashed in one go.
+    int64_t offsets[] = { 0, 0, 0 };
+    int num_samples = 1;
+    int64_t sample_size = size;
+    if (size > 3 * SAMPLE_SIZE)
+    {
+        offsets[1] = (size - SAMPLE_SIZE) / 2;
+        offsets[2] = size - SAMPLE_SIZE;
+        num_samples = 3;
+        sample_size = SAMPLE_SIZE;
+    }
+
+    unique_ptr<guchar[]> buf(new guchar[sample_size > 0 ? sample_size : 1]);
+    for (int i = 0; i < num_samples; ++i)
+    {
+        int64_t done = 0;
+        while (done < sample_size)
+        {
+            ssize_t rc = pread(fd.get(), buf.get() + done, sample_size - done, offsets[i] + done);
+            if (rc == -1)
+            {
+                // LCOV_EXCL_START
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw runtime_error("content_hash(): cannot read " + filename + ": " + safe_strerror(errno));
+                // LCOV_EXCL_STOP
+            }
+            if (rc == 0)
+            {
+                break;  // File was truncated underneath us, we hash what we got.
+            }
+            done += rc;
+        }
+        g_checksum_update(checksum.get(), buf.get(), done);
+    }
+    return truncated_digest(checksum.get());
+}
+
+string key_hash(string const& identity)
+{
+    auto checksum = new_checksum();
+    g_checksum_update(checksum.get(), reinterpret_cast<guchar const*>(identity.data()), identity.size());
+    return truncated_digest(checksum.get());
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
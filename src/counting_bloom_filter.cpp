@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/counting_bloom_filter.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+int const MAX_COUNT = 15;
+int const MAX_HASHES = 16;
+
+string const MAGIC = "CBF1";
+
+uint64_t fnv1a(string const& key)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Finalizer from splitmix64, to derive a second hash that is independent enough of the first.
+
+uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+void append_uint64(string& s, uint64_t val)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        s += char(val >> shift);
+    }
+}
+
+uint64_t read_uint64(string const& s, size_t pos)
+{
+    uint64_t val = 0;
+    for (size_t i = pos; i < pos + 8; ++i)
+    {
+        val = val << 8 | static_cast<unsigned char>(s[i]);
+    }
+    return val;
+}
+
+uint64_t optimal_num_slots(int64_t capacity, double false_positive_rate)
+{
+    double const ln2 = log(2.0);
+    double slots = -double(capacity) * log(false_positive_rate) / (ln2 * ln2);
+    return max(uint64_t(ceil(slots)), uint64_t(64));
+}
+
+int optimal_num_hashes(int64_t capacity, uint64_t num_slots)
+{
+    int k = int(lround(double(num_slots) / double(capacity) * log(2.0)));
+    return min(max(k, 1), MAX_HASHES);
+}
+
+}  // namespace
+
+CountingBloomFilter::CountingBloomFilter(int64_t capacity, double false_positive_rate)
+    : num_slots_(optimal_num_slots(capacity, false_positive_rate))
+    , num_hashes_(optimal_num_hashes(capacity, num_slots_))
+    , counters_((num_slots_ + 1) / 2, 0)
+    , entries_(0)
+{
+    assert(capacity > 0);
+    assert(false_positive_rate > 0.0 && false_positive_rate < 1.0);
+}
+
+CountingBloomFilter::~CountingBloomFilter() = default;
+
+// Double hashing: the slots for a key are h1, h1 + h2, h1 + 2 * h2, ...
+
+template<typename F>
+void CountingBloomFilter::for_each_slot(string const& key, F f) const
+{
+    uint64_t h1 = fnv1a(key);
+    uint64_t h2 = mix(h1) | 1;
+    for (int i = 0; i < num_hashes_; ++i)
+    {
+        if (!f((h1 + uint64_t(i) * h2) % num_slots_))
+        {
+            return;
+        }
+    }
+}
+
+int CountingBloomFilter::counter(uint64_t slot) const
+{
+    uint8_t byte = counters_[slot / 2];
+    return slot % 2 == 0 ? byte & 0x0f : byte >> 4;
+}
+
+void CountingBloomFilter::set_counter(uint64_t slot, int value)
+{
+    uint8_t& byte = counters_[slot / 2];
+    if (slot % 2 == 0)
+    {
+        byte = uint8_t((byte & 0xf0) | value);
+    }
+    else
+    {
+        byte = uint8_t((byte & 0x0f) | value << 4);
+    }
+}
+
+void CountingBloomFilter::add(string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    for_each_slot(key, [this](uint64_t slot)
+    {
+        int count = counter(slot);
+        if (count < MAX_COUNT)
+        {
+            set_counter(slot, count + 1);
+        }
+        return true;
+    });
+    ++entries_;
+}
+
+void CountingBloomFilter::remove(string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    // If one of the counters is zero, the key was never added. Decrementing
+    // the other counters would make us forget keys that share them.
+    bool present = true;
+    for_each_slot(key, [this, &present](uint64_t slot)
+    {
+        present = counter(slot) != 0;
+        return present;
+    });
+    if (!present)
+    {
+        return;
+    }
+    for_each_slot(key, [this](uint64_t slot)
+    {
+        int count = counter(slot);
+        if (count < MAX_COUNT)  // A saturated counter no longer knows how many keys it stands for.
+        {
+            set_counter(slot, count - 1);
+        }
+        return true;
+    });
+    entries_ = max(entries_ - 1, int64_t(0));
+}
+
+bool CountingBloomFilter::may_contain(string const& key) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    bool found = true;
+    for_each_slot(key, [this, &found](uint64_t slot)
+    {
+        found = counter(slot) != 0;
+        return found;
+    });
+    return found;
+}
+
+void CountingBloomFilter::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    fill(counters_.begin(), counters_.end(), 0);
+    entries_ = 0;
+}
+
+CountingBloomFilter::Stats CountingBloomFilter::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    Stats s;
+    s.size_in_bytes = int64_t(counters_.size());
+    s.entries = entries_;
+    s.false_positive_rate = pow(1.0 - exp(-double(num_hashes_) * double(entries_) / double(num_slots_)), num_hashes_);
+    return s;
+}
+
+string CountingBloomFilter::serialize() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    string data = MAGIC;
+    append_uint64(data, num_slots_);
+    append_uint64(data, uint64_t(num_hashes_));
+    append_uint64(data, uint64_t(entries_));
+    data.append(reinterpret_cast<char const*>(counters_.data()), counters_.size());
+    return data;
+}
+
+bool CountingBloomFilter::deserialize(string const& data)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    size_t const header_size = MAGIC.size() + 3 * 8;
+    if (data.size() != header_size + counters_.size() || data.compare(0, MAGIC.size(), MAGIC) != 0)
+    {
+        return false;
+    }
+    if (read_uint64(data, MAGIC.size()) != num_slots_ || read_uint64(data, MAGIC.size() + 8) != uint64_t(num_hashes_))
+    {
+        return false;
+    }
+    entries_ = int64_t(read_uint64(data, MAGIC.size() + 16));
+    copy(data.begin() + header_size, data.end(), counters_.begin());
+    return true;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
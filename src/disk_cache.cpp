@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/disk_cache.h>
+
+#include <boost/filesystem.hpp>
+#include <QDebug>
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Values in an expiring segment store start with the expiry time in milliseconds
+// since the epoch, in big-endian order. Zero means that the entry never expires.
+size_t const EXPIRY_SIZE = 8;
+
+string expiry_prefix(chrono::system_clock::time_point expiry_time)
+{
+    uint64_t msecs = 0;
+    if (expiry_time != chrono::system_clock::time_point())
+    {
+        msecs = chrono::duration_cast<chrono::milliseconds>(expiry_time.time_since_epoch()).count();
+    }
+    string s;
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        s += char(msecs >> shift);
+    }
+    return s;
+}
+
+uint64_t read_expiry(string const& value)
+{
+    uint64_t msecs = 0;
+    for (size_t i = 0; i < EXPIRY_SIZE; ++i)
+    {
+        msecs = msecs << 8 | static_cast<unsigned char>(value[i]);
+    }
+    return msecs;
+}
+
+// Returns true if cache_path contains files that belong to the other backend.
+
+bool holds_other_backend(string const& cache_path, DiskCache::Backend backend)
+{
+    namespace fs = boost::filesystem;
+
+    boost::system::error_code ec;
+    if (!fs::is_directory(cache_path, ec))
+    {
+        return false;
+    }
+    for (fs::directory_iterator it(cache_path, ec), end; !ec && it != end; it.increment(ec))
+    {
+        string const name = it->path().filename().native();
+        bool const is_segment_file = name.compare(0, 8, "segment-") == 0 || name == "index" || name == "index.tmp"
+                                     || name == "lock";
+        bool const is_leveldb_file = name == "CURRENT";
+        if (backend == DiskCache::Backend::leveldb ? is_segment_file : is_leveldb_file)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+DiskCache::Backend DiskCache::backend_for_name(string const& name)
+{
+    if (name == "leveldb")
+    {
+        return Backend::leveldb;
+    }
+    if (name == "segments")
+    {
+        return Backend::segments;
+    }
+    throw domain_error("DiskCache::backend_for_name(): invalid backend: \"" + name + "\"");
+}
+
+DiskCache::Stats::Stats(core::PersistentCacheStats const& st)
+    : cache_path_(st.cache_path())
+    , policy_(st.policy())
+    , size_(st.size())
+    , size_in_bytes_(st.size_in_bytes())
+    , max_size_in_bytes_(st.max_size_in_bytes())
+    , hits_(st.hits())
+    , misses_(st.misses())
+    , hits_since_last_miss_(st.hits_since_last_miss())
+    , misses_since_last_hit_(st.misses_since_last_hit())
+    , longest_hit_run_(st.longest_hit_run())
+    , longest_miss_run_(st.longest_miss_run())
+    , avg_hit_run_length_(st.avg_hit_run_length())
+    , avg_miss_run_length_(st.avg_miss_run_length())
+    , ttl_evictions_(st.ttl_evictions())
+    , lru_evictions_(st.lru_evictions())
+    , most_recent_hit_time_(st.most_recent_hit_time())
+    , most_recent_miss_time_(st.most_recent_miss_time())
+    , longest_hit_run_time_(st.longest_hit_run_time())
+    , longest_miss_run_time_(st.longest_miss_run_time())
+    , histogram_(st.histogram())
+{
+}
+
+DiskCache::Stats::Stats(SegmentStore::Stats const& st, core::CacheDiscardPolicy policy, int64_t ttl_evictions)
+    : cache_path_(st.cache_path)
+    , policy_(policy)
+    , size_(st.size)
+    , size_in_bytes_(st.size_in_bytes)
+    , max_size_in_bytes_(st.max_size_in_bytes)
+    , hits_(st.hits)
+    , misses_(st.misses)
+    , ttl_evictions_(ttl_evictions)
+    , lru_evictions_(st.entries_evicted)
+{
+}
+
+string DiskCache::Stats::cache_path() const
+{
+    return cache_path_;
+}
+
+core::CacheDiscardPolicy DiskCache::Stats::policy() const
+{
+    return policy_;
+}
+
+int64_t DiskCache::Stats::size() const
+{
+    return size_;
+}
+
+int64_t DiskCache::Stats::size_in_bytes() const
+{
+    return size_in_bytes_;
+}
+
+int64_t DiskCache::Stats::max_size_in_bytes() const
+{
+    return max_size_in_bytes_;
+}
+
+int64_t DiskCache::Stats::hits() const
+{
+    return hits_;
+}
+
+int64_t DiskCache::Stats::misses() const
+{
+    return misses_;
+}
+
+int64_t DiskCache::Stats::hits_since_last_miss() const
+{
+    return hits_since_last_miss_;
+}
+
+int64_t DiskCache::Stats::misses_since_last_hit() const
+{
+    return misses_since_last_hit_;
+}
+
+int64_t DiskCache::Stats::longest_hit_run() const
+{
+    return longest_hit_run_;
+}
+
+int64_t DiskCache::Stats::longest_miss_run() const
+{
+    return longest_miss_run_;
+}
+
+double DiskCache::Stats::avg_hit_run_length() const
+{
+    return avg_hit_run_length_;
+}
+
+double DiskCache::Stats::avg_miss_run_length() const
+{
+    return avg_miss_run_length_;
+}
+
+int64_t DiskCache::Stats::ttl_evictions() const
+{
+    return ttl_evictions_;
+}
+
+int64_t DiskCache::Stats::lru_evictions() const
+{
+    return lru_evictions_;
+}
+
+DiskCache::Stats::TimePoint DiskCache::Stats::most_recent_hit_time() const
+{
+    return most_recent_hit_time_;
+}
+
+DiskCache::Stats::TimePoint DiskCache::Stats::most_recent_miss_time() const
+{
+    return most_recent_miss_time_;
+}
+
+DiskCache::Stats::TimePoint DiskCache::Stats::longest_hit_run_time() const
+{
+    return longest_hit_run_time_;
+}
+
+DiskCache::Stats::TimePoint DiskCache::Stats::longest_miss_run_time() const
+{
+    return longest_miss_run_time_;
+}
+
+core::PersistentCacheStats::Histogram DiskCache::Stats::histogram() const
+{
+    return histogram_;
+}
+
+DiskCache::UPtr DiskCache::open(Backend backend,
+                                string const& cache_path,
+                                int64_t max_size_in_bytes,
+                                core::CacheDiscardPolicy policy)
+{
+    if (holds_other_backend(cache_path, backend))
+    {
+        qDebug() << "DiskCache: backend changed, deleting" << cache_path.c_str();
+        boost::filesystem::remove_all(cache_path);
+    }
+
+    UPtr c(new DiskCache(backend, policy));
+    if (backend == Backend::leveldb)
+    {
+        c->leveldb_ = PersistentCacheHelper::open(cache_path, max_size_in_bytes, policy);
+    }
+    else
+    {
+        c->segments_ = CacheHelper<SegmentStore>::open(cache_path, max_size_in_bytes,
+                                                       core::CacheDiscardPolicy::lru_only);
+    }
+    return c;
+}
+
+DiskCache::DiskCache(Backend backend, core::CacheDiscardPolicy policy)
+    : backend_(backend)
+    , expiring_(backend == Backend::segments && policy == core::CacheDiscardPolicy::lru_ttl)
+    , ttl_evictions_(0)
+    , handler_events_()
+{
+}
+
+DiskCache::~DiskCache() = default;
+
+DiskCache::Backend DiskCache::backend() const
+{
+    return backend_;
+}
+
+core::Optional<string> DiskCache::get(string const& key) const
+{
+    if (leveldb_)
+    {
+        return leveldb_->get(key);
+    }
+    return unwrap(key, segments_->get(key), true);
+}
+
+core::Optional<string> DiskCache::take(string const& key)
+{
+    if (leveldb_)
+    {
+        return leveldb_->take(key);
+    }
+    return unwrap(key, segments_->take(key), false);
+}
+
+bool DiskCache::put(string const& key,
+                    string const& value,
+                    chrono::time_point<chrono::system_clock> expiry_time)
+{
+    if (leveldb_)
+    {
+        return leveldb_->put(key, value, expiry_time);
+    }
+    if (expiring_)
+    {
+        return segments_->put(key, expiry_prefix(expiry_time) + value);
+    }
+    return segments_->put(key, value, expiry_time);
+}
+
+// For an expiring segment store, this looks up the value to check its expiry time,
+// which counts as a hit in the stats.
+
+bool DiskCache::contains_key(string const& key) const
+{
+    if (leveldb_)
+    {
+        return leveldb_->contains_key(key);
+    }
+    if (expiring_)
+    {
+        return bool(get(key));
+    }
+    return segments_->contains_key(key);
+}
+
+DiskCache::Stats DiskCache::stats() const
+{
+    if (leveldb_)
+    {
+        return Stats(leveldb_->stats());
+    }
+    return Stats(segments_->stats(),
+                 expiring_ ? core::CacheDiscardPolicy::lru_ttl : core::CacheDiscardPolicy::lru_only,
+                 ttl_evictions_);
+}
+
+void DiskCache::clear_stats()
+{
+    if (leveldb_)
+    {
+        leveldb_->clear_stats();
+        return;
+    }
+    segments_->clear_stats();
+    ttl_evictions_ = 0;
+}
+
+void DiskCache::invalidate()
+{
+    if (leveldb_)
+    {
+        leveldb_->invalidate();
+        return;
+    }
+    segments_->invalidate();
+}
+
+void DiskCache::compact()
+{
+    if (leveldb_)
+    {
+        leveldb_->compact();
+        return;
+    }
+    segments_->compact();
+}
+
+void DiskCache::set_handler(core::CacheEvent events, EventCallback cb)
+{
+    if (leveldb_)
+    {
+        leveldb_->set_handler(events, [cb](string const& key, core::CacheEvent ev, core::PersistentCacheStats const&)
+        {
+            cb(key, ev);
+        });
+        return;
+    }
+    {
+        lock_guard<mutex> lock(handler_mutex_);
+        handler_events_ = events;
+        handler_ = cb;
+    }
+    segments_->set_handler(events, [cb](string const& key, core::CacheEvent ev, SegmentStore::Stats const&)
+    {
+        cb(key, ev);
+    });
+}
+
+DiskCache::RepairStats DiskCache::repair_stats() const
+{
+    if (leveldb_)
+    {
+        return leveldb_->repair_stats();
+    }
+    auto const st = segments_->repair_stats();
+    return RepairStats{st.repairs, st.entries_salvaged, st.entries_lost, st.entries_restored};
+}
+
+void DiskCache::wait_for_repair()
+{
+    if (leveldb_)
+    {
+        leveldb_->wait_for_repair();
+        return;
+    }
+    segments_->wait_for_repair();
+}
+
+// Strips the expiry time from a value in an expiring segment store.
+// If the entry has expired, we remove it (unless the caller took it already)
+// and report a miss.
+
+core::Optional<string> DiskCache::unwrap(string const& key, core::Optional<string> value, bool remove) const
+{
+    if (!value || !expiring_)
+    {
+        return value;
+    }
+    if (value->size() < EXPIRY_SIZE)
+    {
+        return core::Optional<string>();  // LCOV_EXCL_LINE
+    }
+    uint64_t const expiry = read_expiry(*value);
+    if (expiry != 0)
+    {
+        auto const now = chrono::duration_cast<chrono::milliseconds>(
+                             chrono::system_clock::now().time_since_epoch()).count();
+        if (int64_t(expiry) <= now)
+        {
+            if (remove)
+            {
+                segments_->take(key);
+            }
+            ++ttl_evictions_;
+            notify(key, core::CacheEvent::evict_ttl);
+            return core::Optional<string>();
+        }
+    }
+    return value->substr(EXPIRY_SIZE);
+}
+
+void DiskCache::notify(string const& key, core::CacheEvent ev) const
+{
+    EventCallback cb;
+    {
+        lock_guard<mutex> lock(handler_mutex_);
+        if ((uint32_t(handler_events_) & uint32_t(ev)) == 0)
+        {
+            return;
+        }
+        cb = handler_;
+    }
+    cb(key, ev);
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <internal/downscale.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNEL
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Weights are fixed-point numbers with this many fractional bits. The weights
+// for each output pixel add up to exactly 1 << WEIGHT_BITS. 14 bits keeps
+// each weight within an int16_t, which the SIMD kernels need.
+int const WEIGHT_BITS = 14;
+int const WEIGHT_ONE = 1 << WEIGHT_BITS;
+int const WEIGHT_ROUND = 1 << (WEIGHT_BITS - 1);
+
+// For each output pixel (or row), the range of source pixels (or rows)
+// that contribute to it, and their weights. Weights are stored with a fixed
+// stride of max_taps, padded with zeros.
+struct Contributions
+{
+    vector<int> start;
+    vector<int> count;
+    vector<int16_t> weights;
+    int max_taps = 0;
+};
+
+double sinc(double x)
+{
+    if (x == 0.0)
+    {
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+double lanczos3(double x)
+{
+    return abs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+Contributions compute_contributions(int in_size, int out_size, ScaleFilter filter)
+{
+    double const scale = double(in_size) / out_size;
+
+    vector<vector<double>> all_weights(out_size);
+    Contributions c;
+    c.start.resize(out_size);
+    c.count.resize(out_size);
+    for (int i = 0; i < out_size; ++i)
+    {
+        int first;
+        int last;
+        auto& w = all_weights[i];
+        if (filter == ScaleFilter::box)
+        {
+            // Each source pixel is weighted by how much of it lies within the
+            // footprint of the output pixel.
+            double const lo = i * scale;
+            double const hi = (i + 1) * scale;
+            first = int(floor(lo));
+            last = min(int(ceil(hi)) - 1, in_size - 1);
+            for (int j = first; j <= last; ++j)
+            {
+                w.push_back(min(hi, j + 1.0) - max(lo, double(j)));
+            }
+        }
+        else
+        {
+            double const stretch = max(scale, 1.0);
+            double const support = 3.0 * stretch;
+            double const center = (i + 0.5) * scale;
+            first = max(int(floor(center - support)), 0);
+            last = min(int(ceil(center + support)), in_size - 1);
+            for (int j = first; j <= last; ++j)
+            {
+                w.push_back(lanczos3((j + 0.5 - center) / stretch));
+            }
+        }
+
+        assert(!w.empty());
+        c.start[i] = first;
+        c.count[i] = int(w.size());
+        c.max_taps = max(c.max_taps, c.count[i]);
+    }
+
+    // Convert to fixed point. Any rounding error goes to the largest weight.
+    c.weights.resize(size_t(out_size) * c.max_taps);
+    for (int i = 0; i < out_size; ++i)
+    {
+        auto const& w = all_weights[i];
+        double sum = 0.0;
+        for (auto v : w)
+        {
+            sum += v;
+        }
+        int16_t* iw = &c.weights[size_t(i) * c.max_taps];
+        int isum = 0;
+        int largest = 0;
+        for (size_t k = 0; k < w.size(); ++k)
+        {
+            iw[k] = int16_t(lround(w[k] / sum * WEIGHT_ONE));
+            isum += iw[k];
+            if (iw[k] > iw[largest])
+            {
+                largest = int(k);
+            }
+        }
+        iw[largest] += WEIGHT_ONE - isum;
+    }
+    return c;
+}
+
+inline uint8_t clamp_pixel(int v)
+{
+    v >>= WEIGHT_BITS;
+    return uint8_t(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// Vertical pass: out[x] = sum(weights[k] * rows[k][x]) for x in [0, len).
+
+typedef void (*VerticalFunc)(uint8_t const* const* rows, int16_t const* weights, int taps, uint8_t* out, int len);
+
+void vertical_scalar_range(uint8_t const* const* rows, int16_t const* weights, int taps,
+                           uint8_t* out, int begin, int end)
+{
+    for (int x = begin; x < end; ++x)
+    {
+        int acc = WEIGHT_ROUND;
+        for (int k = 0; k < taps; ++k)
+        {
+            acc += weights[k] * rows[k][x];
+        }
+        out[x] = clamp_pixel(acc);
+    }
+}
+
+void vertical_scalar(uint8_t const* const* rows, int16_t const* weights, int taps, uint8_t* out, int len)
+{
+    vertical_scalar_range(rows, weights, taps, out, 0, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// The x86 kernels process pairs of rows: the pixels of the two rows are interleaved
+// as 16-bit values and multiplied with an interleaved pair of weights by pmaddwd,
+// which yields the 32-bit sum for each pixel.
+
+inline int weight_pair(int16_t w0, int16_t w1)
+{
+    return int(uint32_t(uint16_t(w1)) << 16 | uint16_t(w0));
+}
+
+__attribute__((target("sse2")))
+void vertical_sse2(uint8_t const* const* rows, int16_t const* weights, int taps, uint8_t* out, int len)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const round = _mm_set1_epi32(WEIGHT_ROUND);
+    int x = 0;
+    for (; x + 16 <= len; x += 16)
+    {
+        __m128i acc0 = round;
+        __m128i acc1 = round;
+        __m128i acc2 = round;
+        __m128i acc3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i const a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(rows[k] + x));
+            __m128i b = zero;
+            __m128i w;
+            if (k + 1 < taps)
+            {
+                b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(rows[k + 1] + x));
+                w = _mm_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            }
+            else
+            {
+                w = _mm_set1_epi32(weight_pair(weights[k], 0));
+            }
+            __m128i const ab_lo = _mm_unpacklo_epi8(a, b);
+            __m128i const ab_hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(ab_lo, zero), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(ab_lo, zero), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(ab_hi, zero), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(ab_hi, zero), w));
+        }
+        acc0 = _mm_srai_epi32(acc0, WEIGHT_BITS);
+        acc1 = _mm_srai_epi32(acc1, WEIGHT_BITS);
+        acc2 = _mm_srai_epi32(acc2, WEIGHT_BITS);
+        acc3 = _mm_srai_epi32(acc3, WEIGHT_BITS);
+        __m128i const result = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1), _mm_packs_epi32(acc2, acc3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), result);
+    }
+    vertical_scalar_range(rows, weights, taps, out, x, len);
+}
+
+// Same as the SSE2 version, but 32 pixels at a time. The unpack and pack instructions
+// operate within each 128-bit lane, so the pixel order comes out right without
+// any permutes.
+__attribute__((target("avx2")))
+void vertical_avx2(uint8_t const* const* rows, int16_t const* weights, int taps, uint8_t* out, int len)
+{
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const round = _mm256_set1_epi32(WEIGHT_ROUND);
+    int x = 0;
+    for (; x + 32 <= len; x += 32)
+    {
+        __m256i acc0 = round;
+        __m256i acc1 = round;
+        __m256i acc2 = round;
+        __m256i acc3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m256i const a = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(rows[k] + x));
+            __m256i b = zero;
+            __m256i w;
+            if (k + 1 < taps)
+            {
+                b = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(rows[k + 1] + x));
+                w = _mm256_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            }
+            else
+            {
+                w = _mm256_set1_epi32(weight_pair(weights[k], 0));
+            }
+            __m256i const ab_lo = _mm256_unpacklo_epi8(a, b);
+            __m256i const ab_hi = _mm256_unpackhi_epi8(a, b);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(ab_lo, zero), w));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(ab_lo, zero), w));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(ab_hi, zero), w));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(ab_hi, zero), w));
+        }
+        acc0 = _mm256_srai_epi32(acc0, WEIGHT_BITS);
+        acc1 = _mm256_srai_epi32(acc1, WEIGHT_BITS);
+        acc2 = _mm256_srai_epi32(acc2, WEIGHT_BITS);
+        acc3 = _mm256_srai_epi32(acc3, WEIGHT_BITS);
+        __m256i const result = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1), _mm256_packs_epi32(acc2, acc3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), result);
+    }
+    vertical_scalar_range(rows, weights, taps, out, x, len);
+}
+
+#endif  // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNEL
+
+void vertical_neon(uint8_t const* const* rows, int16_t const* weights, int taps, uint8_t* out, int len)
+{
+    int32x4_t const round = vdupq_n_s32(WEIGHT_ROUND);
+    int x = 0;
+    for (; x + 16 <= len; x += 16)
+    {
+        int32x4_t acc0 = round;
+        int32x4_t acc1 = round;
+        int32x4_t acc2 = round;
+        int32x4_t acc3 = round;
+        for (int k = 0; k < taps; ++k)
+        {
+            uint8x16_t const p = vld1q_u8(rows[k] + x);
+            int16x8_t const lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(p)));
+            int16x8_t const hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(p)));
+            int16_t const w = weights[k];
+            acc0 = vmlal_n_s16(acc0, vget_low_s16(lo), w);
+            acc1 = vmlal_n_s16(acc1, vget_high_s16(lo), w);
+            acc2 = vmlal_n_s16(acc2, vget_low_s16(hi), w);
+            acc3 = vmlal_n_s16(acc3, vget_high_s16(hi), w);
+        }
+        int16x8_t const r_lo = vcombine_s16(vqmovn_s32(vshrq_n_s32(acc0, WEIGHT_BITS)),
+                                            vqmovn_s32(vshrq_n_s32(acc1, WEIGHT_BITS)));
+        int16x8_t const r_hi = vcombine_s16(vqmovn_s32(vshrq_n_s32(acc2, WEIGHT_BITS)),
+                                            vqmovn_s32(vshrq_n_s32(acc3, WEIGHT_BITS)));
+        vst1q_u8(out + x, vcombine_u8(vqmovun_s16(r_lo), vqmovun_s16(r_hi)));
+    }
+    vertical_scalar_range(rows, weights, taps, out, x, len);
+}
+
+#endif  // HAVE_NEON_KERNEL
+
+// Horizontal pass over a single row.
+
+template<int CHANNELS>
+void horizontal(uint8_t const* in, uint8_t* out, Contributions const& c)
+{
+    int const out_width = int(c.start.size());
+    for (int i = 0; i < out_width; ++i)
+    {
+        uint8_t const* p = in + c.start[i] * CHANNELS;
+        int16_t const* w = &c.weights[size_t(i) * c.max_taps];
+        int const taps = c.count[i];
+        int acc[CHANNELS];
+        for (int ch = 0; ch < CHANNELS; ++ch)
+        {
+            acc[ch] = WEIGHT_ROUND;
+        }
+        for (int k = 0; k < taps; ++k)
+        {
+            for (int ch = 0; ch < CHANNELS; ++ch)
+            {
+                acc[ch] += w[k] * p[ch];
+            }
+            p += CHANNELS;
+        }
+        for (int ch = 0; ch < CHANNELS; ++ch)
+        {
+            out[ch] = clamp_pixel(acc[ch]);
+        }
+        out += CHANNELS;
+    }
+}
+
+void premultiply(uint8_t const* in, uint8_t* out, int width)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        int const a = in[3];
+        out[0] = uint8_t((in[0] * a + 127) / 255);
+        out[1] = uint8_t((in[1] * a + 127) / 255);
+        out[2] = uint8_t((in[2] * a + 127) / 255);
+        out[3] = uint8_t(a);
+        in += 4;
+        out += 4;
+    }
+}
+
+void unpremultiply(uint8_t* p, int width)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        int const a = p[3];
+        if (a == 0)
+        {
+            p[0] = p[1] = p[2] = 0;
+        }
+        else if (a != 255)
+        {
+            p[0] = uint8_t(min(255, (p[0] * 255 + a / 2) / a));
+            p[1] = uint8_t(min(255, (p[1] * 255 + a / 2) / a));
+            p[2] = uint8_t(min(255, (p[2] * 255 + a / 2) / a));
+        }
+        p += 4;
+    }
+}
+
+VerticalFunc vertical_func(ScaleKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef HAVE_X86_KERNELS
+        case ScaleKernel::sse2:
+            return vertical_sse2;
+        case ScaleKernel::avx2:
+            return vertical_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+        case ScaleKernel::neon:
+            return vertical_neon;
+#endif
+        default:
+            return vertical_scalar;
+    }
+}
+
+}  // namespace
+
+bool scale_kernel_supported(ScaleKernel kernel)
+{
+    switch (kernel)
+    {
+        case ScaleKernel::automatic:
+        case ScaleKernel::scalar:
+            return true;
+#ifdef HAVE_X86_KERNELS
+        case ScaleKernel::sse2:
+            return __builtin_cpu_supports("sse2");
+        case ScaleKernel::avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef HAVE_NEON_KERNEL
+        case ScaleKernel::neon:
+#if defined(__aarch64__)
+            return true;
+#else
+            return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+#endif
+        default:
+            return false;
+    }
+}
+
+ScaleKernel best_scale_kernel()
+{
+    static ScaleKernel const best = []
+    {
+        for (auto k : { ScaleKernel::avx2, ScaleKernel::sse2, ScaleKernel::neon })
+        {
+            if (scale_kernel_supported(k))
+            {
+                return k;
+            }
+        }
+        return ScaleKernel::scalar;
+    }();
+    return best;
+}
+
+char const* scale_kernel_name(ScaleKernel kernel)
+{
+    switch (kernel)
+    {
+        case ScaleKernel::automatic:
+            return "automatic";
+        case ScaleKernel::scalar:
+            return "scalar";
+        case ScaleKernel::sse2:
+            return "sse2";
+        case ScaleKernel::avx2:
+            return "avx2";
+        case ScaleKernel::neon:
+            return "neon";
+        default:
+            abort();  // LCOV_EXCL_LINE  // Impossible
+    }
+}
+
+void downscale(uint8_t const* src, int src_width, int src_height, int src_stride,
+               uint8_t* dst, int dst_width, int dst_height, int dst_stride,
+               int channels,
+               ScaleFilter filter,
+               ScaleKernel kernel)
+{
+    if (channels != 3 && channels != 4)
+    {
+        throw invalid_argument("downscale(): invalid number of channels: " + to_string(channels));
+    }
+    if (src_width < 1 || src_height < 1 || dst_width < 1 || dst_height < 1)
+    {
+        throw invalid_argument("downscale(): invalid size: " + to_string(src_width) + "x" + to_string(src_height) +
+                               " -> " + to_string(dst_width) + "x" + to_string(dst_height));
+    }
+    if (src_stride < src_width * channels || dst_stride < dst_width * channels)
+    {
+        throw invalid_argument("downscale(): stride too small");
+    }
+    if (kernel == ScaleKernel::automatic)
+    {
+        kernel = best_scale_kernel();
+    }
+    if (!scale_kernel_supported(kernel))
+    {
+        throw invalid_argument(string("downscale(): kernel not supported on this machine: ") +
+                               scale_kernel_name(kernel));
+    }
+    VerticalFunc const vertical = vertical_func(kernel);
+
+    Contributions const horiz = compute_contributions(src_width, dst_width, filter);
+    Contributions const vert = compute_contributions(src_height, dst_height, filter);
+
+    int const row_len = src_width * channels;
+    vector<uint8_t> tmp(row_len);
+    vector<uint8_t const*> rows(vert.max_taps);
+
+    // For RGBA, we keep premultiplied copies of the source rows that are in use
+    // in a ring buffer. The first and last contributing rows never decrease from
+    // one output row to the next, so max_taps rows are sufficient.
+    bool const has_alpha = channels == 4;
+    int const ring_size = has_alpha ? vert.max_taps : 0;
+    vector<uint8_t> ring(size_t(ring_size) * row_len);
+    int next_row = 0;  // Next source row to premultiply.
+
+    for (int y = 0; y < dst_height; ++y)
+    {
+        int const first = vert.start[y];
+        int const taps = vert.count[y];
+        for (int k = 0; k < taps; ++k)
+        {
+            int const row = first + k;
+            if (has_alpha)
+            {
+                uint8_t* slot = &ring[size_t(row % ring_size) * row_len];
+                if (row >= next_row)
+                {
+                    premultiply(src + size_t(row) * src_stride, slot, src_width);
+                    next_row = row + 1;
+                }
+                rows[k] = slot;
+            }
+            else
+            {
+                rows[k] = src + size_t(row) * src_stride;
+            }
+        }
+        vertical(rows.data(), &vert.weights[size_t(y) * vert.max_taps], taps, tmp.data(), row_len);
+
+        uint8_t* out = dst + size_t(y) * dst_stride;
+        if (has_alpha)
+        {
+            horizontal<4>(tmp.data(), out, horiz);
+            unpremultiply(out, dst_width);
+        }
+        else
+        {
+            horizontal<3>(tmp.data(), out, horiz);
+        }
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/embedded_art.h>
+
+#include <internal/raii.h>
+#include <internal/safe_strerror.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// The parsers below run over untrusted data. They never read outside the range
+// they are given and simply report "no art" for anything that doesn't make sense.
+//
+// We read the file with pread() instead of mapping it. The file can be truncated
+// (or its medium removed) while we parse it, and touching a mapped page past the
+// end of the file would kill the service with SIGBUS. With pread(), we just see
+// fewer bytes than we expect, which the parsers treat like a truncated file.
+
+// Ranges are file offsets.
+
+struct Range
+{
+    uint64_t begin;
+    uint64_t end;
+
+    uint64_t size() const
+    {
+        return end - begin;
+    }
+};
+
+Range const no_range = { UINT64_MAX, UINT64_MAX };
+
+// Names and MIME types of Matroska attachments longer than this are not cover art.
+size_t const MAX_STRING_SIZE = 256;
+
+class FileReader
+{
+public:
+    FileReader(int fd, string const& filename)
+        : fd_(fd)
+        , filename_(filename)
+    {
+    }
+
+    // Reads up to len bytes at offset into buf and returns the number of bytes read,
+    // which is less than len only at the end of the file.
+    size_t read(uint64_t offset, unsigned char* buf, size_t len) const
+    {
+        size_t total = 0;
+        while (total < len)
+        {
+            ssize_t rc = pread(fd_, buf + total, len - total, off_t(offset + total));
+            if (rc == -1)
+            {
+                // LCOV_EXCL_START
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw runtime_error("extract_embedded_art(): cannot read " + filename_ + ": " + safe_strerror(errno));
+                // LCOV_EXCL_STOP
+            }
+            if (rc == 0)
+            {
+                break;
+            }
+            total += rc;
+        }
+        return total;
+    }
+
+    // Returns the bytes in r, or the empty string if the file ends before r does.
+    // The caller makes sure that r is small enough to hold in memory.
+    string read(Range r) const
+    {
+        string s(r.size(), '\0');
+        if (read(r.begin, reinterpret_cast<unsigned char*>(&s[0]), s.size()) != s.size())
+        {
+            return "";
+        }
+        return s;
+    }
+
+private:
+    int fd_;
+    string filename_;
+};
+
+// MP4 (ISO base media file format)
+
+uint32_t be32(unsigned char const* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+uint64_t be64(unsigned char const* p)
+{
+    return uint64_t(be32(p)) << 32 | be32(p + 4);
+}
+
+// Returns the payload of the first box of the given type in r, or no_range.
+
+Range find_box(FileReader const& file, Range r, char const* type)
+{
+    uint64_t p = r.begin;
+    while (r.end - p >= 8)
+    {
+        unsigned char hdr[16];
+        size_t const n = file.read(p, hdr, size_t(min(uint64_t(sizeof(hdr)), r.end - p)));
+        if (n < 8)
+        {
+            break;  // Truncated.
+        }
+        uint64_t box_size = be32(hdr);
+        size_t header_size = 8;
+        if (box_size == 1)
+        {
+            if (n < 16)
+            {
+                break;
+            }
+            box_size = be64(hdr + 8);
+            header_size = 16;
+        }
+        else if (box_size == 0)
+        {
+            box_size = r.end - p;  // Box extends to the end of the file.
+        }
+        if (box_size < header_size || box_size > r.end - p)
+        {
+            break;  // Corrupt or truncated.
+        }
+        if (memcmp(hdr + 4, type, 4) == 0)
+        {
+            return Range{ p + header_size, p + box_size };
+        }
+        p += box_size;
+    }
+    return no_range;
+}
+
+bool is_mp4(FileReader const& file)
+{
+    static char const* const top_level_boxes[] = { "ftyp", "moov", "mdat", "free", "skip", "wide" };
+
+    unsigned char hdr[8];
+    if (file.read(0, hdr, sizeof(hdr)) < sizeof(hdr))
+    {
+        return false;
+    }
+    for (auto type : top_level_boxes)
+    {
+        if (memcmp(hdr + 4, type, 4) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+string mp4_cover(FileReader const& file, Range all)
+{
+    Range udta = find_box(file, find_box(file, all, "moov"), "udta");
+    Range meta = find_box(file, udta, "meta");
+    unsigned char hdr[8];
+    if (meta.size() < 12 || file.read(meta.begin, hdr, sizeof(hdr)) < sizeof(hdr))
+    {
+        return "";
+    }
+    // meta is a full box (with version and flags), except in some files written by
+    // QuickTime, where the handler box follows the box header immediately.
+    if (memcmp(hdr + 4, "hdlr", 4) != 0)
+    {
+        meta.begin += 4;
+    }
+    Range covr = find_box(file, find_box(file, meta, "ilst"), "covr");
+
+    // covr contains one data box per image. The payload of a data box starts
+    // with a version byte and a type indicator (13 for JPEG, 14 for PNG, 27 for BMP),
+    // followed by a locale. Anything else (such as text) is not an image.
+    while (covr.size() > 0)
+    {
+        Range data = find_box(file, covr, "data");
+        if (data.begin == no_range.begin)
+        {
+            break;
+        }
+        if (data.size() > 8 && file.read(data.begin, hdr, 4) == 4)
+        {
+            uint32_t const type = be32(hdr);
+            if (type == 13 || type == 14 || type == 27)
+            {
+                if (data.size() - 8 > MAX_EMBEDDED_ART_SIZE)
+                {
+                    return "";
+                }
+                return file.read(Range{ data.begin + 8, data.end });
+            }
+        }
+        covr.begin = data.end;
+    }
+    return "";
+}
+
+// Matroska (EBML)
+
+uint32_t const EBML_ID = 0x1A45DFA3;
+uint32_t const SEGMENT_ID = 0x18538067;
+uint32_t const SEEK_HEAD_ID = 0x114D9B74;
+uint32_t const SEEK_ID = 0x4DBB;
+uint32_t const SEEK_ID_ID = 0x53AB;
+uint32_t const SEEK_POSITION_ID = 0x53AC;
+uint32_t const ATTACHMENTS_ID = 0x1941A469;
+uint32_t const ATTACHED_FILE_ID = 0x61A7;
+uint32_t const FILE_NAME_ID = 0x466E;
+uint32_t const FILE_MIME_TYPE_ID = 0x4660;
+uint32_t const FILE_DATA_ID = 0x465C;
+
+struct Element
+{
+    uint32_t id;
+    Range data;
+    bool unknown_size;
+};
+
+// Returns the number of bytes in a variable-length integer that starts with b, or 0 if b is invalid.
+
+int vint_length(unsigned char b, int max_length)
+{
+    for (int len = 1; len <= max_length; ++len)
+    {
+        if (b & (0x80 >> (len - 1)))
+        {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// Reads the element at p and advances p past it. An element that claims to be larger
+// than what is left (which happens for truncated files) is clipped to the end of r.
+// Elements of unknown size extend to the end of r.
+
+bool read_element(FileReader const& file, uint64_t& p, Range r, Element& e)
+{
+    if (p >= r.end)
+    {
+        return false;
+    }
+    unsigned char hdr[12];  // At most four bytes of ID and eight bytes of size.
+    int const n = int(file.read(p, hdr, size_t(min(uint64_t(sizeof(hdr)), r.end - p))));
+    if (n == 0)
+    {
+        return false;
+    }
+    int id_len = vint_length(hdr[0], 4);
+    if (id_len == 0 || n < id_len + 1)
+    {
+        return false;
+    }
+    e.id = 0;
+    for (int i = 0; i < id_len; ++i)
+    {
+        e.id = e.id << 8 | hdr[i];
+    }
+
+    unsigned char const* s = hdr + id_len;
+    int size_len = vint_length(*s, 8);
+    if (size_len == 0 || n - id_len < size_len)
+    {
+        return false;
+    }
+    uint64_t size = *s & (0xff >> size_len);
+    bool all_ones = size == uint64_t(0xff >> size_len);
+    for (int i = 1; i < size_len; ++i)
+    {
+        size = size << 8 | s[i];
+        all_ones = all_ones && s[i] == 0xff;
+    }
+    p += id_len + size_len;
+
+    e.unknown_size = all_ones;
+    e.data.begin = p;
+    e.data.end = all_ones || size > r.end - p ? r.end : p + size;
+    p = e.data.end;
+    return true;
+}
+
+uint64_t read_uint(FileReader const& file, Range r)
+{
+    unsigned char buf[8];
+    size_t const n = file.read(r.begin, buf, size_t(min(uint64_t(sizeof(buf)), r.size())));
+    uint64_t val = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        val = val << 8 | buf[i];
+    }
+    return val;
+}
+
+// Returns the contents of a string element, or the empty string if it is too long.
+
+string read_string(FileReader const& file, Range r)
+{
+    return r.size() > MAX_STRING_SIZE ? "" : file.read(r);
+}
+
+// Matroska defines the attachment names that a player should show as cover art.
+// We prefer the full-size portrait cover.
+
+int cover_rank(string name)
+{
+    static char const* const cover_names[] = { "cover", "cover_land", "small_cover", "small_cover_land" };
+
+    transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+    auto dot = name.rfind('.');
+    if (dot != string::npos)
+    {
+        name.resize(dot);
+    }
+    for (int i = 0; i < int(sizeof(cover_names) / sizeof(cover_names[0])); ++i)
+    {
+        if (name == cover_names[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+string matroska_attachments_cover(FileReader const& file, Range attachments)
+{
+    Range best = no_range;
+    int best_rank = -1;
+
+    auto p = attachments.begin;
+    Element attached_file;
+    while (read_element(file, p, attachments, attached_file))
+    {
+        if (attached_file.id != ATTACHED_FILE_ID)
+        {
+            continue;
+        }
+        string name;
+        string mime_type;
+        Range data = no_range;
+        auto q = attached_file.data.begin;
+        Element e;
+        while (read_element(file, q, attached_file.data, e))
+        {
+            switch (e.id)
+            {
+                case FILE_NAME_ID:
+                    name = read_string(file, e.data);
+                    break;
+                case FILE_MIME_TYPE_ID:
+                    mime_type = read_string(file, e.data);
+                    break;
+                case FILE_DATA_ID:
+                    data = e.data;
+                    break;
+                default:
+                    break;
+            }
+        }
+        int rank = cover_rank(name.c_str());  // Strings may be padded with NUL bytes.
+        if (rank == -1 || mime_type.compare(0, 6, "image/") != 0 || data.size() == 0)
+        {
+            continue;
+        }
+        if (data.size() > MAX_EMBEDDED_ART_SIZE)
+        {
+            continue;
+        }
+        if (best_rank == -1 || rank < best_rank)
+        {
+            best = data;
+            best_rank = rank;
+        }
+    }
+    return best_rank == -1 ? "" : file.read(best);
+}
+
+// Looks up the position of the attachments in the seek head.
+// Returns the offset of the Attachments element, or UINT64_MAX.
+
+uint64_t matroska_seek_attachments(FileReader const& file, Range segment, Range seek_head)
+{
+    auto p = seek_head.begin;
+    Element seek;
+    while (read_element(file, p, seek_head, seek))
+    {
+        if (seek.id != SEEK_ID)
+        {
+            continue;
+        }
+        uint32_t id = 0;
+        uint64_t pos = UINT64_MAX;
+        auto q = seek.data.begin;
+        Element e;
+        while (read_element(file, q, seek.data, e))
+        {
+            if (e.id == SEEK_ID_ID)
+            {
+                id = uint32_t(read_uint(file, e.data));
+            }
+            else if (e.id == SEEK_POSITION_ID)
+            {
+                pos = read_uint(file, e.data);
+            }
+        }
+        if (id == ATTACHMENTS_ID && pos < segment.size())
+        {
+            return segment.begin + pos;
+        }
+    }
+    return UINT64_MAX;
+}
+
+bool is_matroska(FileReader const& file)
+{
+    unsigned char hdr[4];
+    return file.read(0, hdr, sizeof(hdr)) == sizeof(hdr) && be32(hdr) == EBML_ID;
+}
+
+string matroska_cover(FileReader const& file, Range all)
+{
+    auto p = all.begin;
+    Element e;
+    if (!read_element(file, p, all, e) || e.id != EBML_ID)
+    {
+        return "";  // LCOV_EXCL_LINE
+    }
+    Element segment;
+    do
+    {
+        if (!read_element(file, p, all, segment))
+        {
+            return "";
+        }
+    }
+    while (segment.id != SEGMENT_ID);
+
+    // The attachments usually come after the clusters, at the end of the file. If
+    // the seek head tells us where they are, we don't read the clusters in between.
+    p = segment.data.begin;
+    while (read_element(file, p, segment.data, e))
+    {
+        switch (e.id)
+        {
+            case SEEK_HEAD_ID:
+            {
+                auto q = matroska_seek_attachments(file, segment.data, e.data);
+                Element attachments;
+                if (q != UINT64_MAX && read_element(file, q, segment.data, attachments)
+                    && attachments.id == ATTACHMENTS_ID)
+                {
+                    return matroska_attachments_cover(file, attachments.data);
+                }
+                break;
+            }
+            case ATTACHMENTS_ID:
+            {
+                return matroska_attachments_cover(file, e.data);
+            }
+            default:
+            {
+                if (e.unknown_size)
+                {
+                    return "";  // We can't find the end of a live-streamed cluster without parsing it.
+                }
+                break;
+            }
+        }
+    }
+    return "";
+}
+
+}  // namespace
+
+string extract_embedded_art(string const& filename)
+{
+    FdPtr fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC), do_close);
+    if (fd.get() == -1)
+    {
+        throw runtime_error("extract_embedded_art(): cannot open " + filename + ": " + safe_strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+    {
+        throw runtime_error("extract_embedded_art(): cannot stat " + filename + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < 8)
+    {
+        return "";
+    }
+
+    // We only look at the container metadata, so we read a handful of headers
+    // instead of the whole file.
+    FileReader file(fd.get(), filename);
+    Range all = { 0, uint64_t(st.st_size) };
+    if (is_mp4(file))
+    {
+        return mp4_cover(file, all);
+    }
+    if (is_matroska(file))
+    {
+        return matroska_cover(file, all);
+    }
+    return "";
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/extractorpool.h>
+
+#include <internal/config.h>
+#include <internal/env_vars.h>
+#include <internal/raii.h>
+#include <internal/safe_strerror.h>
+#include <internal/vs_thumb_protocol.h>
+
+#include <QDebug>
+#include <QProcess>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QUrl>
+
+#include <algorithm>
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// QProcess that lets the child inherit one end of the control socket.
+// The parent's copy of the descriptor stays close-on-exec, so it does not
+// leak into other child processes that we may be starting concurrently.
+
+class WorkerProcess : public QProcess
+{
+public:
+    int child_fd = -1;
+
+protected:
+    void setupChildProcess() override
+    {
+        // Runs in the child between fork() and exec().
+        fcntl(child_fd, F_SETFD, 0);
+    }
+};
+
+}  // namespace
+
+struct ExtractorPool::Job
+{
+    Job(int64_t id,
+        string const& filename,
+        int max_size,
+        int out_fd,
+        chrono::milliseconds timeout,
+        DoneFunc const& done_func)
+        : id(id)
+        , filename(filename)
+        , max_size(max_size)
+        , out_fd(out_fd, do_close)
+        , timeout(timeout)
+        , done_func(done_func)
+    {
+    }
+
+    int64_t const id;
+    string const filename;
+    int const max_size;
+    FdPtr out_fd;
+    chrono::milliseconds const timeout;
+    DoneFunc const done_func;
+};
+
+class ExtractorPool::Worker : public QObject
+{
+public:
+    explicit Worker(QObject* parent)
+        : QObject(parent)
+        , socket(do_close)
+        , jobs_done(0)
+    {
+    }
+
+    ~Worker()
+    {
+        shutdown();
+    }
+
+    // Kills the process without notifying the pool.
+    void shutdown()
+    {
+        QObject::disconnect(&process, nullptr, this, nullptr);
+        notifier.reset();
+        timer.stop();
+        if (process.state() != QProcess::NotRunning)
+        {
+            process.kill();
+            process.waitForFinished(1000);
+        }
+    }
+
+    WorkerProcess process;
+    QString exe_path;
+    FdPtr socket;
+    unique_ptr<QSocketNotifier> notifier;
+    QTimer timer;
+    unique_ptr<Job> job;  // Null while idle.
+    int jobs_done;
+    string error;         // Set on timeout, so the exit status doesn't overwrite the reason for the kill.
+};
+
+ExtractorPool::ExtractorPool(int max_workers, int max_jobs_per_worker)
+    : max_workers_(max_workers)
+    , max_jobs_per_worker_(max_jobs_per_worker)
+    , next_job_id_(0)
+    , workers_started_(0)
+{
+    assert(max_workers > 0);
+    assert(max_jobs_per_worker > 0);
+}
+
+ExtractorPool::~ExtractorPool()
+{
+    // Shut down explicitly because waiting for a process to finish
+    // can emit signals whose handlers would call back into the pool.
+    for (auto w : workers_)
+    {
+        w->shutdown();
+    }
+    for (auto w : retiring_)
+    {
+        w->shutdown();
+    }
+}
+
+int64_t ExtractorPool::submit(string const& filename,
+                              int max_size,
+                              int out_fd,
+                              chrono::milliseconds timeout,
+                              DoneFunc const& done_func)
+{
+    int64_t id = next_job_id_++;
+    pending_.emplace_back(new Job(id, filename, max_size, out_fd, timeout, done_func));
+    dispatch();
+    return id;
+}
+
+void ExtractorPool::cancel(int64_t job_id)
+{
+    auto it = find_if(pending_.begin(), pending_.end(), [job_id](unique_ptr<Job> const& j){ return j->id == job_id; });
+    if (it != pending_.end())
+    {
+        pending_.erase(it);
+        return;
+    }
+    for (auto w : workers_)
+    {
+        if (w->job && w->job->id == job_id)
+        {
+            // There is no way to interrupt a worker in the middle of an extraction.
+            w->job.reset();
+            retire(w);
+            w->process.kill();
+            return;
+        }
+    }
+}
+
+int ExtractorPool::num_workers() const
+{
+    return int(workers_.size() + retiring_.size());
+}
+
+int64_t ExtractorPool::workers_started() const
+{
+    return workers_started_;
+}
+
+void ExtractorPool::dispatch()
+{
+    while (!pending_.empty())
+    {
+        auto it = find_if(workers_.begin(), workers_.end(), [](Worker* w){ return !w->job; });
+        Worker* w = it != workers_.end() ? *it : nullptr;
+        if (!w)
+        {
+            if (int(workers_.size()) >= max_workers_)
+            {
+                return;  // All workers are busy, job stays queued.
+            }
+            try
+            {
+                w = spawn_worker();
+            }
+            // LCOV_EXCL_START
+            catch (std::exception const& e)
+            {
+                auto job = move(pending_.front());
+                pending_.pop_front();
+                job->done_func(e.what());
+                continue;
+            }
+            // LCOV_EXCL_STOP
+        }
+        auto job = move(pending_.front());
+        pending_.pop_front();
+        run_job(w, move(job));
+    }
+}
+
+ExtractorPool::Worker* ExtractorPool::spawn_worker()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        throw runtime_error(string("ExtractorPool: cannot create socket pair: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    FdPtr child_fd(fds[1], do_close);
+
+    Worker* w = new Worker(this);
+    w->socket.reset(fds[0]);
+    if (fcntl(w->socket.get(), F_SETFL, O_NONBLOCK) == -1)
+    {
+        // LCOV_EXCL_START
+        delete w;
+        throw runtime_error(string("ExtractorPool: cannot set O_NONBLOCK: ") + safe_strerror(errno));
+        // LCOV_EXCL_STOP
+    }
+
+    // Gstreamer video pipelines are unstable so we need to run an
+    // external helper executable.
+    char* utildir = getenv(UTIL_DIR);
+    w->exe_path = utildir ? utildir : SHARE_PRIV_ABS;
+    w->exe_path += QLatin1String("/vs-thumb");
+
+    // QProcess can emit signals from within start(), so we defer handling them until
+    // we are back in the event loop. That way, the handlers never run from within a call into the pool.
+    w->process.child_fd = child_fd.get();
+    w->process.setStandardInputFile(QProcess::nullDevice());
+    w->process.setProcessChannelMode(QProcess::ForwardedChannels);
+    connect(&w->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+            w, [this, w](int exit_code, QProcess::ExitStatus exit_status)
+            {
+                string filename = w->job ? w->job->filename : string();
+                string error;
+                if (exit_status == QProcess::CrashExit)
+                {
+                    error = w->exe_path.toStdString() + " crashed";
+                }
+                else
+                {
+                    switch (exit_code)
+                    {
+                        case 0:
+                            error = w->exe_path.toStdString() + " exited unexpectedly";
+                            break;
+                        case 1:
+                            error = "no artwork for " + filename;
+                            break;
+                        case 2:
+                            error = "extractor pipeline failed for " + filename;
+                            break;
+                        default:
+                            error = "unknown exit status " + to_string(exit_code) +
+                                    " from " + w->exe_path.toStdString() + " for " + filename;
+                            break;
+                    }
+                }
+                QTimer::singleShot(0, w, [this, w, error]{ worker_exited(w, error); });
+            });
+    connect(&w->process, static_cast<void (QProcess::*)(QProcess::ProcessError)>(&QProcess::error),
+            w, [this, w](QProcess::ProcessError error)
+            {
+                if (error == QProcess::ProcessError::FailedToStart)
+                {
+                    string msg = "failed to start " + w->exe_path.toStdString();
+                    QTimer::singleShot(0, w, [this, w, msg]{ worker_exited(w, msg); });
+                }
+            });
+
+    w->notifier.reset(new QSocketNotifier(w->socket.get(), QSocketNotifier::Read));
+    connect(w->notifier.get(), &QSocketNotifier::activated, w, [this, w]{ worker_readable(w); });
+
+    w->timer.setSingleShot(true);
+    connect(&w->timer, &QTimer::timeout, w, [this, w]{ worker_timeout(w); });
+
+    workers_.push_back(w);
+    ++workers_started_;
+    w->process.start(w->exe_path, {QStringLiteral("--worker"), QString::number(child_fd.get())});
+    return w;  // child_fd is closed on return, the child has its own copy by now.
+}
+
+void ExtractorPool::run_job(Worker* w, unique_ptr<Job> job)
+{
+    assert(!w->job);
+    w->job = move(job);
+
+    vs_thumb_protocol::JobHeader hdr;
+    hdr.max_size = w->job->max_size;
+    QByteArray packet(reinterpret_cast<char const*>(&hdr), sizeof(hdr));
+    packet += QUrl::fromLocalFile(QString::fromStdString(w->job->filename)).toEncoded();
+    if (packet.size() > vs_thumb_protocol::MAX_JOB_SIZE)
+    {
+        // LCOV_EXCL_START
+        auto failed_job = move(w->job);
+        failed_job->done_func("file name too long: " + failed_job->filename);
+        return;
+        // LCOV_EXCL_STOP
+    }
+    if (vs_thumb_protocol::send_packet(w->socket.get(), packet.constData(), packet.size(), w->job->out_fd.get()) == -1)
+    {
+        // LCOV_EXCL_START
+        // The worker has gone away. If it completed jobs before, it probably crashed
+        // while idle, so we give the job to another worker. Otherwise, we fail the job
+        // because, if vs-thumb cannot be started, we would loop forever.
+        string error = string("cannot send job to ") + w->exe_path.toStdString() + ": " + safe_strerror(errno);
+        auto failed_job = move(w->job);
+        bool requeue = w->jobs_done > 0;
+        retire(w);
+        w->process.kill();
+        if (requeue)
+        {
+            pending_.push_front(move(failed_job));
+        }
+        else
+        {
+            failed_job->done_func(error);
+        }
+        return;
+        // LCOV_EXCL_STOP
+    }
+    w->job->out_fd.dealloc();  // The worker has its own copy now.
+
+    // Set a watchdog timer in case vs-thumb doesn't finish in time.
+    w->timer.start(int(w->job->timeout.count()));
+}
+
+void ExtractorPool::worker_readable(Worker* w)
+{
+    char status;
+    int fd;
+    ssize_t rc = vs_thumb_protocol::recv_packet(w->socket.get(), &status, sizeof(status), &fd);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    if (fd != -1)
+    {
+        ::close(fd);  // LCOV_EXCL_LINE
+    }
+    if (rc != 1 || !w->job || !w->error.empty())
+    {
+        // The worker closed the socket or replied out of turn. Either way, we no longer
+        // use it. If it is still busy with a job, the job completes when the process exits.
+        w->notifier->setEnabled(false);
+        if (!w->job)
+        {
+            retire(w);
+            w->process.kill();
+        }
+        return;
+    }
+
+    w->timer.stop();
+    ++w->jobs_done;
+    auto job = move(w->job);
+    string error;
+    bool pipeline_ok = true;
+    switch (status)
+    {
+        case vs_thumb_protocol::success:
+            break;
+        case vs_thumb_protocol::no_artwork:
+            error = "no artwork for " + job->filename;  // The pipeline worked fine, there just was nothing to extract.
+            break;
+        case vs_thumb_protocol::extraction_failed:
+            error = "extractor pipeline failed for " + job->filename;
+            pipeline_ok = false;
+            break;
+        // LCOV_EXCL_START
+        default:
+            error = "unknown status " + to_string(int(status)) +
+                    " from " + w->exe_path.toStdString() + " for " + job->filename;
+            pipeline_ok = false;
+            break;
+        // LCOV_EXCL_STOP
+    }
+
+    // A failed pipeline might have left gstreamer in a bad state, so we don't re-use the worker in that case.
+    if (!pipeline_ok || w->jobs_done >= max_jobs_per_worker_)
+    {
+        retire(w);
+    }
+    job->done_func(error);
+    dispatch();
+}
+
+void ExtractorPool::worker_timeout(Worker* w)
+{
+    assert(w->job);
+    w->error = w->exe_path.toStdString() + " (pid " + to_string(w->process.pid()) + ") did not return after " +
+               to_string(w->job->timeout.count()) + " milliseconds";
+    w->process.kill();
+}
+
+void ExtractorPool::worker_exited(Worker* w, string const& exit_error)
+{
+    // The worker may have replied just before exiting, so we give it a chance.
+    if (w->job && w->error.empty() && w->notifier && w->notifier->isEnabled())
+    {
+        worker_readable(w);
+    }
+
+    auto job = move(w->job);
+    string error = w->error.empty() ? exit_error : w->error;
+
+    w->shutdown();
+    workers_.erase(remove(workers_.begin(), workers_.end(), w), workers_.end());
+    retiring_.erase(remove(retiring_.begin(), retiring_.end(), w), retiring_.end());
+    w->deleteLater();
+
+    if (job)
+    {
+        job->done_func(error);
+    }
+    dispatch();
+}
+
+void ExtractorPool::retire(Worker* w)
+{
+    auto it = find(workers_.begin(), workers_.end(), w);
+    if (it == workers_.end())
+    {
+        return;
+    }
+    workers_.erase(it);
+    retiring_.push_back(w);
+
+    // Closing the socket tells the worker to exit once it has finished its current job, if any.
+    w->timer.stop();
+    w->notifier.reset();
+    w->socket.dealloc();
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -18,6 +18,8 @@
  */
 
 #include <internal/image.h>
+
+#include <internal/downscale.h>
 #include <internal/safe_strerror.h>
 
 #pragma GCC diagnostic push
@@ -30,9 +32,13 @@
 
 #include <cassert>
 #include <cmath>
+#include <csetjmp>
+#include <cstdio>
 #include <memory>
 #include <stdexcept>
 
+#include <jpeglib.h>
+
 using namespace std;
 using namespace unity::thumbnailer::internal;
 
@@ -270,6 +276,227 @@ void maybe_scale_image(GdkPixbufLoader* loader, int width, int height, void* use
     gdk_pixbuf_loader_set_size(loader, image_size.width(), image_size.height());
 }
 
+// Returns a copy of pixbuf scaled to the given size.
+gobj_ptr<GdkPixbuf> scale_pixbuf(GdkPixbuf* pixbuf, int width, int height)
+{
+    assert(gdk_pixbuf_get_colorspace(pixbuf) == GDK_COLORSPACE_RGB);
+    assert(gdk_pixbuf_get_bits_per_sample(pixbuf) == 8);
+
+    bool const has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    gobj_ptr<GdkPixbuf> scaled(gdk_pixbuf_new(GDK_COLORSPACE_RGB, has_alpha, 8, width, height));
+    if (!scaled)
+    {
+        throw runtime_error("scale_pixbuf(): could not create pixbuf");  // LCOV_EXCL_LINE
+    }
+    downscale(gdk_pixbuf_read_pixels(pixbuf),
+              gdk_pixbuf_get_width(pixbuf),
+              gdk_pixbuf_get_height(pixbuf),
+              gdk_pixbuf_get_rowstride(pixbuf),
+              gdk_pixbuf_get_pixels(scaled.get()),
+              width,
+              height,
+              gdk_pixbuf_get_rowstride(scaled.get()),
+              gdk_pixbuf_get_n_channels(pixbuf));
+    return scaled;
+}
+
+// Fast path for JPEG images that are to be scaled down. Rather than decoding
+// the full image and then resampling it, we let libjpeg do most of the work
+// during the IDCT by decoding at 1/2, 1/4, or 1/8 of the original size.
+// What's left of the scaling is done by scale_pixbuf().
+//
+// libjpeg reports fatal errors via longjmp(), so everything the decoder touches
+// lives in JpegDecoder and is accessed only via a pointer. If anything goes
+// wrong (including data that is not a JPEG image at all), the decoder
+// gives up and we fall back to the gdk-pixbuf loader, which produces the
+// appropriate error message.
+
+struct JpegErrorMgr
+{
+    jpeg_error_mgr pub;  // Must be first.
+    jmp_buf env;
+};
+
+struct ReaderSource
+{
+    jpeg_source_mgr pub;  // Must be first.
+    Image::Reader* reader;
+};
+
+struct JpegDecoder
+{
+    jpeg_decompress_struct cinfo;
+    JpegErrorMgr err;
+    ReaderSource src;
+    GdkPixbuf* pixbuf;
+    QSize target_size;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(reinterpret_cast<JpegErrorMgr*>(cinfo->err)->env, 1);
+}
+
+void jpeg_output_message(j_common_ptr)
+{
+    // Don't spam stderr with warnings about corrupt data.
+}
+
+void source_init(j_decompress_ptr)
+{
+}
+
+boolean source_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    auto src = reinterpret_cast<ReaderSource*>(cinfo->src);
+    unsigned char const* data = nullptr;
+    size_t length = 0;
+    bool have_data;
+    try
+    {
+        have_data = src->reader->read(&data, &length);
+    }
+    catch (std::exception const&)
+    {
+        have_data = false;  // LCOV_EXCL_LINE
+    }
+    if (!have_data || length == 0)
+    {
+        // Truncated or unreadable image. We don't want to produce a partially
+        // grey thumbnail, so we bail out and let gdk-pixbuf deal with it.
+        cinfo->err->error_exit(reinterpret_cast<j_common_ptr>(cinfo));
+    }
+    src->pub.next_input_byte = data;
+    src->pub.bytes_in_buffer = length;
+    return TRUE;
+}
+
+void source_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    auto src = reinterpret_cast<ReaderSource*>(cinfo->src);
+    if (num_bytes <= 0)
+    {
+        return;
+    }
+    while (size_t(num_bytes) > src->pub.bytes_in_buffer)
+    {
+        num_bytes -= long(src->pub.bytes_in_buffer);
+        source_fill_input_buffer(cinfo);
+    }
+    src->pub.next_input_byte += num_bytes;
+    src->pub.bytes_in_buffer -= num_bytes;
+}
+
+void source_term(j_decompress_ptr)
+{
+}
+
+// Returns true if the image was decoded. Must not create any objects with
+// non-trivial destructors because of the longjmp() on error.
+bool decode_jpeg(JpegDecoder* d, QSize requested_size)
+{
+    j_decompress_ptr cinfo = &d->cinfo;
+    jpeg_read_header(cinfo, TRUE);
+
+    int const width = cinfo->image_width;
+    int const height = cinfo->image_height;
+    QSize req = requested_size;
+    if (req.width() == 0)
+    {
+        req.setWidth(width);
+    }
+    if (req.height() == 0)
+    {
+        req.setHeight(height);
+    }
+    if (width <= req.width() && height <= req.height())
+    {
+        return false;  // No scaling needed, gdk-pixbuf is just as fast.
+    }
+    d->target_size = QSize(width, height);
+    d->target_size.scale(req, Qt::KeepAspectRatio);
+    d->target_size = d->target_size.expandedTo(QSize(1, 1));
+
+    // Pick the largest reduction that still produces at least the target size.
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1;
+    for (unsigned int denom = 8; denom > 1; denom /= 2)
+    {
+        int const scaled_width = (width + denom - 1) / denom;
+        int const scaled_height = (height + denom - 1) / denom;
+        if (scaled_width >= d->target_size.width() && scaled_height >= d->target_size.height())
+        {
+            cinfo->scale_denom = denom;
+            break;
+        }
+    }
+    cinfo->out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(cinfo);
+    if (cinfo->output_components != 3)
+    {
+        return false;  // LCOV_EXCL_LINE
+    }
+    d->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, false, 8, cinfo->output_width, cinfo->output_height);
+    if (!d->pixbuf)
+    {
+        return false;  // LCOV_EXCL_LINE
+    }
+    guchar* pixels = gdk_pixbuf_get_pixels(d->pixbuf);
+    int const rowstride = gdk_pixbuf_get_rowstride(d->pixbuf);
+    while (cinfo->output_scanline < cinfo->output_height)
+    {
+        JSAMPROW row = pixels + cinfo->output_scanline * rowstride;
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+    // We have all the pixels, so there is no need to call jpeg_finish_decompress(),
+    // which would only read the remainder of the file up to the EOI marker.
+    return true;
+}
+
+bool run_jpeg_decoder(JpegDecoder* d, QSize requested_size)
+{
+    if (setjmp(d->err.env))
+    {
+        return false;
+    }
+    return decode_jpeg(d, requested_size);
+}
+
+gobj_ptr<GdkPixbuf> load_jpeg(Image::Reader& reader, QSize requested_size)
+{
+    unique_ptr<JpegDecoder> d(new JpegDecoder);
+    d->cinfo.err = jpeg_std_error(&d->err.pub);
+    d->err.pub.error_exit = jpeg_error_exit;
+    d->err.pub.output_message = jpeg_output_message;
+    d->src.pub.init_source = source_init;
+    d->src.pub.fill_input_buffer = source_fill_input_buffer;
+    d->src.pub.skip_input_data = source_skip_input_data;
+    d->src.pub.resync_to_restart = jpeg_resync_to_restart;
+    d->src.pub.term_source = source_term;
+    d->src.pub.next_input_byte = nullptr;
+    d->src.pub.bytes_in_buffer = 0;
+    d->src.reader = &reader;
+    d->pixbuf = nullptr;
+
+    jpeg_create_decompress(&d->cinfo);
+    d->cinfo.src = &d->src.pub;
+    bool ok = run_jpeg_decoder(d.get(), requested_size);
+    jpeg_destroy_decompress(&d->cinfo);
+
+    gobj_ptr<GdkPixbuf> pixbuf(d->pixbuf);
+    if (!ok)
+    {
+        return gobj_ptr<GdkPixbuf>();
+    }
+    if (gdk_pixbuf_get_width(pixbuf.get()) != d->target_size.width() ||
+        gdk_pixbuf_get_height(pixbuf.get()) != d->target_size.height())
+    {
+        pixbuf = scale_pixbuf(pixbuf.get(), d->target_size.width(), d->target_size.height());
+    }
+    return pixbuf;
+}
+
 }  // namespace
 
 Image::Image(string const& data, QSize requested_size)
@@ -290,6 +517,43 @@ Image::Image(int fd, QSize requested_size)
     load(reader, requested_size);
 }
 
+namespace
+{
+
+extern "C"
+void release_pixels(guchar* /* pixels */, gpointer data)
+{
+    auto release_func = static_cast<function<void()>*>(data);
+    (*release_func)();
+    delete release_func;
+}
+
+}  // namespace
+
+Image::Image(unsigned char const* rgb_data,
+             int width,
+             int height,
+             int rowstride,
+             function<void()> const& release_func)
+{
+    if (width < 1 || height < 1 || rowstride < width * 3)
+    {
+        release_func();
+        throw runtime_error("Image(): invalid raw image geometry: " + to_string(width) + "x" + to_string(height) +
+                            ", rowstride " + to_string(rowstride));
+    }
+    auto release_data = new function<void()>(release_func);
+    pixbuf_.reset(gdk_pixbuf_new_from_data(const_cast<guchar*>(rgb_data), GDK_COLORSPACE_RGB, FALSE, 8,
+                                           width, height, rowstride, release_pixels, release_data));
+    if (!pixbuf_)
+    {
+        // LCOV_EXCL_START
+        release_pixels(nullptr, release_data);
+        throw runtime_error("Image(): cannot create pixbuf from raw image data");
+        // LCOV_EXCL_STOP
+    }
+}
+
 void Image::load(Reader& reader, QSize requested_size)
 {
     // Try to load EXIF data for orientation information and embedded
@@ -354,6 +618,14 @@ void Image::load(Reader& reader, QSize requested_size)
         }
     }
 
+    if (!pixbuf_ && requested_size.isValid())
+    {
+        pixbuf_ = load_jpeg(reader, unrotated_requested_size);
+        if (!pixbuf_)
+        {
+            reader.rewind();
+        }
+    }
     if (!pixbuf_)
     {
         pixbuf_ = load_image(reader, G_CALLBACK(maybe_scale_image), &unrotated_requested_size);
@@ -476,8 +748,7 @@ Image Image::scale(QSize requested_size) const
     }
 
     scaled_size.scale(requested_size, Qt::KeepAspectRatio);
-    // Make sure that we don't try to scale down to zero, which
-    // would cause an error in gdk_pixbuf_scale_simple().
+    // Make sure that we don't try to scale down to zero.
     if (scaled_size.width() == 0)
     {
         scaled_size.setWidth(1);
@@ -488,12 +759,7 @@ Image Image::scale(QSize requested_size) const
     }
 
     Image scaled;
-    scaled.pixbuf_.reset(
-        gdk_pixbuf_scale_simple(pixbuf_.get(), scaled_size.width(), scaled_size.height(), GDK_INTERP_BILINEAR));
-    if (!scaled.pixbuf_)
-    {
-        throw runtime_error("Image::scale(): could not create scaled image");  // LCOV_EXCL_LINE
-    }
+    scaled.pixbuf_ = scale_pixbuf(pixbuf_.get(), scaled_size.width(), scaled_size.height());
     return scaled;
 }
 
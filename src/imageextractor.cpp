@@ -16,107 +16,81 @@
  * Authored by: Jussi Pakkanen <jussi.pakkanen@canonical.com>
  *              James Henstridge <james.henstridge@canonical.com>
  *              Michi Henning <michi.henning@canonical.com>
- */
-
 #include <internal/imageextractor.h>
 
-#include <internal/config.h>
-#include <internal/env_vars.h>
+#include <internal/memfd.h>
 #include <internal/safe_strerror.h>
+#include <internal/vs_thumb_protocol.h>
 
 #include <QDebug>
-#include <QUrl>
 
 #include <cassert>
+#include <cstring>
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace unity::thumbnailer::internal;
 
-ImageExtractor::ImageExtractor(std::string const& filename, chrono::milliseconds timeout)
+namespace
+{
+
+uint32_t const MAX_DIMENSION = 32767;  // Largest width or height we accept for a raw frame.
+
+}  // namespace
+
+ImageExtractor::ImageExtractor(std::string const& filename,
+                               chrono::milliseconds timeout,
+                               shared_ptr<ExtractorPool> const& pool)
     : filename_(filename)
-    , timeout_ms_(timeout.count())
+    , timeout_(timeout)
+    , pool_(pool)
+    , job_id_(-1)
     , read_called_(false)
-    , pipe_read_fd_(::close)
-    , pipe_write_fd_(::close)
+    , memfd_(make_memfd("vs-thumb-image"), do_close)
 {
-    // Still frames are large; avoid lots of reallactions when reading from the pipe.
-    image_data_.reserve(int(2.5 * 1024 * 1024));
-
-    process_.setStandardInputFile(QProcess::nullDevice());
-    process_.setProcessChannelMode(QProcess::ForwardedChannels);
-    connect(&process_, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-            this, &ImageExtractor::processFinished);
-    connect(&process_, static_cast<void (QProcess::*)(QProcess::ProcessError)>(&QProcess::error),
-            this, &ImageExtractor::error);
-    connect(&process_, &QProcess::started, this, &ImageExtractor::started);
-    connect(&timer_, &QTimer::timeout, this, &ImageExtractor::timeout);
-
-    // We set up a pipe to receive the image from vs-thumb. Because some gstreamer
-    // codecs chatter on stdout, we can't use stdout to transfer the image.
-    int pipe_fd[2];
-    if (pipe2(pipe_fd, O_CLOEXEC) == -1)
-    {
-        throw runtime_error(string("ImageExtractor(): cannot create pipe: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
-    }
-    pipe_read_fd_.reset(pipe_fd[0]);
-    pipe_write_fd_.reset(pipe_fd[1]);
+}
 
-    // We use non-blocking I/O because that is faster: we drop back to the event loop more often
-    // and get better CPU utilization this way.
-    if (fcntl(pipe_fd[0], F_SETFL, O_NONBLOCK) == -1)
-    {
-        throw runtime_error(string("ImageExtractor(): cannot set O_NONBLOCK: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
-    }
-    // We clear FD_CLOEXEC on the write fd, so the child ends up with the read end closed.
-    // This prevents a race in threaded programs that can leak open fds to children (see man (2) open).
-    if (fcntl(pipe_fd[1], F_SETFD, 0) == -1)
+ImageExtractor::~ImageExtractor()
+{
+    if (job_id_ != -1)
     {
-        throw runtime_error(string("ImageExtractor(): cannot clear FD_CLOEXEC: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+        pool_->cancel(job_id_);
     }
-
-    // Make notifiers to fire on ready to read and error.
-    read_notifier_.reset(new QSocketNotifier(pipe_fd[0], QSocketNotifier::Read));
-    connect(read_notifier_.get(), &QSocketNotifier::activated, this, &ImageExtractor::readFromPipe);
-    error_notifier_.reset(new QSocketNotifier(pipe_fd[0], QSocketNotifier::Exception));
-    connect(error_notifier_.get(), &QSocketNotifier::activated, this, &ImageExtractor::pipeError);
 }
 
-ImageExtractor::~ImageExtractor()
+void ImageExtractor::extract(int max_size)
 {
-    if (process_.state() != QProcess::NotRunning)
+    assert(job_id_ == -1);
+
+    // The pool closes the descriptor it is given, so we keep our own.
+    int fd = fcntl(memfd_.get(), F_DUPFD_CLOEXEC, 0);
+    if (fd == -1)
     {
-        // LCOV_EXCL_START
-        process_.kill();
-        if (!process_.waitForFinished(timeout_ms_))
-        {
-            qWarning().nospace() << "~ImageExtractor(): " << exe_path_ << " (pid" << process_.pid()
-                                 << ") did not exit after " << timeout_ms_ << " milliseconds";
-        }
-        // LCOV_EXCL_STOP
+        throw runtime_error(string("ImageExtractor::extract(): cannot dup memfd: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
     }
+    job_id_ = pool_->submit(filename_, max_size, fd, timeout_,
+                            [this](string const& error)
+                            {
+                                jobFinished(error);
+                            });
 }
 
-void ImageExtractor::extract()
+bool ImageExtractor::cancel()
 {
-    // Gstreamer video pipelines are unstable so we need to run an
-    // external helper executable.
-    char* utildir = getenv(UTIL_DIR);
-    exe_path_ = utildir ? utildir : SHARE_PRIV_ABS;
-    exe_path_ += QLatin1String("/vs-thumb");
-    QUrl in_url = QUrl::fromLocalFile(filename_.c_str());
-    QUrl out_url;
-    out_url.setScheme("fd");
-    out_url.setPath(to_string(pipe_write_fd_.get()).c_str());
-    process_.start(exe_path_, {in_url.toString(QUrl::FullyEncoded), out_url.toString()});
-
-    // Set a watchdog timer in case vs-thumb doesn't finish in time.
-    timer_.setSingleShot(true);
-    timer_.start(timeout_ms_);
+    if (job_id_ == -1)
+    {
+        return false;
+    }
+    pool_->cancel(job_id_);
+    job_id_ = -1;
+    error_ = "extraction cancelled";
+    return true;
 }
 
-QByteArray ImageExtractor::read()
+Image ImageExtractor::read()
 {
     if (!error_.empty())
     {
@@ -124,114 +98,85 @@ QByteArray ImageExtractor::read()
     }
     assert(!read_called_);
     read_called_ = true;
-    return move(image_data_);
+    return move(image_);
 }
 
-void ImageExtractor::processFinished()
+void ImageExtractor::jobFinished(string const& error)
 {
-    timer_.stop();
-    switch (process_.exitStatus())
+    job_id_ = -1;
+    if (error.empty())
+    {
+        try
+        {
+            image_ = load_image();
+        }
+        catch (std::exception const& e)
+        {
+            error_ = e.what();
+        }
+    }
+    else
     {
-        case QProcess::NormalExit:
-            switch (process_.exitCode())
-            {
-                case 0:
-                    // The finished signal may arrive while there is still
-                    // some unread data in the pipe, so do one more read.
-                    readFromPipe();
-                    error_ = "";
-                    break;
-                case 1:
-                    error_ = string("no artwork for ") + filename_;
-                    break;
-                case 2:
-                    error_ = string("extractor pipeline failed for ") + filename_;
-                    break;
-                default:
-                    error_ = string("unknown exit status ") + to_string(process_.exitCode()) +
-                             " from " + exe_path_.toStdString() + " for " + filename_;
-                    break;
-            }
-            break;
-        case QProcess::CrashExit:
-            if (error_.empty())
-            {
-                // Conditional because, if we get a timeout and send a kill,
-                // we don't want to overwrite the message set by timeout().
-                error_ = exe_path_.toStdString() + " crashed";
-            }
-            break;
-        default:
-            abort();  // LCOV_EXCL_LINE  // Impossible
+        error_ = error;
     }
+    memfd_.dealloc();  // A mapping of a raw frame stays valid after the descriptor is closed.
     Q_EMIT finished();
 }
 
-void ImageExtractor::timeout()
-{
-    if (process_.state() != QProcess::NotRunning)
-    {
-        process_.kill();
-    }
-    error_ = exe_path_.toStdString() + " (pid " + to_string(process_.pid()) + ") did not return after " +
-             to_string(timeout_ms_) + " milliseconds";
-}
+// Maps the image that vs-thumb left in the memfd. For a raw frame, the mapping is
+// owned by the returned image. Encoded data is decoded straight from the mapping.
 
-void ImageExtractor::error()
+Image ImageExtractor::load_image()
 {
-    if (process_.error() == QProcess::ProcessError::FailedToStart)
+    using namespace vs_thumb_protocol;
+
+    struct stat st;
+    if (fstat(memfd_.get(), &st) == -1)
     {
-        timer_.stop();
-        error_ = string("failed to start ") + exe_path_.toStdString();
-        Q_EMIT finished();
+        throw runtime_error(string("cannot stat memfd: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
     }
-}
-
-void ImageExtractor::started()
-{
-    // We don't need the write end of the pipe.
-    pipe_write_fd_.dealloc();
-}
-
-// Read data from pipe (non-blocking) and append it to image_data_.
-
-void ImageExtractor::readFromPipe()
-{
-    if (!error_.empty())
+    size_t const size = st.st_size;
+    if (size == 0)
     {
-        return;
+        throw runtime_error("no image data for " + filename_);  // LCOV_EXCL_LINE
     }
 
-    char buf[16 * 1024];  // No point in making this larger, pipe can hold at most 16 KB.
-    int rc;
-
-try_again:
-    while ((rc = ::read(pipe_read_fd_.get(), buf, sizeof(buf))) > 0)
+    // Private and writable, so nothing downstream can fault by writing to the pixels.
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, memfd_.get(), 0);
+    if (addr == MAP_FAILED)
     {
-        image_data_.append(buf, rc);
+        throw runtime_error(string("cannot mmap memfd: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
     }
-    if (rc == -1)
+    auto unmap = [addr, size]{ munmap(addr, size); };
+    unsigned char const* data = static_cast<unsigned char const*>(addr);
+
+    RawFrameHeader hdr;
+    if (size < sizeof(hdr) || memcmp(data, RAW_FRAME_MAGIC, sizeof(RAW_FRAME_MAGIC)) != 0)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        // Embedded cover art.
+        try
         {
-            return;  // EOF
+            Image image(QByteArray::fromRawData(reinterpret_cast<char const*>(data), int(size)));
+            unmap();
+            return image;
         }
-        if (errno != EINTR)
+        catch (...)
         {
-            // LCOV_EXCL_START
-            error_ = string("cannot read remaining bytes from pipe: ") + safe_strerror(errno);
-            return;
-            // LCOV_EXCL_STOP
+            unmap();
+            throw;
         }
-        assert(errno == EINTR);
-        goto try_again;
     }
-    assert(rc == 0);  // No data available for now.
-}
 
-// LCOV_EXCL_START
-void ImageExtractor::pipeError()
-{
-    error_ = "broken pipe";
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.width == 0 || hdr.width > MAX_DIMENSION
+        || hdr.height == 0 || hdr.height > MAX_DIMENSION
+        || hdr.rowstride < hdr.width * 3 || hdr.rowstride > hdr.width * 3 + 3
+        || size - sizeof(hdr) < uint64_t(hdr.rowstride) * (hdr.height - 1) + hdr.width * 3)
+    {
+        unmap();
+        throw runtime_error("invalid raw frame for " + filename_ + ": " + to_string(hdr.width) + "x" +
+                            to_string(hdr.height) + ", rowstride " + to_string(hdr.rowstride) +
+                            ", " + to_string(size) + " bytes");
+    }
+    return Image(data + sizeof(hdr), hdr.width, hdr.height, hdr.rowstride, unmap);
 }
-// LCOV_EXCL_STOP
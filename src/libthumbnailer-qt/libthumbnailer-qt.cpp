@@ -20,16 +20,27 @@
 #include <unity/thumbnailer/qt/thumbnailer-qt.h>
 
 #include <ratelimiter.h>
+#include <service/batch.h>
 #include <service/client_config.h>
 #include <service/dbus_names.h>
 #include <settings-defaults.h>
 #include <thumbnailerinterface.h>
 
 #include <boost/filesystem.hpp>
+#include <QDBusUnixFileDescriptor>
+#include <QPointer>
 #include <QSharedPointer>
+#include <QSocketNotifier>
 
+#include <cstring>
 #include <memory>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace unity
 {
 
@@ -42,6 +53,7 @@ namespace qt
 namespace internal
 {
 
+class BatchImpl;
 class ThumbnailerImpl;
 
 class RequestImpl : public QObject
@@ -51,7 +63,16 @@ public:
     RequestImpl(QString const& details,
                 QSize const& requested_size,
                 ThumbnailerImpl* thumbnailer,
-                std::function<QDBusPendingReply<QByteArray>()> const& job,
+                std::function<QDBusPendingCall()> const& job,
+                RateLimiter::Priority priority,
+                quint64 request_id,
+                bool trace_client);
+
+    // Constructor for a request that is part of a batch.
+    RequestImpl(QString const& details,
+                QSize const& requested_size,
+                ThumbnailerImpl* thumbnailer,
+                std::shared_ptr<BatchImpl> const& batch,
                 bool trace_client);
 
     ~RequestImpl();
@@ -90,16 +111,21 @@ public:
         return cancelled_;
     }
 
+    // Called by the batch once the result for this request has arrived.
+    void batchItemFinished(QByteArray const& thumbnail, QString const& error);
+
 private Q_SLOTS:
     void dbusCallFinished();
+    void batchItemCancelled();
 
 private:
     void finishWithError(QString const& errorMessage);
+    void cancelInService();
 
     QString details_;
     QSize requested_size_;
     ThumbnailerImpl* thumbnailer_;
-    std::function<QDBusPendingReply<QByteArray>()> job_;
+    std::function<QDBusPendingCall()> job_;
     std::function<void()> send_request_;
 
     std::unique_ptr<QDBusPendingCallWatcher> watcher_;
@@ -110,8 +136,51 @@ private:
     bool cancelled_;                 // true if cancel() was called by client
     bool cancelled_while_waiting_;   // true if cancel() succeeded because request was not sent yet
     bool trace_client_;
+    quint64 request_id_;             // Non-zero if the service can cancel the request.
     QImage image_;
     unity::thumbnailer::qt::Request* public_request_;
+    std::shared_ptr<BatchImpl> batch_;  // Null unless the request was created by getThumbnails().
+};
+
+// BatchImpl holds the state of a getThumbnails() call. The batch uses a single
+// D-Bus call and occupies a single slot in the limiter. The service streams
+// the results back over a socket; each result is passed to the corresponding
+// RequestImpl as soon as it arrives. The batch is kept alive by its requests
+// and closes the socket once the last of them is destroyed.
+
+class BatchImpl : public QObject, public std::enable_shared_from_this<BatchImpl>
+{
+    Q_OBJECT
+public:
+    BatchImpl(ThumbnailerImpl* thumbnailer);
+    ~BatchImpl();
+
+    void add(RequestImpl* request, QString const& filename, QSize const& requested_size);
+    void remove(RequestImpl* request);
+    void start();
+    void waitFor(RequestImpl* request);
+
+private Q_SLOTS:
+    void dbusCallFinished();
+    void readRecords();
+
+private:
+    void processRecords();
+    void finishAll(QString const& error);
+    void done();
+
+    ThumbnailerImpl* thumbnailer_;
+    QStringList filenames_;
+    unity::thumbnailer::service::BatchItems items_;
+    std::vector<RequestImpl*> requests_;  // Indexed like items_. Null once a request is destroyed.
+    std::function<void()> send_request_;
+    std::unique_ptr<QDBusPendingCallWatcher> watcher_;
+    RateLimiter::CancelFunc cancel_func_;
+    bool reply_handled_;
+    bool done_;
+    int fd_;
+    std::unique_ptr<QSocketNotifier> notifier_;
+    QByteArray in_buffer_;
 };
 
 class ThumbnailerImpl : public QObject
@@ -124,24 +193,70 @@ public:
 
     QSharedPointer<Request> getAlbumArt(QString const& artist, QString const& album, QSize const& requestedSize);
     QSharedPointer<Request> getArtistArt(QString const& artist, QString const& album, QSize const& requestedSize);
-    QSharedPointer<Request> getThumbnail(QString const& filename, QSize const& requestedSize);
+    QSharedPointer<Request> getThumbnail(QString const& filename, QSize const& requestedSize, Priority priority);
+    QList<QSharedPointer<Request>> getThumbnails(QList<QPair<QString, QSize>> const& requests);
 
     RateLimiter& limiter();
     Q_INVOKABLE void pump_limiter();
 
+    ThumbnailerInterface& iface()
+    {
+        return *iface_;
+    }
+
 private:
     QSharedPointer<Request> createRequest(QString const& details,
                                           QSize const& requested_size,
-                                          std::function<QDBusPendingReply<QByteArray>()> const& job);
+                                          std::function<QDBusPendingCall()> const& job,
+                                          RateLimiter::Priority priority = RateLimiter::Priority::interactive,
+                                          quint64 request_id = 0);
     std::unique_ptr<ThumbnailerInterface> iface_;
     bool trace_client_;
+    bool fd_delivery_;  // True if we use the Get*Fd() methods.
+    bool priorities_;   // True if we use the *WithPriority methods.
     std::unique_ptr<RateLimiter> limiter_;
+    quint64 last_request_id_;  // For requests that the service can cancel.
 };
 
+namespace
+{
+
+// Decodes the image in the memfd returned by one of the Get*Fd() methods.
+// We decode straight from the mapping, so the image data is never copied.
+
+QImage image_from_fd(QDBusUnixFileDescriptor const& unix_fd)
+{
+    if (!unix_fd.isValid())
+    {
+        throw std::runtime_error("invalid file descriptor");  // LCOV_EXCL_LINE
+    }
+    struct stat st;
+    if (fstat(unix_fd.fileDescriptor(), &st) == -1)
+    {
+        throw std::runtime_error(std::string("fstat() failed: ") + strerror(errno));  // LCOV_EXCL_LINE
+    }
+    if (st.st_size == 0)
+    {
+        return QImage();  // LCOV_EXCL_LINE
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, unix_fd.fileDescriptor(), 0);
+    if (addr == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("mmap() failed: ") + strerror(errno));  // LCOV_EXCL_LINE
+    }
+    QImage image = QImage::fromData(static_cast<uchar const*>(addr), int(st.st_size));
+    munmap(addr, st.st_size);
+    return image;
+}
+
+}  // namespace
+
 RequestImpl::RequestImpl(QString const& details,
                          QSize const& requested_size,
                          ThumbnailerImpl* thumbnailer,
-                         std::function<QDBusPendingReply<QByteArray>()> const& job,
+                         std::function<QDBusPendingCall()> const& job,
+                         RateLimiter::Priority priority,
+                         quint64 request_id,
                          bool trace_client)
     : details_(details)
     , requested_size_(requested_size)
@@ -152,6 +267,7 @@ RequestImpl::RequestImpl(QString const& details,
     , cancelled_(false)
     , cancelled_while_waiting_(false)
     , trace_client_(trace_client)
+    , request_id_(request_id)
     , public_request_(nullptr)
 {
     if (!requested_size.isValid())
@@ -169,11 +285,43 @@ RequestImpl::RequestImpl(QString const& details,
         watcher_.reset(new QDBusPendingCallWatcher(job_()));
         connect(watcher_.get(), &QDBusPendingCallWatcher::finished, this, &RequestImpl::dbusCallFinished);
     };
-    cancel_func_ = thumbnailer_->limiter().schedule(send_request_);
+    cancel_func_ = thumbnailer_->limiter().schedule(send_request_, priority);
+}
+
+RequestImpl::RequestImpl(QString const& details,
+                         QSize const& requested_size,
+                         ThumbnailerImpl* thumbnailer,
+                         std::shared_ptr<BatchImpl> const& batch,
+                         bool trace_client)
+    : details_(details)
+    , requested_size_(requested_size)
+    , thumbnailer_(thumbnailer)
+    , finished_(false)
+    , is_valid_(false)
+    , cancelled_(false)
+    , cancelled_while_waiting_(false)
+    , trace_client_(trace_client)
+    , request_id_(0)
+    , public_request_(nullptr)
+{
+    if (!requested_size.isValid())
+    {
+        error_message_ = details_ + ": " + "invalid QSize";
+        qCritical().noquote() << error_message_;
+        finished_ = true;
+        return;
+    }
+    batch_ = batch;
 }
 
 RequestImpl::~RequestImpl()
 {
+    if (batch_)
+    {
+        batch_->remove(this);
+        return;
+    }
+
     // If cancel_func_() returns false and we have a watcher,
     // the request was sent but the reply has not yet trickled in.
     // We have to pump the limiter in that case because we'll never
@@ -185,6 +333,12 @@ RequestImpl::~RequestImpl()
     }
     if (watcher_ && already_sent)
     {
+        // Nobody will look at the result, so the service can stop working on it.
+        if (!finished_ && !cancelled_)
+        {
+            cancelInService();
+        }
+
         // Delay pumping until we drop back to the event loop. Otherwse,
         // if the caller destroys a whole bunch of requests at once, we'd
         // schedule the next request in the queue before the caller gets
@@ -217,16 +371,32 @@ void RequestImpl::dbusCallFinished()
     Q_ASSERT(watcher_);
     Q_ASSERT(!finished_);
 
-    QDBusPendingReply<QByteArray> reply = *watcher_.get();
-    if (!reply.isValid())
+    if (watcher_->isError())
     {
-        finishWithError("Thumbnailer: RequestImpl::dbusCallFinished(): D-Bus error: " + reply.error().message());
+        finishWithError("Thumbnailer: RequestImpl::dbusCallFinished(): D-Bus error: " + watcher_->error().message());
         return;
     }
 
     try
     {
-        image_ = QImage::fromData(reply.value());
+        // The reply contains either the image data or, for the Get*Fd() methods, a memfd.
+        QVariant result = watcher_->reply().arguments().value(0);
+        if (result.userType() == qMetaTypeId<QDBusUnixFileDescriptor>())
+        {
+            image_ = image_from_fd(result.value<QDBusUnixFileDescriptor>());
+        }
+        else if (result.type() == QVariant::ByteArray)
+        {
+            image_ = QImage::fromData(result.toByteArray());
+        }
+        else
+        {
+            // LCOV_EXCL_START
+            finishWithError("Thumbnailer: RequestImpl::dbusCallFinished(): unexpected reply signature: " +
+                            watcher_->reply().signature());
+            return;
+            // LCOV_EXCL_STOP
+        }
         finished_ = true;
         is_valid_ = true;
         error_message_ = QLatin1String("");
@@ -251,6 +421,37 @@ void RequestImpl::dbusCallFinished()
     // LCOV_EXCL_STOP
 }
 
+void RequestImpl::batchItemFinished(QByteArray const& thumbnail, QString const& error)
+{
+    if (finished_ || cancelled_)
+    {
+        return;  // batchItemCancelled() takes care of completing a cancelled request.
+    }
+    if (!error.isNull())
+    {
+        finishWithError("Thumbnailer: RequestImpl::batchItemFinished(): " + error);
+        return;
+    }
+    image_ = QImage::fromData(thumbnail);
+    finished_ = true;
+    is_valid_ = true;
+    error_message_ = QLatin1String("");
+    Q_ASSERT(public_request_);
+    Q_EMIT public_request_->finished();
+    if (trace_client_)
+    {
+        qDebug().noquote() << "Thumbnailer: completed:" << details_;
+    }
+}
+
+void RequestImpl::batchItemCancelled()
+{
+    if (!finished_)
+    {
+        finishWithError("Request cancelled");
+    }
+}
+
 void RequestImpl::finishWithError(QString const& errorMessage)
 {
     error_message_ = errorMessage;
@@ -287,6 +488,12 @@ void RequestImpl::cancel()
     }
 
     cancelled_ = true;
+    if (batch_)
+    {
+        // Any result that arrives from now on is ignored.
+        QMetaObject::invokeMethod(this, "batchItemCancelled", Qt::QueuedConnection);
+        return;
+    }
     cancelled_while_waiting_ = cancel_func_();
     if (cancelled_while_waiting_)
     {
@@ -295,6 +502,23 @@ void RequestImpl::cancel()
         // because that would schedule the next request in the queue.
         QMetaObject::invokeMethod(this, "dbusCallFinished", Qt::QueuedConnection);
     }
+    else
+    {
+        // The request was sent already. The service replies with an error
+        // once it has abandoned the request, and dbusCallFinished() reports
+        // the cancellation to the caller.
+        cancelInService();
+    }
+}
+
+void RequestImpl::cancelInService()
+{
+    if (request_id_ != 0)
+    {
+        // We don't wait for the reply. If the service completed the request already,
+        // the cancellation has no effect.
+        thumbnailer_->iface().CancelRequest(request_id_);
+    }
 }
 
 void RequestImpl::waitForFinished()
@@ -304,6 +528,12 @@ void RequestImpl::waitForFinished()
         return;
     }
 
+    if (batch_)
+    {
+        batch_->waitFor(this);
+        return;
+    }
+
     // If we are called before the request made it out of the limiter queue,
     // we have not sent the request yet and, therefore, don't have a watcher.
     // In that case we send the request right here after removing it
@@ -317,18 +547,245 @@ void RequestImpl::waitForFinished()
     watcher_->waitForFinished();
 }
 
+namespace
+{
+
+// Remote end requires an absolute path.
+QString canonical_path(QString const& filename)
+{
+    try
+    {
+        return QString::fromStdString(boost::filesystem::canonical(filename.toStdString()).native());
+    }
+    catch (std::exception const&)
+    {
+        // If name can't be canonicalised, errors will be dealt with on the server side.
+    }
+    return filename;
+}
+
+}  // namespace
+
+BatchImpl::BatchImpl(ThumbnailerImpl* thumbnailer)
+    : thumbnailer_(thumbnailer)
+    , reply_handled_(false)
+    , done_(false)
+    , fd_(-1)
+{
+}
+
+BatchImpl::~BatchImpl()
+{
+    // Same logic as for RequestImpl: if the call was sent but the results
+    // have not all arrived yet, we must pump the limiter ourselves.
+    bool already_sent = false;
+    if (cancel_func_)
+    {
+        already_sent = !cancel_func_();
+    }
+    if (already_sent && !done_)
+    {
+        QMetaObject::invokeMethod(thumbnailer_, "pump_limiter", Qt::QueuedConnection);
+    }
+    notifier_.reset();
+    if (fd_ >= 0)
+    {
+        ::close(fd_);  // Tells the service to stop sending results.
+    }
+}
+
+void BatchImpl::add(RequestImpl* request, QString const& filename, QSize const& requested_size)
+{
+    Q_ASSERT(!send_request_);
+    filenames_.append(filename);
+    items_.append(unity::thumbnailer::service::BatchItem{QString(), requested_size});
+    requests_.push_back(request);
+}
+
+void BatchImpl::remove(RequestImpl* request)
+{
+    for (auto& r : requests_)
+    {
+        if (r == request)
+        {
+            r = nullptr;
+        }
+    }
+}
+
+void BatchImpl::start()
+{
+    // Canonicalization touches the file system, so we delay it until the call is actually sent.
+    send_request_ = [this]
+    {
+        for (int i = 0; i < items_.size(); ++i)
+        {
+            items_[i].filename = canonical_path(filenames_[i]);
+        }
+        watcher_.reset(new QDBusPendingCallWatcher(thumbnailer_->iface().GetThumbnails(items_)));
+        connect(watcher_.get(), &QDBusPendingCallWatcher::finished, this, &BatchImpl::dbusCallFinished);
+    };
+    cancel_func_ = thumbnailer_->limiter().schedule(send_request_);
+}
+
+void BatchImpl::waitFor(RequestImpl* request)
+{
+    auto self = shared_from_this();
+    QPointer<RequestImpl> req(request);
+
+    // See RequestImpl::waitForFinished().
+    if (cancel_func_())
+    {
+        Q_ASSERT(!watcher_);
+        thumbnailer_->limiter().schedule_now(send_request_);
+    }
+    watcher_->waitForFinished();
+    dbusCallFinished();
+
+    while (req && !req->isFinished() && !req->isCancelled() && fd_ >= 0)
+    {
+        struct pollfd pfd = { fd_, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        {
+            finishAll("Thumbnailer: BatchImpl::waitFor(): poll() failed");  // LCOV_EXCL_LINE
+            done();                                                          // LCOV_EXCL_LINE
+            break;                                                           // LCOV_EXCL_LINE
+        }
+        readRecords();
+    }
+}
+
+void BatchImpl::dbusCallFinished()
+{
+    if (reply_handled_)
+    {
+        return;  // waitFor() beat us to it.
+    }
+    reply_handled_ = true;
+
+    QDBusPendingReply<QDBusUnixFileDescriptor> reply = *watcher_.get();
+    if (!reply.isValid())
+    {
+        finishAll("D-Bus error: " + reply.error().message());
+        done();
+        return;
+    }
+    fd_ = fcntl(reply.value().fileDescriptor(), F_DUPFD_CLOEXEC, 0);
+    if (fd_ == -1 || fcntl(fd_, F_SETFL, O_NONBLOCK) == -1)
+    {
+        // LCOV_EXCL_START
+        finishAll(QStringLiteral("cannot access result stream"));
+        done();
+        return;
+        // LCOV_EXCL_STOP
+    }
+    notifier_.reset(new QSocketNotifier(fd_, QSocketNotifier::Read));
+    connect(notifier_.get(), &QSocketNotifier::activated, this, &BatchImpl::readRecords);
+}
+
+void BatchImpl::readRecords()
+{
+    // Delivering a result may cause the caller to destroy the last request, and with it, this batch.
+    auto self = shared_from_this();
+
+    char buf[64 * 1024];
+    while (fd_ >= 0)
+    {
+        ssize_t rc = ::read(fd_, buf, sizeof(buf));
+        if (rc > 0)
+        {
+            in_buffer_.append(buf, rc);
+            continue;
+        }
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;  // LCOV_EXCL_LINE
+        }
+        bool eof = rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        processRecords();
+        if (eof)
+        {
+            finishAll(QStringLiteral("no result for request"));
+            done();
+        }
+        break;
+    }
+}
+
+void BatchImpl::processRecords()
+{
+    using unity::thumbnailer::service::BatchRecordHeader;
+
+    int offset = 0;
+    while (in_buffer_.size() - offset >= int(sizeof(BatchRecordHeader)))
+    {
+        BatchRecordHeader hdr;
+        memcpy(&hdr, in_buffer_.constData() + offset, sizeof(hdr));
+        if (in_buffer_.size() - offset - int(sizeof(hdr)) < int(hdr.size))
+        {
+            break;  // Incomplete record.
+        }
+        QByteArray payload = in_buffer_.mid(offset + sizeof(hdr), hdr.size);
+        offset += sizeof(hdr) + hdr.size;
+        if (hdr.index < requests_.size() && requests_[hdr.index])
+        {
+            auto request = requests_[hdr.index];
+            requests_[hdr.index] = nullptr;  // Each request receives exactly one result.
+            request->batchItemFinished(hdr.error ? QByteArray() : payload,
+                                       hdr.error ? QString::fromUtf8(payload) : QString());
+        }
+    }
+    in_buffer_.remove(0, offset);
+}
+
+void BatchImpl::finishAll(QString const& error)
+{
+    for (size_t i = 0; i < requests_.size(); ++i)
+    {
+        auto request = requests_[i];
+        if (request)
+        {
+            requests_[i] = nullptr;
+            request->batchItemFinished(QByteArray(), error);
+        }
+    }
+}
+
+void BatchImpl::done()
+{
+    if (done_)
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    done_ = true;
+    notifier_.reset();
+    if (fd_ >= 0)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    thumbnailer_->limiter().done();
+}
+
 ThumbnailerImpl::ThumbnailerImpl(QDBusConnection const& connection)
+    : last_request_id_(0)
 {
     iface_.reset(new ThumbnailerInterface(service::BUS_NAME, service::THUMBNAILER_BUS_PATH, connection));
     qDBusRegisterMetaType<unity::thumbnailer::service::ConfigValues>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::BatchItem>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::BatchItems>();
 
     // We need to retrieve config parameters from the server because, when an app runs confined,
     // it cannot read gsettings. We do this synchronously because we can't do anything else until
     // after we get the settings anyway.
 
     auto client_config_call = iface_->ClientConfig();
+    auto fd_delivery_call = iface_->FdDelivery();
+    auto priorities_call = iface_->RequestPriorities();
     {
         trace_client_ = TRACE_CLIENT_DEFAULT;
+        fd_delivery_ = false;
+        priorities_ = false;
         int max_backlog = MAX_BACKLOG_DEFAULT;
 
         client_config_call.waitForFinished();
@@ -347,6 +804,16 @@ ThumbnailerImpl::ThumbnailerImpl(QDBusConnection const& connection)
         }
         // LCOV_EXCL_STOP
         limiter_.reset(new RateLimiter(max_backlog));
+
+        // An older service doesn't have FdDelivery(), in which case we stick to the byte array methods.
+        // Both ends of the connection must be able to pass file descriptors.
+        fd_delivery_call.waitForFinished();
+        fd_delivery_ = fd_delivery_call.isValid() && fd_delivery_call.value() &&
+                       (connection.connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing);
+
+        // Likewise, an older service doesn't know about priorities and can't cancel requests.
+        priorities_call.waitForFinished();
+        priorities_ = priorities_call.isValid() && priorities_call.value();
     }
 }
 
@@ -358,8 +825,12 @@ QSharedPointer<Request> ThumbnailerImpl::getAlbumArt(QString const& artist,
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getAlbumArt: (" << requestedSize.width() << "," << requestedSize.height()
       << ") \"" << artist << "\", \"" << album << "\"";
-    auto job = [this, artist, album, requestedSize]
+    auto job = [this, artist, album, requestedSize]() -> QDBusPendingCall
     {
+        if (fd_delivery_)
+        {
+            return iface_->GetAlbumArtFd(artist, album, requestedSize);
+        }
         return iface_->GetAlbumArt(artist, album, requestedSize);
     };
     return createRequest(details, requestedSize, job);
@@ -373,44 +844,102 @@ QSharedPointer<Request> ThumbnailerImpl::getArtistArt(QString const& artist,
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getArtistArt: (" << requestedSize.width() << "," << requestedSize.height()
       << ") \"" << artist << "\", \"" << album << "\"";
-    auto job = [this, artist, album, requestedSize]
+    auto job = [this, artist, album, requestedSize]() -> QDBusPendingCall
     {
+        if (fd_delivery_)
+        {
+            return iface_->GetArtistArtFd(artist, album, requestedSize);
+        }
         return iface_->GetArtistArt(artist, album, requestedSize);
     };
     return createRequest(details, requestedSize, job);
 }
 
-QSharedPointer<Request> ThumbnailerImpl::getThumbnail(QString const& filename, QSize const& requestedSize)
+QSharedPointer<Request> ThumbnailerImpl::getThumbnail(QString const& filename,
+                                                      QSize const& requestedSize,
+                                                      Priority priority)
 {
     QString details;
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getThumbnail: (" << requestedSize.width() << "," << requestedSize.height() << ") " << filename;
-    auto job = [this, filename, requestedSize]
+    if (priority != Priority::Interactive)
+    {
+        s << (priority == Priority::Prefetch ? " [prefetch]" : " [background]");
+    }
+
+    // The service uses the same numbering for priorities as the limiter.
+    // The request id allows us to tell the service when the caller loses interest.
+    // Without priorities on the service side, the priority still applies to our own limiter.
+    auto limiter_priority = RateLimiter::Priority(int(priority));
+    auto request_id = priorities_ ? ++last_request_id_ : 0;
+    auto job = [this, filename, requestedSize, limiter_priority, request_id]() -> QDBusPendingCall
     {
-        // Remote end requires an absolute path.
-        QString canonical_name = filename;
-        try
+        if (!priorities_)
         {
-            canonical_name = QString::fromStdString(boost::filesystem::canonical(filename.toStdString()).native());
+            if (fd_delivery_)
+            {
+                return iface_->GetThumbnailFd(canonical_path(filename), requestedSize);
+            }
+            return iface_->GetThumbnail(canonical_path(filename), requestedSize);
         }
-        catch (std::exception const&)
+        if (fd_delivery_)
         {
-            // If name can't be canonicalised, errors will be dealt with on the server side.
+            return iface_->GetThumbnailFdWithPriority(canonical_path(filename), requestedSize,
+                                                      int(limiter_priority), request_id);
         }
-        return iface_->GetThumbnail(canonical_name, requestedSize);
+        return iface_->GetThumbnailWithPriority(canonical_path(filename), requestedSize,
+                                                int(limiter_priority), request_id);
     };
-    return createRequest(details, requestedSize, job);
+    return createRequest(details, requestedSize, job, limiter_priority, request_id);
+}
+
+QList<QSharedPointer<Request>> ThumbnailerImpl::getThumbnails(QList<QPair<QString, QSize>> const& requests)
+{
+    QList<QSharedPointer<Request>> result;
+    auto batch = std::make_shared<BatchImpl>(this);
+    bool have_valid_request = false;
+    for (auto const& r : requests)
+    {
+        QString details;
+        QTextStream s(&details, QIODevice::WriteOnly);
+        s << "getThumbnails: (" << r.second.width() << "," << r.second.height() << ") " << r.first;
+        s.flush();
+        if (trace_client_)
+        {
+            qDebug().noquote() << "Thumbnailer:" << details;
+        }
+        auto request_impl = new RequestImpl(details, r.second, this, batch, trace_client_);
+        auto request = QSharedPointer<Request>(new Request(request_impl));
+        request_impl->setRequest(request.data());
+        if (request->isFinished() && !request->isValid())
+        {
+            QMetaObject::invokeMethod(request.data(), "finished", Qt::QueuedConnection);
+        }
+        else
+        {
+            batch->add(request_impl, r.first, r.second);
+            have_valid_request = true;
+        }
+        result.append(request);
+    }
+    if (have_valid_request)
+    {
+        batch->start();
+    }
+    return result;
 }
 
 QSharedPointer<Request> ThumbnailerImpl::createRequest(QString const& details,
                                                        QSize const& requested_size,
-                                                       std::function<QDBusPendingReply<QByteArray>()> const& job)
+                                                       std::function<QDBusPendingCall()> const& job,
+                                                       RateLimiter::Priority priority,
+                                                       quint64 request_id)
 {
     if (trace_client_)
     {
         qDebug().noquote() << "Thumbnailer:" << details;
     }
-    auto request_impl = new RequestImpl(details, requested_size, this, job, trace_client_);
+    auto request_impl = new RequestImpl(details, requested_size, this, job, priority, request_id, trace_client_);
     auto request = QSharedPointer<Request>(new Request(request_impl));
     request_impl->setRequest(request.data());
     if (request->isFinished() && !request->isValid())
@@ -504,7 +1033,19 @@ QSharedPointer<Request> Thumbnailer::getArtistArt(QString const& artist,
 
 QSharedPointer<Request> Thumbnailer::getThumbnail(QString const& filePath, QSize const& requestedSize)
 {
-    return p_->getThumbnail(filePath, requestedSize);
+    return p_->getThumbnail(filePath, requestedSize, Priority::Interactive);
+}
+
+QSharedPointer<Request> Thumbnailer::getThumbnail(QString const& filePath,
+                                                  QSize const& requestedSize,
+                                                  Priority priority)
+{
+    return p_->getThumbnail(filePath, requestedSize, priority);
+}
+
+QList<QSharedPointer<Request>> Thumbnailer::getThumbnails(QList<QPair<QString, QSize>> const& requests)
+{
+    return p_->getThumbnails(requests);
 }
 }  // namespace qt
 
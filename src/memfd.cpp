@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/memfd.h>
+
+#include <internal/raii.h>
+#include <internal/safe_strerror.h>
+
+#include <stdexcept>
+#include <string>
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Older glibc versions don't provide these.
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+void write_all(int fd, void const* data, size_t size)
+{
+    char const* p = static_cast<char const*>(data);
+    while (size > 0)
+    {
+        ssize_t rc = write(fd, p, size);
+        if (rc == -1)
+        {
+            // LCOV_EXCL_START
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(string("make_sealed_memfd(): write() failed: ") + safe_strerror(errno));
+            // LCOV_EXCL_STOP
+        }
+        p += rc;
+        size -= rc;
+    }
+}
+
+// LCOV_EXCL_START
+// Fallback for kernels without memfd_create() (earlier than 3.17).
+int create_tmpfile(char const* func)
+{
+    char const* dir = getenv("XDG_RUNTIME_DIR");
+    string tmpl = string(dir && *dir ? dir : "/tmp") + "/thumbnailer.XXXXXX";
+    int fd = mkostemp(&tmpl[0], O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw runtime_error(string(func) + ": cannot create " + tmpl + ": " + safe_strerror(errno));
+    }
+    unlink(tmpl.c_str());
+    return fd;
+}
+
+int make_tmpfile(void const* data, size_t size)
+{
+    FdPtr rw_fd(create_tmpfile("make_sealed_memfd()"), do_close);
+    write_all(rw_fd.get(), data, size);
+
+    // Re-open read-only, so the receiver can't modify the contents.
+    string proc_path = "/proc/self/fd/" + to_string(rw_fd.get());
+    int ro_fd = open(proc_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ro_fd == -1)
+    {
+        throw runtime_error("make_sealed_memfd(): cannot re-open " + proc_path + ": " + safe_strerror(errno));
+    }
+    return ro_fd;
+}
+// LCOV_EXCL_STOP
+
+}  // namespace
+
+int make_sealed_memfd(char const* name, void const* data, size_t size)
+{
+    int fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        return make_tmpfile(data, size);  // LCOV_EXCL_LINE
+    }
+    FdPtr memfd(fd, do_close);
+    write_all(memfd.get(), data, size);
+    if (fcntl(memfd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        throw runtime_error(string("make_sealed_memfd(): cannot seal memfd: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    // The receiver shares the file offset with us, so rewind for readers that don't mmap.
+    if (lseek(memfd.get(), 0, SEEK_SET) == -1)
+    {
+        throw runtime_error(string("make_sealed_memfd(): lseek() failed: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    return memfd.release();
+}
+
+int make_memfd(char const* name)
+{
+    int fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        return create_tmpfile("make_memfd()");  // LCOV_EXCL_LINE
+    }
+    return fd;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
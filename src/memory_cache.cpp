@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/memory_cache.h>
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Rough cost of the list node, the hash table node, and the QByteArray header.
+int64_t const ENTRY_OVERHEAD = 128;
+
+string const SNAPSHOT_MAGIC = "MCS1";
+
+void append_uint32(string& s, uint32_t val)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        s += char(val >> shift);
+    }
+}
+
+uint32_t read_uint32(string const& s, size_t& pos)
+{
+    uint32_t val = 0;
+    for (size_t end = pos + 4; pos < end; ++pos)
+    {
+        val = val << 8 | static_cast<unsigned char>(s[pos]);
+    }
+    return val;
+}
+
+void append_string(string& s, string const& val)
+{
+    append_uint32(s, uint32_t(val.size()));
+    s += val;
+}
+
+bool read_string(string const& s, size_t& pos, string& val)
+{
+    if (s.size() - pos < 4)
+    {
+        return false;
+    }
+    uint32_t len = read_uint32(s, pos);
+    if (s.size() - pos < len)
+    {
+        return false;
+    }
+    val = s.substr(pos, len);
+    pos += len;
+    return true;
+}
+
+}  // namespace
+
+MemoryCache::MemoryCache(int64_t max_size_in_bytes, int num_shards)
+    : max_size_in_bytes_(max_size_in_bytes)
+    , max_shard_size_(max_size_in_bytes / num_shards)
+    , hits_(0)
+    , misses_(0)
+    , evictions_(0)
+{
+    assert(max_size_in_bytes >= 0);
+    assert(num_shards > 0);
+
+    for (int i = 0; i < num_shards; ++i)
+    {
+        shards_.emplace_back(new Shard);
+    }
+}
+
+MemoryCache::~MemoryCache() = default;
+
+core::Optional<QByteArray> MemoryCache::get(string const& key, string* source, int64_t* hits)
+{
+    Shard& s = shard_for(key);
+    lock_guard<mutex> lock(s.mutex);
+
+    auto it = s.index.find(key);
+    if (it == s.index.end())
+    {
+        ++misses_;
+        return core::Optional<QByteArray>();
+    }
+    auto entry = it->second;
+    if (entry->expiry_time != chrono::system_clock::time_point() && entry->expiry_time <= chrono::system_clock::now())
+    {
+        erase(s, entry);
+        ++evictions_;
+        ++misses_;
+        return core::Optional<QByteArray>();
+    }
+    s.lru.splice(s.lru.begin(), s.lru, entry);  // Move to front.
+    ++entry->hits;
+    ++hits_;
+    if (source)
+    {
+        *source = entry->source;
+    }
+    if (hits)
+    {
+        *hits = entry->hits;
+    }
+    return core::Optional<QByteArray>(entry->value);
+}
+
+bool MemoryCache::put(string const& key,
+                      QByteArray const& value,
+                      chrono::system_clock::time_point expiry_time,
+                      string const& source)
+{
+    int64_t charge = int64_t(key.size()) + value.size() + ENTRY_OVERHEAD;
+    if (charge > max_shard_size_)
+    {
+        // Too large to ever fit. Make sure we don't hang on to an older version.
+        invalidate(key);
+        return false;
+    }
+
+    Shard& s = shard_for(key);
+    lock_guard<mutex> lock(s.mutex);
+
+    auto it = s.index.find(key);
+    if (it != s.index.end())
+    {
+        erase(s, it->second);
+    }
+    while (s.size_in_bytes + charge > max_shard_size_)
+    {
+        assert(!s.lru.empty());
+        erase(s, prev(s.lru.end()));
+        ++evictions_;
+    }
+    s.lru.push_front(Entry{key, value, expiry_time, charge, source, 0});
+    s.index[key] = s.lru.begin();
+    s.size_in_bytes += charge;
+    return true;
+}
+
+void MemoryCache::invalidate(string const& key)
+{
+    Shard& s = shard_for(key);
+    lock_guard<mutex> lock(s.mutex);
+
+    auto it = s.index.find(key);
+    if (it != s.index.end())
+    {
+        erase(s, it->second);
+    }
+}
+
+void MemoryCache::invalidate()
+{
+    for (auto& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex);
+        s->index.clear();
+        s->lru.clear();
+        s->size_in_bytes = 0;
+    }
+}
+
+int MemoryCache::invalidate_if(function<bool(string const& key, string const& source)> const& pred)
+{
+    int removed = 0;
+    for (auto& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex);
+        for (auto it = s->lru.begin(); it != s->lru.end();)
+        {
+            auto next = std::next(it);
+            if (pred(it->key, it->source))
+            {
+                erase(*s, it);
+                ++removed;
+            }
+            it = next;
+        }
+    }
+    return removed;
+}
+
+MemoryCache::Stats MemoryCache::stats() const
+{
+    Stats st;
+    for (auto const& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex);
+        st.size += s->index.size();
+        st.size_in_bytes += s->size_in_bytes;
+    }
+    st.max_size_in_bytes = max_size_in_bytes_;
+    st.hits = hits_;
+    st.misses = misses_;
+    st.evictions = evictions_;
+    return st;
+}
+
+void MemoryCache::clear_stats()
+{
+    hits_ = 0;
+    misses_ = 0;
+    evictions_ = 0;
+}
+
+string MemoryCache::snapshot(int max_entries) const
+{
+    assert(max_entries >= 0);
+
+    // Within each shard, the most recently used entries come first, so
+    // the stable sort prefers those among entries with the same count.
+    vector<SnapshotEntry> entries;
+    for (auto const& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex);
+        for (auto const& e : s->lru)
+        {
+            if (!e.source.empty())
+            {
+                entries.push_back(SnapshotEntry{e.key, e.source, e.hits});
+            }
+        }
+    }
+    stable_sort(entries.begin(), entries.end(),
+                [](SnapshotEntry const& a, SnapshotEntry const& b) { return a.hits > b.hits; });
+    if (entries.size() > size_t(max_entries))
+    {
+        entries.resize(max_entries);
+    }
+
+    string data = SNAPSHOT_MAGIC;
+    append_uint32(data, uint32_t(entries.size()));
+    for (auto const& e : entries)
+    {
+        append_string(data, e.key);
+        append_string(data, e.source);
+        append_uint32(data, uint32_t(min(e.hits, int64_t(UINT32_MAX))));
+    }
+    return data;
+}
+
+vector<MemoryCache::SnapshotEntry> MemoryCache::parse_snapshot(string const& data)
+{
+    vector<SnapshotEntry> entries;
+    if (data.size() < SNAPSHOT_MAGIC.size() + 4 || data.compare(0, SNAPSHOT_MAGIC.size(), SNAPSHOT_MAGIC) != 0)
+    {
+        return entries;
+    }
+    size_t pos = SNAPSHOT_MAGIC.size();
+    uint32_t num_entries = read_uint32(data, pos);
+    for (uint32_t i = 0; i < num_entries; ++i)
+    {
+        SnapshotEntry e;
+        if (!read_string(data, pos, e.key) || !read_string(data, pos, e.source) || data.size() - pos < 4)
+        {
+            return vector<SnapshotEntry>();
+        }
+        e.hits = read_uint32(data, pos);
+        entries.push_back(move(e));
+    }
+    if (pos != data.size())
+    {
+        return vector<SnapshotEntry>();
+    }
+    return entries;
+}
+
+MemoryCache::Shard& MemoryCache::shard_for(string const& key)
+{
+    return *shards_[hash<string>()(key) % shards_.size()];
+}
+
+void MemoryCache::erase(Shard& shard, LRUList::iterator it)
+{
+    shard.size_in_bytes -= it->charge;
+    shard.index.erase(it->key);
+    shard.lru.erase(it);
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
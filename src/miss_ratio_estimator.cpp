@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/miss_ratio_estimator.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Keys are sampled if the low bits of their hash are below the threshold.
+uint64_t const MODULUS = uint64_t(1) << 24;
+
+// Reuse distances go into logarithmic buckets, which is plenty
+// precise for picking a cache size and keeps the histogram small.
+int const BUCKETS_PER_OCTAVE = 16;
+int const NUM_BUCKETS = BUCKETS_PER_OCTAVE * 48;
+
+// Once we have seen this many requests, we halve all the counts, so old requests fade out.
+double const AGING_REQUESTS = 64 * 1024;
+
+string const MAGIC = "MRC1";
+
+uint64_t fnv1a(string const& key)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Finalizer from splitmix64. FNV-1a on its own doesn't spread similar keys well
+// enough over the low bits, which would skew the sample.
+
+uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+int bucket(double distance)
+{
+    if (distance <= 0)
+    {
+        return 0;
+    }
+    return min(int(BUCKETS_PER_OCTAVE * log2(1.0 + distance)), NUM_BUCKETS - 1);
+}
+
+// Returns the smallest cache size that holds every reuse distance in bucket b.
+
+int64_t bucket_limit(int b)
+{
+    return int64_t(ceil(exp2(double(b + 1) / BUCKETS_PER_OCTAVE) - 1.0));
+}
+
+void append_uint64(string& s, uint64_t val)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        s += char(val >> shift);
+    }
+}
+
+void append_double(string& s, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    append_uint64(s, bits);
+}
+
+uint64_t read_uint64(string const& s, size_t& pos)
+{
+    uint64_t val = 0;
+    for (size_t end = pos + 8; pos < end; ++pos)
+    {
+        val = val << 8 | static_cast<unsigned char>(s[pos]);
+    }
+    return val;
+}
+
+double read_double(string const& s, size_t& pos)
+{
+    uint64_t bits = read_uint64(s, pos);
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+}  // namespace
+
+MissRatioEstimator::MissRatioEstimator(int max_keys)
+    : max_keys_(max(max_keys, 1))
+    , threshold_(MODULUS)
+    , tree_(2 * (max_keys_ + 1))
+    , next_slot_(0)
+    , total_size_(0)
+    , histogram_(NUM_BUCKETS)
+    , cold_misses_(0)
+    , requests_(0)
+{
+}
+
+MissRatioEstimator::~MissRatioEstimator() = default;
+
+void MissRatioEstimator::record(string const& key, int64_t size)
+{
+    assert(size >= 0);
+    record_hash(mix(fnv1a(key)), size);
+}
+
+void MissRatioEstimator::record_repeat(string const& key)
+{
+    record_hash(mix(fnv1a(key)), -1);
+}
+
+// A negative size means that the size is the same as for the previous access.
+
+void MissRatioEstimator::record_hash(uint64_t hash, int64_t size)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if ((hash & (MODULUS - 1)) >= threshold_)
+    {
+        return;
+    }
+
+    auto it = index_.find(hash);
+    if (it == index_.end() && size < 0)
+    {
+        return;  // We don't know the size.
+    }
+
+    // Each sample stands for 1 / sampling rate requests. The rate goes down as
+    // we see more keys, so samples from earlier on count for less.
+    double const weight = double(MODULUS) / threshold_;
+    requests_ += weight;
+
+    if (it == index_.end())
+    {
+        cold_misses_ += weight;
+        lru_.push_front(Entry{hash, size, 0});
+        index_[hash] = lru_.begin();
+        place(lru_.front());
+        if (index_.size() > max_keys_)
+        {
+            lower_threshold();
+        }
+    }
+    else
+    {
+        // The request would have been a hit in a cache that is large enough for
+        // everything that was used since the last request for key, plus the entry itself.
+        auto const entry = it->second;
+        if (size < 0)
+        {
+            size = entry->size;
+        }
+        int64_t distance = size + total_size_ - tree_sum(entry->slot);
+        histogram_[bucket(distance * weight)] += weight;
+        tree_add(entry->slot, -entry->size);
+        total_size_ -= entry->size;
+        entry->size = size;
+        lru_.splice(lru_.begin(), lru_, entry);
+        place(*entry);
+    }
+
+    if (requests_ >= AGING_REQUESTS)
+    {
+        age();
+    }
+}
+
+double MissRatioEstimator::miss_ratio(int64_t size_in_bytes) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if (requests_ == 0)
+    {
+        return 1.0;
+    }
+    double hits = 0;
+    for (int b = 0; b < NUM_BUCKETS && bucket_limit(b) <= size_in_bytes; ++b)
+    {
+        hits += histogram_[b];
+    }
+    return max(1.0 - hits / requests_, 0.0);
+}
+
+vector<MissRatioEstimator::Point> MissRatioEstimator::curve(int64_t max_size_in_bytes, int num_points) const
+{
+    vector<Point> points;
+    for (int i = 1; i <= num_points; ++i)
+    {
+        int64_t size = max_size_in_bytes / num_points * i;
+        points.push_back(Point{size, miss_ratio(size)});
+    }
+    return points;
+}
+
+int64_t MissRatioEstimator::size_for_miss_ratio(double target) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if (requests_ == 0)
+    {
+        return -1;
+    }
+
+    // Allow for rounding errors, so we can reach the floor exactly.
+    target = max(target, cold_misses_ / requests_) + 1e-9;
+    double hits = 0;
+    int last_used = 0;
+    for (int b = 0; b < NUM_BUCKETS; ++b)
+    {
+        if (histogram_[b] == 0)
+        {
+            continue;
+        }
+        hits += histogram_[b];
+        last_used = b;
+        if (1.0 - hits / requests_ <= target)
+        {
+            return bucket_limit(b);
+        }
+    }
+    return bucket_limit(last_used);  // LCOV_EXCL_LINE  // Only if the target is below the floor.
+}
+
+double MissRatioEstimator::requests() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    return requests_;
+}
+
+double MissRatioEstimator::sampling_rate() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    return double(threshold_) / MODULUS;
+}
+
+void MissRatioEstimator::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    threshold_ = MODULUS;
+    lru_.clear();
+    index_.clear();
+    renumber();
+    fill(histogram_.begin(), histogram_.end(), 0);
+    cold_misses_ = 0;
+    requests_ = 0;
+}
+
+string MissRatioEstimator::serialize() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    string data = MAGIC;
+    append_uint64(data, max_keys_);
+    append_uint64(data, threshold_);
+    append_double(data, cold_misses_);
+    append_double(data, requests_);
+    for (auto count : histogram_)
+    {
+        append_double(data, count);
+    }
+    append_uint64(data, lru_.size());
+    for (auto const& e : lru_)
+    {
+        append_uint64(data, e.hash);
+        append_uint64(data, uint64_t(e.size));
+    }
+    return data;
+}
+
+bool MissRatioEstimator::deserialize(string const& data)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    size_t const header_size = MAGIC.size() + (5 + NUM_BUCKETS) * 8;
+    if (data.size() < header_size || data.compare(0, MAGIC.size(), MAGIC) != 0)
+    {
+        return false;
+    }
+    size_t pos = MAGIC.size();
+    if (read_uint64(data, pos) != max_keys_)
+    {
+        return false;
+    }
+    uint64_t threshold = read_uint64(data, pos);
+    double cold_misses = read_double(data, pos);
+    double requests = read_double(data, pos);
+    vector<double> histogram(NUM_BUCKETS);
+    for (auto& count : histogram)
+    {
+        count = read_double(data, pos);
+    }
+    uint64_t num_entries = read_uint64(data, pos);
+    if (threshold == 0 || threshold > MODULUS || num_entries > max_keys_ || data.size() != pos + num_entries * 16)
+    {
+        return false;
+    }
+
+    threshold_ = threshold;
+    cold_misses_ = cold_misses;
+    requests_ = requests;
+    histogram_.swap(histogram);
+    lru_.clear();
+    index_.clear();
+    for (uint64_t i = 0; i < num_entries; ++i)
+    {
+        uint64_t hash = read_uint64(data, pos);
+        int64_t size = int64_t(read_uint64(data, pos));
+        lru_.push_back(Entry{hash, size, 0});
+        index_[hash] = prev(lru_.end());
+    }
+    renumber();
+    return true;
+}
+
+// Lowers the threshold to the largest sampled hash value we are tracking
+// and drops every key at or above the new threshold.
+
+void MissRatioEstimator::lower_threshold()
+{
+    uint64_t highest = 0;
+    for (auto const& e : lru_)
+    {
+        highest = max(highest, e.hash & (MODULUS - 1));
+    }
+    threshold_ = max(highest, uint64_t(1));
+
+    for (auto e = lru_.begin(); e != lru_.end(); )
+    {
+        if ((e->hash & (MODULUS - 1)) >= threshold_)
+        {
+            index_.erase(e->hash);
+            e = lru_.erase(e);
+        }
+        else
+        {
+            ++e;
+        }
+    }
+    renumber();
+}
+
+// Gives e, which was just moved to the front of lru_, the next slot.
+// Once we run out of slots, we hand them out again in LRU order.
+
+void MissRatioEstimator::place(Entry& e)
+{
+    if (next_slot_ == tree_.size())
+    {
+        renumber();
+        return;
+    }
+    e.slot = next_slot_++;
+    tree_add(e.slot, e.size);
+    total_size_ += e.size;
+}
+
+void MissRatioEstimator::renumber()
+{
+    fill(tree_.begin(), tree_.end(), 0);
+    next_slot_ = 0;
+    total_size_ = 0;
+    for (auto e = lru_.rbegin(); e != lru_.rend(); ++e)
+    {
+        e->slot = next_slot_++;
+        tree_add(e->slot, e->size);
+        total_size_ += e->size;
+    }
+}
+
+void MissRatioEstimator::tree_add(size_t slot, int64_t delta)
+{
+    for (size_t i = slot + 1; i <= tree_.size(); i += i & -i)
+    {
+        tree_[i - 1] += delta;
+    }
+}
+
+// Returns the sum of the sizes in slots 0 to slot.
+
+int64_t MissRatioEstimator::tree_sum(size_t slot) const
+{
+    int64_t sum = 0;
+    for (size_t i = slot + 1; i > 0; i -= i & -i)
+    {
+        sum += tree_[i - 1];
+    }
+    return sum;
+}
+
+void MissRatioEstimator::age()
+{
+    for (auto& count : histogram_)
+    {
+        count /= 2;
+    }
+    cold_misses_ /= 2;
+    requests_ /= 2;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -29,11 +29,15 @@ namespace unity
 namespace thumbnailer
 {
 
-RateLimiter::RateLimiter(int concurrency)
+RateLimiter::RateLimiter(int concurrency, chrono::milliseconds aging_interval)
     : concurrency_(concurrency)
+    , aging_interval_(aging_interval)
     , running_(0)
+    , next_seq_(0)
+    , buckets_(make_shared<Buckets>())
 {
     assert(concurrency > 0);
+    assert(aging_interval.count() > 0);
 }
 
 RateLimiter::~RateLimiter()
@@ -44,29 +48,53 @@ RateLimiter::~RateLimiter()
     // assert(running_ == 0);
 }
 
-RateLimiter::CancelFunc RateLimiter::schedule(function<void()> job)
+RateLimiter::CancelFunc RateLimiter::schedule(function<void()> job, Priority priority)
+{
+    PriorityFunc priority_func;
+    return schedule(move(job), priority, priority_func);
+}
+
+RateLimiter::CancelFunc RateLimiter::schedule(function<void()> job, Priority priority, PriorityFunc& priority_func)
 {
     assert(job);
     assert (running_ >= 0);
 
     if (running_ < concurrency_)
     {
+        priority_func = [](Priority) noexcept { return false; };  // Not queued, so there is nothing to change.
         return schedule_now(job);
     }
 
-    list_.emplace_back(make_shared<function<void()>>(move(job)));
+    auto job_p = make_shared<Job>(Job{move(job), priority, chrono::steady_clock::now(), next_seq_++});
+    (*buckets_)[int(priority)].emplace(job_p->seq, job_p);
 
-    // Returned function clears the job when called, provided the job is still in the queue.
-    // done() removes any cleared jobs from the queue without calling them.
-    weak_ptr<function<void()>> weak_p(list_.back());
-    return [this, weak_p]() noexcept
+    // Returned functions modify the job when called, provided the job is still in the queue.
+    // Once done() has started a job, it is no longer in any bucket, so weak_p has expired.
+    weak_ptr<Job> weak_p(job_p);
+    weak_ptr<Buckets> weak_buckets(buckets_);
+    priority_func = [weak_p, weak_buckets](Priority new_priority) noexcept
+    {
+        auto job_p = weak_p.lock();
+        auto buckets = weak_buckets.lock();
+        if (!job_p || !buckets)
+        {
+            return false;
+        }
+        (*buckets)[int(job_p->priority)].erase(job_p->seq);
+        job_p->priority = new_priority;
+        (*buckets)[int(new_priority)].emplace(job_p->seq, job_p);
+        return true;
+    };
+    return [weak_p, weak_buckets]() noexcept
     {
         auto job_p = weak_p.lock();
-        if (job_p)
+        auto buckets = weak_buckets.lock();
+        if (!job_p || !buckets)
         {
-            *job_p = nullptr;
+            return false;
         }
-        return job_p != nullptr;
+        (*buckets)[int(job_p->priority)].erase(job_p->seq);
+        return true;
     };
 }
 
@@ -84,23 +112,38 @@ void RateLimiter::done()
     assert(running_ > 0);
     --running_;
 
-    // Find the next job, discarding any cancelled jobs.
-    shared_ptr<function<void()>> job_p;
-    while (!list_.empty())
+    // Jobs in the same bucket age at the same rate, so the oldest job in each bucket has
+    // been promoted the most. If it hasn't been promoted yet, none of the jobs in the bucket
+    // have, and the most recent one goes first. That leaves one candidate per bucket.
+    auto const now = chrono::steady_clock::now();
+    Bucket* best_bucket = nullptr;
+    shared_ptr<Job> best;
+    long best_rank = 0;
+    for (size_t p = 0; p < buckets_->size(); ++p)
     {
-        job_p = list_.back();
-        assert(job_p);
-        list_.pop_back();
-        if (*job_p != nullptr)
+        auto& bucket = (*buckets_)[p];
+        if (bucket.empty())
+        {
+            continue;
+        }
+        auto const& oldest = bucket.begin()->second;
+        long promotion = long((now - oldest->queued_time) / aging_interval_);
+        auto const& candidate = promotion > 0 ? oldest : bucket.rbegin()->second;
+        long rank = long(p) - promotion;
+        if (!best || rank < best_rank || (rank == best_rank && candidate->seq > best->seq))
         {
-            break;
+            best_bucket = &bucket;
+            best = candidate;
+            best_rank = rank;
         }
     }
 
-    // If we found an uncancelled job, call it.
-    if (job_p && *job_p)
+    if (best)
     {
-        schedule_now(*job_p);
+        auto job = move(best->func);
+        best_bucket->erase(best->seq);
+        best.reset();  // Expires the cancel and priority functions for the job.
+        schedule_now(job);
     }
 }
 
@@ -0,0 +1,1081 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/segment_store.h>
+
+#include <internal/make_directories.h>
+#include <internal/raii.h>
+#include <internal/safe_strerror.h>
+
+#include <boost/filesystem.hpp>
+#include <QDebug>
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Segment file: header, followed by records.
+//   0: magic
+//   8: offset of the end of the last record (uint64)
+// Record:
+//   0: key size (uint32)
+//   4: value size (uint32)
+//   8: upper half of the key hash (uint32), to detect garbage
+//  12: key, then value, padded to a multiple of 8 bytes.
+// A record with a value size of TOMBSTONE has no value. It records that take() removed
+// the key, so rebuilding the index doesn't bring back the record before it. (A record
+// that replaces a value does the same for the old value.)
+//
+// Index file: header, followed by the hash table.
+//   0: magic
+//   8: number of slots (uint64)
+//  16: maximum size of the store (uint64)
+//
+// Both files are in host byte order; they never leave the machine.
+
+char const SEGMENT_MAGIC[8] = { 'S', 'E', 'G', 'S', 'T', 'O', 'R', '1' };
+char const INDEX_MAGIC[8] = { 'S', 'E', 'G', 'I', 'N', 'D', 'X', '1' };
+size_t const SEGMENT_HEADER_SIZE = 16;
+size_t const RECORD_HEADER_SIZE = 12;
+size_t const INDEX_HEADER_SIZE = 32;
+uint32_t const TOMBSTONE = UINT32_MAX;
+
+string const SEGMENT_PREFIX = "segment-";
+string const INDEX_NAME = "index";
+string const LOCK_NAME = "lock";
+
+// The store is split into this many segments, so deleting the oldest
+// segment evicts a small fraction of the entries.
+int64_t const SEGMENTS_PER_STORE = 16;
+int64_t const MIN_SEGMENT_SIZE = 256 * 1024;
+int64_t const MAX_SEGMENT_SIZE = 1024 * 1024 * 1024;  // Offsets are 32 bits.
+
+uint64_t const MIN_INDEX_CAPACITY = 1024;
+
+uint64_t fnv1a(char const* p, size_t size)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= static_cast<unsigned char>(p[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Finalizer from splitmix64. FNV-1a on its own leaves the low bits of similar keys
+// correlated, and we use the low bits to pick a slot.
+
+uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+uint64_t hash_key(char const* p, size_t size)
+{
+    uint64_t h = mix(fnv1a(p, size));
+    return h == 0 ? 1 : h;  // 0 marks an empty slot.
+}
+
+uint32_t load32(char const* p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+uint64_t load64(char const* p)
+{
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+void store32(char* p, uint32_t val)
+{
+    memcpy(p, &val, sizeof(val));
+}
+
+void store64(char* p, uint64_t val)
+{
+    memcpy(p, &val, sizeof(val));
+}
+
+int64_t record_size(size_t key_size, size_t value_size)
+{
+    return (RECORD_HEADER_SIZE + key_size + value_size + 7) & ~int64_t(7);
+}
+
+[[noreturn]] void throw_corrupt(string const& msg)
+{
+    // Same code as leveldb uses for corruption, so CacheHelper knows to start over.
+    throw system_error(error_code(666, generic_category()), "SegmentStore: " + msg);
+}
+
+// Maps the file at path read-write. If size is non-zero, the file is created with that size.
+// Returns the mapping and sets size to the size of the file.
+
+char* map_file(string const& path, int64_t& size)
+{
+    int flags = O_RDWR | O_CLOEXEC;
+    if (size != 0)
+    {
+        flags |= O_CREAT | O_TRUNC;
+    }
+    FdPtr fd(::open(path.c_str(), flags, 0600), do_close);
+    if (fd.get() == -1)
+    {
+        throw runtime_error("SegmentStore: cannot open " + path + ": " + safe_strerror(errno));
+    }
+    if (size != 0)
+    {
+        // ftruncate() alone creates a sparse file. If the disk fills up later, writing to
+        // the mapping raises SIGBUS, so we reserve the blocks now and fail here instead.
+        if (ftruncate(fd.get(), size) == -1)
+        {
+            throw runtime_error("SegmentStore: cannot size " + path + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+        }
+        int rc = posix_fallocate(fd.get(), 0, size);
+        if (rc != 0)
+        {
+            ::unlink(path.c_str());
+            throw runtime_error("SegmentStore: cannot allocate " + to_string(size) + " bytes for " + path + ": "
+                                + safe_strerror(rc));
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1)
+        {
+            throw runtime_error("SegmentStore: cannot stat " + path + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+        }
+        size = st.st_size;
+        if (size == 0)
+        {
+            return nullptr;
+        }
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (addr == MAP_FAILED)
+    {
+        throw runtime_error("SegmentStore: cannot mmap " + path + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    return static_cast<char*>(addr);
+}
+
+}  // namespace
+
+// A mapped segment file. The file may be unlinked while the mapping is still in use.
+
+struct SegmentStore::Segment
+{
+    Segment(string const& path, uint32_t id, int64_t capacity);
+    ~Segment();
+
+    Segment(Segment const&) = delete;
+    Segment& operator=(Segment const&) = delete;
+
+    uint64_t used() const
+    {
+        return load64(base + 8);
+    }
+    void set_used(uint64_t used)
+    {
+        store64(base + 8, used);
+    }
+
+    string const path;
+    uint32_t const id;
+    int64_t capacity;
+    char* base;
+};
+
+// Creates a new segment if capacity is non-zero, and opens an existing one otherwise.
+
+SegmentStore::Segment::Segment(string const& path, uint32_t id, int64_t capacity)
+    : path(path)
+    , id(id)
+    , capacity(capacity)
+    , base(map_file(path, this->capacity))
+{
+    if (capacity != 0)
+    {
+        memcpy(base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        set_used(SEGMENT_HEADER_SIZE);
+        return;
+    }
+    if (this->capacity < int64_t(SEGMENT_HEADER_SIZE)
+        || memcmp(base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0
+        || used() < SEGMENT_HEADER_SIZE
+        || used() > uint64_t(this->capacity))
+    {
+        if (base)
+        {
+            munmap(base, this->capacity);
+        }
+        throw_corrupt("bad segment header: " + path);
+    }
+}
+
+SegmentStore::Segment::~Segment()
+{
+    munmap(base, capacity);
+}
+
+SegmentStore::Value::Value(shared_ptr<Segment const> const& segment, char const* data, size_t size)
+    : segment_(segment)
+    , data_(data)
+    , size_(size)
+{
+}
+
+SegmentStore::UPtr SegmentStore::open(string const& cache_path, int64_t max_size_in_bytes, core::CacheDiscardPolicy policy)
+{
+    if (max_size_in_bytes <= 0)
+    {
+        throw invalid_argument("SegmentStore::open(): invalid max_size_in_bytes: " + to_string(max_size_in_bytes));
+    }
+    if (policy != core::CacheDiscardPolicy::lru_only)
+    {
+        throw invalid_argument("SegmentStore::open(): only lru_only is supported");
+    }
+    return UPtr(new SegmentStore(cache_path, max_size_in_bytes));
+}
+
+SegmentStore::UPtr SegmentStore::open(string const& cache_path)
+{
+    return UPtr(new SegmentStore(cache_path, -1));
+}
+
+// If max_size_in_bytes is -1, we use the size that is stored in the index.
+
+SegmentStore::SegmentStore(string const& cache_path, int64_t max_size_in_bytes)
+    : path_(cache_path)
+    , max_size_(max_size_in_bytes)
+    , next_segment_id_(1)
+    , lock_fd_(-1)
+    , index_map_(nullptr)
+    , slots_(nullptr)
+    , index_capacity_(0)
+    , entries_(0)
+    , live_bytes_(0)
+    , disk_bytes_(0)
+    , hits_(0)
+    , misses_(0)
+    , segments_evicted_(0)
+    , entries_evicted_(0)
+    , handler_events_()
+{
+    try
+    {
+        make_directories(path_, 0700);
+        lock();
+        load_segments();
+        bool const index_ok = load_index();
+        if (max_size_in_bytes == -1)
+        {
+            if (!index_ok)
+            {
+                throw runtime_error("SegmentStore: cannot open " + path_ + ": no valid index");
+            }
+        }
+        else
+        {
+            max_size_ = max_size_in_bytes;
+        }
+        if (!index_ok)
+        {
+            rebuild_index();
+        }
+        store64(static_cast<char*>(index_map_) + 16, max_size_);
+        evict();
+    }
+    catch (...)
+    {
+        unmap_index();
+        unlock();
+        throw;
+    }
+}
+
+SegmentStore::~SegmentStore()
+{
+    unmap_index();
+    unlock();
+}
+
+// Two processes (such as the service and thumbnailer-admin) that both append to the
+// same segments would corrupt them, so only one of them can have the store open.
+// The lock goes away with the process, so a crash doesn't leave the store locked.
+
+void SegmentStore::lock()
+{
+    string const path = path_ + "/" + LOCK_NAME;
+    lock_fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd_ == -1)
+    {
+        throw runtime_error("SegmentStore: cannot open " + path + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    if (flock(lock_fd_, LOCK_EX | LOCK_NB) == -1)
+    {
+        int const err = errno;
+        unlock();
+        if (err == EWOULDBLOCK)
+        {
+            throw runtime_error("SegmentStore: cannot open " + path_ + ": store is in use by another process");
+        }
+        throw runtime_error("SegmentStore: cannot lock " + path + ": " + safe_strerror(err));  // LCOV_EXCL_LINE
+    }
+}
+
+void SegmentStore::unlock()
+{
+    if (lock_fd_ != -1)
+    {
+        ::close(lock_fd_);  // Releases the lock.
+        lock_fd_ = -1;
+    }
+}
+
+int64_t SegmentStore::segment_capacity() const
+{
+    return min(max(max_size_ / SEGMENTS_PER_STORE, MIN_SEGMENT_SIZE), MAX_SEGMENT_SIZE);
+}
+
+void SegmentStore::load_segments()
+{
+    namespace fs = boost::filesystem;
+
+    for (fs::directory_iterator it(path_); it != fs::directory_iterator(); ++it)
+    {
+        string const name = it->path().filename().native();
+        if (name.compare(0, SEGMENT_PREFIX.size(), SEGMENT_PREFIX) != 0)
+        {
+            continue;
+        }
+        string const digits = name.substr(SEGMENT_PREFIX.size());
+        if (digits.empty() || digits.size() > 9 || !all_of(digits.begin(), digits.end(), ::isdigit))
+        {
+            continue;
+        }
+        uint32_t const id = stoul(digits);
+        auto segment = make_shared<Segment>(it->path().native(), id, 0);
+        disk_bytes_ += segment->capacity;
+        segments_[id] = move(segment);
+        next_segment_id_ = max(next_segment_id_, id + 1);
+    }
+}
+
+// Maps the index if it is intact and consistent with the segments.
+
+bool SegmentStore::load_index()
+{
+    string const path = path_ + "/" + INDEX_NAME;
+    int64_t size = 0;
+    char* base;
+    try
+    {
+        base = map_file(path, size);
+    }
+    catch (std::exception const&)
+    {
+        return false;  // Doesn't exist yet.
+    }
+    if (!base)
+    {
+        return false;
+    }
+
+    uint64_t capacity = 0;
+    if (size >= int64_t(INDEX_HEADER_SIZE) && memcmp(base, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0)
+    {
+        capacity = load64(base + 8);
+    }
+    if (capacity < MIN_INDEX_CAPACITY
+        || capacity > uint64_t(size)
+        || (capacity & (capacity - 1)) != 0
+        || uint64_t(size) != INDEX_HEADER_SIZE + capacity * sizeof(Slot))
+    {
+        munmap(base, size);
+        return false;
+    }
+    index_map_ = base;
+    slots_ = static_cast<Slot*>(static_cast<void*>(base + INDEX_HEADER_SIZE));
+    index_capacity_ = capacity;
+    if (max_size_ == -1)
+    {
+        max_size_ = load64(base + 16);
+    }
+
+    // If we crashed, the index may point at records that are no longer there.
+    for (uint64_t i = 0; i < index_capacity_; ++i)
+    {
+        if (slots_[i].hash == 0)
+        {
+            continue;
+        }
+        Record r;
+        if (!read_record(slots_[i].segment_id, slots_[i].offset, r)
+            || r.tombstone
+            || hash_key(r.key, r.key_size) != slots_[i].hash)
+        {
+            unmap_index();
+            entries_ = 0;
+            live_bytes_ = 0;
+            return false;
+        }
+        ++entries_;
+        live_bytes_ += r.key_size + r.value_size;
+    }
+    return true;
+}
+
+// Creates a new index from the records in the segments. Where a key appears more
+// than once, the most recent record wins. If that is a tombstone, the key is gone.
+
+void SegmentStore::rebuild_index()
+{
+    uint64_t records = 0;
+    for (auto const& s : segments_)
+    {
+        auto const& seg = *s.second;
+        for (uint64_t offset = SEGMENT_HEADER_SIZE; offset < seg.used();)
+        {
+            Record r;
+            if (!read_record(seg.id, offset, r) || load32(seg.base + offset + 8) != hash_key(r.key, r.key_size) >> 32)
+            {
+                throw_corrupt("bad record at offset " + to_string(offset) + " in " + seg.path);
+            }
+            ++records;
+            offset += record_size(r.key_size, r.value_size);
+        }
+    }
+
+    uint64_t capacity = MIN_INDEX_CAPACITY;
+    while (capacity < 2 * records)
+    {
+        capacity *= 2;
+    }
+    create_index(capacity);
+
+    entries_ = 0;
+    live_bytes_ = 0;
+    for (auto const& s : segments_)
+    {
+        auto const& seg = *s.second;
+        for (uint64_t offset = SEGMENT_HEADER_SIZE; offset < seg.used();)
+        {
+            Record r;
+            read_record(seg.id, offset, r);
+            string const key(r.key, r.key_size);
+            uint64_t const hash = hash_key(r.key, r.key_size);
+            uint32_t const record_offset = offset;
+            offset += record_size(r.key_size, r.value_size);
+            uint64_t slot;
+            bool const found = find(key, hash, slot);
+            if (found)
+            {
+                Record old;
+                read_record(slots_[slot].segment_id, slots_[slot].offset, old);
+                live_bytes_ -= old.key_size + old.value_size;
+            }
+            if (r.tombstone)
+            {
+                if (found)
+                {
+                    erase_slot(slot);
+                    --entries_;
+                }
+                continue;
+            }
+            if (found)
+            {
+                slots_[slot].segment_id = seg.id;
+                slots_[slot].offset = record_offset;
+            }
+            else
+            {
+                insert_slot(Slot{hash, seg.id, record_offset});
+                ++entries_;
+            }
+            live_bytes_ += r.key_size + r.value_size;
+        }
+    }
+    commit_index();
+}
+
+// Replaces the index with an empty one with the given number of slots.
+// The new index lives in a temporary file until commit_index() renames it
+// into place, so a crash while we fill it leaves the old index behind.
+
+void SegmentStore::create_index(uint64_t capacity)
+{
+    int64_t size = INDEX_HEADER_SIZE + capacity * sizeof(Slot);
+    char* base = map_file(path_ + "/" + INDEX_NAME + ".tmp", size);
+    memcpy(base, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    store64(base + 8, capacity);
+    store64(base + 16, max_size_);
+    unmap_index();
+    index_map_ = base;
+    slots_ = static_cast<Slot*>(static_cast<void*>(base + INDEX_HEADER_SIZE));  // ftruncate() zeroed the slots.
+    index_capacity_ = capacity;
+}
+
+void SegmentStore::commit_index()
+{
+    string const path = path_ + "/" + INDEX_NAME;
+    string const tmp_path = path + ".tmp";
+    if (rename(tmp_path.c_str(), path.c_str()) == -1)
+    {
+        throw runtime_error("SegmentStore: cannot rename " + tmp_path + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+}
+
+void SegmentStore::unmap_index()
+{
+    if (index_map_)
+    {
+        munmap(index_map_, INDEX_HEADER_SIZE + index_capacity_ * sizeof(Slot));
+        index_map_ = nullptr;
+        slots_ = nullptr;
+        index_capacity_ = 0;
+    }
+}
+
+shared_ptr<SegmentStore::Segment> SegmentStore::new_segment()
+{
+    uint32_t const id = next_segment_id_++;
+    auto segment = make_shared<Segment>(path_ + "/" + SEGMENT_PREFIX + to_string(id), id, segment_capacity());
+    disk_bytes_ += segment->capacity;
+    segments_[id] = segment;
+    return segment;
+}
+
+// Removes a segment and all the index entries that point into it.
+
+void SegmentStore::drop_segment(uint32_t id)
+{
+    bool const report = handler_ && (uint32_t(handler_events_) & uint32_t(core::CacheEvent::evict_lru)) != 0;
+    vector<string> evicted;
+    vector<Slot> keep;
+    for (uint64_t i = 0; i < index_capacity_; ++i)
+    {
+        Slot const& s = slots_[i];
+        if (s.hash == 0)
+        {
+            continue;
+        }
+        if (s.segment_id == id)
+        {
+            Record r;
+            read_record(s.segment_id, s.offset, r);
+            --entries_;
+            live_bytes_ -= r.key_size + r.value_size;
+            ++entries_evicted_;
+            if (report)
+            {
+                evicted.emplace_back(r.key, r.key_size);
+            }
+        }
+        else
+        {
+            keep.push_back(s);
+        }
+    }
+    memset(slots_, 0, index_capacity_ * sizeof(Slot));
+    for (auto const& s : keep)
+    {
+        insert_slot(s);
+    }
+
+    auto it = segments_.find(id);
+    assert(it != segments_.end());
+    ::unlink(it->second->path.c_str());
+    disk_bytes_ -= it->second->capacity;
+    segments_.erase(it);  // The mapping goes away once the last Value for it is gone.
+
+    for (auto const& key : evicted)
+    {
+        notify(key, core::CacheEvent::evict_lru);
+    }
+}
+
+void SegmentStore::evict()
+{
+    while (disk_bytes_ > max_size_ && segments_.size() > 1)
+    {
+        drop_segment(segments_.begin()->first);
+        ++segments_evicted_;
+    }
+}
+
+bool SegmentStore::read_record(uint32_t segment_id, uint32_t offset, Record& r) const
+{
+    auto it = segments_.find(segment_id);
+    if (it == segments_.end())
+    {
+        return false;
+    }
+    Segment const& seg = *it->second;
+    uint64_t const used = seg.used();
+    if (offset < SEGMENT_HEADER_SIZE || offset % 8 != 0 || offset + RECORD_HEADER_SIZE > used)
+    {
+        return false;
+    }
+    char const* p = seg.base + offset;
+    r.segment = &seg;
+    r.key_size = load32(p);
+    r.value_size = load32(p + 4);
+    r.tombstone = r.value_size == TOMBSTONE;
+    if (r.tombstone)
+    {
+        r.value_size = 0;
+    }
+    if (offset + RECORD_HEADER_SIZE + uint64_t(r.key_size) + r.value_size > used)
+    {
+        return false;
+    }
+    r.key = p + RECORD_HEADER_SIZE;
+    r.value = r.key + r.key_size;
+    return true;
+}
+
+// Returns true and sets slot to the slot for key if key is in the index.
+// Otherwise, returns false.
+
+bool SegmentStore::find(string const& key, uint64_t hash, uint64_t& slot) const
+{
+    uint64_t const mask = index_capacity_ - 1;
+    for (uint64_t i = hash & mask; slots_[i].hash != 0; i = (i + 1) & mask)
+    {
+        if (slots_[i].hash != hash)
+        {
+            continue;
+        }
+        Record r;
+        if (read_record(slots_[i].segment_id, slots_[i].offset, r)
+            && r.key_size == key.size()
+            && memcmp(r.key, key.data(), key.size()) == 0)
+        {
+            slot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SegmentStore::insert_slot(Slot const& s)
+{
+    uint64_t const mask = index_capacity_ - 1;
+    uint64_t i = s.hash & mask;
+    while (slots_[i].hash != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    slots_[i] = s;
+}
+
+// Removes the entry in slot, moving later entries of the same probe sequence back
+// so lookups don't stop at the gap.
+
+void SegmentStore::erase_slot(uint64_t slot)
+{
+    uint64_t const mask = index_capacity_ - 1;
+    uint64_t i = slot;
+    uint64_t j = slot;
+    for (;;)
+    {
+        slots_[i].hash = 0;
+        for (;;)
+        {
+            j = (j + 1) & mask;
+            if (slots_[j].hash == 0)
+            {
+                return;
+            }
+            uint64_t const home = slots_[j].hash & mask;
+            bool const stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays)
+            {
+                break;
+            }
+        }
+        slots_[i] = slots_[j];
+        i = j;
+    }
+}
+
+// Appends a record to the newest segment, starting a new segment if it doesn't fit.
+// Sets the location in s. If value is nullptr, the record is a tombstone for key.
+
+void SegmentStore::append(string const& key, char const* value, size_t value_size, Slot& s)
+{
+    bool const tombstone = value == nullptr;
+    if (tombstone)
+    {
+        value_size = 0;
+    }
+    int64_t const size = record_size(key.size(), value_size);
+    if (segments_.empty()
+        || int64_t(segments_.rbegin()->second->used()) + size > segments_.rbegin()->second->capacity)
+    {
+        new_segment();
+    }
+    Segment& seg = *segments_.rbegin()->second;
+    uint64_t const offset = seg.used();
+    char* p = seg.base + offset;
+    store32(p, key.size());
+    store32(p + 4, tombstone ? TOMBSTONE : value_size);
+    store32(p + 8, hash_key(key.data(), key.size()) >> 32);
+    memcpy(p + RECORD_HEADER_SIZE, key.data(), key.size());
+    if (!tombstone)
+    {
+        memcpy(p + RECORD_HEADER_SIZE + key.size(), value, value_size);
+    }
+    seg.set_used(offset + size);  // Only now does the record count.
+    s.segment_id = seg.id;
+    s.offset = offset;
+}
+
+core::Optional<SegmentStore::Value> SegmentStore::get_view(string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    uint64_t slot;
+    if (!find(key, hash_key(key.data(), key.size()), slot))
+    {
+        ++misses_;
+        notify(key, core::CacheEvent::miss);
+        return core::Optional<Value>();
+    }
+    ++hits_;
+    Record r;
+    read_record(slots_[slot].segment_id, slots_[slot].offset, r);
+    Value v(segments_[slots_[slot].segment_id], r.value, r.value_size);
+    notify(key, core::CacheEvent::get);
+    return v;
+}
+
+core::Optional<string> SegmentStore::get(string const& key)
+{
+    auto v = get_view(key);
+    if (!v)
+    {
+        return core::Optional<string>();
+    }
+    return v->to_string();
+}
+
+core::Optional<string> SegmentStore::take(string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    uint64_t slot;
+    if (!find(key, hash_key(key.data(), key.size()), slot))
+    {
+        ++misses_;
+        notify(key, core::CacheEvent::miss);
+        return core::Optional<string>();
+    }
+    ++hits_;
+    Record r;
+    read_record(slots_[slot].segment_id, slots_[slot].offset, r);
+    string value(r.value, r.value_size);
+    erase_slot(slot);
+    --entries_;
+    live_bytes_ -= r.key_size + r.value_size;
+
+    // Without the tombstone, the record would come back if the index is ever rebuilt.
+    Slot s{0, 0, 0};
+    try
+    {
+        append(key, nullptr, 0, s);
+        evict();
+    }
+    catch (runtime_error const& e)
+    {
+        qWarning() << e.what();  // We still return the value, and the record stays dead until the next rebuild.
+    }
+    notify(key, core::CacheEvent::get);
+    return value;
+}
+
+bool SegmentStore::put(string const& key,
+                       string const& value,
+                       chrono::time_point<chrono::system_clock> expiry_time)
+{
+    if (expiry_time != chrono::system_clock::time_point())
+    {
+        throw logic_error("SegmentStore::put(): expiry times are not supported");
+    }
+    if (key.empty())
+    {
+        throw invalid_argument("SegmentStore::put(): key must not be empty");
+    }
+
+    lock_guard<mutex> lock(mutex_);
+
+    if (record_size(key.size(), value.size()) > segment_capacity() - int64_t(SEGMENT_HEADER_SIZE))
+    {
+        return false;
+    }
+
+    // Keep the load factor below 0.5, so probe sequences stay short.
+    if (uint64_t(entries_ + 1) * 2 > index_capacity_)
+    {
+        vector<Slot> slots(slots_, slots_ + index_capacity_);
+        create_index(index_capacity_ * 2);
+        for (auto const& s : slots)
+        {
+            if (s.hash != 0)
+            {
+                insert_slot(s);
+            }
+        }
+        commit_index();
+    }
+
+    uint64_t const hash = hash_key(key.data(), key.size());
+    Slot s{hash, 0, 0};
+    try
+    {
+        append(key, value.data(), value.size(), s);
+    }
+    catch (runtime_error const& e)
+    {
+        // We could not create a new segment, most likely because the disk is full.
+        qWarning() << e.what();
+        return false;
+    }
+
+    // Starting a new segment in append() may have pushed the oldest one out.
+    evict();
+
+    uint64_t slot;
+    if (find(key, hash, slot))
+    {
+        Record old;
+        read_record(slots_[slot].segment_id, slots_[slot].offset, old);
+        live_bytes_ -= old.key_size + old.value_size;
+        erase_slot(slot);
+        --entries_;
+    }
+    insert_slot(s);
+    ++entries_;
+    live_bytes_ += key.size() + value.size();
+    notify(key, core::CacheEvent::put);
+    return true;
+}
+
+bool SegmentStore::contains_key(string const& key) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    uint64_t slot;
+    return find(key, hash_key(key.data(), key.size()), slot);
+}
+
+SegmentStore::Stats SegmentStore::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_locked();
+}
+
+SegmentStore::Stats SegmentStore::stats_locked() const
+{
+    return Stats{path_,
+                 entries_,
+                 live_bytes_,
+                 max_size_,
+                 disk_bytes_,
+                 int64_t(segments_.size()),
+                 hits_,
+                 misses_,
+                 segments_evicted_,
+                 entries_evicted_};
+}
+
+void SegmentStore::clear_stats()
+{
+    lock_guard<mutex> lock(mutex_);
+    hits_ = 0;
+    misses_ = 0;
+    segments_evicted_ = 0;
+    entries_evicted_ = 0;
+}
+
+void SegmentStore::invalidate()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    for (auto const& s : segments_)
+    {
+        ::unlink(s.second->path.c_str());
+    }
+    segments_.clear();
+    memset(slots_, 0, index_capacity_ * sizeof(Slot));
+    entries_ = 0;
+    live_bytes_ = 0;
+    disk_bytes_ = 0;
+    notify("", core::CacheEvent::invalidate);
+}
+
+void SegmentStore::compact()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    // Copy the live entries in the order they were written, so the oldest entries are still evicted first.
+    vector<Slot> live;
+    for (uint64_t i = 0; i < index_capacity_; ++i)
+    {
+        if (slots_[i].hash != 0)
+        {
+            live.push_back(slots_[i]);
+        }
+    }
+    sort(live.begin(), live.end(), [](Slot const& a, Slot const& b)
+    {
+        return a.segment_id < b.segment_id || (a.segment_id == b.segment_id && a.offset < b.offset);
+    });
+
+    // Hang on to the old segments and the index until everything is copied. If we cannot
+    // create a new segment (because the disk is full), we go back to where we were.
+    vector<Slot> const old_slots(slots_, slots_ + index_capacity_);
+    int64_t const old_disk_bytes = disk_bytes_;
+    int64_t const old_entries = entries_;
+    int64_t const old_live_bytes = live_bytes_;
+    auto old_segments = move(segments_);
+    segments_.clear();
+    disk_bytes_ = 0;
+    entries_ = 0;
+    live_bytes_ = 0;
+    memset(slots_, 0, index_capacity_ * sizeof(Slot));
+    try
+    {
+        for (auto const& old : live)
+        {
+            Segment const& seg = *old_segments[old.segment_id];
+            char const* p = seg.base + old.offset;
+            uint32_t const key_size = load32(p);
+            uint32_t const value_size = load32(p + 4);
+            if (record_size(key_size, value_size) > segment_capacity() - int64_t(SEGMENT_HEADER_SIZE))
+            {
+                continue;  // The store was made smaller since this entry was added.
+            }
+            string const key(p + RECORD_HEADER_SIZE, key_size);
+            Slot s{old.hash, 0, 0};
+            append(key, p + RECORD_HEADER_SIZE + key_size, value_size, s);
+            insert_slot(s);
+            ++entries_;
+            live_bytes_ += key_size + value_size;
+        }
+    }
+    catch (std::exception const&)
+    {
+        for (auto const& s : segments_)
+        {
+            ::unlink(s.second->path.c_str());
+        }
+        segments_ = move(old_segments);
+        copy(old_slots.begin(), old_slots.end(), slots_);
+        disk_bytes_ = old_disk_bytes;
+        entries_ = old_entries;
+        live_bytes_ = old_live_bytes;
+        throw;
+    }
+    for (auto const& s : old_segments)
+    {
+        ::unlink(s.second->path.c_str());
+    }
+}
+
+void SegmentStore::resize(int64_t size_in_bytes)
+{
+    if (size_in_bytes <= 0)
+    {
+        throw invalid_argument("SegmentStore::resize(): invalid size_in_bytes: " + to_string(size_in_bytes));
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    max_size_ = size_in_bytes;
+    store64(static_cast<char*>(index_map_) + 16, max_size_);
+    evict();
+}
+
+vector<pair<string, string>> SegmentStore::scan(uint64_t& cursor, int max_entries) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    vector<pair<string, string>> entries;
+    uint64_t i = cursor;
+    for (; i < index_capacity_ && int(entries.size()) < max_entries; ++i)
+    {
+        Record r;
+        if (slots_[i].hash != 0 && read_record(slots_[i].segment_id, slots_[i].offset, r))
+        {
+            entries.emplace_back(string(r.key, r.key_size), string(r.value, r.value_size));
+        }
+    }
+    cursor = i < index_capacity_ ? i : 0;
+    return entries;
+}
+
+void SegmentStore::set_handler(core::CacheEvent events, EventCallback cb)
+{
+    lock_guard<mutex> lock(mutex_);
+    handler_events_ = events;
+    handler_ = cb;
+}
+
+void SegmentStore::notify(string const& key, core::CacheEvent ev)
+{
+    if (handler_ && (uint32_t(handler_events_) & uint32_t(ev)) != 0)
+    {
+        handler_(key, ev, stats_locked());
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
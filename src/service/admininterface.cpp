@@ -39,6 +39,8 @@ namespace
 
 char const ADMIN_ERROR[] = "com.canonical.ThumbnailerAdmin.Error.Failed";
 
+int const MISS_RATIO_CURVE_POINTS = 20;
+
 // Conversion to QDateTime is somewhat awkward because system_clock
 // is not guaranteed to use the same epoch as QDateTime.
 // (The C++ standard leaves the epoch time point undefined.)
@@ -58,7 +60,7 @@ QList<quint32> to_list(core::PersistentCacheStats::Histogram const& histogram)
     return l;
 }
 
-CacheStats to_cache_stats(core::PersistentCacheStats const& st)
+CacheStats to_cache_stats(DiskCache::Stats const& st)
 {
     return
     {
@@ -85,6 +87,11 @@ CacheStats to_cache_stats(core::PersistentCacheStats const& st)
     };
 }
 
+WriteQueueStats to_write_queue_stats(WriteBehindQueue::Stats const& st)
+{
+    return { st.queued, st.queued_bytes, st.written, st.batches, st.coalesced, st.stalls, st.failures };
+}
+
 class ActivityNotifier
 {
 public:
@@ -114,6 +121,17 @@ unity::thumbnailer::service::AllStats AdminInterface::Stats()
     all.full_size_stats = to_cache_stats(st.full_size_stats);
     all.thumbnail_stats = to_cache_stats(st.thumbnail_stats);
     all.failure_stats = to_cache_stats(st.failure_stats);
+    all.alias_stats = to_cache_stats(st.alias_stats);
+    all.dedup_stats = { st.dedup_stats.duplicate_files, st.dedup_stats.duplicate_hits, st.dedup_stats.bytes_saved };
+    all.failure_filter_stats = { st.failure_filter_stats.size_in_bytes, st.failure_filter_stats.entries,
+                                 st.failure_filter_stats.false_positive_rate, st.failure_filter_stats.lookups_skipped };
+    all.gc_stats = { st.gc_stats.files_checked, st.gc_stats.stale_files, st.gc_stats.entries_removed,
+                     st.gc_stats.bytes_reclaimed, st.gc_stats.compactions };
+    all.repair_stats = { st.repair_stats.repairs, st.repair_stats.entries_salvaged,
+                         st.repair_stats.entries_lost, st.repair_stats.entries_restored };
+    all.full_size_write_queue_stats = to_write_queue_stats(st.full_size_write_queue_stats);
+    all.thumbnail_write_queue_stats = to_write_queue_stats(st.thumbnail_write_queue_stats);
+    all.cancel_stats = server_.cancel_stats();
     return all;
 }
 
@@ -128,6 +146,10 @@ void AdminInterface::ClearStats(int cache_id)
     }
     auto selector = static_cast<Thumbnailer::CacheSelector>(cache_id);
     thumbnailer_->clear_stats(selector);
+    if (selector == Thumbnailer::CacheSelector::all)
+    {
+        server_.clear_cancel_stats();
+    }
 }
 
 void AdminInterface::Clear(int cache_id)
@@ -156,6 +178,25 @@ void AdminInterface::Compact(int cache_id)
     thumbnailer_->compact(selector);
 }
 
+MissRatioPoints AdminInterface::MissRatioCurve(int cache_id)
+{
+    ActivityNotifier notifier(*inactivity_handler_);
+
+    auto selector = static_cast<Thumbnailer::CacheSelector>(cache_id);
+    if (selector != Thumbnailer::CacheSelector::full_size_cache &&
+        selector != Thumbnailer::CacheSelector::thumbnail_cache)
+    {
+        sendErrorReply(ADMIN_ERROR, QStringLiteral("MissRatioCurve(): invalid cache selector: ") + QString::number(cache_id));
+        return MissRatioPoints();
+    }
+    MissRatioPoints points;
+    for (auto const& p : thumbnailer_->miss_ratio_curve(selector, MISS_RATIO_CURVE_POINTS))
+    {
+        points.append(MissRatioPoint{p.size_in_bytes, p.miss_ratio});
+    }
+    return points;
+}
+
 void AdminInterface::Shutdown()
 {
     QCoreApplication::instance()->quit();
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <internal/thumbnailer.h>
+#include "dbusinterface.h"
 #include "inactivityhandler.h"
 #include "stats.h"
 
@@ -39,10 +40,12 @@ class AdminInterface : public QObject, protected QDBusContext
 public:
     AdminInterface(std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const& thumbnailer,
                    std::shared_ptr<InactivityHandler> const& inactivity_handler,
+                   DBusInterface& server,
                    QObject* parent = nullptr)
         : QObject(parent)
         , thumbnailer_(thumbnailer)
         , inactivity_handler_(inactivity_handler)
+        , server_(server)
     {
     }
     ~AdminInterface() = default;  // LCOV_EXCL_LINE  // False negative from gcovr.
@@ -55,11 +58,13 @@ public Q_SLOTS:
     void ClearStats(int cache_id);
     void Clear(int cache_id);
     void Compact(int cache_id);
+    MissRatioPoints MissRatioCurve(int cache_id);
     void Shutdown();
 
 private:
     std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const& thumbnailer_;
     std::shared_ptr<InactivityHandler> inactivity_handler_;
+    DBusInterface& server_;  // For the stats that the service keeps.
 };
 
 }  // namespace service
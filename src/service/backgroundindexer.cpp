@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backgroundindexer.h"
+
+#include <internal/safe_strerror.h>
+
+#include <QDebug>
+#include <QDirIterator>
+#include <QFile>
+#include <QMimeDatabase>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <sys/inotify.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+namespace
+{
+
+// How long there must be no interactive requests before background work resumes.
+int const RESUME_DELAY_MS = 2000;
+
+uint32_t const WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR;
+
+bool is_media_file(QString const& path)
+{
+    static QMimeDatabase const db;
+    QString const type = db.mimeTypeForFile(path, QMimeDatabase::MatchExtension).name();
+    return type.startsWith(QLatin1String("image/"))
+           || type.startsWith(QLatin1String("video/"))
+           || type.startsWith(QLatin1String("audio/"));
+}
+
+}  // namespace
+
+BackgroundIndexer::BackgroundIndexer(shared_ptr<Thumbnailer> const& thumbnailer,
+                                     shared_ptr<RateLimiter> const& limiter,
+                                     InactivityHandler& inactivity_handler,
+                                     QStringList const& directories,
+                                     vector<int> const& sizes)
+    : thumbnailer_(thumbnailer)
+    , limiter_(limiter)
+    , directories_(directories)
+    , inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC), do_close)
+    , paused_(false)
+    , num_indexed_(0)
+    , state_(State::idle)
+    , current_index_(0)
+{
+    if (inotify_fd_.get() == -1)
+    {
+        throw runtime_error("BackgroundIndexer(): cannot initialize inotify: " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+
+    for (auto size : sizes)
+    {
+        QSize s(size, size);
+        if (find(sizes_.begin(), sizes_.end(), s) == sizes_.end())
+        {
+            sizes_.push_back(s);
+        }
+    }
+
+    // A single thread is plenty; background work is meant to trickle along.
+    pool_.setMaxThreadCount(1);
+
+    resume_timer_.setSingleShot(true);
+    resume_timer_.setInterval(RESUME_DELAY_MS);
+    connect(&resume_timer_, &QTimer::timeout, this, &BackgroundIndexer::resume);
+    connect(&inactivity_handler, &InactivityHandler::busy, this, &BackgroundIndexer::pause);
+    connect(&inactivity_handler, &InactivityHandler::idle, &resume_timer_, static_cast<void(QTimer::*)()>(&QTimer::start));
+    connect(&check_watcher_, &QFutureWatcher<int>::finished, this, &BackgroundIndexer::checkFinished);
+
+    notifier_.reset(new QSocketNotifier(inotify_fd_.get(), QSocketNotifier::Read));
+    connect(notifier_.get(), &QSocketNotifier::activated, this, &BackgroundIndexer::inotifyReadable);
+
+    // Walking the directory trees can take a while, so we don't do it
+    // until the event loop is running and the service has its bus name.
+    QTimer::singleShot(0, this, &BackgroundIndexer::start);
+}
+
+BackgroundIndexer::~BackgroundIndexer()
+{
+    if (state_ == State::download_queued)
+    {
+        cancel_func_();
+    }
+    check_watcher_.waitForFinished();
+    pool_.waitForDone();
+}
+
+int BackgroundIndexer::num_watches() const
+{
+    return int(watches_.size());
+}
+
+int BackgroundIndexer::num_queued() const
+{
+    return int(queue_.size());
+}
+
+int BackgroundIndexer::num_indexed() const
+{
+    return num_indexed_;
+}
+
+void BackgroundIndexer::start()
+{
+    for (auto const& dir : directories_)
+    {
+        add_watches(dir, false);
+    }
+    qDebug() << "BackgroundIndexer: watching" << num_watches() << "directories";
+}
+
+// Adds a watch for dir and all directories below it. If queue_files is true,
+// the files that are already in the tree are queued as well. That is necessary
+// for directories that are moved into a watched tree, or that were created and
+// populated before we managed to add the watch.
+
+void BackgroundIndexer::add_watches(QString const& dir, bool queue_files)
+{
+    auto add_watch = [this](QString const& path)
+    {
+        int wd = inotify_add_watch(inotify_fd_.get(), QFile::encodeName(path).constData(), WATCH_MASK);
+        if (wd == -1)
+        {
+            // ENOSPC means that we ran into max_user_watches.
+            qWarning() << "BackgroundIndexer: cannot watch" << path << ":" << safe_strerror(errno).c_str();
+            return false;
+        }
+        watches_[wd] = path;
+        return true;
+    };
+
+    if (!add_watch(dir))
+    {
+        return;
+    }
+
+    auto filters = QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks;
+    if (queue_files)
+    {
+        filters |= QDir::Files;
+    }
+    QDirIterator it(dir, filters, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        QString path = it.next();
+        if (it.fileInfo().isDir())
+        {
+            if (!add_watch(path))
+            {
+                return;
+            }
+        }
+        else
+        {
+            enqueue(path);
+        }
+    }
+}
+
+void BackgroundIndexer::inotifyReadable()
+{
+    char buf[64 * 1024];
+    for (;;)
+    {
+        ssize_t len = read(inotify_fd_.get(), buf, sizeof(buf));
+        if (len == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;  // LCOV_EXCL_LINE
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                qWarning() << "BackgroundIndexer: cannot read inotify events:" << safe_strerror(errno).c_str();  // LCOV_EXCL_LINE
+            }
+            break;
+        }
+
+        char const* p = buf;
+        while (p < buf + len)
+        {
+            // Copy the header because the buffer is not necessarily aligned for inotify_event.
+            inotify_event event;
+            memcpy(&event, p, sizeof(event));
+            char const* name = p + sizeof(event);
+            p += sizeof(event) + event.len;
+
+            if (event.mask & IN_Q_OVERFLOW)
+            {
+                qWarning() << "BackgroundIndexer: inotify queue overflow, some changes were missed";
+                continue;
+            }
+            if (event.mask & IN_IGNORED)
+            {
+                watches_.erase(event.wd);  // Directory was removed.
+                continue;
+            }
+            auto it = watches_.find(event.wd);
+            if (it == watches_.end() || event.len == 0 || name[0] == '.')
+            {
+                continue;  // Hidden files are usually temporary files of some application.
+            }
+
+            QString path = it->second + QLatin1Char('/') + QFile::decodeName(name);
+            if (event.mask & IN_ISDIR)
+            {
+                add_watches(path, true);
+            }
+            else if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                enqueue(path);
+            }
+        }
+    }
+    next();
+}
+
+void BackgroundIndexer::enqueue(QString const& path)
+{
+    if (!is_media_file(path))
+    {
+        return;
+    }
+    if (queued_.insert(path).second)
+    {
+        queue_.push_back(path);
+    }
+}
+
+void BackgroundIndexer::pause()
+{
+    paused_ = true;
+    resume_timer_.stop();
+
+    // Step out of the way of the interactive request if our extraction hasn't started yet.
+    if (state_ == State::download_queued && cancel_func_())
+    {
+        state_ = State::needs_download;
+    }
+}
+
+void BackgroundIndexer::resume()
+{
+    paused_ = false;
+    if (state_ == State::needs_download)
+    {
+        schedule_download();
+    }
+    else
+    {
+        next();
+    }
+}
+
+void BackgroundIndexer::next()
+{
+    if (paused_ || state_ != State::idle)
+    {
+        return;
+    }
+
+    while (!queue_.empty())
+    {
+        current_ = queue_.front();
+        queue_.pop_front();
+        queued_.erase(current_);
+
+        requests_.clear();
+        try
+        {
+            for (auto const& size : sizes_)
+            {
+                requests_.emplace_back(thumbnailer_->get_thumbnail(current_.toStdString(), size));
+                connect(requests_.back().get(), &ThumbnailRequest::downloadFinished,
+                        this, &BackgroundIndexer::downloadFinished);
+            }
+        }
+        catch (std::exception const& e)
+        {
+            qDebug() << "BackgroundIndexer:" << current_ << ":" << e.what();
+            requests_.clear();
+            continue;
+        }
+        if (requests_.empty())
+        {
+            continue;
+        }
+
+        // Let the first request produce the other sizes from the image it decodes.
+        for (size_t i = 1; i < requests_.size(); ++i)
+        {
+            requests_[0]->coalesce(*requests_[i]);
+        }
+        check(0, false);
+        return;
+    }
+}
+
+// Runs the requests for the current file, starting at first, in the thread pool.
+// The result is the index of the first request that needs an extraction,
+// or the number of requests if all of them are done. If downloaded is true,
+// the request at first has just been through its extraction.
+
+void BackgroundIndexer::check(size_t first, bool downloaded)
+{
+    state_ = State::checking;
+
+    vector<ThumbnailRequest*> requests;
+    for (auto const& r : requests_)
+    {
+        requests.push_back(r.get());
+    }
+    QString path = current_;
+    auto do_check = [requests, first, downloaded, path]() -> int
+    {
+        QThread::currentThread()->setPriority(QThread::IdlePriority);
+        for (size_t i = first; i < requests.size(); ++i)
+        {
+            try
+            {
+                if (requests[i]->thumbnail().isEmpty()
+                    && requests[i]->status() == ThumbnailRequest::FetchStatus::needs_download
+                    && !(downloaded && i == first))
+                {
+                    return int(i);
+                }
+            }
+            catch (std::exception const& e)
+            {
+                qDebug() << "BackgroundIndexer:" << path << ":" << e.what();
+            }
+        }
+        return int(requests.size());
+    };
+    check_watcher_.setFuture(QtConcurrent::run(&pool_, do_check));
+}
+
+void BackgroundIndexer::checkFinished()
+{
+    assert(state_ == State::checking);
+
+    size_t index = check_watcher_.result();
+    if (index == requests_.size())
+    {
+        requests_.clear();
+        state_ = State::idle;
+        ++num_indexed_;
+        next();
+        return;
+    }
+
+    current_index_ = index;
+    state_ = State::needs_download;
+    if (!paused_)
+    {
+        schedule_download();
+    }
+}
+
+void BackgroundIndexer::schedule_download()
+{
+    assert(state_ == State::needs_download);
+
+    state_ = State::download_queued;
+    cancel_func_ = limiter_->schedule([this]
+    {
+        state_ = State::downloading;
+        try
+        {
+            requests_[current_index_]->download();
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qDebug() << "BackgroundIndexer:" << current_ << ": download error:" << e.what();
+            QMetaObject::invokeMethod(this, "downloadFinished", Qt::QueuedConnection);
+        }
+        // LCOV_EXCL_STOP
+    }, RateLimiter::Priority::background);
+}
+
+void BackgroundIndexer::downloadFinished()
+{
+    assert(state_ == State::downloading);
+
+    limiter_->done();
+    check(current_index_, true);
+}
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "inactivityhandler.h"
+
+#include <internal/raii.h>
+#include <internal/thumbnailer.h>
+#include <ratelimiter.h>
+
+#include <QFutureWatcher>
+#include <QSize>
+#include <QSocketNotifier>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+// BackgroundIndexer watches a set of directories with inotify and generates
+// thumbnails for new or changed media files before anyone asks for them.
+//
+// Files are processed one at a time, on a private thread pool that runs at
+// idle priority. Extractions go through the same rate limiter as interactive
+// requests, with background priority. As soon as the inactivity handler
+// reports an interactive request, the indexer stops starting new work and
+// withdraws any extraction that is still waiting in the limiter. It resumes
+// once no interactive request has been active for a short while. The indexer never calls request_started(),
+// so background work does not count as activity.
+
+class BackgroundIndexer : public QObject
+{
+    Q_OBJECT
+public:
+    BackgroundIndexer(std::shared_ptr<internal::Thumbnailer> const& thumbnailer,
+                      std::shared_ptr<RateLimiter> const& limiter,
+                      InactivityHandler& inactivity_handler,
+                      QStringList const& directories,
+                      std::vector<int> const& sizes);
+    ~BackgroundIndexer();
+
+    BackgroundIndexer(BackgroundIndexer const&) = delete;
+    BackgroundIndexer& operator=(BackgroundIndexer&) = delete;
+
+    int num_watches() const;
+    int num_queued() const;
+    int num_indexed() const;
+
+private Q_SLOTS:
+    void start();
+    void inotifyReadable();
+    void pause();
+    void resume();
+    void checkFinished();
+    void downloadFinished();
+
+private:
+    enum class State { idle, checking, needs_download, download_queued, downloading };
+
+    void add_watches(QString const& dir, bool queue_files);
+    void enqueue(QString const& path);
+    void next();
+    void check(size_t first, bool downloaded);
+    void schedule_download();
+
+    std::shared_ptr<internal::Thumbnailer> const thumbnailer_;
+    std::shared_ptr<RateLimiter> const limiter_;
+    QStringList const directories_;
+    std::vector<QSize> sizes_;
+    internal::FdPtr inotify_fd_;
+    std::unique_ptr<QSocketNotifier> notifier_;
+    std::map<int, QString> watches_;                // Watch descriptor -> directory
+    std::deque<QString> queue_;
+    std::set<QString> queued_;
+    QThreadPool pool_;
+    QTimer resume_timer_;
+    bool paused_;
+    int num_indexed_;
+
+    // Requests for the file that is currently being indexed, one per size.
+    State state_;
+    QString current_;
+    std::vector<std::unique_ptr<internal::ThumbnailRequest>> requests_;
+    size_t current_index_;
+    QFutureWatcher<int> check_watcher_;
+    RateLimiter::CancelFunc cancel_func_;
+};
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
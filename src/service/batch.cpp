@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <service/batch.h>
+
+using namespace unity::thumbnailer::service;
+
+QDBusArgument& operator<<(QDBusArgument& arg, BatchItem const& s)
+{
+    arg.beginStructure();
+    arg << s.filename
+        << s.requested_size;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, BatchItem& s)
+{
+    arg.beginStructure();
+    arg >> s.filename
+        >> s.requested_size;
+    arg.endStructure();
+    return arg;
+}
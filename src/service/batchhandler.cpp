@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batchhandler.h"
+
+#include <internal/safe_strerror.h>
+
+#include <QFutureWatcher>
+#include <QPointer>
+#include <QtConcurrent>
+#include <QTextStream>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+struct BatchItemState
+{
+    QString filename;
+    QSize requested_size;
+    QString details;
+    unique_ptr<ThumbnailRequest> request;  // Set by the prepare job in the check pool.
+    QFutureWatcher<QString> prepare_watcher;
+    string key;                            // Set once the request exists.
+    vector<int> duplicates;                // Later items with the same key and size. They get our result.
+    QPointer<Handler> handler;             // Set once the item is handed to a Handler.
+    bool active = false;                   // Counts towards num_active_.
+    bool done = false;
+};
+
+BatchHandler::BatchHandler(QDBusConnection const& bus,
+                           QDBusMessage const& message,
+                           shared_ptr<Thumbnailer> const& thumbnailer,
+                           BatchItems const& items,
+                           shared_ptr<QThreadPool> const& check_pool,
+                           shared_ptr<QThreadPool> const& create_pool,
+                           shared_ptr<RateLimiter> const& limiter,
+                           CredentialsCache& creds,
+                           InactivityHandler& inactivity_handler,
+                           QueueFunc const& queue_func,
+                           CancelFunc const& cancel_func)
+    : bus_(bus)
+    , message_(message)
+    , thumbnailer_(thumbnailer)
+    , check_pool_(check_pool)
+    , create_pool_(create_pool)
+    , limiter_(limiter)
+    , creds_(creds)
+    , inactivity_handler_(inactivity_handler)
+    , queue_func_(queue_func)
+    , cancel_func_(cancel_func)
+    , next_item_(0)
+    , num_active_(0)
+    , starting_work_(false)
+    , num_done_(0)
+    , num_sent_(0)
+    , read_fd_(::close)
+    , write_fd_(::close)
+    , out_offset_(0)
+    , waiting_for_credentials_(false)
+    , cancelled_(false)
+    , finished_(false)
+    , start_time_(chrono::system_clock::now())
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        throw runtime_error(string("BatchHandler(): cannot create socket pair: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    read_fd_.reset(fds[0]);
+    write_fd_.reset(fds[1]);
+
+    // Thumbnails are large compared to the socket buffer, so we write
+    // without blocking and drop back to the event loop until the client catches up.
+    if (fcntl(write_fd_.get(), F_SETFL, O_NONBLOCK) == -1)
+    {
+        throw runtime_error(string("BatchHandler(): cannot set O_NONBLOCK: ") + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    write_notifier_.reset(new QSocketNotifier(write_fd_.get(), QSocketNotifier::Write));
+    write_notifier_->setEnabled(false);
+    connect(write_notifier_.get(), &QSocketNotifier::activated, this, &BatchHandler::socketWritable);
+
+    inactivity_handler_.request_started();
+
+    // We don't call get_thumbnail() here. It looks at the file, and for a large
+    // batch, that would hold up the event loop and with it all other clients.
+    for (int i = 0; i < items.size(); ++i)
+    {
+        auto const& item = items[i];
+        items_.emplace_back(new BatchItemState);
+        auto& state = *items_.back();
+        state.filename = item.filename;
+        state.requested_size = item.requested_size;
+        QTextStream s(&state.details);
+        s << "thumbnail: " << item.filename
+          << " (" << item.requested_size.width() << "," << item.requested_size.height() << ")";
+        connect(&state.prepare_watcher, &QFutureWatcher<QString>::finished, this, [this, i]{ prepareFinished(i); });
+    }
+}
+
+BatchHandler::~BatchHandler()
+{
+    cancelled_ = true;
+    // Ensure that jobs occurring in the thread pool complete.
+    for (auto& item : items_)
+    {
+        item->prepare_watcher.waitForFinished();
+    }
+    inactivity_handler_.request_completed();
+}
+
+QDBusUnixFileDescriptor BatchHandler::result_fd()
+{
+    assert(read_fd_.has_resource());
+    QDBusUnixFileDescriptor fd(read_fd_.get());  // Dups the descriptor.
+    read_fd_.dealloc();
+    return fd;
+}
+
+QString BatchHandler::client() const
+{
+    return message_.service();
+}
+
+int BatchHandler::size() const
+{
+    return int(items_.size());
+}
+
+int BatchHandler::num_sent() const
+{
+    return num_sent_;
+}
+
+bool BatchHandler::cancelled() const
+{
+    return cancelled_;
+}
+
+chrono::microseconds BatchHandler::completion_time() const
+{
+    assert(finish_time_ != chrono::system_clock::time_point());
+    return chrono::duration_cast<chrono::microseconds>(finish_time_ - start_time_);
+}
+
+void BatchHandler::begin()
+{
+    waiting_for_credentials_ = true;
+    creds_.get(message_.service(),
+               [this](CredentialsCache::Credentials const& credentials)
+               {
+                   gotCredentials(credentials);
+               });
+}
+
+void BatchHandler::gotCredentials(CredentialsCache::Credentials const& credentials)
+{
+    waiting_for_credentials_ = false;
+    credentials_ = credentials;
+    start_work();
+    maybe_finish();
+}
+
+// Starts the work for more items, as long as the client keeps up with reading the results.
+// We keep a few items per thread of the check pool in progress, so a slow client
+// holds up the work instead of letting the results pile up in out_buffer_.
+
+void BatchHandler::start_work()
+{
+    if (starting_work_)
+    {
+        return;  // Called from itemFinished() while we are in the loop below.
+    }
+    starting_work_ = true;
+    int const max_active = 2 * max(check_pool_->maxThreadCount(), 1);
+    while (next_item_ < items_.size()
+           && !cancelled_
+           && num_active_ < max_active
+           && out_buffer_.size() - out_offset_ < MAX_BUFFERED_BYTES)
+    {
+        int const index = int(next_item_++);
+        auto& item = *items_[index];
+        if (!credentials_.valid)
+        {
+            // LCOV_EXCL_START
+            itemFinished(index, QByteArray(), "BatchHandler::start_work(): " + item.details +
+                                              ": could not retrieve peer credentials");
+            continue;
+            // LCOV_EXCL_STOP
+        }
+
+        shared_ptr<Thumbnailer> thumbnailer = thumbnailer_;
+        BatchItemState* state = &item;
+        auto prepare = [this, thumbnailer, state]() -> QString
+        {
+            if (cancelled_)
+            {
+                return QString();  // LCOV_EXCL_LINE
+            }
+            try
+            {
+                state->request = thumbnailer->get_thumbnail(state->filename.toStdString(), state->requested_size);
+                return QString();
+            }
+            catch (std::exception const& e)
+            {
+                return QString::fromUtf8(e.what());
+            }
+        };
+        item.active = true;
+        ++num_active_;
+        item.prepare_watcher.setFuture(QtConcurrent::run(check_pool_.get(), prepare));
+    }
+    starting_work_ = false;
+}
+
+// Called once the request for an item exists. Items with the same key and size as an
+// item in progress wait for its result. Everything else goes to a normal handler, so
+// DBusInterface chains it with other requests for the same file, whether they are
+// from this batch or not, and the file is decoded only once.
+
+void BatchHandler::prepareFinished(int index)
+{
+    if (cancelled_)
+    {
+        return;
+    }
+
+    auto& item = *items_[index];
+    QString const error = item.prepare_watcher.result();
+    if (!error.isNull())
+    {
+        itemFinished(index, QByteArray(), "BatchHandler::prepareFinished(): " + item.details + ": " + error);
+        return;
+    }
+    assert(item.request);
+
+    item.key = item.request->key();
+    auto it = in_progress_.find(make_pair(item.key, make_pair(item.requested_size.width(), item.requested_size.height())));
+    if (it != in_progress_.end())
+    {
+        items_[it->second]->duplicates.push_back(index);
+        item.request.reset();
+        item.active = false;
+        --num_active_;
+        start_work();
+        return;
+    }
+    in_progress_.emplace(make_pair(item.key, make_pair(item.requested_size.width(), item.requested_size.height())),
+                         index);
+    queue_handler(index);
+}
+
+void BatchHandler::queue_handler(int index)
+{
+    auto& item = *items_[index];
+    auto handler = new Handler(bus_, message_,
+                               check_pool_, create_pool_,
+                               limiter_, creds_, inactivity_handler_,
+                               move(item.request), item.details);
+    QPointer<BatchHandler> self(this);
+    handler->set_batch_reply([self, index](QByteArray const& thumbnail, QString const& error)
+                             {
+                                 if (self)
+                                 {
+                                     self->itemFinished(index, thumbnail, error);
+                                 }
+                             },
+                             credentials_);
+    item.handler = handler;
+    queue_func_(handler);
+}
+
+void BatchHandler::itemFinished(int index, QByteArray const& thumbnail, QString const& error)
+{
+    auto& item = *items_[index];
+    assert(!item.done);
+    item.done = true;
+    ++num_done_;
+    if (item.active)
+    {
+        item.active = false;
+        --num_active_;
+    }
+    if (!item.key.empty())
+    {
+        in_progress_.erase(make_pair(item.key, make_pair(item.requested_size.width(), item.requested_size.height())));
+    }
+
+    if (cancelled_)
+    {
+        maybe_finish();
+        return;
+    }
+
+    QByteArray payload = error.isNull() ? thumbnail : error.toUtf8();
+    BatchRecordHeader hdr;
+    hdr.index = index;
+    hdr.error = error.isNull() ? 0 : 1;
+    hdr.size = payload.size();
+    out_buffer_.append(reinterpret_cast<char const*>(&hdr), sizeof(hdr));
+    out_buffer_.append(payload);
+    if (error.isNull())
+    {
+        ++num_sent_;
+    }
+    flush();
+
+    for (int d : item.duplicates)
+    {
+        itemFinished(d, thumbnail, error);
+    }
+    start_work();
+}
+
+void BatchHandler::cancel()
+{
+    if (cancelled_ || finished_)
+    {
+        return;
+    }
+    cancelled_ = true;
+    // Only the last handler in a chain can be cancelled, and later items are further
+    // down the chain for their key, so we go backwards.
+    for (auto it = items_.rbegin(); it != items_.rend(); ++it)
+    {
+        auto& item = **it;
+        if (!item.done && item.handler)
+        {
+            cancel_func_(item.handler);  // The handler reports back to itemFinished() if it can be cancelled.
+        }
+    }
+    maybe_finish();
+}
+
+void BatchHandler::socketWritable()
+{
+    flush();
+    start_work();
+}
+
+void BatchHandler::flush()
+{
+    while (out_offset_ < out_buffer_.size())
+    {
+        ssize_t rc = send(write_fd_.get(),
+                          out_buffer_.constData() + out_offset_,
+                          out_buffer_.size() - out_offset_,
+                          MSG_NOSIGNAL);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;  // LCOV_EXCL_LINE
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Client isn't reading fast enough. Resume once there is space in the socket buffer.
+                // We drop what was sent already, so out_buffer_ holds only what the client hasn't seen.
+                out_buffer_.remove(0, out_offset_);
+                out_offset_ = 0;
+                write_notifier_->setEnabled(true);
+                return;
+            }
+            // The client closed its end, so there is no point in carrying on.
+            qDebug() << "BatchHandler: client closed result stream:" << safe_strerror(errno).c_str();
+            write_notifier_->setEnabled(false);
+            out_buffer_.clear();
+            out_offset_ = 0;
+            cancel();
+            return;
+        }
+        out_offset_ += rc;
+    }
+    write_notifier_->setEnabled(false);
+    out_buffer_.clear();
+    out_offset_ = 0;
+    maybe_finish();
+}
+
+void BatchHandler::maybe_finish()
+{
+    if (finished_ || waiting_for_credentials_)
+    {
+        return;
+    }
+    if (!cancelled_ && (num_done_ != int(items_.size()) || out_offset_ < out_buffer_.size()))
+    {
+        return;
+    }
+    if (read_fd_.has_resource())
+    {
+        return;  // Still constructing, result_fd() not called yet.
+    }
+    finished_ = true;
+    write_notifier_.reset();
+    write_fd_.dealloc();  // Client sees EOF.
+    finish_time_ = chrono::system_clock::now();
+    Q_EMIT finished();
+}
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "credentialscache.h"
+#include "handler.h"
+#include "inactivityhandler.h"
+
+#include <internal/thumbnailer.h>
+#include <ratelimiter.h>
+#include <service/batch.h>
+
+#include <unity/util/ResourcePtr.h>
+
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusUnixFileDescriptor>
+#include <QObject>
+#include <QSocketNotifier>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+class QThreadPool;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+struct BatchItemState;
+
+// BatchHandler processes a GetThumbnails() call. It retrieves the caller's
+// credentials once for the entire batch and creates the request for each item
+// in the check pool, so the file system calls don't hold up the event loop.
+// Each item is then handed to a normal Handler via queue_func, with the result
+// delivered back to the batch. That way, DBusInterface chains batch items with
+// any other requests for the same key, and the work is done only once.
+// Results are written to a stream socket as they become available.
+//
+// Items with the same key and size go through a single Handler, and all of
+// them get that result.
+//
+// We keep only a few items per check pool thread in progress, and we stop
+// starting more while MAX_BUFFERED_BYTES are waiting for a slow client,
+// so the buffer stays bounded.
+
+class BatchHandler : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::function<void(Handler*)> QueueFunc;
+    typedef std::function<void(Handler*)> CancelFunc;
+
+    static constexpr int MAX_BUFFERED_BYTES = 4 * 1024 * 1024;
+
+    BatchHandler(QDBusConnection const& bus,
+                 QDBusMessage const& message,
+                 std::shared_ptr<internal::Thumbnailer> const& thumbnailer,
+                 BatchItems const& items,
+                 std::shared_ptr<QThreadPool> const& check_pool,
+                 std::shared_ptr<QThreadPool> const& create_pool,
+                 std::shared_ptr<RateLimiter> const& limiter,
+                 CredentialsCache& creds,
+                 InactivityHandler& inactivity_handler,
+                 QueueFunc const& queue_func,
+                 CancelFunc const& cancel_func);
+    ~BatchHandler();
+
+    BatchHandler(BatchHandler const&) = delete;
+    BatchHandler& operator=(BatchHandler&) = delete;
+
+    // Returns the read end of the result stream. Must be called exactly once, before begin().
+    QDBusUnixFileDescriptor result_fd();
+
+    QString client() const;                             // Unique bus name of the caller.
+    int size() const;
+    int num_sent() const;                               // Number of items for which we sent a thumbnail.
+    bool cancelled() const;                             // True if the client closed the stream early.
+    std::chrono::microseconds completion_time() const;  // End-to-end time taken.
+
+    // Stops work on the batch and cancels the handlers of its items (using cancel_func),
+    // and closes the result stream. finished() is emitted as soon as the credentials lookup is done.
+    void cancel();
+
+public Q_SLOTS:
+    void begin();
+
+private Q_SLOTS:
+    void socketWritable();
+
+Q_SIGNALS:
+    void finished();
+
+private:
+    void gotCredentials(CredentialsCache::Credentials const& credentials);
+    void start_work();
+    void prepareFinished(int index);
+    void queue_handler(int index);
+    void itemFinished(int index, QByteArray const& thumbnail, QString const& error);
+    void flush();
+    void maybe_finish();
+
+    QDBusConnection const bus_;
+    QDBusMessage const message_;
+    std::shared_ptr<internal::Thumbnailer> const thumbnailer_;
+    std::shared_ptr<QThreadPool> const check_pool_;
+    std::shared_ptr<QThreadPool> const create_pool_;
+    std::shared_ptr<RateLimiter> const limiter_;
+    CredentialsCache& creds_;
+    InactivityHandler& inactivity_handler_;
+    QueueFunc const queue_func_;
+    CancelFunc const cancel_func_;
+    CredentialsCache::Credentials credentials_;
+    std::vector<std::unique_ptr<BatchItemState>> items_;
+    size_t next_item_;                                  // Next item for start_work().
+    int num_active_;                                    // Items that are being prepared or are with a Handler.
+    std::map<std::pair<std::string, std::pair<int, int>>, int> in_progress_;  // Key and size -> item
+    bool starting_work_;                                // True while start_work() is running.
+    int num_done_;
+    int num_sent_;
+    unity::util::ResourcePtr<int, decltype(&::close)> read_fd_;
+    unity::util::ResourcePtr<int, decltype(&::close)> write_fd_;
+    std::unique_ptr<QSocketNotifier> write_notifier_;
+    QByteArray out_buffer_;
+    int out_offset_;
+    bool waiting_for_credentials_;
+    std::atomic_bool cancelled_;                        // Must be atomic because the check pool reads it.
+    bool finished_;
+    std::chrono::system_clock::time_point const start_time_;
+    std::chrono::system_clock::time_point finish_time_;
+};
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -22,7 +22,11 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/regex.hpp>
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
 
+#include <algorithm>
 #include <thread>
 
 using namespace std;
@@ -73,6 +77,7 @@ DBusInterface::DBusInterface(shared_ptr<Thumbnailer> const& thumbnailer,
     , check_thread_pool_(make_shared<QThreadPool>())
     , create_thread_pool_(make_shared<QThreadPool>())
     , download_limiter_(make_shared<RateLimiter>(settings_.max_downloads()))
+    , cancel_stats_()
 {
     auto limit = settings_.max_extractions();
 
@@ -96,10 +101,53 @@ DBusInterface::DBusInterface(shared_ptr<Thumbnailer> const& thumbnailer,
     log_level_ = settings_.log_level();
     config_values_.trace_client = settings_.trace_client();
     config_values_.max_backlog = settings_.max_backlog();
+
+    if (settings_.background_indexing())
+    {
+        QStringList dirs;
+        for (auto location : { QStandardPaths::PicturesLocation,
+                               QStandardPaths::MoviesLocation,
+                               QStandardPaths::MusicLocation })
+        {
+            // If an XDG user directory is not configured, we may get the home
+            // directory instead, which is far too much to watch.
+            QString dir = QStandardPaths::writableLocation(location);
+            if (!dir.isEmpty() && dir != QDir::homePath() && QFileInfo(dir).isDir())
+            {
+                dirs.append(dir);
+            }
+        }
+        indexer_.reset(new BackgroundIndexer(thumbnailer_, extraction_limiter_, *inactivity_handler_,
+                                             dirs, settings_.background_indexing_sizes()));
+    }
+
+    maintenance_.reset(new MaintenanceTask(thumbnailer_, *inactivity_handler_, background_indexing()));
 }
 
 DBusInterface::~DBusInterface()
 {
+    if (cancel_stats_.cancelled != 0 || cancel_stats_.too_late != 0)
+    {
+        qDebug().nospace() << "cancelled requests: " << cancel_stats_.cancelled
+                           << " (" << cancel_stats_.downloads_dropped << " downloads not started, "
+                           << cancel_stats_.downloads_aborted << " downloads aborted, "
+                           << cancel_stats_.too_late << " cancellations too late)";
+    }
+}
+
+bool DBusInterface::background_indexing() const
+{
+    return bool(indexer_);
+}
+
+CancelStats DBusInterface::cancel_stats() const
+{
+    return cancel_stats_;
+}
+
+void DBusInterface::clear_cancel_stats()
+{
+    cancel_stats_ = CancelStats();
 }
 
 CredentialsCache& DBusInterface::credentials()
@@ -111,9 +159,110 @@ CredentialsCache& DBusInterface::credentials()
     return *credentials_.get();
 }
 
+QDBusServiceWatcher& DBusInterface::client_watcher()
+{
+    if (!client_watcher_)
+    {
+        client_watcher_.reset(new QDBusServiceWatcher);
+        client_watcher_->setConnection(connection());
+        client_watcher_->setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+        connect(client_watcher_.get(), &QDBusServiceWatcher::serviceUnregistered,
+                this, &DBusInterface::clientVanished);
+    }
+    return *client_watcher_;
+}
+
 QByteArray DBusInterface::GetAlbumArt(QString const& artist,
                                       QString const& album,
                                       QSize const& requestedSize)
+{
+    queueAlbumArt(artist, album, requestedSize, false);
+    return QByteArray();
+}
+
+QByteArray DBusInterface::GetArtistArt(QString const& artist,
+                                       QString const& album,
+                                       QSize const& requestedSize)
+{
+    queueArtistArt(artist, album, requestedSize, false);
+    return QByteArray();
+}
+
+QByteArray DBusInterface::GetThumbnail(QString const& filename, QSize const& requestedSize)
+{
+    queueThumbnail(filename, requestedSize, false);
+    return QByteArray();
+}
+
+QDBusUnixFileDescriptor DBusInterface::GetAlbumArtFd(QString const& artist,
+                                                     QString const& album,
+                                                     QSize const& requestedSize)
+{
+    queueAlbumArt(artist, album, requestedSize, true);
+    return QDBusUnixFileDescriptor();
+}
+
+QDBusUnixFileDescriptor DBusInterface::GetArtistArtFd(QString const& artist,
+                                                      QString const& album,
+                                                      QSize const& requestedSize)
+{
+    queueArtistArt(artist, album, requestedSize, true);
+    return QDBusUnixFileDescriptor();
+}
+
+QDBusUnixFileDescriptor DBusInterface::GetThumbnailFd(QString const& filename, QSize const& requestedSize)
+{
+    queueThumbnail(filename, requestedSize, true);
+    return QDBusUnixFileDescriptor();
+}
+
+QByteArray DBusInterface::GetThumbnailWithPriority(QString const& filename,
+                                                   QSize const& requestedSize,
+                                                   int priority,
+                                                   quint64 request_id)
+{
+    queueThumbnail(filename, requestedSize, false, priority, request_id);
+    return QByteArray();
+}
+
+QDBusUnixFileDescriptor DBusInterface::GetThumbnailFdWithPriority(QString const& filename,
+                                                                  QSize const& requestedSize,
+                                                                  int priority,
+                                                                  quint64 request_id)
+{
+    queueThumbnail(filename, requestedSize, true, priority, request_id);
+    return QDBusUnixFileDescriptor();
+}
+
+void DBusInterface::CancelRequest(quint64 request_id)
+{
+    auto it = request_ids_.find(make_pair(message().service(), request_id));
+    if (it == request_ids_.end())
+    {
+        ++cancel_stats_.too_late;  // Completed already, or the id is bogus.
+        return;
+    }
+    switch (cancelRequest(it->second))
+    {
+        case Handler::CancelResult::too_late:
+            ++cancel_stats_.too_late;
+            return;
+        case Handler::CancelResult::download_dropped:
+            ++cancel_stats_.downloads_dropped;
+            break;
+        case Handler::CancelResult::download_aborted:
+            ++cancel_stats_.downloads_aborted;
+            break;
+        default:
+            break;
+    }
+    ++cancel_stats_.cancelled;
+}
+
+void DBusInterface::queueAlbumArt(QString const& artist,
+                                  QString const& album,
+                                  QSize const& requestedSize,
+                                  bool reply_as_fd)
 {
     try
     {
@@ -124,7 +273,8 @@ QByteArray DBusInterface::GetAlbumArt(QString const& artist,
         queueRequest(new Handler(connection(), message(),
                                  check_thread_pool_, create_thread_pool_,
                                  download_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
+                                 std::move(request), details),
+                     reply_as_fd);
     }
     // LCOV_EXCL_START
     catch (exception const& e)
@@ -134,12 +284,12 @@ QByteArray DBusInterface::GetAlbumArt(QString const& artist,
         sendErrorReply(ART_ERROR, e.what());
     }
     // LCOV_EXCL_STOP
-    return QByteArray();
 }
 
-QByteArray DBusInterface::GetArtistArt(QString const& artist,
-                                       QString const& album,
-                                       QSize const& requestedSize)
+void DBusInterface::queueArtistArt(QString const& artist,
+                                   QString const& album,
+                                   QSize const& requestedSize,
+                                   bool reply_as_fd)
 {
     try
     {
@@ -150,7 +300,8 @@ QByteArray DBusInterface::GetArtistArt(QString const& artist,
         queueRequest(new Handler(connection(), message(),
                                  check_thread_pool_, create_thread_pool_,
                                  download_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
+                                 std::move(request), details),
+                     reply_as_fd);
     }
     // LCOV_EXCL_START
     catch (exception const& e)
@@ -160,24 +311,42 @@ QByteArray DBusInterface::GetArtistArt(QString const& artist,
         sendErrorReply(ART_ERROR, msg);
     }
     // LCOV_EXCL_STOP
-    return QByteArray();
 }
 
-QByteArray DBusInterface::GetThumbnail(QString const& filename, QSize const& requestedSize)
+void DBusInterface::queueThumbnail(QString const& filename,
+                                   QSize const& requestedSize,
+                                   bool reply_as_fd,
+                                   int priority,
+                                   quint64 request_id)
 {
-    std::unique_ptr<ThumbnailRequest> request;
-
     try
     {
+        if (priority < int(RateLimiter::Priority::interactive) || priority > int(RateLimiter::Priority::background))
+        {
+            throw invalid_argument("invalid priority: " + to_string(priority));
+        }
+        auto id = make_pair(message().service(), request_id);
+        if (request_id != 0 && request_ids_.find(id) != request_ids_.end())
+        {
+            throw invalid_argument("duplicate request id: " + to_string(request_id));
+        }
+
         QString details;
         QTextStream s(&details);
         s << "thumbnail: " << filename << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
 
         auto request = thumbnailer_->get_thumbnail(filename.toStdString(), requestedSize);
-        queueRequest(new Handler(connection(), message(),
-                                 check_thread_pool_, create_thread_pool_,
-                                 extraction_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
+        auto handler = new Handler(connection(), message(),
+                                   check_thread_pool_, create_thread_pool_,
+                                   extraction_limiter_, credentials(), *inactivity_handler_,
+                                   std::move(request), details);
+        handler->set_priority(RateLimiter::Priority(priority));
+        if (request_id != 0)
+        {
+            handler->set_request_id(request_id);
+            request_ids_[id] = handler;
+        }
+        queueRequest(handler, reply_as_fd);
     }
     catch (exception const& e)
     {
@@ -185,14 +354,61 @@ QByteArray DBusInterface::GetThumbnail(QString const& filename, QSize const& req
         qWarning() << msg;
         sendErrorReply(ART_ERROR, msg);
     }
-    return QByteArray();
 }
 
-void DBusInterface::queueRequest(Handler* handler)
+QDBusUnixFileDescriptor DBusInterface::GetThumbnails(BatchItems const& requests)
+{
+    try
+    {
+        if (requests.size() > MAX_BATCH_SIZE)
+        {
+            throw runtime_error("too many requests in batch (" + to_string(requests.size()) +
+                                ", max = " + to_string(MAX_BATCH_SIZE) + ")");
+        }
+        auto batch = new BatchHandler(connection(), message(), thumbnailer_, requests,
+                                      check_thread_pool_, create_thread_pool_,
+                                      extraction_limiter_, credentials(), *inactivity_handler_,
+                                      [this](Handler* handler){ startRequest(handler); },
+                                      [this](Handler* handler)
+                                      {
+                                          if (requests_.find(handler) != requests_.end())
+                                          {
+                                              cancelRequest(handler);
+                                          }
+                                      });
+        batches_.emplace(batch, std::unique_ptr<BatchHandler>(batch));
+        client_watcher().addWatchedService(batch->client());  // Does nothing if we watch the client already.
+        connect(batch, &BatchHandler::finished, this, &DBusInterface::batchFinished);
+        auto fd = batch->result_fd();
+        batch->begin();
+        return fd;
+    }
+    // LCOV_EXCL_START
+    catch (exception const& e)
+    {
+        QString msg = QStringLiteral("DBusInterface::GetThumbnails(): ") + e.what();
+        qWarning() << msg;
+        sendErrorReply(ART_ERROR, msg);
+    }
+    // LCOV_EXCL_STOP
+    return QDBusUnixFileDescriptor();
+}
+
+void DBusInterface::queueRequest(Handler* handler, bool reply_as_fd)
+{
+    if (reply_as_fd)
+    {
+        handler->set_reply_as_fd();
+    }
+    setDelayedReply(true);
+    client_watcher().addWatchedService(handler->client());  // Does nothing if we watch the client already.
+    startRequest(handler);
+}
+
+void DBusInterface::startRequest(Handler* handler)
 {
     requests_.emplace(handler, std::unique_ptr<Handler>(handler));
     connect(handler, &Handler::finished, this, &DBusInterface::requestFinished);
-    setDelayedReply(true);
 
     std::vector<Handler*> &requests_for_key = request_keys_[handler->key()];
     if (requests_for_key.size() == 0)
@@ -205,14 +421,91 @@ void DBusInterface::queueRequest(Handler* handler)
     {
         /* There are other requests for this item, so chain this
          * request to wait for them to complete first.  This way we
-         * can take advantage of any cached downloads or failures. */
+         * can take advantage of any cached downloads or failures.
+         * If this request is for a different size, the request in
+         * progress may be able to produce our thumbnail from the
+         * image it decodes, in which case we find it in the cache. */
         // TODO: should record time spent in queue
+        requests_for_key.front()->coalesce(*handler);
+        // If the request in progress is waiting for an extraction, it is now
+        // at least as important as this request.
+        requests_for_key.front()->raise_priority(handler->priority());
         connect(requests_for_key.back(), &Handler::finished,
                 handler, &Handler::begin);
     }
     requests_for_key.push_back(handler);
 }
 
+Handler::CancelResult DBusInterface::cancelRequest(Handler* handler)
+{
+    // A handler further down the chain waits for this one to finish.
+    // The work is not wasted then, so we let the request run.
+    string const key = handler->key();
+    auto const& requests_for_key = request_keys_.at(key);
+    if (requests_for_key.back() != handler)
+    {
+        return Handler::CancelResult::too_late;
+    }
+
+    Handler* front = requests_for_key.front();
+    auto result = handler->cancel();  // Emits finished() unless it is too late, which removes the handler from the chain.
+    if (result == Handler::CancelResult::too_late || front == handler)
+    {
+        return result;
+    }
+
+    // The handler was waiting for the request in progress. That request no longer
+    // needs to produce a thumbnail for it, nor to run at its priority.
+    front->uncoalesce(*handler);
+    auto priority = RateLimiter::Priority::background;
+    for (auto h : request_keys_.at(key))
+    {
+        if (h != front)
+        {
+            priority = min(priority, h->priority());
+        }
+    }
+    front->reset_priority(priority);
+    return result;
+}
+
+void DBusInterface::clientVanished(QString const& client)
+{
+    client_watcher_->removeWatchedService(client);
+
+    // Nobody is left to receive the results, so we cancel the client's requests.
+    // Because only the last request in a chain can be cancelled, we collect
+    // the requests from the back of each chain. The client didn't ask for this,
+    // so it doesn't count towards the cancellation stats.
+    vector<Handler*> handlers;
+    for (auto const& requests_for_key : request_keys_)
+    {
+        auto const& chain = requests_for_key.second;
+        for (auto it = chain.rbegin(); it != chain.rend() && (*it)->client() == client; ++it)
+        {
+            handlers.push_back(*it);
+        }
+    }
+    for (auto handler : handlers)
+    {
+        cancelRequest(handler);
+    }
+
+    // The client's batches stop too, which cancels whatever is left of their items.
+    vector<BatchHandler*> batches;
+    for (auto const& b : batches_)
+    {
+        if (b.first->client() == client)
+        {
+            batches.push_back(b.first);
+        }
+    }
+    for (auto batch : batches)
+    {
+        batch->cancel();
+    }
+}
+
 namespace
 {
 
@@ -247,7 +540,7 @@ void write_log_message(Handler const* handler)
         s << "]";
     }
 
-    s << " sec (" << handler->status_as_string() << ")";
+    s << " sec (" << (handler->cancelled() ? QStringLiteral("CANCELLED") : handler->status_as_string()) << ")";
     qDebug() << msg;
 }
 
@@ -269,6 +562,11 @@ void DBusInterface::requestFinished()
     }
     // LCOV_EXCL_STOP
 
+    if (handler->request_id() != 0)
+    {
+        request_ids_.erase(make_pair(handler->client(), handler->request_id()));
+    }
+
     // Remove ourselves from the chain of requests
     std::vector<Handler*> &requests_for_key = request_keys_[handler->key()];
     requests_for_key.erase(
@@ -305,11 +603,56 @@ void DBusInterface::requestFinished()
     }
 }
 
+void DBusInterface::batchFinished()
+{
+    BatchHandler* batch = static_cast<BatchHandler*>(sender());
+    try
+    {
+        auto& b = batches_.at(batch);
+        b.release();
+        batches_.erase(batch);
+    }
+    // LCOV_EXCL_START
+    catch (std::out_of_range const& e)
+    {
+        qWarning() << "finished() called on unknown batch handler" << batch;
+    }
+    // LCOV_EXCL_STOP
+
+    batch->deleteLater();
+
+    if (log_level_ == 2 || batch->cancelled())
+    {
+        QString msg;
+        QTextStream s(&msg);
+        s.setRealNumberNotation(QTextStream::FixedNotation);
+        s << "batch: " << batch->num_sent() << "/" << batch->size() << " thumbnails: "
+          << double(batch->completion_time().count()) / 1000000 << " sec";
+        if (batch->cancelled())
+        {
+            s << " (CANCELLED)";
+        }
+        qDebug() << msg;
+    }
+}
+
 ConfigValues DBusInterface::ClientConfig()
 {
     return config_values_;
 }
 
+bool DBusInterface::FdDelivery()
+{
+    // The Get*Fd() methods are useful only if the bus can carry file descriptors.
+    // The client checks its own end of the connection.
+    return bool(connection().connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing);
+}
+
+bool DBusInterface::RequestPriorities()
+{
+    return true;
+}
+
 }  // namespace service
 
 }  // namespace thumbnailer
@@ -18,14 +18,21 @@
 
 #pragma once
 
+#include "backgroundindexer.h"
+#include "batchhandler.h"
 #include "credentialscache.h"
 #include "handler.h"
+#include "maintenancetask.h"
+#include "stats.h"
 
 #include <internal/settings.h>
 #include <ratelimiter.h>
+#include <service/batch.h>
 #include <service/client_config.h>
 
 #include <QDBusContext>
+#include <QDBusServiceWatcher>
+#include <QDBusUnixFileDescriptor>
 #include <QThreadPool>
 
 namespace unity
@@ -53,16 +60,67 @@ public Q_SLOTS:
     QByteArray GetAlbumArt(QString const& artist, QString const& album, QSize const& requestedSize);
     QByteArray GetArtistArt(QString const& artist, QString const& album, QSize const& requestedSize);
     QByteArray GetThumbnail(QString const& filename, QSize const& requestedSize);
+    QDBusUnixFileDescriptor GetThumbnails(BatchItems const& requests);
+
+    // Same as the methods above, but the thumbnail is returned as a file descriptor
+    // for a sealed memfd that the client can mmap.
+    QDBusUnixFileDescriptor GetAlbumArtFd(QString const& artist, QString const& album, QSize const& requestedSize);
+    QDBusUnixFileDescriptor GetArtistArtFd(QString const& artist, QString const& album, QSize const& requestedSize);
+    QDBusUnixFileDescriptor GetThumbnailFd(QString const& filename, QSize const& requestedSize);
+
+    // Same as GetThumbnail() and GetThumbnailFd(), but with a priority for the extraction.
+    // The priority is the integer value of a RateLimiter::Priority. A non-zero
+    // request_id allows the caller to cancel the request with CancelRequest().
+    QByteArray GetThumbnailWithPriority(QString const& filename,
+                                        QSize const& requestedSize,
+                                        int priority,
+                                        quint64 request_id);
+    QDBusUnixFileDescriptor GetThumbnailFdWithPriority(QString const& filename,
+                                                       QSize const& requestedSize,
+                                                       int priority,
+                                                       quint64 request_id);
+
+    // Abandons the caller's request with the given id, so we don't extract
+    // a thumbnail that nobody is waiting for anymore.
+    void CancelRequest(quint64 request_id);
 
     // This method returns the values of gsettings keys relevant to the client. We retrieve these on the server
     // side because the client-side API runs under confinement, which disallows access to gsettings.
     ConfigValues ClientConfig();
 
+    // True if the Get*Fd() methods can be used on this connection. This is a separate
+    // method (rather than part of ClientConfig()) so that the ClientConfig() reply keeps
+    // the layout that existing clients expect.
+    bool FdDelivery();
+
+    // True if the *WithPriority methods and CancelRequest() are available.
+    // Services that predate them don't have this method either.
+    bool RequestPriorities();
+
+    // True if the background-indexing setting is enabled. In that case,
+    // the service should not exit when it becomes idle.
+    bool background_indexing() const;
+
+    // For AdminInterface.
+    CancelStats cancel_stats() const;
+    void clear_cancel_stats();
+
 private:
-    void queueRequest(Handler* handler);
+    void queueAlbumArt(QString const& artist, QString const& album, QSize const& requestedSize, bool reply_as_fd);
+    void queueArtistArt(QString const& artist, QString const& album, QSize const& requestedSize, bool reply_as_fd);
+    void queueThumbnail(QString const& filename,
+                        QSize const& requestedSize,
+                        bool reply_as_fd,
+                        int priority = int(RateLimiter::Priority::interactive),
+                        quint64 request_id = 0);
+    void queueRequest(Handler* handler, bool reply_as_fd);
+    void startRequest(Handler* handler);
+    Handler::CancelResult cancelRequest(Handler* handler);
 
 private Q_SLOTS:
     void requestFinished();
+    void batchFinished();
+    void clientVanished(QString const& client);
 
 Q_SIGNALS:
     void startedRequest();
@@ -72,16 +130,24 @@ private:
     std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const thumbnailer_;
     std::unique_ptr<CredentialsCache> credentials_;
     CredentialsCache& credentials();
+    std::unique_ptr<QDBusServiceWatcher> client_watcher_;
+    QDBusServiceWatcher& client_watcher();
     std::shared_ptr<InactivityHandler> inactivity_handler_;
     std::shared_ptr<QThreadPool> check_thread_pool_;
     std::shared_ptr<QThreadPool> create_thread_pool_;
     std::map<Handler*, std::unique_ptr<Handler>> requests_;
     std::map<std::string, std::vector<Handler*>> request_keys_;
+    std::map<std::pair<QString, quint64>, Handler*> request_ids_;  // Client name and request id -> handler
+    std::map<BatchHandler*, std::unique_ptr<BatchHandler>> batches_;
     unity::thumbnailer::internal::Settings settings_;
     std::shared_ptr<RateLimiter> download_limiter_;
     std::shared_ptr<RateLimiter> extraction_limiter_;
     int log_level_;
     ConfigValues config_values_;
+
+    CancelStats cancel_stats_;
+    std::unique_ptr<MaintenanceTask> maintenance_;
+    std::unique_ptr<BackgroundIndexer> indexer_;  // Must be destroyed first.
 };
 
 }  // namespace service
@@ -18,14 +18,18 @@
 
 #include "handler.h"
 
+#include <internal/memfd.h>
 #include <internal/raii.h>
 #include <internal/safe_strerror.h>
 
 #include <QFuture>
 #include <QFutureWatcher>
+#include <QPointer>
 #include <QtConcurrent>
+#include <QDBusUnixFileDescriptor>
 #include <QThreadPool>
 
+#include <algorithm>
 #include <atomic>
 
 #include <fcntl.h>
@@ -75,6 +79,13 @@ struct HandlerPrivate
     QString const details;
     QString const status;
     RateLimiter::CancelFunc cancel_func;
+    RateLimiter::PriorityFunc priority_func;                // Set while the download/extract is queued.
+    RateLimiter::Priority priority = RateLimiter::Priority::interactive;
+    RateLimiter::Priority own_priority = RateLimiter::Priority::interactive;  // Not raised for chained requests.
+    Handler::ReplyFunc reply_func;                          // Set only for requests that are part of a batch.
+    CredentialsCache::Credentials batch_credentials;
+    bool reply_as_fd = false;
+    quint64 request_id = 0;
 
     atomic_bool cancelled;                                  // Must be atomic because destructor asynchronously writes to it.
     QFutureWatcher<ByteArrayOrError> checkWatcher;
@@ -138,17 +149,147 @@ Handler::~Handler()
     p->request.reset();
 }
 
+void Handler::set_batch_reply(ReplyFunc const& reply_func, CredentialsCache::Credentials const& credentials)
+{
+    p->reply_func = reply_func;
+    p->batch_credentials = credentials;
+}
+
+void Handler::set_reply_as_fd()
+{
+    p->reply_as_fd = true;
+}
+
+void Handler::set_priority(RateLimiter::Priority priority)
+{
+    p->priority = priority;
+    p->own_priority = priority;
+}
+
+RateLimiter::Priority Handler::priority() const
+{
+    return p->priority;
+}
+
+void Handler::raise_priority(RateLimiter::Priority priority)
+{
+    if (priority >= p->priority)
+    {
+        return;
+    }
+    p->priority = priority;
+    if (p->priority_func)
+    {
+        p->priority_func(priority);  // Does nothing if the job is no longer queued.
+    }
+}
+
+void Handler::reset_priority(RateLimiter::Priority priority)
+{
+    priority = min(priority, p->own_priority);
+    if (priority == p->priority)
+    {
+        return;
+    }
+    p->priority = priority;
+    if (p->priority_func)
+    {
+        p->priority_func(priority);  // Does nothing if the job is no longer queued.
+    }
+}
+
+void Handler::set_request_id(quint64 request_id)
+{
+    p->request_id = request_id;
+}
+
+quint64 Handler::request_id() const
+{
+    return p->request_id;
+}
+
+QString Handler::client() const
+{
+    return p->message.service();
+}
+
+Handler::CancelResult Handler::cancel()
+{
+    // Once the download/extract has completed, we let the request run to
+    // the end, so the result makes it into the cache.
+    if (p->cancelled
+        || p->finish_time != chrono::system_clock::time_point()
+        || p->download_finish_time != chrono::system_clock::time_point())
+    {
+        return CancelResult::too_late;
+    }
+
+    auto result = CancelResult::before_download;
+    if (p->cancel_func)
+    {
+        if (p->cancel_func())
+        {
+            result = CancelResult::download_dropped;
+        }
+        else if (p->request->cancel_download())
+        {
+            // downloadFinished() won't be called, so we pump the limiter here.
+            p->download_finish_time = chrono::system_clock::now();
+            p->limiter->done();
+            result = CancelResult::download_aborted;
+        }
+        else
+        {
+            return CancelResult::too_late;
+        }
+    }
+
+    // Anything still running in the thread pools sees the flag and drops its result.
+    p->cancelled = true;
+    sendError("Handler::cancel(): " + details() + ": request cancelled");
+    return result;
+}
+
+bool Handler::cancelled() const
+{
+    return p->cancelled;
+}
+
 string const& Handler::key() const
 {
     return p->request->key();
 }
 
+bool Handler::coalesce(Handler const& other)
+{
+    return p->request->coalesce(*other.p->request);
+}
+
+void Handler::uncoalesce(Handler const& other)
+{
+    p->request->uncoalesce(*other.p->request);
+}
+
 void Handler::begin()
 {
+    if (p->cancelled)
+    {
+        return;  // Cancelled while chained behind another request.
+    }
+    if (p->reply_func)
+    {
+        gotCredentials(p->batch_credentials);
+        return;
+    }
+    // The handler may be cancelled and deleted before the credentials arrive.
+    QPointer<Handler> self(this);
     p->creds.get(p->message.service(),
-                 [this](CredentialsCache::Credentials const& credentials)
+                 [self](CredentialsCache::Credentials const& credentials)
                  {
-                     gotCredentials(credentials);
+                     if (self)
+                     {
+                         self->gotCredentials(credentials);
+                     }
                  });
 }
 
@@ -156,10 +297,7 @@ void Handler::gotCredentials(CredentialsCache::Credentials const& credentials)
 {
     if (p->cancelled)
     {
-        // LCOV_EXCL_START  // Too small a window to hit with a test.
-        Q_EMIT finished();
-        return;
-        // LCOV_EXCL_STOP
+        return;  // cancel() has sent the reply already.
     }
 
     if (!credentials.valid)
@@ -262,7 +400,7 @@ void Handler::checkFinished()
                     p->download_start_time = chrono::system_clock::now();
                     p->request->download();
                 }
-            });
+            }, p->priority, p->priority_func);
         }
         // LCOV_EXCL_START
         catch (std::exception const& e)
@@ -350,7 +488,34 @@ void Handler::createFinished()
 
 void Handler::sendThumbnail(QByteArray const& ba)
 {
-    p->bus.send(p->message.createReply(QVariant(ba)));
+    if (p->reply_func)
+    {
+        p->reply_func(ba, QString());
+    }
+    else if (p->reply_as_fd)
+    {
+        // The data is copied once into the memfd. From there, the client maps it,
+        // so neither the bus daemon nor libdbus need to copy the bytes.
+        int raw_fd;
+        try
+        {
+            raw_fd = make_sealed_memfd("thumbnail", ba.constData(), ba.size());
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            sendError(QStringLiteral("Handler::sendThumbnail(): ") + details() + ": " + e.what());
+            return;
+        }
+        // LCOV_EXCL_STOP
+        FdPtr fd(raw_fd, do_close);
+        QDBusUnixFileDescriptor unix_fd(fd.get());  // Dups the descriptor.
+        p->bus.send(p->message.createReply(QVariant::fromValue(unix_fd)));
+    }
+    else
+    {
+        p->bus.send(p->message.createReply(QVariant(ba)));
+    }
     p->finish_time = chrono::system_clock::now();
     Q_EMIT finished();
 }
@@ -362,7 +527,14 @@ void Handler::sendError(QString const& error)
     {
         qWarning() << error;
     }
-    p->bus.send(p->message.createErrorReply(ART_ERROR, error));
+    if (p->reply_func)
+    {
+        p->reply_func(QByteArray(), error);
+    }
+    else
+    {
+        p->bus.send(p->message.createErrorReply(ART_ERROR, error));
+    }
     p->finish_time = chrono::system_clock::now();
     Q_EMIT finished();
 }
@@ -408,6 +580,8 @@ QString Handler::status_as_string() const
         return QStringLiteral("HIT");
     case ThumbnailRequest::FetchStatus::scaled_from_fullsize:
         return QStringLiteral("FULL-SIZE HIT");
+    case ThumbnailRequest::FetchStatus::scaled_from_larger:
+        return QStringLiteral("LARGER-SIZE HIT");
     case ThumbnailRequest::FetchStatus::cached_failure:
         return QStringLiteral("FAILED PREVIOUSLY");
     case ThumbnailRequest::FetchStatus::needs_download:
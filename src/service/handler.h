@@ -23,6 +23,7 @@
 #include <internal/thumbnailer.h>
 #include <ratelimiter.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -62,7 +63,57 @@ public:
     Handler(Handler const&) = delete;
     Handler& operator=(Handler&) = delete;
 
+    // Requests that are part of a batch deliver their result via a callback
+    // instead of a D-Bus reply. The batch has already retrieved the credentials
+    // of the caller, so the handler does not look them up again.
+    typedef std::function<void(QByteArray const& thumbnail, QString const& error)> ReplyFunc;
+    void set_batch_reply(ReplyFunc const& reply_func, CredentialsCache::Credentials const& credentials);
+
+    // Deliver the thumbnail as a file descriptor for a sealed memfd instead of a byte array.
+    void set_reply_as_fd();
+
+    // The priority with which the download/extract is queued in the limiter.
+    // The default is RateLimiter::Priority::interactive.
+    void set_priority(RateLimiter::Priority priority);
+    RateLimiter::Priority priority() const;
+
+    // Raises the priority to the given one (if it is higher), including
+    // for a download/extract that is already waiting in the limiter.
+    void raise_priority(RateLimiter::Priority priority);
+
+    // Undoes raise_priority(): sets the priority to the given one, or to the
+    // one passed to set_priority() if that is higher.
+    void reset_priority(RateLimiter::Priority priority);
+
+    // The id that the client supplied for this request, or 0 if it did not supply one.
+    void set_request_id(quint64 request_id);
+    quint64 request_id() const;
+
+    // The unique bus name of the client that sent the request.
+    QString client() const;
+
+    // What cancel() managed to save.
+    enum class CancelResult
+    {
+        too_late,          // Not cancelled; the download/extract has completed or cannot be interrupted.
+        before_download,   // Cancelled during credentials check or cache lookup.
+        download_dropped,  // Cancelled while the download/extract was waiting in the limiter.
+        download_aborted   // Cancelled while the download/extract was running.
+    };
+
+    // Abandons the request and sends a "request cancelled" error to the client.
+    // finished() is emitted immediately, so this must be called only for a
+    // handler that no other handler is chained to.
+    CancelResult cancel();
+    bool cancelled() const;
+
     std::string const& key() const;
+
+    // Asks this handler's request to also produce the thumbnail for other,
+    // which is for the same key, from the same decoded image.
+    bool coalesce(Handler const& other);
+    void uncoalesce(Handler const& other);
+
     std::chrono::microseconds completion_time() const;  // End-to-end time taken.
     std::chrono::microseconds queued_time() const;      // Time spent waiting in download/extract queue.
     std::chrono::microseconds download_time() const;    // Time of that for download/extract, incl. queueing time.
@@ -97,6 +97,7 @@ void InactivityHandler::request_started()
     if (num_active_requests_++ == 0)
     {
         timer_.stop();
+        Q_EMIT busy();
     }
 }
 
@@ -107,6 +108,7 @@ void InactivityHandler::request_completed()
     if (--num_active_requests_ == 0)
     {
         timer_.start();
+        Q_EMIT idle();
     }
 }
 
@@ -45,6 +45,14 @@ public:
 public Q_SLOTS:
     void timer_expired();
 
+Q_SIGNALS:
+    // busy() is emitted when the first interactive request starts,
+    // and idle() is emitted once the last one has completed.
+    // Background work does not call request_started(), so it
+    // neither delays the timer nor causes these signals to fire.
+    void busy();
+    void idle();
+
 private:
     std::function<void()> timer_func_;
     int num_active_requests_;
@@ -28,6 +28,7 @@
 
 #include <QCoreApplication>
 
+#include <chrono>
 #include <cstdio>
 #include <sys/stat.h>
 
@@ -38,7 +39,7 @@ using namespace unity::thumbnailer::service;
 namespace
 {
 
-QString get_summary(core::PersistentCacheStats const& stats)
+QString get_summary(DiskCache::Stats const& stats)
 {
     auto hits = stats.hits();
     auto misses = stats.misses();
@@ -59,18 +60,86 @@ QString get_summary(core::PersistentCacheStats const& stats)
     return summary;
 }
 
+QString get_summary(MemoryCache::Stats const& stats)
+{
+    auto hits = stats.hits;
+    auto misses = stats.misses;
+    double hit_rate = (hits + misses == 0) ? 0.0 : double(hits) / (hits + misses);
+    QString entry_str = stats.size == 1 ? QStringLiteral("entry") : QStringLiteral("entries");
+    QString summary;
+    summary = QStringLiteral("%1 %2, %3 bytes, hit rate %4 (%5/%6), %7 evictions")
+        .arg(stats.size)
+        .arg(entry_str)
+        .arg(stats.size_in_bytes)
+        .arg(hit_rate, 4, 'f', 2, '0')
+        .arg(hits)
+        .arg(misses)
+        .arg(stats.evictions);
+    return summary;
+}
+
+QString get_summary(PersistentAdmissionFilter::Stats const& stats)
+{
+    return QStringLiteral("%1 admitted, %2 rejected, %3 window hits, sketch %4 bytes")
+        .arg(stats.admitted)
+        .arg(stats.rejected)
+        .arg(stats.window_hits)
+        .arg(stats.sketch_size_in_bytes);
+}
+
+QString get_summary(WriteBehindQueue::Stats const& stats)
+{
+    return QStringLiteral("%1 queued (%2 bytes), %3 written in %4 batches, %5 coalesced, %6 stalls, %7 failures")
+        .arg(stats.queued)
+        .arg(stats.queued_bytes)
+        .arg(stats.written)
+        .arg(stats.batches)
+        .arg(stats.coalesced)
+        .arg(stats.stalls)
+        .arg(stats.failures);
+}
+
 void show_stats(shared_ptr<Thumbnailer> const& thumbnailer)
 {
     auto stats = thumbnailer->stats();
     qDebug() << qUtf8Printable("image cache:     " + get_summary(stats.full_size_stats));
     qDebug() << qUtf8Printable("thumbnail cache: " + get_summary(stats.thumbnail_stats));
     qDebug() << qUtf8Printable("failure cache:   " + get_summary(stats.failure_stats));
+    qDebug() << qUtf8Printable("thumbnail mem:   " + get_summary(stats.thumbnail_memory_stats));
+    qDebug() << qUtf8Printable("failure mem:     " + get_summary(stats.failure_memory_stats));
+    qDebug() << qUtf8Printable("alias cache:     " + get_summary(stats.alias_stats));
+    qDebug() << qUtf8Printable(QStringLiteral("duplicates:      %1 files, %2 hits, %3 bytes saved")
+                                   .arg(stats.dedup_stats.duplicate_files)
+                                   .arg(stats.dedup_stats.duplicate_hits)
+                                   .arg(stats.dedup_stats.bytes_saved));
+    qDebug() << qUtf8Printable(QStringLiteral("failure filter:  %1 entries, %2 bytes, false positives %3, %4 lookups skipped")
+                                   .arg(stats.failure_filter_stats.entries)
+                                   .arg(stats.failure_filter_stats.size_in_bytes)
+                                   .arg(stats.failure_filter_stats.false_positive_rate, 0, 'f', 4)
+                                   .arg(stats.failure_filter_stats.lookups_skipped));
+    qDebug() << qUtf8Printable(QStringLiteral("garbage:         %1 of %2 files stale, %3 entries removed, %4 bytes reclaimed")
+                                   .arg(stats.gc_stats.stale_files)
+                                   .arg(stats.gc_stats.files_checked)
+                                   .arg(stats.gc_stats.entries_removed)
+                                   .arg(stats.gc_stats.bytes_reclaimed));
+    qDebug() << qUtf8Printable(QStringLiteral("repair:          %1 repairs, %2 entries salvaged, %3 lost, %4 restored")
+                                   .arg(stats.repair_stats.repairs)
+                                   .arg(stats.repair_stats.entries_salvaged)
+                                   .arg(stats.repair_stats.entries_lost)
+                                   .arg(stats.repair_stats.entries_restored));
+    qDebug() << qUtf8Printable("image window:    " + get_summary(stats.full_size_window_stats));
+    qDebug() << qUtf8Printable("thumbnail win:   " + get_summary(stats.thumbnail_window_stats));
+    qDebug() << qUtf8Printable("image admission: " + get_summary(stats.full_size_admission_stats));
+    qDebug() << qUtf8Printable("thumb admission: " + get_summary(stats.thumbnail_admission_stats));
+    qDebug() << qUtf8Printable("image writes:    " + get_summary(stats.full_size_write_queue_stats));
+    qDebug() << qUtf8Printable("thumb writes:    " + get_summary(stats.thumbnail_write_queue_stats));
 }
 
 }  // namespace
 
 int main(int argc, char** argv)
 {
+    auto const start_time = chrono::steady_clock::now();
     TraceMessageHandler message_handler("thumbnailer-service");
 
     int rc = 1;
@@ -93,14 +162,28 @@ int main(int argc, char** argv)
 
         QCoreApplication app(argc, argv);
 
-        auto inactivity_handler = make_shared<InactivityHandler>([&]{ qDebug() << "Idle timeout reached."; app.quit(); });
-
+        // This returns before the caches are open, so we can acquire the bus name without waiting for them.
+        // Requests that arrive in the mean time wait for the caches.
         auto thumbnailer = make_shared<Thumbnailer>();
 
+        // With background indexing, the service stays resident so it can keep watching for new media.
+        // Either way, nothing should sit in the write queues while we are idle.
+        bool resident = false;
+        auto inactivity_handler = make_shared<InactivityHandler>([&]
+        {
+            thumbnailer->flush();
+            if (!resident)
+            {
+                qDebug() << "Idle timeout reached.";
+                app.quit();
+            }
+        });
+
         unity::thumbnailer::service::DBusInterface server(thumbnailer, inactivity_handler);
         new ThumbnailerAdaptor(&server);
+        resident = server.background_indexing();
 
-        unity::thumbnailer::service::AdminInterface admin_server(move(thumbnailer), move(inactivity_handler));
+        unity::thumbnailer::service::AdminInterface admin_server(move(thumbnailer), move(inactivity_handler), server);
         new ThumbnailerAdminAdaptor(&admin_server);
 
         auto bus = QDBusConnection::sessionBus();
@@ -108,14 +191,20 @@ int main(int argc, char** argv)
         bus.registerObject(ADMIN_BUS_PATH, &admin_server);
 
         qDBusRegisterMetaType<unity::thumbnailer::service::AllStats>();
+        qDBusRegisterMetaType<unity::thumbnailer::service::MissRatioPoints>();
         qDBusRegisterMetaType<unity::thumbnailer::service::ConfigValues>();
+        qDBusRegisterMetaType<unity::thumbnailer::service::BatchItem>();
+        qDBusRegisterMetaType<unity::thumbnailer::service::BatchItems>();
 
         if (!bus.registerService(BUS_NAME))
         {
             throw runtime_error(string("thumbnailer-service: Could not acquire DBus name ") + BUS_NAME);
         }
+        qDebug() << "Acquired DBus name after"
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count() << "ms";
 
         // Print basic cache stats on start-up. This is useful when examining log entries.
+        // It waits for the caches to be open, and throws if that failed.
         show_stats(thumbnailer);
 
         rc = app.exec();
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maintenancetask.h"
+
+#include <QDebug>
+#include <QThread>
+#include <QtConcurrent>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+namespace
+{
+
+// How long there must be no interactive requests before maintenance resumes.
+int const RESUME_DELAY_MS = 2000;
+
+// Each slice checks this many files. That takes a few milliseconds, so an
+// interactive request that arrives during a slice hardly has to wait.
+int const SLICE_SIZE = 50;
+
+// Pause between slices, so maintenance trickles along.
+int const SLICE_INTERVAL_MS = 100;
+
+// Once we have been through all files, we wait this long before starting over.
+int const PASS_INTERVAL_MS = 60 * 60 * 1000;
+
+// How long there must be no interactive requests before we compact a cache.
+// This is longer than the service normally stays alive while idle, which is why
+// we compact only if the service is resident.
+int const COMPACT_DELAY_MS = 5 * 60 * 1000;
+
+}  // namespace
+
+MaintenanceTask::MaintenanceTask(shared_ptr<Thumbnailer> const& thumbnailer,
+                                 InactivityHandler& inactivity_handler,
+                                 bool resident)
+    : thumbnailer_(thumbnailer)
+    , resident_(resident)
+    , paused_(false)
+    , pass_complete_(false)
+    , compact_pending_(false)
+{
+    pool_.setMaxThreadCount(1);
+
+    timer_.setSingleShot(true);
+    connect(&timer_, &QTimer::timeout, this, &MaintenanceTask::timerExpired);
+    compact_timer_.setSingleShot(true);
+    connect(&compact_timer_, &QTimer::timeout, this, &MaintenanceTask::compactTimerExpired);
+    connect(&inactivity_handler, &InactivityHandler::busy, this, &MaintenanceTask::pause);
+    connect(&inactivity_handler, &InactivityHandler::idle, this, &MaintenanceTask::resume);
+    connect(&slice_watcher_, &QFutureWatcher<bool>::finished, this, &MaintenanceTask::sliceFinished);
+    connect(&compact_watcher_, &QFutureWatcher<bool>::finished, this, &MaintenanceTask::compactionFinished);
+
+    // The service is usually started by a request, so we give that a head start.
+    timer_.start(RESUME_DELAY_MS);
+}
+
+MaintenanceTask::~MaintenanceTask()
+{
+    slice_watcher_.waitForFinished();
+    compact_watcher_.waitForFinished();
+    pool_.waitForDone();
+}
+
+void MaintenanceTask::pause()
+{
+    paused_ = true;
+    if (!pass_complete_)
+    {
+        timer_.stop();
+    }
+    compact_timer_.stop();
+}
+
+void MaintenanceTask::resume()
+{
+    paused_ = false;
+    if (!pass_complete_ && !slice_watcher_.isRunning())
+    {
+        timer_.start(RESUME_DELAY_MS);
+    }
+    if (compact_pending_ && !compact_watcher_.isRunning())
+    {
+        compact_timer_.start(COMPACT_DELAY_MS);
+    }
+}
+
+void MaintenanceTask::timerExpired()
+{
+    pass_complete_ = false;
+    if (!paused_)
+    {
+        next();
+    }
+}
+
+void MaintenanceTask::next()
+{
+    auto thumbnailer = thumbnailer_;
+    auto do_slice = [thumbnailer]() -> bool
+    {
+        QThread::currentThread()->setPriority(QThread::IdlePriority);
+        try
+        {
+            return thumbnailer->collect_garbage(SLICE_SIZE);
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "MaintenanceTask: cannot collect garbage:" << e.what();
+            return false;
+        }
+        // LCOV_EXCL_STOP
+    };
+    slice_watcher_.setFuture(QtConcurrent::run(&pool_, do_slice));
+}
+
+void MaintenanceTask::sliceFinished()
+{
+    if (slice_watcher_.result())
+    {
+        if (!paused_)
+        {
+            timer_.start(SLICE_INTERVAL_MS);
+        }
+        return;
+    }
+
+    auto stats = thumbnailer_->stats().gc_stats;
+    qDebug() << "MaintenanceTask: checked" << stats.files_checked << "files, removed"
+             << stats.entries_removed << "entries of" << stats.stale_files << "stale files,"
+             << stats.bytes_reclaimed << "bytes reclaimed";
+    pass_complete_ = true;
+    timer_.start(PASS_INTERVAL_MS);
+
+    compact_pending_ = resident_;
+    if (compact_pending_ && !paused_ && !compact_watcher_.isRunning())
+    {
+        compact_timer_.start(COMPACT_DELAY_MS);
+    }
+}
+
+void MaintenanceTask::compactTimerExpired()
+{
+    if (paused_)
+    {
+        return;
+    }
+    auto thumbnailer = thumbnailer_;
+    auto paused = &paused_;
+    auto do_compaction = [thumbnailer, paused]() -> bool
+    {
+        // A request may have come in while we waited for the pool.
+        if (*paused)
+        {
+            return true;
+        }
+        QThread::currentThread()->setPriority(QThread::IdlePriority);
+        try
+        {
+            return thumbnailer->compact_garbage();
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "MaintenanceTask: cannot compact cache:" << e.what();
+            return false;
+        }
+        // LCOV_EXCL_STOP
+    };
+    compact_watcher_.setFuture(QtConcurrent::run(&pool_, do_compaction));
+}
+
+void MaintenanceTask::compactionFinished()
+{
+    compact_pending_ = compact_watcher_.result();
+    if (compact_pending_ && !paused_)
+    {
+        compact_timer_.start(COMPACT_DELAY_MS);
+    }
+}
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
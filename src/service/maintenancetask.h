@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "inactivityhandler.h"
+
+#include <internal/thumbnailer.h>
+
+#include <QFutureWatcher>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <atomic>
+#include <memory>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+// MaintenanceTask removes the cache entries of files that were modified or
+// deleted, and compacts the caches afterwards, while the service is idle.
+//
+// The work is done in small slices (see Thumbnailer::collect_garbage()),
+// one at a time, on a private thread pool that runs at idle priority. As
+// soon as the inactivity handler reports an interactive request, no new
+// slice is started. Work resumes once no interactive request has been
+// active for a short while. After each pass over all files, we leave the
+// caches alone for an hour.
+//
+// A compaction can't be interrupted and holds up requests for that cache
+// while it runs, so we compact only after there has been no interactive
+// request for several minutes. The service normally exits after 30 seconds
+// without requests, so we compact only if it is resident (with background
+// indexing). Otherwise, compaction is left to the cache backend: leveldb
+// gets the space back in its own background compactions as it writes new
+// data, and SegmentStore once the oldest segments are evicted.
+
+class MaintenanceTask : public QObject
+{
+    Q_OBJECT
+public:
+    // resident is true if the service does not exit when it is idle.
+    MaintenanceTask(std::shared_ptr<internal::Thumbnailer> const& thumbnailer,
+                    InactivityHandler& inactivity_handler,
+                    bool resident);
+    ~MaintenanceTask();
+
+    MaintenanceTask(MaintenanceTask const&) = delete;
+    MaintenanceTask& operator=(MaintenanceTask&) = delete;
+
+private Q_SLOTS:
+    void pause();
+    void resume();
+    void timerExpired();
+    void sliceFinished();
+    void compactTimerExpired();
+    void compactionFinished();
+
+private:
+    void next();
+
+    std::shared_ptr<internal::Thumbnailer> const thumbnailer_;
+    QThreadPool pool_;
+    QTimer timer_;
+    QTimer compact_timer_;
+    QFutureWatcher<bool> slice_watcher_;
+    QFutureWatcher<bool> compact_watcher_;
+    bool const resident_;       // We compact the caches only if true.
+    std::atomic<bool> paused_;  // An interactive request is active.
+    bool pass_complete_;        // We are waiting for the next pass.
+    bool compact_pending_;      // Caches are waiting for compaction.
+};
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
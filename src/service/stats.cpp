@@ -88,12 +88,176 @@ QDBusArgument const& operator>>(QDBusArgument const& arg, CacheStats& s)
     return arg;
 }
 
+QDBusArgument& operator<<(QDBusArgument& arg, DedupStats const& s)
+{
+    arg.beginStructure();
+    arg << s.duplicate_files
+        << s.duplicate_hits
+        << s.bytes_saved;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, DedupStats& s)
+{
+    arg.beginStructure();
+    arg >> s.duplicate_files
+        >> s.duplicate_hits
+        >> s.bytes_saved;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, FilterStats const& s)
+{
+    arg.beginStructure();
+    arg << s.size_in_bytes
+        << s.entries
+        << s.false_positive_rate
+        << s.lookups_skipped;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, FilterStats& s)
+{
+    arg.beginStructure();
+    arg >> s.size_in_bytes
+        >> s.entries
+        >> s.false_positive_rate
+        >> s.lookups_skipped;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, GcStats const& s)
+{
+    arg.beginStructure();
+    arg << s.files_checked
+        << s.stale_files
+        << s.entries_removed
+        << s.bytes_reclaimed
+        << s.compactions;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, GcStats& s)
+{
+    arg.beginStructure();
+    arg >> s.files_checked
+        >> s.stale_files
+        >> s.entries_removed
+        >> s.bytes_reclaimed
+        >> s.compactions;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, RepairStats const& s)
+{
+    arg.beginStructure();
+    arg << s.repairs
+        << s.entries_salvaged
+        << s.entries_lost
+        << s.entries_restored;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, RepairStats& s)
+{
+    arg.beginStructure();
+    arg >> s.repairs
+        >> s.entries_salvaged
+        >> s.entries_lost
+        >> s.entries_restored;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, CancelStats const& s)
+{
+    arg.beginStructure();
+    arg << s.cancelled
+        << s.downloads_dropped
+        << s.downloads_aborted
+        << s.too_late;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, CancelStats& s)
+{
+    arg.beginStructure();
+    arg >> s.cancelled
+        >> s.downloads_dropped
+        >> s.downloads_aborted
+        >> s.too_late;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, WriteQueueStats const& s)
+{
+    arg.beginStructure();
+    arg << s.queued
+        << s.queued_bytes
+        << s.written
+        << s.batches
+        << s.coalesced
+        << s.stalls
+        << s.failures;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, WriteQueueStats& s)
+{
+    arg.beginStructure();
+    arg >> s.queued
+        >> s.queued_bytes
+        >> s.written
+        >> s.batches
+        >> s.coalesced
+        >> s.stalls
+        >> s.failures;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument& operator<<(QDBusArgument& arg, MissRatioPoint const& p)
+{
+    arg.beginStructure();
+    arg << p.size_in_bytes
+        << p.miss_ratio;
+    arg.endStructure();
+    return arg;
+}
+
+QDBusArgument const& operator>>(QDBusArgument const& arg, MissRatioPoint& p)
+{
+    arg.beginStructure();
+    arg >> p.size_in_bytes
+        >> p.miss_ratio;
+    arg.endStructure();
+    return arg;
+}
+
 QDBusArgument& operator<<(QDBusArgument& arg, AllStats const& s)
 {
     arg.beginStructure();
     arg << s.full_size_stats
         << s.thumbnail_stats
-        << s.failure_stats;
+        << s.failure_stats
+        << s.alias_stats
+        << s.dedup_stats
+        << s.failure_filter_stats
+        << s.gc_stats
+        << s.repair_stats
+        << s.full_size_write_queue_stats
+        << s.thumbnail_write_queue_stats
+        << s.cancel_stats;
     arg.endStructure();
     return arg;
 }
@@ -103,7 +267,15 @@ QDBusArgument const& operator>>(QDBusArgument const& arg, AllStats& s)
     arg.beginStructure();
     arg >> s.full_size_stats
         >> s.thumbnail_stats
-        >> s.failure_stats;
+        >> s.failure_stats
+        >> s.alias_stats
+        >> s.dedup_stats
+        >> s.failure_filter_stats
+        >> s.gc_stats
+        >> s.repair_stats
+        >> s.full_size_write_queue_stats
+        >> s.thumbnail_write_queue_stats
+        >> s.cancel_stats;
     arg.endStructure();
     return arg;
 }
@@ -55,11 +55,79 @@ struct CacheStats
     QList<quint32> histogram;
 };
 
+struct DedupStats
+{
+    qint64 duplicate_files;
+    qint64 duplicate_hits;
+    qint64 bytes_saved;
+};
+
+struct FilterStats
+{
+    qint64 size_in_bytes;
+    qint64 entries;
+    double false_positive_rate;
+    qint64 lookups_skipped;
+};
+
+struct GcStats
+{
+    qint64 files_checked;
+    qint64 stale_files;
+    qint64 entries_removed;
+    qint64 bytes_reclaimed;
+    qint64 compactions;
+};
+
+struct RepairStats
+{
+    qint64 repairs;
+    qint64 entries_salvaged;
+    qint64 entries_lost;
+    qint64 entries_restored;
+};
+
+// How much work cancellation saved us.
+struct CancelStats
+{
+    qint64 cancelled;          // Requests that were cancelled.
+    qint64 downloads_dropped;  // Cancelled before the download/extract started.
+    qint64 downloads_aborted;  // Cancelled while the download/extract was running.
+    qint64 too_late;           // Cancellations that arrived after the work was done.
+};
+
+struct WriteQueueStats
+{
+    qint64 queued;
+    qint64 queued_bytes;
+    qint64 written;
+    qint64 batches;
+    qint64 coalesced;
+    qint64 stalls;
+    qint64 failures;
+};
+
+struct MissRatioPoint
+{
+    qint64 size_in_bytes;
+    double miss_ratio;
+};
+
+typedef QList<MissRatioPoint> MissRatioPoints;
+
 struct AllStats
 {
     CacheStats full_size_stats;
     CacheStats thumbnail_stats;
     CacheStats failure_stats;
+    CacheStats alias_stats;
+    DedupStats dedup_stats;
+    FilterStats failure_filter_stats;
+    GcStats gc_stats;
+    RepairStats repair_stats;
+    WriteQueueStats full_size_write_queue_stats;
+    WriteQueueStats thumbnail_write_queue_stats;
+    CancelStats cancel_stats;
 };
 
 }  // namespace service
@@ -69,9 +137,31 @@ struct AllStats
 }  // namespace unity
 
 Q_DECLARE_METATYPE(unity::thumbnailer::service::AllStats)
+Q_DECLARE_METATYPE(unity::thumbnailer::service::MissRatioPoints)
 
 QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::CacheStats const& s);
 QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::CacheStats& s);
 
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::DedupStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::DedupStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::FilterStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::FilterStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::GcStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::GcStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::RepairStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::RepairStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::CancelStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::CancelStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::WriteQueueStats const& s);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::WriteQueueStats& s);
+
+QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::MissRatioPoint const& p);
+QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::MissRatioPoint& p);
+
 QDBusArgument& operator<<(QDBusArgument& arg, unity::thumbnailer::service::AllStats const& s);
 QDBusArgument const& operator>>(QDBusArgument const& arg, unity::thumbnailer::service::AllStats& s);
@@ -30,6 +30,7 @@
 
 #include <chrono>
 #include <memory>
+#include <sstream>
 
 using namespace std;
 
@@ -85,11 +86,78 @@ int Settings::failure_cache_size() const
     return get_positive_int("failure-cache-size", FAILURE_CACHE_SIZE_DEFAULT);
 }
 
+string Settings::full_size_cache_backend() const
+{
+    return get_backend("full-size-cache-backend", FULL_SIZE_CACHE_BACKEND_DEFAULT);
+}
+
+string Settings::thumbnail_cache_backend() const
+{
+    return get_backend("thumbnail-cache-backend", THUMBNAIL_CACHE_BACKEND_DEFAULT);
+}
+
+string Settings::failure_cache_backend() const
+{
+    return get_backend("failure-cache-backend", FAILURE_CACHE_BACKEND_DEFAULT);
+}
+
+int Settings::memory_cache_size() const
+{
+    return get_positive_or_zero_int("memory-cache-size", MEMORY_CACHE_SIZE_DEFAULT);
+}
+
+int Settings::warm_restart_entries() const
+{
+    return get_positive_or_zero_int("warm-restart-entries", WARM_RESTART_ENTRIES_DEFAULT);
+}
+
+int Settings::target_hit_rate() const
+{
+    int rate = get_positive_or_zero_int("target-hit-rate", TARGET_HIT_RATE_DEFAULT);
+    if (rate >= 100)
+    {
+        throw domain_error(string("Settings::target_hit_rate(): invalid value for target-hit-rate: ")
+                           + to_string(rate) + " (must be less than 100) in schema " + schema_name_);
+    }
+    return rate;
+}
+
+int Settings::full_size_cache_min_size() const
+{
+    return get_positive_int("full-size-cache-min-size", FULL_SIZE_CACHE_MIN_SIZE_DEFAULT);
+}
+
+int Settings::full_size_cache_max_size() const
+{
+    return get_positive_int("full-size-cache-max-size", FULL_SIZE_CACHE_MAX_SIZE_DEFAULT);
+}
+
+int Settings::thumbnail_cache_min_size() const
+{
+    return get_positive_int("thumbnail-cache-min-size", THUMBNAIL_CACHE_MIN_SIZE_DEFAULT);
+}
+
+int Settings::thumbnail_cache_max_size() const
+{
+    return get_positive_int("thumbnail-cache-max-size", THUMBNAIL_CACHE_MAX_SIZE_DEFAULT);
+}
+
 int Settings::max_thumbnail_size() const
 {
     return get_positive_int("max-thumbnail-size", MAX_THUMBNAIL_SIZE_DEFAULT);
 }
 
+int Settings::thumbnail_size_ladder() const
+{
+    int step = get_positive_or_zero_int("thumbnail-size-ladder", THUMBNAIL_SIZE_LADDER_DEFAULT);
+    if (step != 0 && step <= 100)
+    {
+        throw domain_error(string("Settings::thumbnail_size_ladder(): invalid value for thumbnail-size-ladder: ")
+                           + to_string(step) + " (must be 0 or greater than 100) in schema " + schema_name_);
+    }
+    return step;
+}
+
 int Settings::retry_not_found_hours() const
 {
     return get_positive_int("retry-not-found-hours", RETRY_NOT_FOUND_HOURS_DEFAULT);
@@ -164,6 +232,40 @@ int Settings::log_level() const
     return log_level;
 }
 
+bool Settings::background_indexing() const
+{
+    return get_bool("background-indexing", BACKGROUND_INDEXING_DEFAULT);
+}
+
+vector<int> Settings::background_indexing_sizes() const
+{
+    string const list = get_string("background-indexing-sizes", BACKGROUND_INDEXING_SIZES_DEFAULT);
+
+    vector<int> sizes;
+    istringstream s(list);
+    string item;
+    while (getline(s, item, ','))
+    {
+        size_t pos;
+        int size = 0;
+        try
+        {
+            size = stoi(item, &pos);
+        }
+        catch (std::exception const&)
+        {
+            pos = 0;
+        }
+        if (pos == 0 || item.find_first_not_of(" \t", pos) != string::npos || size <= 0)
+        {
+            throw domain_error("Settings::background_indexing_sizes(): invalid value for background-indexing-sizes: \""
+                               + list + "\" in schema " + schema_name_);
+        }
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
 string Settings::get_string(char const* key, string const& default_value) const
 {
     if (!settings_ || !g_settings_schema_has_key(schema_.get(), key))
@@ -181,6 +283,19 @@ string Settings::get_string(char const* key, string const& default_value) const
     return default_value; // LCOV_EXCL_LINE
 }
 
+// The schema limits the choices, so this fails only if the schema was changed by hand.
+
+string Settings::get_backend(char const* key, string const& default_value) const
+{
+    string const backend = get_string(key, default_value);
+    if (backend != "leveldb" && backend != "segments")
+    {
+        throw domain_error(string("Settings::get_backend(): invalid value for ") + key + ": \""
+                           + backend + "\" in schema " + schema_name_);  // LCOV_EXCL_LINE
+    }
+    return backend;
+}
+
 int Settings::get_positive_int(char const* key, int default_value) const
 {
     int i = get_int(key, default_value);
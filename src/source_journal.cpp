@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/source_journal.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// The journal has one record per source, keyed by 's' + source key, which holds the
+// cache key and the identity of the source. For each cache key, a record keyed by
+// 'k' + cache key holds the number of sources and the keys of the entries.
+
+char const SOURCE_PREFIX = 's';
+char const CACHE_KEY_PREFIX = 'k';
+char const CURSOR_KEY[] = "cursor";
+
+void append32(string& s, uint32_t n)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        s += char(n >> shift);
+    }
+}
+
+bool read32(string const& s, size_t& pos, uint32_t& n)
+{
+    if (s.size() - pos < 4)
+    {
+        return false;
+    }
+    n = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        n = n << 8 | static_cast<unsigned char>(s[pos++]);
+    }
+    return true;
+}
+
+void append_string(string& s, string const& str)
+{
+    append32(s, str.size());
+    s += str;
+}
+
+bool read_string(string const& s, size_t& pos, string& str)
+{
+    uint32_t len;
+    if (!read32(s, pos, len) || s.size() - pos < len)
+    {
+        return false;
+    }
+    str = s.substr(pos, len);
+    pos += len;
+    return true;
+}
+
+// Returns the record for a cache key.
+
+string encode_cache_key_record(uint32_t num_sources, vector<string> const& entry_keys)
+{
+    string record;
+    append32(record, num_sources);
+    for (auto const& k : entry_keys)
+    {
+        append_string(record, k);
+    }
+    return record;
+}
+
+bool decode_cache_key_record(string const& record, uint32_t& num_sources, vector<string>& entry_keys)
+{
+    size_t pos = 0;
+    if (!read32(record, pos, num_sources))
+    {
+        return false;
+    }
+    entry_keys.clear();
+    while (pos < record.size())
+    {
+        string key;
+        if (!read_string(record, pos, key))
+        {
+            return false;
+        }
+        entry_keys.push_back(move(key));
+    }
+    return true;
+}
+
+}  // namespace
+
+SourceJournal::SourceJournal(string const& path, int64_t max_size_in_bytes)
+    : path_(path)
+    , max_size_(max_size_in_bytes)
+    , cursor_(0)
+{
+    open();
+}
+
+SourceJournal::~SourceJournal() = default;
+
+void SourceJournal::open()
+{
+    try
+    {
+        store_ = SegmentStore::open(path_, max_size_, core::CacheDiscardPolicy::lru_only);
+    }
+    catch (std::exception const&)
+    {
+        // All we lose by starting over is the garbage we know about.
+        boost::filesystem::remove_all(path_);
+        store_ = SegmentStore::open(path_, max_size_, core::CacheDiscardPolicy::lru_only);
+    }
+
+    auto cursor = store_->get(CURSOR_KEY);
+    if (cursor)
+    {
+        try
+        {
+            cursor_ = stoull(*cursor);
+        }
+        catch (std::exception const&)
+        {
+            cursor_ = 0;
+        }
+    }
+}
+
+void SourceJournal::add_source(string const& source_key, string const& identity, string const& cache_key)
+{
+    string const key = SOURCE_PREFIX + source_key;
+    if (store_->contains_key(key))
+    {
+        return;  // Common case, no need to lock.
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    if (store_->contains_key(key))
+    {
+        return;
+    }
+    string record;
+    append_string(record, cache_key);
+    record += identity;
+    if (!store_->put(key, record))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+
+    uint32_t num_sources = 0;
+    vector<string> entry_keys;
+    auto cache_key_record = store_->get(CACHE_KEY_PREFIX + cache_key);
+    if (cache_key_record && !decode_cache_key_record(*cache_key_record, num_sources, entry_keys))
+    {
+        num_sources = 0;  // LCOV_EXCL_LINE
+        entry_keys.clear();  // LCOV_EXCL_LINE
+    }
+    store_->put(CACHE_KEY_PREFIX + cache_key, encode_cache_key_record(num_sources + 1, entry_keys));
+}
+
+void SourceJournal::add_entry(string const& cache_key, string const& entry_key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto record = store_->get(CACHE_KEY_PREFIX + cache_key);
+    uint32_t num_sources;
+    vector<string> entry_keys;
+    if (!record || !decode_cache_key_record(*record, num_sources, entry_keys))
+    {
+        return;
+    }
+    if (find(entry_keys.begin(), entry_keys.end(), entry_key) != entry_keys.end())
+    {
+        return;
+    }
+    entry_keys.push_back(entry_key);
+    store_->put(CACHE_KEY_PREFIX + cache_key, encode_cache_key_record(num_sources, entry_keys));
+}
+
+// Drops a source from the record for cache_key. Returns true and sets entry_keys
+// if that was the last source. If we don't have a record for cache_key, we can't
+// tell whether there are other sources, so we assume that there are.
+
+bool SourceJournal::release_source(string const& cache_key, vector<string>& entry_keys)
+{
+    string const key = CACHE_KEY_PREFIX + cache_key;
+    auto record = store_->get(key);
+    uint32_t num_sources;
+    if (!record || !decode_cache_key_record(*record, num_sources, entry_keys))
+    {
+        entry_keys.clear();
+        return false;
+    }
+    if (num_sources > 1)
+    {
+        store_->put(key, encode_cache_key_record(num_sources - 1, entry_keys));
+        entry_keys.clear();
+        return false;
+    }
+    store_->take(key);
+    return true;
+}
+
+SourceJournal::SweepResult SourceJournal::sweep(int max_sources, IsCurrentFunc const& is_current)
+{
+    assert(is_current);
+
+    SweepResult result{0, false, {}};
+
+    uint64_t cursor;
+    {
+        lock_guard<mutex> lock(mutex_);
+        cursor = cursor_;
+    }
+    auto records = store_->scan(cursor, max_sources);
+    result.pass_complete = cursor == 0;
+
+    // Checking the files can take a while, so we don't hold the lock while we do that.
+    vector<pair<string, string>> stale;  // Source key and cache key
+    for (auto const& r : records)
+    {
+        if (r.first.empty() || r.first[0] != SOURCE_PREFIX)
+        {
+            continue;
+        }
+        ++result.sources_checked;
+        size_t pos = 0;
+        string cache_key;
+        if (!read_string(r.second, pos, cache_key) || !is_current(r.second.substr(pos)))
+        {
+            stale.emplace_back(r.first.substr(1), move(cache_key));
+        }
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    for (auto& s : stale)
+    {
+        if (!store_->take(SOURCE_PREFIX + s.first))
+        {
+            continue;  // LCOV_EXCL_LINE
+        }
+        Garbage g{s.first, s.second, false, {}};
+        g.last_source = !s.second.empty() && release_source(s.second, g.entry_keys);
+        result.garbage.push_back(move(g));
+    }
+    cursor_ = cursor;
+    store_->put(CURSOR_KEY, to_string(cursor_));
+
+    // Updates leave dead space behind, which we reclaim once per pass.
+    if (result.pass_complete)
+    {
+        auto st = store_->stats();
+        if (st.segments > 1 && st.disk_size_in_bytes > 2 * st.size_in_bytes)
+        {
+            store_->compact();
+        }
+    }
+    return result;
+}
+
+void SourceJournal::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+    store_->invalidate();
+    cursor_ = 0;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -45,6 +45,8 @@ ShowStats::ShowStats(QCommandLineParser& parser)
     parser.addPositionalArgument(QStringLiteral("cache_id"), QStringLiteral("Select cache (i=image, t=thumbnail, f=failure)"), QStringLiteral("[cache_id]"));
     QCommandLineOption histogram_option({"v", "verbose"}, QStringLiteral("Show histogram"));
     parser.addOption(histogram_option);
+    QCommandLineOption miss_ratio_option({"m", "miss-ratio"}, QStringLiteral("Show miss ratio curve"));
+    parser.addOption(miss_ratio_option);
 
     if (!parser.parse(QCoreApplication::arguments()))
     {
@@ -65,9 +67,14 @@ ShowStats::ShowStats(QCommandLineParser& parser)
     {
         show_histogram_ = true;
     }
+    if (parser.isSet(miss_ratio_option))
+    {
+        show_miss_ratio_ = true;
+    }
 
     if (args.size() == 2)
     {
+        show_dedup_stats_ = false;
         QString arg = args[1];
         if (arg == QLatin1String("i"))
         {
@@ -190,9 +197,37 @@ void ShowStats::show_stats(service::CacheStats const& st)
     }
 }
 
+void ShowStats::show_write_queue_stats(service::WriteQueueStats const& st)
+{
+    printf("%s\n", "Write queue:");
+    printf("    Queued:                %" PRId64 "\n", int64_t(st.queued));
+    printf("    Queued bytes:          %" PRId64 "\n", int64_t(st.queued_bytes));
+    printf("    Written:               %" PRId64 "\n", int64_t(st.written));
+    printf("    Batches:               %" PRId64 "\n", int64_t(st.batches));
+    printf("    Coalesced:             %" PRId64 "\n", int64_t(st.coalesced));
+    printf("    Stalls:                %" PRId64 "\n", int64_t(st.stalls));
+    printf("    Failures:              %" PRId64 "\n", int64_t(st.failures));
+}
+
+void ShowStats::show_miss_ratio_curve(DBusConnection& conn, int cache_id)
+{
+    auto reply = conn.admin().MissRatioCurve(cache_id);
+    reply.waitForFinished();
+    if (!reply.isValid())
+    {
+        throw reply.error().message();  // LCOV_EXCL_LINE
+    }
+    printf("    Miss ratio curve:\n");
+    for (auto const& p : reply.value())
+    {
+        printf("        %10" PRId64 ": %.03f\n", int64_t(p.size_in_bytes), p.miss_ratio);
+    }
+}
+
 void ShowStats::run(DBusConnection& conn)
 {
     qDBusRegisterMetaType<unity::thumbnailer::service::AllStats>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::MissRatioPoints>();
 
     auto reply = conn.admin().Stats();
     reply.waitForFinished();
@@ -205,16 +240,56 @@ void ShowStats::run(DBusConnection& conn)
     {
         printf("%s\n", "Image cache:");
         show_stats(st.full_size_stats);
+        if (show_miss_ratio_)
+        {
+            show_miss_ratio_curve(conn, 1);
+        }
+        show_write_queue_stats(st.full_size_write_queue_stats);
     }
     if (show_thumbnail_stats_)
     {
         printf("%s\n", "Thumbnail cache:");
         show_stats(st.thumbnail_stats);
+        if (show_miss_ratio_)
+        {
+            show_miss_ratio_curve(conn, 2);
+        }
+        show_write_queue_stats(st.thumbnail_write_queue_stats);
     }
     if (show_failure_stats_)
     {
         printf("%s\n", "Failure cache:");
         show_stats(st.failure_stats);
+        printf("%s\n", "Failure filter:");
+        printf("    Entries:               %" PRId64 "\n", int64_t(st.failure_filter_stats.entries));
+        printf("    Size in bytes:         %" PRId64 "\n", int64_t(st.failure_filter_stats.size_in_bytes));
+        printf("    False positive rate:   %.04f\n", st.failure_filter_stats.false_positive_rate);
+        printf("    Lookups skipped:       %" PRId64 "\n", int64_t(st.failure_filter_stats.lookups_skipped));
+    }
+    if (show_dedup_stats_)
+    {
+        printf("%s\n", "Alias cache:");
+        show_stats(st.alias_stats);
+        printf("%s\n", "Deduplication:");
+        printf("    Duplicate files:       %" PRId64 "\n", int64_t(st.dedup_stats.duplicate_files));
+        printf("    Duplicate hits:        %" PRId64 "\n", int64_t(st.dedup_stats.duplicate_hits));
+        printf("    Bytes saved:           %" PRId64 "\n", int64_t(st.dedup_stats.bytes_saved));
+        printf("%s\n", "Garbage collection:");
+        printf("    Files checked:         %" PRId64 "\n", int64_t(st.gc_stats.files_checked));
+        printf("    Stale files:           %" PRId64 "\n", int64_t(st.gc_stats.stale_files));
+        printf("    Entries removed:       %" PRId64 "\n", int64_t(st.gc_stats.entries_removed));
+        printf("    Bytes reclaimed:       %" PRId64 "\n", int64_t(st.gc_stats.bytes_reclaimed));
+        printf("    Compactions:           %" PRId64 "\n", int64_t(st.gc_stats.compactions));
+        printf("%s\n", "Repair:");
+        printf("    Repairs:               %" PRId64 "\n", int64_t(st.repair_stats.repairs));
+        printf("    Entries salvaged:      %" PRId64 "\n", int64_t(st.repair_stats.entries_salvaged));
+        printf("    Entries lost:          %" PRId64 "\n", int64_t(st.repair_stats.entries_lost));
+        printf("    Entries restored:      %" PRId64 "\n", int64_t(st.repair_stats.entries_restored));
+        printf("%s\n", "Cancellation:");
+        printf("    Cancelled requests:    %" PRId64 "\n", int64_t(st.cancel_stats.cancelled));
+        printf("    Downloads dropped:     %" PRId64 "\n", int64_t(st.cancel_stats.downloads_dropped));
+        printf("    Downloads aborted:     %" PRId64 "\n", int64_t(st.cancel_stats.downloads_aborted));
+        printf("    Too late:              %" PRId64 "\n", int64_t(st.cancel_stats.too_late));
     }
 }
 
@@ -41,11 +41,15 @@ public:
 
 private:
     void show_stats(unity::thumbnailer::service::CacheStats const& st);
+    void show_write_queue_stats(unity::thumbnailer::service::WriteQueueStats const& st);
+    void show_miss_ratio_curve(DBusConnection& conn, int cache_id);
 
     bool show_histogram_ = false;
+    bool show_miss_ratio_ = false;
     bool show_image_stats_ = true;
     bool show_thumbnail_stats_ = true;
     bool show_failure_stats_ = true;
+    bool show_dedup_stats_ = true;
 };
 
 }  // namespace tools
@@ -21,8 +21,11 @@
 #include <internal/thumbnailer.h>
 
 #include <internal/artreply.h>
-#include <internal/cachehelper.h>
 #include <internal/check_access.h>
+#include <internal/content_hash.h>
+#include <internal/disk_cache.h>
+#include <internal/embedded_art.h>
+#include <internal/file_io.h>
 #include <internal/image.h>
 #include <internal/imageextractor.h>
 #include <internal/local_album_art.h>
@@ -37,8 +40,17 @@
 #include <boost/filesystem.hpp>
 #include <unity/UnityExceptions.h>
 
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -60,6 +72,180 @@ enum class Location
     remote
 };
 
+// How long we remember a failure from the failure cache in memory.
+chrono::seconds const FAILURE_MEMORY_CACHE_TTL(60);
+
+// Each alias takes around 150 bytes, so this is enough for tens of thousands of files.
+int64_t const ALIAS_CACHE_SIZE = 4 * 1024 * 1024;
+
+// Each source of the source journal takes a few hundred bytes, so this covers a similar number of files.
+int64_t const SOURCE_JOURNAL_SIZE = 8 * 1024 * 1024;
+
+// How long after an upgrade we look for cache entries with keys in the old format.
+chrono::hours const LEGACY_KEY_MIGRATION_PERIOD(24 * 28);
+
+// The failure filter is sized for one entry per this many bytes of failure cache.
+// A failure entry is a 16-byte key with an empty value, plus whatever leveldb needs
+// to store it, so we err on the generous side.
+int64_t const FAILURE_ENTRY_SIZE = 64;
+double const FAILURE_FILTER_FPR = 0.01;
+
+// Typical entry sizes, to size the frequency sketches of the admission filters.
+int64_t const THUMBNAIL_ENTRY_SIZE = 16 * 1024;
+int64_t const FULL_SIZE_ENTRY_SIZE = 256 * 1024;
+
+// A thumbnail that is served from memory touches its disk entry every this many hits,
+// so the disk cache doesn't evict it as unused while it is popular.
+int64_t const DISK_REFRESH_HITS = 16;
+
+// Upper bound on the memory used by the entries that are waiting to be written to each cache.
+int64_t const WRITE_QUEUE_SIZE = 16 * 1024 * 1024;
+
+// Adaptive cache sizing doesn't change the size of a cache before we have seen this many requests for it.
+double const MIN_ADAPTIVE_REQUESTS = 1000;
+
+WriteBehindQueue::WriteFunc write_func(PersistentAdmissionFilter* filter, char const* cache_name)
+{
+    return [filter, cache_name](string const& key, string const& value)
+    {
+        try
+        {
+            filter->put(key, value);
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qCritical().nospace() << "cannot write to " << cache_name << ": " << e.what();
+            throw;
+        }
+        // LCOV_EXCL_STOP
+    };
+}
+
+void load_sketch(PersistentAdmissionFilter& filter, string const& path)
+{
+    try
+    {
+        if (!filter.deserialize(read_file(path)))
+        {
+            qDebug() << "ignoring invalid request history in" << path.c_str();
+        }
+    }
+    catch (std::exception const&)
+    {
+        // Nothing saved yet.
+    }
+}
+
+MissRatioEstimator::UPtr load_estimator(string const& path)
+{
+    MissRatioEstimator::UPtr mrc(new MissRatioEstimator);
+    try
+    {
+        if (!mrc->deserialize(read_file(path)))
+        {
+            qDebug() << "ignoring invalid miss ratio data in" << path.c_str();
+        }
+    }
+    catch (std::exception const&)
+    {
+        // Nothing saved yet.
+    }
+    return mrc;
+}
+
+// With adaptive sizing, returns the smallest size (in whole megabytes) at which the
+// cache is estimated to reach the target hit rate, clamped to the bounds.
+// Otherwise, or if we don't know enough yet, returns the configured size.
+
+int64_t adapted_cache_size(MissRatioEstimator const& mrc,
+                           char const* name,
+                           int64_t configured_size,
+                           int target_hit_rate,
+                           int64_t min_size,
+                           int64_t max_size)
+{
+    if (target_hit_rate == 0 || mrc.requests() < MIN_ADAPTIVE_REQUESTS)
+    {
+        return configured_size;
+    }
+    int64_t const mb = 1024 * 1024;
+    int64_t size = mrc.size_for_miss_ratio(1.0 - target_hit_rate / 100.0);
+    size = min(max((size + mb - 1) / mb * mb, min_size), max_size);
+    qDebug() << name << "size for" << target_hit_rate << "% hit rate:" << size / mb
+             << "MB, estimated hit rate" << 1.0 - mrc.miss_ratio(size);
+    return size;
+}
+
+// Appends width and height to key as two 32-bit big-endian integers.
+
+void append_size(string& key, QSize const& size)
+{
+    for (int dimension : { size.width(), size.height() })
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            key += char(uint32_t(dimension) >> shift);
+        }
+    }
+}
+
+// Returns the size that append_size() appended to key.
+
+QSize key_size(string const& key)
+{
+    assert(key.size() >= 8);
+    size_t pos = key.size() - 8;
+    int dimensions[2];
+    for (int& dimension : dimensions)
+    {
+        uint32_t val = 0;
+        for (size_t end = pos + 4; pos < end; ++pos)
+        {
+            val = val << 8 | static_cast<unsigned char>(key[pos]);
+        }
+        dimension = int(val);
+    }
+    return QSize(dimensions[0], dimensions[1]);
+}
+
+// Returns the identity of a local file: the concatenation of path name, device,
+// inode, modification time, and size. If any of these change, so does the identity.
+
+string file_identity(string const& filename, struct stat const& st)
+{
+    string identity = filename;
+    identity += '\0';
+    identity += to_string(st.st_dev);
+    identity += '\0';
+    identity += to_string(st.st_ino);
+    identity += '\0';
+    identity += to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
+    identity += '\0';
+    identity += to_string(st.st_size);
+    return identity;
+}
+
+// Returns false if the file with the given identity was modified or deleted.
+// If the directory of the file is gone as well, the file may be on removable
+// media that isn't mounted right now, so we leave it alone.
+
+bool is_current_file(string const& identity)
+{
+    string const filename = identity.substr(0, identity.find('\0'));
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0)
+    {
+        return S_ISREG(st.st_mode) && file_identity(filename, st) == identity;
+    }
+    if (errno != ENOENT)
+    {
+        return true;  // Can't tell.
+    }
+    string const dir = boost::filesystem::path(filename).parent_path().native();
+    return stat(dir.c_str(), &st) == -1;
+}
+
 }  // namespace
 
 class RequestBase : public ThumbnailRequest
@@ -86,6 +272,14 @@ public:
     {
     }
 
+    bool coalesce(ThumbnailRequest const& other) override;
+    void uncoalesce(ThumbnailRequest const& other) override;
+
+    bool cancel_download() override
+    {
+        return false;  // Network downloads run to completion.
+    }
+
     enum class CachePolicy
     {
         cache_fullsize,
@@ -136,9 +330,50 @@ protected:
                 chrono::milliseconds timeout);
     virtual ImageData fetch(QSize const& size_hint) noexcept = 0;
 
+    // Returns the key under which the request is stored in the persistent caches.
+    virtual string lookup_cache_key()
+    {
+        return key_hash_;
+    }
+
+    // Returns the key that cache version 2 used for the request.
+    virtual string legacy_key() const
+    {
+        return key_;
+    }
+
     ArtDownloader* downloader() const
     {
-        return thumbnailer_->downloader_.get();
+        return thumbnailer_->downloader();
+    }
+
+    QSize target_size(QSize const& requested_size) const;
+    QSize ladder_size(QSize const& target_size) const;
+    QSize next_ladder_size(QSize const& ladder_size) const;
+    string sized_key(QSize const& target_size) const;
+    string memory_key(QSize const& target_size) const;
+    string legacy_sized_key(QSize const& target_size) const;
+    core::Optional<string> migrate(DiskCache& cache, string const& legacy_key, string const& key);
+    core::Optional<string> cached_thumbnail(string const& key, bool requested = true);
+    QByteArray put_thumbnail(Image const& ladder_image, QSize const& target_size);
+    vector<QSize> close_coalescing(QSize const& target_size);
+    void reopen_coalescing();
+    void count_duplicate_file();
+    void count_duplicate_hit(int64_t bytes);
+
+    shared_ptr<ExtractorPool> const& extractor_pool() const
+    {
+        return thumbnailer_->extractor_pool_;
+    }
+
+    DiskCache* alias_cache() const
+    {
+        return thumbnailer_->alias_cache_.get();
+    }
+
+    SourceJournal* source_journal() const
+    {
+        return thumbnailer_->source_journal_.get();
     }
 
     // LCOV_EXCL_START
@@ -164,12 +399,20 @@ protected:
 
     Thumbnailer* thumbnailer_;
     string key_;
+    string key_hash_;    // Hash of key_, set by thumbnail().
+    string cache_key_;   // Set by thumbnail(), see lookup_cache_key().
+    bool duplicate_;     // Set by lookup_cache_key() if the file is a copy of a file we have seen before.
+    bool journaled_;     // Set by lookup_cache_key() if cache_key_ has a source in the source journal.
     QSize const requested_size_;
     string error_message_;
     chrono::milliseconds timeout_;
 
 private:
     FetchStatus status_;
+
+    mutex coalesce_mutex_;
+    vector<QSize> coalesced_sizes_;  // Target sizes of other requests for the same key, one per request.
+    bool coalescing_closed_;         // Set once we have picked the size to decode at.
 };
 
 namespace
@@ -194,10 +437,14 @@ public:
 
 protected:
     ImageData fetch(QSize const& size_hint) noexcept override;
+    string lookup_cache_key() override;
+    string legacy_key() const override;
     void download(std::chrono::milliseconds timeout) override;
+    bool cancel_download() override;
 
 private:
     string filename_;
+    struct stat stat_;
     unique_ptr<ImageExtractor> image_extractor_;
 };
 
@@ -263,9 +510,12 @@ RequestBase::RequestBase(Thumbnailer* thumbnailer,
                          chrono::milliseconds timeout)
     : thumbnailer_(thumbnailer)
     , key_(key)
+    , duplicate_(false)
+    , journaled_(false)
     , requested_size_(requested_size)
     , timeout_(timeout)
     , status_(FetchStatus::needs_download)
+    , coalescing_closed_(false)
 {
 }
 
@@ -273,8 +523,16 @@ RequestBase::RequestBase(Thumbnailer* thumbnailer,
 //
 // key_ is set by the subclass to uniquely identify what is being
 // thumbnailed.  For online art, this includes the artist and album.
-// For local thumbnails, this includes the path name, inode, mtime,
-// and ctime.
+// For local thumbnails, this includes the path name, device, inode,
+// mtime, and size.
+//
+// The caches don't use key_ directly. Instead, the keys are a 128-bit
+// hash, followed by the packed width and height for thumbnails.
+// The memory caches are indexed by the hash of key_. For the persistent
+// caches, we look up the key once we've missed in memory. For local
+// files, that is an id for the contents of the file, so copies and hard
+// links of a file share their cache entries. For online art, it is
+// the hash of key_.
 //
 // We first look in the cache to see if we have a thumbnail already
 // for the provided key and size.  If not, we check whether a
@@ -291,6 +549,23 @@ RequestBase::RequestBase(Thumbnailer* thumbnailer,
 // At this point we have the image data, so scale it to the desired
 // size, store the scaled version to the thumbnail cache and return
 // it.
+//
+// The thumbnail and failure caches each have an in-memory tier in
+// front of them. An entry is promoted into memory only on its second
+// access (that is, when we find it in the persistent cache), so
+// thumbnails that are requested just once don't displace hot ones.
+//
+// The persistent thumbnail and full-size caches are protected the same way:
+// once they are full, new entries go into a small window cache first, and only
+// entries that are requested repeatedly make it into the main cache (see
+// admission_filter.h).
+//
+// Requests for the same key are run one after the other. While a request
+// is in progress, later requests for other sizes can attach to it by
+// calling coalesce(). When the in-progress request gets to decode the image,
+// it decodes at a size that is large enough for all attached requests,
+// and adds their thumbnails to the cache along with its own. When the
+// attached requests get to run, they find their thumbnail in the cache.
 
 QByteArray RequestBase::thumbnail()
 {
@@ -309,40 +584,122 @@ QByteArray RequestBase::thumbnail()
             throw invalid_argument(msg.toStdString());
         }
 
-        // Enforce size limitation.
-        auto target_size = QSize(thumbnailer_->max_size_, thumbnailer_->max_size_);
-        if (requested_size_.width() != 0)
-        {
-            target_size.setWidth(min(requested_size_.width(), thumbnailer_->max_size_));
-        }
-        if (requested_size_.height() != 0)
+        if (key_hash_.empty())
         {
-            target_size.setHeight(min(requested_size_.height(), thumbnailer_->max_size_));
+            key_hash_ = key_hash(key_);
         }
-
-        string sized_key = key_;
-        sized_key += '\0';
-        sized_key += to_string(target_size.width());
-        sized_key += '\0';
-        sized_key += to_string(target_size.height());
+        auto const target_size = this->target_size(requested_size_);
+        auto const memory_key = this->memory_key(target_size);
 
         // Check if we have the thumbnail in the cache already.
         assert(thumbnailer_);
         assert(thumbnailer_->thumbnail_cache_);
-        auto thumbnail = thumbnailer_->thumbnail_cache_->get(sized_key);
+        string source;
+        int64_t hits;
+        auto hot = thumbnailer_->thumbnail_memory_cache_->get(memory_key, &source, &hits);
+        if (hot)
+        {
+            if (!source.empty())
+            {
+                // The request still counts for the disk cache, as if the memory cache weren't there.
+                thumbnailer_->thumbnail_admission_->record(source);
+                thumbnailer_->thumbnail_mrc_->record_repeat(source);
+                if (hits % DISK_REFRESH_HITS == 0)
+                {
+                    cached_thumbnail(source, false);
+                }
+            }
+            status_ = FetchStatus::cache_hit;
+            return *hot;
+        }
+
+        if (cache_key_.empty())
+        {
+            cache_key_ = lookup_cache_key();
+        }
+
+        // The disk cache holds thumbnails at the ladder size for the target size. If that
+        // differs from the target size, we scale the (small) cached thumbnail down.
+        auto const ladder_size = this->ladder_size(target_size);
+        auto const ladder_key = this->sized_key(ladder_size);
+        auto thumbnail = cached_thumbnail(ladder_key);
+        if (!thumbnail && thumbnailer_->migrate_legacy_keys_)
+        {
+            // Version 2 stored thumbnails at the target size, which usually isn't on the ladder.
+            // Such a thumbnail is too small to stand in for the ladder size, so we don't move it.
+            // It stays where it is until it is evicted.
+            if (ladder_size != target_size)
+            {
+                auto legacy = thumbnailer_->thumbnail_cache_->get(legacy_sized_key(target_size));
+                if (legacy)
+                {
+                    status_ = FetchStatus::cache_hit;
+                    QByteArray data = QByteArray::fromStdString(*legacy);
+                    thumbnailer_->thumbnail_memory_cache_->put(memory_key, data);
+                    count_duplicate_hit(data.size());
+                    return data;
+                }
+            }
+            thumbnail = migrate(*thumbnailer_->thumbnail_cache_, legacy_sized_key(ladder_size), ladder_key);
+        }
         if (thumbnail)
         {
+            thumbnailer_->thumbnail_mrc_->record(ladder_key, thumbnail->size());
+
+            // Second access to this thumbnail, so it's worth keeping in memory.
             status_ = FetchStatus::cache_hit;
-            return QByteArray::fromStdString(*thumbnail);
+            QByteArray data = ladder_size == target_size
+                                  ? QByteArray::fromStdString(*thumbnail)
+                                  : QByteArray::fromStdString(Image(*thumbnail, target_size).jpeg_or_png_data());
+            thumbnailer_->thumbnail_memory_cache_->put(memory_key, data, chrono::system_clock::time_point(), ladder_key);
+            count_duplicate_hit(data.size());
+            return data;
+        }
+
+        // If we have a thumbnail further up the ladder, scaling that down is a lot
+        // cheaper than going back to the original image.
+        for (QSize size = next_ladder_size(ladder_size); size.isValid(); size = next_ladder_size(size))
+        {
+            thumbnail = cached_thumbnail(this->sized_key(size), false);
+            if (thumbnail)
+            {
+                status_ = FetchStatus::scaled_from_larger;
+                QByteArray data = put_thumbnail(Image(*thumbnail, ladder_size), target_size);
+                count_duplicate_hit(data.size());
+                return data;
+            }
+        }
+
+        // From here on, we will decode the image, so it's too late for other requests
+        // to attach. The decode size covers all the requests that have attached already.
+        auto const coalesced_sizes = close_coalescing(target_size);
+        QSize decode_size = ladder_size;
+        for (auto const& size : coalesced_sizes)
+        {
+            decode_size = decode_size.expandedTo(this->ladder_size(size));
         }
 
         // Don't have the thumbnail yet, see if we have the original image around.
-        auto full_size = thumbnailer_->full_size_cache_->get(key_);
+        auto full_size = thumbnailer_->full_size_write_queue_->get(cache_key_);
+        if (!full_size)
+        {
+            bool promote = false;
+            full_size = thumbnailer_->full_size_admission_->get(cache_key_, &promote);
+            if (promote)
+            {
+                thumbnailer_->full_size_write_queue_->put(cache_key_, *full_size);
+            }
+        }
+        if (!full_size && thumbnailer_->migrate_legacy_keys_)
+        {
+            full_size = migrate(*thumbnailer_->full_size_cache_, legacy_key(), cache_key_);
+        }
         Image scaled_image;
         if (full_size)
         {
+            thumbnailer_->full_size_mrc_->record(cache_key_, full_size->size());
             status_ = ThumbnailRequest::FetchStatus::scaled_from_fullsize;
-            scaled_image = Image(*full_size, target_size);
+            scaled_image = Image(*full_size, decode_size);
             full_size = "";  // Release memory
         }
         else
@@ -350,14 +707,39 @@ QByteArray RequestBase::thumbnail()
             // Try and download or read the artwork, provided that we don't
             // have this image in the failure cache. We use get()
             // here instead of contains_key(), so the stats for the
-            // failure cache are updated.
-            if (thumbnailer_->failure_cache_->get(key_))
+            // failure cache are updated. Most keys are not in the
+            // failure cache, and the failure filter tells us that
+            // without touching the DB (unless we are still rebuilding it).
+            if (thumbnailer_->failure_memory_cache_->get(key_hash_))
+            {
+                status_ = ThumbnailRequest::FetchStatus::cached_failure;
+                return "";
+            }
+            bool filter_valid = thumbnailer_->failure_filter_valid_;
+            bool failed = false;
+            if (filter_valid && !thumbnailer_->failure_filter_->may_contain(cache_key_))
+            {
+                ++thumbnailer_->failure_lookups_skipped_;
+            }
+            else
             {
+                failed = bool(thumbnailer_->failure_cache_->get(cache_key_));
+                if (failed && !filter_valid)
+                {
+                    thumbnailer_->track_failure_key(cache_key_);
+                }
+            }
+            if (failed)
+            {
+                // We can't find out how much longer the entry has to live in the
+                // persistent cache, so we remember the failure in memory only briefly.
+                auto later = chrono::system_clock::now() + FAILURE_MEMORY_CACHE_TTL;
+                thumbnailer_->failure_memory_cache_->put(key_hash_, QByteArray(), later);
                 status_ = ThumbnailRequest::FetchStatus::cached_failure;
                 return "";
             }
 
-            ImageData image_data = fetch(target_size);
+            ImageData image_data = fetch(decode_size);
             status_ = image_data.status;
             switch (status_)
             {
@@ -368,6 +750,7 @@ QByteArray RequestBase::thumbnail()
                     }
                     break;
                 case FetchStatus::needs_download:  // Caller will call download().
+                    reopen_coalescing();
                     if (image_data.location == Location::remote)
                     {
                         // If we had the last failure within the retry limit, don't attempt the download.
@@ -382,16 +765,12 @@ QByteArray RequestBase::thumbnail()
                     return "";  // LCOV_EXCL_LINE  // No way to test this without physically disabling network.
                 case FetchStatus::not_found:
                 {
-                    // Authoritative answer that artwork does not exist.
-                    // For local files, we don't set an expiry time because, if the file is
-                    // changed (say, such that artwork is added), the file's key will change too.
-                    // For remote files, we try again after one week.
-                    chrono::time_point<std::chrono::system_clock> later;  // Infinite expiry time
-                    if (image_data.location == Location::remote)
-                    {
-                        later = chrono::system_clock::now() + chrono::hours(thumbnailer_->retry_not_found_hours_);
-                    }
-                    thumbnailer_->failure_cache_->put(key_, "", later);
+                    // Authoritative answer that artwork does not exist. We try again after one week.
+                    // For local files, the key changes if the file is changed (say, such that artwork
+                    // is added), but we still let the entry expire, so the failure filter can be
+                    // rebuilt within that time.
+                    auto later = chrono::system_clock::now() + chrono::hours(thumbnailer_->retry_not_found_hours_);
+                    thumbnailer_->failure_cache_->put(cache_key_, "", later);
                     if (image_data.location == Location::remote)
                     {
                         // Even though we didn't get an image, the request itself worked.
@@ -402,7 +781,8 @@ QByteArray RequestBase::thumbnail()
                 case FetchStatus::hard_error:
                 {
                     // No chance of recovery, the problem is with the request data.
-                    thumbnailer_->failure_cache_->put(key_, "");
+                    auto later = chrono::system_clock::now() + chrono::hours(thumbnailer_->retry_not_found_hours_);
+                    thumbnailer_->failure_cache_->put(cache_key_, "", later);
                     if (image_data.location == Location::remote)
                     {
                         // Even though we didn't get an image, the request itself worked.
@@ -459,18 +839,36 @@ QByteArray RequestBase::thumbnail()
                     image_data.image = image_data.image.scale(QSize(max_size, max_size));
                 }
                 // Keep high-quality image.
-                thumbnailer_->full_size_cache_->put(key_, image_data.image.jpeg_or_png_data(90));
+                string data = image_data.image.jpeg_or_png_data(90);
+                thumbnailer_->full_size_write_queue_->put(cache_key_, data);
+                thumbnailer_->full_size_mrc_->record(cache_key_, data.size());
             }
-            // If the image is already within the target dimensions, this
-            // will be a no-op.
-            scaled_image = image_data.image.scale(target_size);
+            scaled_image = image_data.image;
             image_data.image = Image();
         }
 
-        string data = scaled_image.jpeg_or_png_data();
-        scaled_image = Image();
-        thumbnailer_->thumbnail_cache_->put(sized_key, data);
-        return QByteArray::fromStdString(data);
+        // Produce the thumbnails for the attached requests from the decoded image,
+        // largest first. If the image is already within a target size, scaling is a no-op.
+        auto sizes = coalesced_sizes;
+        sort(sizes.begin(), sizes.end(), [](QSize const& a, QSize const& b)
+             {
+                 return int64_t(a.width()) * a.height() > int64_t(b.width()) * b.height();
+             });
+        for (auto const& size : sizes)
+        {
+            // The attached request is about to look for this, so it goes straight into memory.
+            QByteArray extra_data = put_thumbnail(scaled_image.scale(this->ladder_size(size)), size);
+            thumbnailer_->thumbnail_memory_cache_->put(this->memory_key(size), extra_data,
+                                                       chrono::system_clock::time_point(),
+                                                       this->sized_key(this->ladder_size(size)));
+        }
+        scaled_image = scaled_image.scale(ladder_size);
+        QByteArray data = put_thumbnail(scaled_image, target_size);
+        if (status_ == FetchStatus::scaled_from_fullsize)
+        {
+            count_duplicate_hit(data.size());
+        }
+        return data;
     }
     // LCOV_EXCL_START
     catch (std::exception const& e)
@@ -488,141 +886,467 @@ ThumbnailRequest::FetchStatus RequestBase::status() const
     return status_;
 }
 
-LocalThumbnailRequest::LocalThumbnailRequest(Thumbnailer* thumbnailer,
-                                             string const& filename,
-                                             QSize const& requested_size,
-                                             chrono::milliseconds timeout)
-    : RequestBase(thumbnailer, "", requested_size, timeout)
-    , filename_(filename)
+bool RequestBase::coalesce(ThumbnailRequest const& other)
 {
-    if (!boost::filesystem::path(filename).is_absolute())
+    auto const& other_base = dynamic_cast<RequestBase const&>(other);
+    assert(other_base.key_ == key_);
+
+    if (!other_base.requested_size_.isValid())
     {
-        throw runtime_error("LocalThumbnailRequest(): " + filename_ + ": file name must be an absolute path");
+        return false;
     }
+    auto const size = target_size(other_base.requested_size_);
 
-    // We canonicalise the path name both to avoid caching the file
-    // multiple times, and to ensure our access checks are against the
-    // real file rather than a symlink.
-    filename_ = boost::filesystem::canonical(filename).native();
-
-    struct stat st;
-    if (stat(filename_.c_str(), &st) < 0)
+    lock_guard<mutex> lock(coalesce_mutex_);
+    if (coalescing_closed_)
     {
-        // LCOV_EXCL_START
-        throw runtime_error("LocalThumbnailRequest(): Could not stat " + filename_ + ": " + safe_strerror(errno));
-        // LCOV_EXCL_STOP
+        return false;
     }
+    coalesced_sizes_.push_back(size);
+    return true;
+}
 
-    if (!S_ISREG(st.st_mode))
+void RequestBase::uncoalesce(ThumbnailRequest const& other)
+{
+    auto const& other_base = dynamic_cast<RequestBase const&>(other);
+    assert(other_base.key_ == key_);
+
+    if (!other_base.requested_size_.isValid())
     {
-        throw runtime_error("LocalThumbnailRequest(): '" + filename_ + "' is not a regular file");
+        return;
     }
+    auto const size = target_size(other_base.requested_size_);
 
-    // The full cache key for the file is the concatenation of path
-    // name, inode, modification time, and inode modification time
-    // (because permissions may change).  If the file exists with the
-    // same path on different removable media, or the file was
-    // modified since we last cached it, the key will be
-    // different. There is no point in trying to remove such stale
-    // entries from the cache. Instead, we just let the normal
-    // eviction mechanism take care of them (because stale thumbnails
-    // due to file removal or file update are rare).
-    key_ = filename_;
-    key_ += '\0';
-    key_ += to_string(st.st_ino);
-    key_ += '\0';
-    key_ += to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
-    key_ += '\0';
-    key_ += to_string(st.st_ctim.tv_sec) + "." + to_string(st.st_ctim.tv_nsec);
+    // Other requests may still want the same size.
+    lock_guard<mutex> lock(coalesce_mutex_);
+    auto it = find(coalesced_sizes_.begin(), coalesced_sizes_.end(), size);
+    if (!coalescing_closed_ && it != coalesced_sizes_.end())
+    {
+        coalesced_sizes_.erase(it);
+    }
 }
 
-void LocalThumbnailRequest::check_client_credentials(uid_t user,
-                                                     std::string const& label)
+// Returns the size we actually produce for a requested size, enforcing the size limit.
+
+QSize RequestBase::target_size(QSize const& requested_size) const
 {
-    if (user != geteuid())
+    auto target_size = QSize(thumbnailer_->max_size_, thumbnailer_->max_size_);
+    if (requested_size.width() != 0)
     {
-        throw runtime_error("LocalThumbnailRequest::fetch(): Request comes from a different user ID");
+        target_size.setWidth(min(requested_size.width(), thumbnailer_->max_size_));
     }
-    if (!apparmor_can_read(label, filename_)) {
-        // LCOV_EXCL_START
-        qDebug() << "Apparmor label" << QString::fromStdString(label) << "has no access to" << QString::fromStdString(filename_);
-        throw runtime_error("LocalThumbnailRequest::fetch(): AppArmor policy forbids access to " + filename_);
-        // LCOV_EXCL_STOP
+    if (requested_size.height() != 0)
+    {
+        target_size.setHeight(min(requested_size.height(), thumbnailer_->max_size_));
     }
-
+    return target_size;
 }
 
-RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noexcept
+namespace
 {
-    // Default in case something below throws.
-    ImageData image_data(FetchStatus::hard_error, CachePolicy::dont_cache_fullsize, Location::local);
-    try
+
+// Returns the smallest rung of the size ladder that is not less than size. The rungs are
+// max_size, max_size / step, max_size / step², and so on, where step is a percentage.
+
+int ladder_rung(int size, int max_size, int step)
+{
+    double const factor = 100.0 / step;
+    int rung = max_size;
+    for (double r = max_size * factor; ; r *= factor)
     {
-        if (image_extractor_)
+        int next = int(lround(r));
+        if (next < size || next >= rung)
         {
-            // The image data has been extracted via vs-thumb. Update image_data policy in case read() throws.
-            image_data.cache_policy = CachePolicy::cache_fullsize;
-            return ImageData(Image(image_extractor_->read()), CachePolicy::cache_fullsize, Location::local);
+            return rung;
         }
+        rung = next;
+    }
+}
 
-        string content_type = get_mimetype(filename_);
-        assert(!content_type.empty());
+}  // namespace
 
-        // Call the appropriate image extractor and return the image data as JPEG (not scaled).
-        // We indicate that full-size images are to be cached only for video files,
-        // for which extraction is expensive. For local audio and images, we don't cache full size.
+// Returns the size at which we cache the thumbnail for target_size. With the size ladder
+// enabled, each dimension is rounded up to the next rung, so clients that ask for 127x127,
+// 128x128, and 130x130 share a single cache entry. Otherwise, this is target_size.
 
-        if (content_type.find("image/") == 0)
-        {
-            FdPtr fd(open(filename_.c_str(), O_RDONLY | O_CLOEXEC), do_close);
-            if (fd.get() < 0)
-            {
-                // LCOV_EXCL_START
-                throw runtime_error("LocalThumbnailRequest::fetch(): Could not open " + filename_ + ": " + safe_strerror(errno));
-                // LCOV_EXCL_STOP
-            }
-            Image scaled(fd.get(), size_hint);
-            return ImageData(scaled, CachePolicy::dont_cache_fullsize, Location::local);
-        }
-        else if (content_type.find("audio/") == 0)
-        {
-            string art = extract_local_album_art(filename_);
-            if (!art.empty())
-            {
-                return ImageData(Image(art), CachePolicy::dont_cache_fullsize, Location::local);
-            }
-        }
-        else if (content_type.find("video/") == 0)
-        {
-            return ImageData(FetchStatus::needs_download, CachePolicy::cache_fullsize, Location::local);
-        }
-    }
-    catch (std::exception const& e)
+QSize RequestBase::ladder_size(QSize const& target_size) const
+{
+    int const step = thumbnailer_->size_ladder_step_;
+    if (step == 0)
     {
-        qCritical().nospace() << "LocalThumbnailRequest::fetch(): " << e.what();
-        set_error_message(e.what());
-        return image_data;
+        return target_size;
     }
-    return ImageData(FetchStatus::not_found, image_data.cache_policy, Location::local);
+    int const max_size = thumbnailer_->max_size_;
+    return QSize(ladder_rung(target_size.width(), max_size, step), ladder_rung(target_size.height(), max_size, step));
 }
 
-void LocalThumbnailRequest::download(chrono::milliseconds timeout)
+// Returns the next larger size on the ladder, or an invalid size if there is none.
+
+QSize RequestBase::next_ladder_size(QSize const& ladder_size) const
 {
-    if (timeout.count() == 0)
+    int const max_size = thumbnailer_->max_size_;
+    if (thumbnailer_->size_ladder_step_ == 0
+        || (ladder_size.width() >= max_size && ladder_size.height() >= max_size))
     {
-        timeout = timeout_;
+        return QSize();
     }
-    image_extractor_.reset(new ImageExtractor(filename_, timeout));
-    connect(image_extractor_.get(), &ImageExtractor::finished, this, &LocalThumbnailRequest::downloadFinished,
-            Qt::DirectConnection);
-    image_extractor_->extract();
+    return this->ladder_size(QSize(min(ladder_size.width() + 1, max_size), min(ladder_size.height() + 1, max_size)));
 }
 
-AlbumRequest::AlbumRequest(Thumbnailer* thumbnailer,
-                           string const& artist,
-                           string const& album,
-                           QSize const& requested_size,
-                           chrono::milliseconds timeout)
+// Adds ladder_image to the thumbnail cache under the ladder size for target_size,
+// and returns the thumbnail for target_size.
+
+QByteArray RequestBase::put_thumbnail(Image const& ladder_image, QSize const& target_size)
+{
+    auto const ladder_size = this->ladder_size(target_size);
+    auto const key = sized_key(ladder_size);
+    string data = ladder_image.jpeg_or_png_data();
+    thumbnailer_->thumbnail_write_queue_->put(key, data);
+    thumbnailer_->thumbnail_mrc_->record(key, data.size());
+    if (journaled_)
+    {
+        source_journal()->add_entry(cache_key_, key);
+    }
+    if (ladder_size != target_size)
+    {
+        data = ladder_image.scale(target_size).jpeg_or_png_data();
+    }
+    return QByteArray::fromStdString(data);
+}
+
+// Returns the key for the thumbnail cache.
+
+string RequestBase::sized_key(QSize const& target_size) const
+{
+    assert(!cache_key_.empty());
+    string sized_key = cache_key_;
+    append_size(sized_key, target_size);
+    return sized_key;
+}
+
+// Returns the key for the thumbnail memory cache.
+
+string RequestBase::memory_key(QSize const& target_size) const
+{
+    assert(!key_hash_.empty());
+    string memory_key = key_hash_;
+    append_size(memory_key, target_size);
+    return memory_key;
+}
+
+// Returns the key that cache version 2 used for the thumbnail.
+
+string RequestBase::legacy_sized_key(QSize const& target_size) const
+{
+    string sized_key = legacy_key();
+    sized_key += '\0';
+    sized_key += to_string(target_size.width());
+    sized_key += '\0';
+    sized_key += to_string(target_size.height());
+    return sized_key;
+}
+
+// After an upgrade from cache version 2, we move entries to the new key format
+// the first time they are needed instead of throwing the caches away.
+
+core::Optional<string> RequestBase::migrate(DiskCache& cache, string const& legacy_key, string const& key)
+{
+    auto value = cache.take(legacy_key);
+    if (value)
+    {
+        cache.put(key, *value);
+    }
+    return value;
+}
+
+// Looks up a thumbnail on disk. We look in the write queue first, in case we produced
+// the thumbnail a moment ago, and then in the thumbnail cache and its admission window.
+// A thumbnail from the window goes to the main cache via the write queue.
+// If requested is false, the lookup is on behalf of another thumbnail size,
+// so it doesn't count as a request for key in the admission filter.
+
+core::Optional<string> RequestBase::cached_thumbnail(string const& key, bool requested)
+{
+    auto thumbnail = thumbnailer_->thumbnail_write_queue_->get(key);
+    if (!thumbnail)
+    {
+        bool promote = false;
+        auto& admission = *thumbnailer_->thumbnail_admission_;
+        thumbnail = requested ? admission.get(key, &promote) : admission.probe(key, &promote);
+        if (promote)
+        {
+            thumbnailer_->thumbnail_write_queue_->put(key, *thumbnail);
+        }
+    }
+    return thumbnail;
+}
+
+// Stops other requests from attaching and returns the target sizes of
+// the requests that attached so far, other than our own.
+
+vector<QSize> RequestBase::close_coalescing(QSize const& target_size)
+{
+    lock_guard<mutex> lock(coalesce_mutex_);
+    coalescing_closed_ = true;
+    vector<QSize> sizes;
+    for (auto const& size : coalesced_sizes_)
+    {
+        if (size != target_size && find(sizes.begin(), sizes.end(), size) == sizes.end())
+        {
+            sizes.push_back(size);
+        }
+    }
+    return sizes;
+}
+
+// fetch() found that the image has yet to be downloaded or extracted, so
+// there is still time for other requests to attach.
+
+void RequestBase::reopen_coalescing()
+{
+    lock_guard<mutex> lock(coalesce_mutex_);
+    coalescing_closed_ = false;
+}
+
+void RequestBase::count_duplicate_file()
+{
+    ++thumbnailer_->duplicate_files_;
+}
+
+// We found the thumbnail for a duplicate file in the persistent caches,
+// so we didn't have to produce and store another copy of it.
+
+void RequestBase::count_duplicate_hit(int64_t bytes)
+{
+    if (duplicate_)
+    {
+        ++thumbnailer_->duplicate_hits_;
+        thumbnailer_->bytes_saved_ += bytes;
+    }
+}
+
+LocalThumbnailRequest::LocalThumbnailRequest(Thumbnailer* thumbnailer,
+                                             string const& filename,
+                                             QSize const& requested_size,
+                                             chrono::milliseconds timeout)
+    : RequestBase(thumbnailer, "", requested_size, timeout)
+    , filename_(filename)
+{
+    if (!boost::filesystem::path(filename).is_absolute())
+    {
+        throw runtime_error("LocalThumbnailRequest(): " + filename_ + ": file name must be an absolute path");
+    }
+
+    // We canonicalise the path name both to avoid caching the file
+    // multiple times, and to ensure our access checks are against the
+    // real file rather than a symlink.
+    filename_ = boost::filesystem::canonical(filename).native();
+
+    struct stat& st = stat_;
+    if (stat(filename_.c_str(), &st) < 0)
+    {
+        // LCOV_EXCL_START
+        throw runtime_error("LocalThumbnailRequest(): Could not stat " + filename_ + ": " + safe_strerror(errno));
+        // LCOV_EXCL_STOP
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        throw runtime_error("LocalThumbnailRequest(): '" + filename_ + "' is not a regular file");
+    }
+
+    // The key for the file is its identity. If the file exists with the
+    // same path on different removable media, or the file was
+    // modified since we last cached it, the key will be
+    // different. Stale entries for files that were modified or removed
+    // are found by Thumbnailer::collect_garbage(), or evicted eventually.
+    //
+    // The key is an alias for the contents of the file, see lookup_cache_key().
+    // A change of permissions (which only updates the ctime) doesn't change the key.
+    key_ = file_identity(filename_, st);
+}
+
+// Returns the content id of the file, so the thumbnails for all copies of a file
+// (in different albums, on removable media, hard links, etc.) are stored only once.
+// The alias cache maps the hash of key_ to the content id, so we only hash a file
+// the first time we see it. The alias cache also records the name of the first file
+// we saw with a given content id, which tells us whether a file is a duplicate.
+// The file is also added to the source journal, so we can find its cache
+// entries once the file is modified or deleted.
+
+string LocalThumbnailRequest::lookup_cache_key()
+{
+    auto alias_cache = this->alias_cache();
+    auto alias = alias_cache->get(key_hash_);
+    if (alias && alias->size() == size_t(HASH_SIZE) + 1)
+    {
+        // The value is the content id, followed by a flag that indicates a duplicate.
+        duplicate_ = (*alias)[HASH_SIZE] == '1';
+        string content_id = alias->substr(0, HASH_SIZE);
+        source_journal()->add_source(key_hash_, key_, content_id);
+        journaled_ = true;
+        return content_id;
+    }
+
+    string content_id;
+    try
+    {
+        content_id = content_hash(filename_);
+    }
+    catch (std::exception const& e)
+    {
+        // We'll run into the same problem in fetch(), which takes care of the error.
+        qDebug().nospace() << "LocalThumbnailRequest::lookup_cache_key(): " << e.what();
+        return key_hash_;
+    }
+
+    // The prefix makes the key one byte longer than an alias, so the two can't clash.
+    string const first_filename_key = 'c' + content_id;
+    auto first_filename = alias_cache->get(first_filename_key);
+    if (!first_filename)
+    {
+        alias_cache->put(first_filename_key, filename_);
+    }
+    else if (*first_filename != filename_)
+    {
+        duplicate_ = true;
+        count_duplicate_file();
+    }
+    alias_cache->put(key_hash_, content_id + (duplicate_ ? '1' : '0'));
+    source_journal()->add_source(key_hash_, key_, content_id);
+    journaled_ = true;
+    return content_id;
+}
+
+string LocalThumbnailRequest::legacy_key() const
+{
+    string key = filename_;
+    key += '\0';
+    key += to_string(stat_.st_ino);
+    key += '\0';
+    key += to_string(stat_.st_mtim.tv_sec) + "." + to_string(stat_.st_mtim.tv_nsec);
+    key += '\0';
+    key += to_string(stat_.st_ctim.tv_sec) + "." + to_string(stat_.st_ctim.tv_nsec);
+    return key;
+}
+
+void LocalThumbnailRequest::check_client_credentials(uid_t user,
+                                                     std::string const& label)
+{
+    if (user != geteuid())
+    {
+        throw runtime_error("LocalThumbnailRequest::fetch(): Request comes from a different user ID");
+    }
+    if (!apparmor_can_read(label, filename_)) {
+        // LCOV_EXCL_START
+        qDebug() << "Apparmor label" << QString::fromStdString(label) << "has no access to" << QString::fromStdString(filename_);
+        throw runtime_error("LocalThumbnailRequest::fetch(): AppArmor policy forbids access to " + filename_);
+        // LCOV_EXCL_STOP
+    }
+
+}
+
+RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noexcept
+{
+    // Default in case something below throws.
+    ImageData image_data(FetchStatus::hard_error, CachePolicy::dont_cache_fullsize, Location::local);
+    try
+    {
+        if (image_extractor_)
+        {
+            // The image data has been extracted via vs-thumb. Update image_data policy in case read() throws.
+            image_data.cache_policy = CachePolicy::cache_fullsize;
+            return ImageData(image_extractor_->read(), CachePolicy::cache_fullsize, Location::local);
+        }
+
+        string content_type = get_mimetype(filename_);
+        assert(!content_type.empty());
+
+        // Call the appropriate image extractor and return the image data as JPEG (not scaled).
+        // We indicate that full-size images are to be cached only for video files,
+        // for which extraction is expensive. For local audio and images, we don't cache full size.
+
+        if (content_type.find("image/") == 0)
+        {
+            FdPtr fd(open(filename_.c_str(), O_RDONLY | O_CLOEXEC), do_close);
+            if (fd.get() < 0)
+            {
+                // LCOV_EXCL_START
+                throw runtime_error("LocalThumbnailRequest::fetch(): Could not open " + filename_ + ": " + safe_strerror(errno));
+                // LCOV_EXCL_STOP
+            }
+            Image scaled(fd.get(), size_hint);
+            return ImageData(scaled, CachePolicy::dont_cache_fullsize, Location::local);
+        }
+        else if (content_type.find("audio/") == 0)
+        {
+            string art = extract_local_album_art(filename_);
+            if (!art.empty())
+            {
+                return ImageData(Image(art), CachePolicy::dont_cache_fullsize, Location::local);
+            }
+        }
+        else if (content_type.find("video/") == 0)
+        {
+            // Ripped movies often carry cover art in the container, which we can read
+            // in a fraction of the time it takes vs-thumb to get to the same tag.
+            string art = extract_embedded_art(filename_);
+            if (!art.empty())
+            {
+                // If the cover doesn't decode, we still get a frame from vs-thumb.
+                try
+                {
+                    return ImageData(Image(art, size_hint), CachePolicy::dont_cache_fullsize, Location::local);
+                }
+                catch (std::exception const& e)
+                {
+                    qDebug().nospace() << "LocalThumbnailRequest::fetch(): cannot decode embedded art in "
+                                       << QString::fromStdString(filename_) << ": " << e.what();
+                }
+            }
+            return ImageData(FetchStatus::needs_download, CachePolicy::cache_fullsize, Location::local);
+        }
+    }
+    catch (std::exception const& e)
+    {
+        qCritical().nospace() << "LocalThumbnailRequest::fetch(): " << e.what();
+        set_error_message(e.what());
+        return image_data;
+    }
+    return ImageData(FetchStatus::not_found, image_data.cache_policy, Location::local);
+}
+
+void LocalThumbnailRequest::download(chrono::milliseconds timeout)
+{
+    if (timeout.count() == 0)
+    {
+        timeout = timeout_;
+    }
+    image_extractor_.reset(new ImageExtractor(filename_, timeout, extractor_pool()));
+    connect(image_extractor_.get(), &ImageExtractor::finished, this, &LocalThumbnailRequest::downloadFinished,
+            Qt::DirectConnection);
+    // The extracted frame goes into the full-size cache, so we ask for the largest
+    // size we ever produce. That is still a lot less than the resolution of most videos.
+    image_extractor_->extract(target_size(QSize(0, 0)).width());
+}
+
+bool LocalThumbnailRequest::cancel_download()
+{
+    if (!image_extractor_ || !image_extractor_->cancel())
+    {
+        return false;
+    }
+    // Without the extractor, a later call to thumbnail() reports needs_download
+    // again instead of caching a failure for the file.
+    image_extractor_.reset();
+    return true;
+}
+
+AlbumRequest::AlbumRequest(Thumbnailer* thumbnailer,
+                           string const& artist,
+                           string const& album,
+                           QSize const& requested_size,
+                           chrono::milliseconds timeout)
     : RequestBase(thumbnailer, artist + '\0' + album + '\0' + "album", requested_size, timeout)
     , artist_(artist)
     , album_(album)
@@ -693,129 +1417,642 @@ RequestBase::ImageData AlbumRequest::fetch(QSize const& /*size_hint*/) noexcept
     return common_fetch(this, artreply_);
 }
 
-void AlbumRequest::download(chrono::milliseconds timeout)
+void AlbumRequest::download(chrono::milliseconds timeout)
+{
+    if (timeout.count() == 0)
+    {
+        timeout = timeout_;
+    }
+    artreply_ = downloader()->download_album(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
+    connect(artreply_.get(), &ArtReply::finished, this, &AlbumRequest::downloadFinished, Qt::DirectConnection);
+}
+
+ArtistRequest::ArtistRequest(Thumbnailer* thumbnailer,
+                             string const& artist,
+                             string const& album,
+                             QSize const& requested_size,
+                             chrono::milliseconds timeout)
+    : RequestBase(thumbnailer, artist + '\0' + album + '\0' + "artist", requested_size, timeout)
+    , artist_(artist)
+    , album_(album)
+{
+}
+
+RequestBase::ImageData ArtistRequest::fetch(QSize const& /*size_hint*/) noexcept
+{
+    return common_fetch(this, artreply_);
+}
+
+void ArtistRequest::download(chrono::milliseconds timeout)
+{
+    if (timeout.count() == 0)
+    {
+        timeout = timeout_;
+    }
+    artreply_ = downloader()->download_artist(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
+    connect(artreply_.get(), &ArtReply::finished, this, &ArtistRequest::downloadFinished, Qt::DirectConnection);
+}
+
+namespace
+{
+
+// Keys under which we store the last time we had a network failure
+// and the current backoff period (in seconds).
+// No entry in the failure cache ever has these keys because keys for
+// local files are content ids (or include inode number and modification time).
+string const LAST_NETWORK_FAIL_TIME_KEY = "/*** LAST_NETWORK_FAIL_TIME ***/";
+string const BACKOFF_PERIOD_KEY = "/*** BACKOFF_PERIOD ***/";
+
+// Key under which we store the time (in seconds) until which we migrate entries with old-style keys.
+string const LEGACY_KEY_DEADLINE_KEY = "/*** LEGACY_KEY_DEADLINE ***/";
+
+string const BOOKKEEPING_KEYS[] = { LAST_NETWORK_FAIL_TIME_KEY, BACKOFF_PERIOD_KEY, LEGACY_KEY_DEADLINE_KEY };
+
+bool is_bookkeeping_key(string const& key)
+{
+    return find(begin(BOOKKEEPING_KEYS), end(BOOKKEEPING_KEYS), key) != end(BOOKKEEPING_KEYS);
+}
+
+}
+
+Thumbnailer::Thumbnailer()
+    : failure_filter_valid_(false)
+    , failure_keys_untracked_(0)
+    , failure_filter_saved_(false)
+    , warm_restart_entries_(0)
+    , stop_prefetch_(false)
+    , prefetched_(0)
+    , duplicate_files_(0)
+    , duplicate_hits_(0)
+    , bytes_saved_(0)
+    , failure_lookups_skipped_(0)
+    , migrate_legacy_keys_(false)
+    , gc_files_checked_(0)
+    , gc_stale_files_(0)
+    , gc_entries_removed_(0)
+    , gc_bytes_reclaimed_(0)
+    , gc_compactions_(0)
+{
+    string xdg_base = g_get_user_cache_dir();  // Always returns something, even HOME and XDG_CACHE_HOME are not set.
+    string cache_dir = xdg_base + "/unity-thumbnailer";
+    make_directories(cache_dir, 0700);
+
+    // We never run more extractions than that at a time, so there is no point in having more workers.
+    // The pool is a QObject, so we create it here rather than on the init thread.
+    int max_workers = Settings().max_extractions();
+    if (max_workers == 0)
+    {
+        max_workers = max(thread::hardware_concurrency(), 1u);
+    }
+    extractor_pool_ = make_shared<ExtractorPool>(max_workers);
+
+    // The service is started on demand. Opening the caches takes a while, so we do
+    // that in the background. That way, the service can acquire its bus name without
+    // waiting for the caches, and the public methods wait for init() instead.
+    init_ = async(launch::async, &Thumbnailer::init, this, cache_dir).share();
+}
+
+// Runs on a separate thread, started by the constructor. We log how long each phase took.
+
+void Thumbnailer::init(string const& cache_dir)
+{
+    auto const start_time = chrono::steady_clock::now();
+    auto phase_start = start_time;
+    auto phase_msecs = [&phase_start]
+    {
+        auto const now = chrono::steady_clock::now();
+        double msecs = chrono::duration<double, milli>(now - phase_start).count();
+        phase_start = now;
+        return msecs;
+    };
+
+    try
+    {
+        Settings settings;
+        full_size_mrc_path_ = cache_dir + "/image-mrc";
+        thumbnail_mrc_path_ = cache_dir + "/thumbnail-mrc";
+        full_size_mrc_ = load_estimator(full_size_mrc_path_);
+        thumbnail_mrc_ = load_estimator(thumbnail_mrc_path_);
+
+        // The cache helper re-sizes the caches as they are opened if the size has changed.
+        int const target_hit_rate = settings.target_hit_rate();
+        int64_t full_size_cache_size = adapted_cache_size(*full_size_mrc_, "image cache",
+                                                          int64_t(settings.full_size_cache_size()) * 1024 * 1024,
+                                                          target_hit_rate,
+                                                          int64_t(settings.full_size_cache_min_size()) * 1024 * 1024,
+                                                          int64_t(settings.full_size_cache_max_size()) * 1024 * 1024);
+        int64_t thumbnail_cache_size = adapted_cache_size(*thumbnail_mrc_, "thumbnail cache",
+                                                          int64_t(settings.thumbnail_cache_size()) * 1024 * 1024,
+                                                          target_hit_rate,
+                                                          int64_t(settings.thumbnail_cache_min_size()) * 1024 * 1024,
+                                                          int64_t(settings.thumbnail_cache_max_size()) * 1024 * 1024);
+        double const settings_msecs = phase_msecs();
+
+        // Opening a cache reads its log and the index of each table file, and a cache
+        // that turns out to be corrupt is repaired. The caches are independent of each
+        // other, so we open them all at once instead of paying for them one by one.
+        auto open_cache = [](DiskCache::Backend backend, string const& path, int64_t size,
+                             core::CacheDiscardPolicy policy)
+        {
+            return async(launch::async, [backend, path, size, policy]
+            {
+                return DiskCache::open(backend, path, size, policy);
+            });
+        };
+        // The window caches use the same backend as their main cache.
+        auto const full_size_backend = DiskCache::backend_for_name(settings.full_size_cache_backend());
+        auto const thumbnail_backend = DiskCache::backend_for_name(settings.thumbnail_cache_backend());
+        auto const failure_backend = DiskCache::backend_for_name(settings.failure_cache_backend());
+        auto full_size_cache = open_cache(full_size_backend,
+                                          cache_dir + "/images",
+                                          full_size_cache_size,
+                                          core::CacheDiscardPolicy::lru_only);
+        auto thumbnail_cache = open_cache(thumbnail_backend,
+                                          cache_dir + "/thumbnails",
+                                          thumbnail_cache_size,
+                                          core::CacheDiscardPolicy::lru_only);
+        auto full_size_window_cache = open_cache(full_size_backend,
+                                                 cache_dir + "/image-window",
+                                                 full_size_cache_size * PersistentAdmissionFilter::WINDOW_PERCENT / 100,
+                                                 core::CacheDiscardPolicy::lru_only);
+        auto thumbnail_window_cache = open_cache(thumbnail_backend,
+                                                 cache_dir + "/thumbnail-window",
+                                                 thumbnail_cache_size * PersistentAdmissionFilter::WINDOW_PERCENT / 100,
+                                                 core::CacheDiscardPolicy::lru_only);
+        auto failure_cache = open_cache(failure_backend,
+                                        cache_dir + "/failures",
+                                        int64_t(settings.failure_cache_size()) * 1024 * 1024,
+                                        core::CacheDiscardPolicy::lru_ttl);
+        auto alias_cache = open_cache(DiskCache::Backend::leveldb,
+                                      cache_dir + "/aliases",
+                                      ALIAS_CACHE_SIZE,
+                                      core::CacheDiscardPolicy::lru_only);
+        full_size_cache_ = full_size_cache.get();
+        thumbnail_cache_ = thumbnail_cache.get();
+        full_size_window_cache_ = full_size_window_cache.get();
+        thumbnail_window_cache_ = thumbnail_window_cache.get();
+        failure_cache_ = failure_cache.get();
+        alias_cache_ = alias_cache.get();
+        double const caches_msecs = phase_msecs();
+
+        full_size_admission_.reset(new PersistentAdmissionFilter(*full_size_cache_, *full_size_window_cache_,
+                                                                 max(full_size_cache_size / FULL_SIZE_ENTRY_SIZE,
+                                                                     int64_t(1))));
+        thumbnail_admission_.reset(new PersistentAdmissionFilter(*thumbnail_cache_, *thumbnail_window_cache_,
+                                                                 max(thumbnail_cache_size / THUMBNAIL_ENTRY_SIZE,
+                                                                     int64_t(1))));
+        full_size_sketch_path_ = cache_dir + "/image-sketch";
+        thumbnail_sketch_path_ = cache_dir + "/thumbnail-sketch";
+        load_sketch(*full_size_admission_, full_size_sketch_path_);
+        load_sketch(*thumbnail_admission_, thumbnail_sketch_path_);
+        full_size_write_queue_.reset(new WriteBehindQueue(write_func(full_size_admission_.get(), "image cache"),
+                                                          WRITE_QUEUE_SIZE));
+        thumbnail_write_queue_.reset(new WriteBehindQueue(write_func(thumbnail_admission_.get(), "thumbnail cache"),
+                                                          WRITE_QUEUE_SIZE));
+        source_journal_.reset(new SourceJournal(cache_dir + "/sources", SOURCE_JOURNAL_SIZE));
+        int64_t memory_cache_size = int64_t(settings.memory_cache_size()) * 1024 * 1024;
+        thumbnail_memory_cache_.reset(new MemoryCache(memory_cache_size));
+        failure_memory_cache_.reset(new MemoryCache(memory_cache_size / 16));
+        retry_not_found_hours_ = settings.retry_not_found_hours();
+        int64_t const failure_capacity = int64_t(settings.failure_cache_size()) * 1024 * 1024 / FAILURE_ENTRY_SIZE;
+        failure_filter_.reset(new CountingBloomFilter(failure_capacity, FAILURE_FILTER_FPR));
+
+        max_size_ = settings.max_thumbnail_size();
+        size_ladder_step_ = settings.thumbnail_size_ladder();
+        extraction_timeout_ = chrono::milliseconds(settings.extraction_timeout() * 1000);
+        backoff_.set_min_backoff(chrono::seconds(settings.extraction_timeout() * 2));
+        backoff_.set_max_backoff(chrono::seconds(settings.retry_error_max_seconds()));
+        double const filters_msecs = phase_msecs();
+
+        // Apply any adjustments to the caches that are version-dependent.
+        // This comes before we load the failure filter, so the filter doesn't
+        // account for failure entries the upgrade removes.
+        apply_upgrade_actions(cache_dir);
+        double const upgrade_msecs = phase_msecs();
+        init_failure_filter(cache_dir);
+        double const failure_filter_msecs = phase_msecs();
+
+        // For transient remote errors, we read the time at which the last failure
+        // happened and the backoff period. The destructor writes these values back out,
+        // so we remember the values across re-starts. We call contains_key() to avoid generating
+        // a bogus cache miss in the stats.
+        if (failure_cache_->contains_key(LAST_NETWORK_FAIL_TIME_KEY))
+        {
+            auto last_fail_time = failure_cache_->get(LAST_NETWORK_FAIL_TIME_KEY);
+            auto fail_time_point = chrono::system_clock::time_point(chrono::seconds(stoll(*last_fail_time)));
+            backoff_.set_last_fail_time(fail_time_point);
+        }
+        if (failure_cache_->contains_key(BACKOFF_PERIOD_KEY))
+        {
+            auto backoff = failure_cache_->get(BACKOFF_PERIOD_KEY);
+            backoff_.set_backoff_period(chrono::seconds(stoll(*backoff)));
+        }
+
+        if (failure_cache_->contains_key(LEGACY_KEY_DEADLINE_KEY))
+        {
+            auto deadline = failure_cache_->get(LEGACY_KEY_DEADLINE_KEY);
+            auto deadline_point = chrono::system_clock::time_point(chrono::seconds(stoll(*deadline)));
+            migrate_legacy_keys_ = chrono::system_clock::now() < deadline_point;
+        }
+
+        // Last, so the upgrade actions get to clear the caches first.
+        warm_set_path_ = cache_dir + "/warm-set";
+        warm_restart_entries_ = settings.warm_restart_entries();
+        if (warm_restart_entries_ > 0 && memory_cache_size > 0)
+        {
+            prefetch_thread_ = thread(&Thumbnailer::prefetch, this);
+        }
+        double const state_msecs = phase_msecs();
+
+        double const total_msecs = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+        qDebug() << "startup took" << total_msecs << "ms: settings" << settings_msecs << "ms, caches" << caches_msecs
+                 << "ms, filters" << filters_msecs << "ms, upgrade" << upgrade_msecs << "ms, failure filter"
+                 << failure_filter_msecs << "ms, saved state" << state_msecs << "ms";
+    }
+    catch (std::exception const& e)
+    {
+        throw runtime_error(string("Thumbnailer(): Cannot instantiate cache: ") + e.what());
+    }
+}
+
+Thumbnailer::~Thumbnailer()
+{
+    try
+    {
+        init_.get();
+    }
+    catch (std::exception const&)
+    {
+        return;  // We never got going, so there is nothing to save.
+    }
+
+    stop_prefetch_ = true;
+    wait_for_prefetch();
+    flush();
+
+    try
+    {
+        auto seconds = chrono::duration_cast<chrono::seconds>(backoff_.last_fail_time().time_since_epoch()).count();
+        failure_cache_->put(LAST_NETWORK_FAIL_TIME_KEY, to_string(seconds));
+        seconds = backoff_.backoff_period().count();
+        failure_cache_->put(BACKOFF_PERIOD_KEY, to_string(seconds));
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qDebug() << "~Thumbnailer(): cannot update network failure time:" << e.what();
+    }
+    catch (...)
+    {
+        qDebug() << "~Thumbnailer(): cannot update network failure time: unknown exception";
+    }
+    // LCOV_EXCL_STOP
+
+    try
+    {
+        write_file(full_size_mrc_path_, full_size_mrc_->serialize());
+        write_file(thumbnail_mrc_path_, thumbnail_mrc_->serialize());
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qDebug() << "~Thumbnailer(): cannot save miss ratio data:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+
+    try
+    {
+        write_file(full_size_sketch_path_, full_size_admission_->serialize());
+        write_file(thumbnail_sketch_path_, thumbnail_admission_->serialize());
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qDebug() << "~Thumbnailer(): cannot save request history:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+
+    try
+    {
+        if (warm_restart_entries_ > 0)
+        {
+            write_file(warm_set_path_, thumbnail_memory_cache_->snapshot(warm_restart_entries_));
+        }
+        else
+        {
+            ::unlink(warm_set_path_.c_str());
+        }
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qDebug() << "~Thumbnailer(): cannot save popular thumbnails:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
+// Runs on prefetch_thread_. Reads the thumbnails that were popular before the restart
+// from disk and adds them to the memory cache, most popular first. The first requests
+// after a restart then don't pay for opening the table files and for reading the blocks.
+// We use at most half the memory cache, so there is room for everything else.
+
+void Thumbnailer::prefetch()
+{
+    auto const start_time = chrono::steady_clock::now();
+    vector<MemoryCache::SnapshotEntry> entries;
+    try
+    {
+        entries = MemoryCache::parse_snapshot(read_file(warm_set_path_));
+    }
+    catch (std::exception const&)
+    {
+        return;  // Nothing saved yet.
+    }
+
+    int64_t const budget = thumbnail_memory_cache_->stats().max_size_in_bytes / 2;
+    int64_t bytes = 0;
+    for (auto const& e : entries)
+    {
+        if (stop_prefetch_ || prefetched_ >= warm_restart_entries_ || bytes >= budget)
+        {
+            break;
+        }
+        if (e.key.size() < 8 || e.source.size() < 8)
+        {
+            continue;  // LCOV_EXCL_LINE
+        }
+        try
+        {
+            // Otherwise, collect_garbage() could remove the entry after we read it and before
+            // we add it to the memory cache, and we would bring back a stale thumbnail.
+            lock_guard<mutex> lock(gc_mutex_);
+            auto thumbnail = thumbnail_cache_->get(e.source);
+            if (!thumbnail)
+            {
+                thumbnail = thumbnail_window_cache_->get(e.source);
+            }
+            if (!thumbnail)
+            {
+                continue;  // Evicted or removed since.
+            }
+            // The memory cache has the thumbnail at the requested size, the disk cache at the ladder size.
+            QSize const target_size = key_size(e.key);
+            QByteArray data = target_size == key_size(e.source)
+                                  ? QByteArray::fromStdString(*thumbnail)
+                                  : QByteArray::fromStdString(Image(*thumbnail, target_size).jpeg_or_png_data());
+            if (thumbnail_memory_cache_->put(e.key, data, chrono::system_clock::time_point(), e.source))
+            {
+                ++prefetched_;
+                bytes += data.size();
+            }
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& ex)
+        {
+            qDebug() << "Thumbnailer::prefetch(): cannot load thumbnail:" << ex.what();
+        }
+        // LCOV_EXCL_STOP
+    }
+    auto const msecs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+    qDebug() << "prefetched" << prefetched_.load() << "of" << entries.size() << "popular thumbnails," << bytes
+             << "bytes in" << msecs << "ms";
+}
+
+// Waits until init() has finished. If it failed, throws the exception it threw.
+
+void Thumbnailer::wait_for_init() const
+{
+    init_.get();
+}
+
+int Thumbnailer::wait_for_prefetch()
+{
+    wait_for_init();
+
+    lock_guard<mutex> lock(prefetch_mutex_);
+    if (prefetch_thread_.joinable())
+    {
+        prefetch_thread_.join();
+    }
+    return prefetched_;
+}
+
+void Thumbnailer::init_failure_filter(string const& cache_dir)
+{
+    failure_filter_path_ = cache_dir + "/failure-filter";
+
+    // We save the filter whenever we are idle, preceded by the time (in seconds) until which
+    // it is still being rebuilt, or 0 if it is complete. We remove the file as soon as we have
+    // read it (and again when the filter changes after saving it), so we never trust a filter
+    // that is out of date because we crashed.
+    bool loaded = false;
+    chrono::system_clock::time_point deadline;
+    try
+    {
+        string data = read_file(failure_filter_path_);
+        auto const pos = data.find('\n');
+        if (pos != string::npos)
+        {
+            deadline = chrono::system_clock::time_point(chrono::seconds(stoll(data.substr(0, pos))));
+            loaded = failure_filter_->deserialize(data.substr(pos + 1));
+        }
+    }
+    catch (std::exception const&)
+    {
+        // No filter was saved.
+    }
+    ::unlink(failure_filter_path_.c_str());
+
+    auto const now = chrono::system_clock::now();
+    int64_t untracked = 0;
+    if (!loaded || now < deadline)
+    {
+        // Without a complete filter, we can't tell which keys are in the failure cache, and the
+        // persistent cache has no way to enumerate them. Until the filter has seen every entry
+        // (because it was looked up or has expired), we look up every key in the failure cache.
+        // Our own bookkeeping entries are not looked up via the filter.
+        untracked = failure_cache_->stats().size();
+        for (auto const& key : BOOKKEEPING_KEYS)
+        {
+            if (failure_cache_->contains_key(key))
+            {
+                --untracked;
+            }
+        }
+    }
+    if (untracked > 0)
+    {
+        // Every failure entry expires after retry_not_found_hours_, so once that much
+        // time has passed, the entries we haven't seen yet are gone. If we saved the
+        // filter part-way through the rebuild, we carry on from there.
+        if (!loaded)
+        {
+            deadline = now + chrono::hours(retry_not_found_hours_);
+        }
+        qDebug() << "no valid failure filter, rebuilding for" << untracked << "entries";
+        failure_keys_untracked_ = untracked;
+        failure_filter_deadline_ = deadline;
+    }
+    else
+    {
+        failure_filter_valid_ = true;
+    }
+
+    // From here on, the filter follows the failure cache as entries are added and expire.
+    // While we rebuild, entries we haven't seen yet were never added, so we must not remove them.
+    auto events = core::CacheEvent::put | core::CacheEvent::evict_ttl | core::CacheEvent::evict_lru;
+    failure_cache_->set_handler(events, [this](string const& key, core::CacheEvent ev)
+    {
+        if (is_bookkeeping_key(key))
+        {
+            return;
+        }
+        bool const hashed = key.size() == size_t(HASH_SIZE);  // Anything else is never looked up.
+        lock_guard<mutex> lock(failure_filter_mutex_);
+        if (failure_filter_valid_)
+        {
+            if (!hashed)
+            {
+                return;
+            }
+            failure_filter_changed();
+            if (ev == core::CacheEvent::put)
+            {
+                failure_filter_->add(key);
+            }
+            else
+            {
+                failure_filter_->remove(key);
+            }
+        }
+        else if (ev == core::CacheEvent::put)
+        {
+            if (hashed && failure_keys_seen_.insert(key).second)
+            {
+                failure_filter_changed();
+                failure_filter_->add(key);
+            }
+        }
+        else if (hashed && failure_keys_seen_.erase(key) != 0)
+        {
+            failure_filter_changed();
+            failure_filter_->remove(key);
+        }
+        else if (--failure_keys_untracked_ == 0)
+        {
+            finish_failure_filter_rebuild();  // The last entry from before the restart has gone.
+        }
+    });
+}
+
+// Called while the failure filter is rebuilt, after finding key in the failure cache.
+// Once we have seen every entry that was there at start-up, the filter is valid again.
+void Thumbnailer::track_failure_key(string const& key)
 {
-    if (timeout.count() == 0)
+    lock_guard<mutex> lock(failure_filter_mutex_);
+    if (failure_filter_valid_ || !failure_keys_seen_.insert(key).second)
     {
-        timeout = timeout_;
+        return;
+    }
+    failure_filter_changed();
+    failure_filter_->add(key);
+    if (--failure_keys_untracked_ == 0)
+    {
+        finish_failure_filter_rebuild();
     }
-    artreply_ = downloader()->download_album(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
-    connect(artreply_.get(), &ArtReply::finished, this, &AlbumRequest::downloadFinished, Qt::DirectConnection);
 }
 
-ArtistRequest::ArtistRequest(Thumbnailer* thumbnailer,
-                             string const& artist,
-                             string const& album,
-                             QSize const& requested_size,
-                             chrono::milliseconds timeout)
-    : RequestBase(thumbnailer, artist + '\0' + album + '\0' + "artist", requested_size, timeout)
-    , artist_(artist)
-    , album_(album)
-{
-}
+// Called with failure_filter_mutex_ locked.
 
-RequestBase::ImageData ArtistRequest::fetch(QSize const& /*size_hint*/) noexcept
+void Thumbnailer::finish_failure_filter_rebuild()
 {
-    return common_fetch(this, artreply_);
+    failure_keys_seen_.clear();
+    failure_keys_untracked_ = 0;
+    failure_filter_valid_ = true;
+    failure_filter_changed();
 }
 
-void ArtistRequest::download(chrono::milliseconds timeout)
+// Called with failure_filter_mutex_ locked, before changing the filter.
+// The saved copy is out of date from here on, so we remove it.
+
+void Thumbnailer::failure_filter_changed()
 {
-    if (timeout.count() == 0)
+    if (failure_filter_saved_)
     {
-        timeout = timeout_;
+        ::unlink(failure_filter_path_.c_str());
+        failure_filter_saved_ = false;
     }
-    artreply_ = downloader()->download_artist(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
-    connect(artreply_.get(), &ArtReply::finished, this, &ArtistRequest::downloadFinished, Qt::DirectConnection);
 }
 
-namespace
-{
-
-// Keys under which we store the last time we had a network failure
-// and the current backoff period (in seconds).
-// No entry in the failure cache ever has these keys because keys for
-// local files include inode number and modification times.
-string const LAST_NETWORK_FAIL_TIME_KEY = "/*** LAST_NETWORK_FAIL_TIME ***/";
-string const BACKOFF_PERIOD_KEY = "/*** BACKOFF_PERIOD ***/";
-
-}
-
-Thumbnailer::Thumbnailer()
-    : downloader_(new UbuntuServerDownloader())
+void Thumbnailer::save_failure_filter()
 {
-    string xdg_base = g_get_user_cache_dir();  // Always returns something, even HOME and XDG_CACHE_HOME are not set.
-    string cache_dir = xdg_base + "/unity-thumbnailer";
-    make_directories(cache_dir, 0700);
-
-    try
+    lock_guard<mutex> lock(failure_filter_mutex_);
+    if (!failure_filter_valid_ && chrono::system_clock::now() >= failure_filter_deadline_)
     {
-        Settings settings;
-        full_size_cache_ = PersistentCacheHelper::open(cache_dir + "/images",
-                                                       settings.full_size_cache_size() * 1024 * 1024,
-                                                       core::CacheDiscardPolicy::lru_only);
-        thumbnail_cache_ = PersistentCacheHelper::open(cache_dir + "/thumbnails",
-                                                       settings.thumbnail_cache_size() * 1024 * 1024,
-                                                       core::CacheDiscardPolicy::lru_only);
-        failure_cache_ = PersistentCacheHelper::open(cache_dir + "/failures",
-                                                     settings.failure_cache_size() * 1024 * 1024,
-                                                     core::CacheDiscardPolicy::lru_ttl);
-        max_size_ = settings.max_thumbnail_size();
-        retry_not_found_hours_ = settings.retry_not_found_hours();
-        extraction_timeout_ = chrono::milliseconds(settings.extraction_timeout() * 1000);
-        backoff_.set_min_backoff(chrono::seconds(settings.extraction_timeout() * 2));
-        backoff_.set_max_backoff(chrono::seconds(settings.retry_error_max_seconds()));
-
-        // For transient remote errors, we read the time at which the last failure
-        // happened and the backoff period. The destructor writes these values back out,
-        // so we remember the values across re-starts. We call contains_key() to avoid generating
-        // a bogus cache miss in the stats.
-        if (failure_cache_->contains_key(LAST_NETWORK_FAIL_TIME_KEY))
-        {
-            auto last_fail_time = failure_cache_->get(LAST_NETWORK_FAIL_TIME_KEY);
-            auto fail_time_point = chrono::system_clock::time_point(chrono::seconds(stoll(*last_fail_time)));
-            backoff_.set_last_fail_time(fail_time_point);
-        }
-        if (failure_cache_->contains_key(BACKOFF_PERIOD_KEY))
-        {
-            auto backoff = failure_cache_->get(BACKOFF_PERIOD_KEY);
-            backoff_.set_backoff_period(chrono::seconds(stoll(*backoff)));
-        }
-
-        // Apply any adjustments to the caches that are version-dependent.
-        apply_upgrade_actions(cache_dir);
+        finish_failure_filter_rebuild();
     }
-    catch (std::exception const& e)
+    if (failure_filter_saved_)
     {
-        throw runtime_error(string("Thumbnailer(): Cannot instantiate cache: ") + e.what());
+        return;
     }
+    int64_t deadline = 0;
+    if (!failure_filter_valid_)
+    {
+        deadline = chrono::duration_cast<chrono::seconds>(failure_filter_deadline_.time_since_epoch()).count();
+    }
+    write_file(failure_filter_path_, to_string(deadline) + '\n' + failure_filter_->serialize());
+    failure_filter_saved_ = true;
 }
 
-Thumbnailer::~Thumbnailer()
+// Most sessions only ask for local thumbnails, so we don't create the downloader
+// (which reads the settings and sets up the network access manager) until the
+// first remote request needs it. Downloads are started on the main thread,
+// which is where the network access manager has to live.
+
+ArtDownloader* Thumbnailer::downloader() const
 {
-    try
-    {
-        auto seconds = chrono::duration_cast<chrono::seconds>(backoff_.last_fail_time().time_since_epoch()).count();
-        failure_cache_->put(LAST_NETWORK_FAIL_TIME_KEY, to_string(seconds));
-        seconds = backoff_.backoff_period().count();
-        failure_cache_->put(BACKOFF_PERIOD_KEY, to_string(seconds));
-    }
-    // LCOV_EXCL_START
-    catch (std::exception const& e)
-    {
-        qDebug() << "~Thumbnailer(): cannot update network failure time:" << e.what();
-    }
-    catch (...)
+    lock_guard<mutex> lock(downloader_mutex_);
+    if (!downloader_)
     {
-        qDebug() << "~Thumbnailer(): cannot update network failure time: unknown exception";
+        downloader_.reset(new UbuntuServerDownloader());
     }
-    // LCOV_EXCL_STOP
+    return downloader_.get();
 }
 
 void Thumbnailer::apply_upgrade_actions(string const& cache_dir)
 {
     Version v(cache_dir);
-    if (v.prev_cache_version() != v.cache_version)
+    if (v.prev_cache_version() == 2)
+    {
+        // Version 2 used variable-length string keys. Wiping the caches would make
+        // every client regenerate its thumbnails at once, so we keep the entries and
+        // move them to the new key format as they are used. Entries that aren't
+        // used for a while are evicted as usual.
+        qDebug() << "cache version update from" << v.prev_cache_version() << "to" << v.cache_version
+                 << ": migrating cache keys";
+
+        // Failure entries are never migrated, so nothing would look them up again.
+        // Each file that failed is retried under its new key anyway, so we drop them,
+        // apart from the backoff state.
+        vector<pair<string, string>> bookkeeping;
+        for (auto const& key : { LAST_NETWORK_FAIL_TIME_KEY, BACKOFF_PERIOD_KEY })
+        {
+            if (failure_cache_->contains_key(key))
+            {
+                bookkeeping.emplace_back(key, *failure_cache_->get(key));
+            }
+        }
+        failure_cache_->invalidate();
+        for (auto const& entry : bookkeeping)
+        {
+            failure_cache_->put(entry.first, entry.second);
+        }
+
+        auto deadline = chrono::system_clock::now() + LEGACY_KEY_MIGRATION_PERIOD;
+        auto seconds = chrono::duration_cast<chrono::seconds>(deadline.time_since_epoch()).count();
+        failure_cache_->put(LEGACY_KEY_DEADLINE_KEY, to_string(seconds));
+    }
+    else if (v.prev_cache_version() != v.cache_version)
     {
         // Whenever the version changes, we wipe all three caches.
         // That's useful to, for example, get rid of old unknown
@@ -824,7 +2061,7 @@ void Thumbnailer::apply_upgrade_actions(string const& cache_dir)
         // is also needed if we ever change the way keys and values
         // are stored in the caches.
         qDebug() << "cache version update from" << v.prev_cache_version() << "to" << v.cache_version;
-        clear(Thumbnailer::CacheSelector::all);
+        clear_caches(Thumbnailer::CacheSelector::all);
     }
 }
 
@@ -836,6 +2073,8 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_thumbnail(string const& filename,
         throw unity::InvalidArgumentException("Thumbnailer::get_thumbnail(): filename is empty");
     }
 
+    wait_for_init();
+
     try
     {
         return unique_ptr<ThumbnailRequest>(
@@ -856,6 +2095,8 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_album_art(string const& artist,
         throw unity::InvalidArgumentException("Thumbnailer::get_album_art(): album is empty");
     }
 
+    wait_for_init();
+
     try
     {
         return unique_ptr<ThumbnailRequest>(new AlbumRequest(this, artist, album, requested_size, extraction_timeout_));
@@ -877,6 +2118,8 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_artist_art(string const& artist,
         throw unity::InvalidArgumentException("Thumbnailer::get_artist_art(): artist is empty");
     }
 
+    wait_for_init();
+
     try
     {
         return unique_ptr<ThumbnailRequest>(new ArtistRequest(this, artist, album, requested_size, extraction_timeout_));
@@ -891,7 +2134,29 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_artist_art(string const& artist,
 
 Thumbnailer::AllStats Thumbnailer::stats() const
 {
-    return AllStats{full_size_cache_->stats(), thumbnail_cache_->stats(), failure_cache_->stats()};
+    wait_for_init();
+
+    auto filter_stats = failure_filter_->stats();
+    DiskCache::RepairStats repair_stats = {};
+    for (auto c : select_caches(CacheSelector::all))
+    {
+        auto rs = c->repair_stats();
+        repair_stats.repairs += rs.repairs;
+        repair_stats.entries_salvaged += rs.entries_salvaged;
+        repair_stats.entries_lost += rs.entries_lost;
+        repair_stats.entries_restored += rs.entries_restored;
+    }
+    return AllStats{full_size_cache_->stats(), thumbnail_cache_->stats(), failure_cache_->stats(),
+                    thumbnail_memory_cache_->stats(), failure_memory_cache_->stats(),
+                    alias_cache_->stats(), DedupStats{duplicate_files_, duplicate_hits_, bytes_saved_},
+                    FilterStats{filter_stats.size_in_bytes, filter_stats.entries,
+                                filter_stats.false_positive_rate, failure_lookups_skipped_},
+                    full_size_window_cache_->stats(), thumbnail_window_cache_->stats(),
+                    full_size_admission_->stats(), thumbnail_admission_->stats(),
+                    GcStats{gc_files_checked_, gc_stale_files_, gc_entries_removed_, gc_bytes_reclaimed_,
+                            gc_compactions_},
+                    repair_stats,
+                    full_size_write_queue_->stats(), thumbnail_write_queue_->stats()};
 }
 
 Thumbnailer::CacheVec Thumbnailer::select_caches(CacheSelector selector) const
@@ -901,9 +2166,11 @@ Thumbnailer::CacheVec Thumbnailer::select_caches(CacheSelector selector) const
     {
         case Thumbnailer::CacheSelector::full_size_cache:
             v.push_back(full_size_cache_.get());
+            v.push_back(full_size_window_cache_.get());
             break;
         case Thumbnailer::CacheSelector::thumbnail_cache:
             v.push_back(thumbnail_cache_.get());
+            v.push_back(thumbnail_window_cache_.get());
             break;
         case Thumbnailer::CacheSelector::failure_cache:
             v.push_back(failure_cache_.get());
@@ -912,6 +2179,72 @@ Thumbnailer::CacheVec Thumbnailer::select_caches(CacheSelector selector) const
             v.push_back(full_size_cache_.get());
             v.push_back(thumbnail_cache_.get());
             v.push_back(failure_cache_.get());
+            v.push_back(alias_cache_.get());
+            v.push_back(full_size_window_cache_.get());
+            v.push_back(thumbnail_window_cache_.get());
+            break;
+    }
+    return v;
+}
+
+Thumbnailer::MemoryCacheVec Thumbnailer::select_memory_caches(CacheSelector selector) const
+{
+    MemoryCacheVec v;
+    switch (selector)
+    {
+        case Thumbnailer::CacheSelector::full_size_cache:
+            break;
+        case Thumbnailer::CacheSelector::thumbnail_cache:
+            v.push_back(thumbnail_memory_cache_.get());
+            break;
+        case Thumbnailer::CacheSelector::failure_cache:
+            v.push_back(failure_memory_cache_.get());
+            break;
+        default:
+            v.push_back(thumbnail_memory_cache_.get());
+            v.push_back(failure_memory_cache_.get());
+            break;
+    }
+    return v;
+}
+
+Thumbnailer::AdmissionFilterVec Thumbnailer::select_admission_filters(CacheSelector selector) const
+{
+    AdmissionFilterVec v;
+    switch (selector)
+    {
+        case Thumbnailer::CacheSelector::full_size_cache:
+            v.push_back(full_size_admission_.get());
+            break;
+        case Thumbnailer::CacheSelector::thumbnail_cache:
+            v.push_back(thumbnail_admission_.get());
+            break;
+        case Thumbnailer::CacheSelector::failure_cache:
+            break;
+        default:
+            v.push_back(full_size_admission_.get());
+            v.push_back(thumbnail_admission_.get());
+            break;
+    }
+    return v;
+}
+
+Thumbnailer::WriteQueueVec Thumbnailer::select_write_queues(CacheSelector selector) const
+{
+    WriteQueueVec v;
+    switch (selector)
+    {
+        case Thumbnailer::CacheSelector::full_size_cache:
+            v.push_back(full_size_write_queue_.get());
+            break;
+        case Thumbnailer::CacheSelector::thumbnail_cache:
+            v.push_back(thumbnail_write_queue_.get());
+            break;
+        case Thumbnailer::CacheSelector::failure_cache:
+            break;
+        default:
+            v.push_back(full_size_write_queue_.get());
+            v.push_back(thumbnail_write_queue_.get());
             break;
     }
     return v;
@@ -939,22 +2272,85 @@ char const* cache_name(Thumbnailer::CacheSelector selector)
 
 void Thumbnailer::clear_stats(CacheSelector selector)
 {
+    wait_for_init();
+
     for (auto c : select_caches(selector))
     {
         c->clear_stats();
     }
+    for (auto c : select_memory_caches(selector))
+    {
+        c->clear_stats();
+    }
+    if (selector == Thumbnailer::CacheSelector::all)
+    {
+        duplicate_files_ = 0;
+        duplicate_hits_ = 0;
+        bytes_saved_ = 0;
+        gc_files_checked_ = 0;
+        gc_stale_files_ = 0;
+        gc_entries_removed_ = 0;
+        gc_bytes_reclaimed_ = 0;
+        gc_compactions_ = 0;
+    }
+    if (selector == Thumbnailer::CacheSelector::failure_cache ||
+        selector == Thumbnailer::CacheSelector::all)
+    {
+        failure_lookups_skipped_ = 0;
+    }
+    for (auto a : select_admission_filters(selector))
+    {
+        a->clear_stats();
+    }
     qDebug() << "reset statistics for" << cache_name(selector);
 }
 
 void Thumbnailer::clear(CacheSelector selector)
 {
+    // A prefetch that is still under way would put thumbnails back into the memory cache.
+    wait_for_prefetch();
+    clear_caches(selector);
+}
+
+// Called by init() for the upgrade, so this must not wait for init().
+
+void Thumbnailer::clear_caches(CacheSelector selector)
+{
+    // Drop whatever is queued, and wait for the writes that are under way,
+    // so nothing turns up in the caches after we invalidate them.
+    for (auto q : select_write_queues(selector))
+    {
+        q->clear();
+        q->flush();
+    }
     for (auto c : select_caches(selector))
     {
         c->invalidate();
     }
+    for (auto c : select_memory_caches(selector))
+    {
+        c->invalidate();
+    }
+    if (selector == Thumbnailer::CacheSelector::all)
+    {
+        migrate_legacy_keys_ = false;  // Nothing left to migrate.
+        source_journal_->clear();
+    }
+    for (auto a : select_admission_filters(selector))
+    {
+        a->clear();
+    }
     if (selector == Thumbnailer::CacheSelector::failure_cache ||
         selector == Thumbnailer::CacheSelector::all)
     {
+        {
+            // The failure cache is empty now, so the empty filter is complete.
+            lock_guard<mutex> lock(failure_filter_mutex_);
+            failure_filter_changed();
+            failure_filter_->clear();
+            finish_failure_filter_rebuild();
+        }
+
         // Force retry on next remote retrieval even if we
         // are still within the timeout period.
         backoff_.set_last_fail_time(chrono::system_clock::time_point())
@@ -963,8 +2359,25 @@ void Thumbnailer::clear(CacheSelector selector)
     qDebug() << "cleared" << cache_name(selector);
 }
 
+vector<MissRatioEstimator::Point> Thumbnailer::miss_ratio_curve(CacheSelector selector, int num_points) const
+{
+    wait_for_init();
+
+    switch (selector)
+    {
+        case Thumbnailer::CacheSelector::full_size_cache:
+            return full_size_mrc_->curve(2 * full_size_cache_->stats().max_size_in_bytes(), num_points);
+        case Thumbnailer::CacheSelector::thumbnail_cache:
+            return thumbnail_mrc_->curve(2 * thumbnail_cache_->stats().max_size_in_bytes(), num_points);
+        default:
+            throw invalid_argument(string("Thumbnailer::miss_ratio_curve(): no curve for ") + cache_name(selector));
+    }
+}
+
 void Thumbnailer::compact(CacheSelector selector)
 {
+    wait_for_init();
+
     qDebug() << "compacting" << cache_name(selector);
     for (auto c : select_caches(selector))
     {
@@ -973,6 +2386,138 @@ void Thumbnailer::compact(CacheSelector selector)
     qDebug() << "completed compacting" << cache_name(selector);
 }
 
+bool Thumbnailer::collect_garbage(int max_files)
+{
+    wait_for_init();
+
+    lock_guard<mutex> lock(gc_mutex_);
+
+    auto result = source_journal_->sweep(max_files, is_current_file);
+    gc_files_checked_ += result.sources_checked;
+    if (!result.garbage.empty())
+    {
+        flush();  // Otherwise, a queued write could bring back an entry after we remove it.
+    }
+
+    // We use contains_key() so we don't count a miss for entries that were evicted already.
+    auto take_entry = [this](DiskCache* cache, string const& key)
+    {
+        if (!cache->contains_key(key))
+        {
+            return;
+        }
+        auto value = cache->take(key);
+        if (value)
+        {
+            ++gc_entries_removed_;
+            gc_bytes_reclaimed_ += int64_t(key.size() + value->size());
+            if (find(gc_dirty_caches_.begin(), gc_dirty_caches_.end(), cache) == gc_dirty_caches_.end())
+            {
+                gc_dirty_caches_.push_back(cache);
+            }
+        }
+    };
+    for (auto const& g : result.garbage)
+    {
+        ++gc_stale_files_;
+        take_entry(alias_cache_.get(), g.source_key);
+        if (!g.last_source)
+        {
+            continue;  // Another file has the same contents.
+        }
+        for (auto const& key : g.entry_keys)
+        {
+            take_entry(thumbnail_cache_.get(), key);
+            take_entry(thumbnail_window_cache_.get(), key);
+        }
+        take_entry(full_size_cache_.get(), g.cache_key);
+        take_entry(full_size_window_cache_.get(), g.cache_key);
+        take_entry(alias_cache_.get(), 'c' + g.cache_key);
+    }
+
+    // The memory cache would still serve what it has for the stale files, and the destructor
+    // would save those entries in the warm set again. Memory keys are the source key followed
+    // by the size, and entries made from a disk cache entry have that entry as their source.
+    if (!result.garbage.empty())
+    {
+        unordered_set<string> stale_sources;
+        unordered_set<string> removed_entries;
+        for (auto const& g : result.garbage)
+        {
+            stale_sources.insert(g.source_key);
+            if (g.last_source)
+            {
+                removed_entries.insert(g.entry_keys.begin(), g.entry_keys.end());
+            }
+        }
+        auto is_stale = [&](string const& key, string const& source)
+        {
+            if (key.size() >= 8 && stale_sources.count(key.substr(0, key.size() - 8)) != 0)
+            {
+                return true;
+            }
+            return !source.empty() && removed_entries.count(source) != 0;
+        };
+        thumbnail_memory_cache_->invalidate_if(is_stale);
+    }
+    if (!result.pass_complete)
+    {
+        return true;
+    }
+
+    for (auto cache : gc_dirty_caches_)
+    {
+        if (find(gc_compactions_pending_.begin(), gc_compactions_pending_.end(), cache) == gc_compactions_pending_.end())
+        {
+            gc_compactions_pending_.push_back(cache);
+        }
+    }
+    gc_dirty_caches_.clear();
+    return false;
+}
+
+// leveldb only gets the space back once it compacts the files with the removed entries.
+// persistent-cache can only compact the whole DB, which blocks readers of that cache
+// until it is done, so we do one cache at a time, and only when asked to.
+
+bool Thumbnailer::compact_garbage()
+{
+    wait_for_init();
+
+    lock_guard<mutex> lock(gc_mutex_);
+
+    if (gc_compactions_pending_.empty())
+    {
+        return false;
+    }
+    auto cache = gc_compactions_pending_.back();
+    gc_compactions_pending_.pop_back();
+    cache->compact();
+    ++gc_compactions_;
+    return !gc_compactions_pending_.empty();
+}
+
+void Thumbnailer::flush()
+{
+    wait_for_init();
+
+    for (auto q : select_write_queues(CacheSelector::all))
+    {
+        q->flush();
+    }
+
+    try
+    {
+        save_failure_filter();
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qDebug() << "Thumbnailer::flush(): cannot save failure filter:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
 }  // namespace internal
 
 }  // namespace thumbnailer
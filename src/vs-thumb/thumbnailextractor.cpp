@@ -19,7 +19,10 @@
 
 #include "thumbnailextractor.h"
 
+#include <internal/vs_thumb_protocol.h>
+
 #include <QDebug>
+#include <QSize>
 #include <unity/util/ResourcePtr.h>
 
 #include <cstring>
@@ -137,9 +140,11 @@ ThumbnailExtractor::ThumbnailExtractor()
         // LCOV_EXCL_STOP
     }
 
+    // We never look at the audio, so we don't decode it. Embedded artwork still
+    // shows up in the tags (see extract_cover_art()).
     g_object_set(video_sink, "sync", TRUE, nullptr);
     g_object_set(playbin_.get(), "audio-sink", audio_sink, "video-sink", video_sink, "flags",
-                 GST_PLAY_FLAG_VIDEO | GST_PLAY_FLAG_AUDIO, nullptr);
+                 GST_PLAY_FLAG_VIDEO, nullptr);
 }
 
 ThumbnailExtractor::~ThumbnailExtractor()
@@ -189,27 +194,81 @@ void unmap_callback(guchar* /* pixels */, gpointer data)
     bm->unmap();
 }
 
+// Returns the size of a frame with square pixels that fits into max_size x max_size,
+// or an invalid size if the frame is small enough already or its size is unknown.
+
+QSize scaled_frame_size(GstElement* playbin, int max_size)
+{
+    GstPad* pad = nullptr;
+    g_signal_emit_by_name(playbin, "get-video-pad", 0, &pad);
+    if (!pad)
+    {
+        return QSize();  // LCOV_EXCL_LINE
+    }
+    gobj_ptr<GstPad> pad_guard(pad);
+    unique_ptr<GstCaps, decltype(&gst_caps_unref)> caps(gst_pad_get_current_caps(pad), gst_caps_unref);
+    if (!caps)
+    {
+        return QSize();  // LCOV_EXCL_LINE
+    }
+    GstStructure* s = gst_caps_get_structure(caps.get(), 0);
+    int width = 0;
+    int height = 0;
+    int par_n = 1;
+    int par_d = 1;
+    gst_structure_get_int(s, "width", &width);
+    gst_structure_get_int(s, "height", &height);
+    gst_structure_get_fraction(s, "pixel-aspect-ratio", &par_n, &par_d);
+    if (width <= 0 || height <= 0 || par_n <= 0 || par_d <= 0)
+    {
+        return QSize();  // LCOV_EXCL_LINE
+    }
+
+    QSize size(int(int64_t(width) * par_n / par_d), height);
+    if (size.width() <= max_size && size.height() <= max_size)
+    {
+        return QSize();
+    }
+    return size.scaled(max_size, max_size, Qt::KeepAspectRatio).expandedTo(QSize(1, 1));
 }
 
+}  // namespace
+
 // Extract a still frame from a video. Rotate the frame as needed and leave it in still_frame_ in RGB format.
+// If max_size is not 0, the frame is scaled down to fit into max_size x max_size.
 
-bool ThumbnailExtractor::extract_video_frame()
+bool ThumbnailExtractor::extract_video_frame(int max_size)
 {
     // Seek some distance into the video so we don't always get black or a 20th Century Fox logo.
+    // We land on the closest key frame and tell the decoders to skip everything else,
+    // so only a single frame needs to be decoded.
     gint64 seek_point = 10 * GST_SECOND;
     if (duration_ >= 0)
     {
         seek_point = 2 * duration_ / 7;
     }
-    gst_element_seek_simple(playbin_.get(), GST_FORMAT_TIME,
-                            static_cast<GstSeekFlags>(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT), seek_point);
+    int seek_flags = GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE;
+#if GST_CHECK_VERSION(1, 6, 0)
+    seek_flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS;
+#endif
+    gst_element_seek_simple(playbin_.get(), GST_FORMAT_TIME, static_cast<GstSeekFlags>(seek_flags), seek_point);
     gst_element_get_state(playbin_.get(), nullptr, nullptr, GST_CLOCK_TIME_NONE);
 
-    // Retrieve sample from the playbin.
+    // Retrieve sample from the playbin. If we don't need the full resolution,
+    // the conversion scales the frame, which is much cheaper than converting
+    // the whole frame to RGB and scaling it afterwards.
     unique_ptr<GstCaps, decltype(&gst_caps_unref)> desired_caps(
         gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "RGB", "pixel-aspect-ratio", GST_TYPE_FRACTION, 1,
                             1, nullptr),
         gst_caps_unref);
+    QSize scaled_size = max_size > 0 ? scaled_frame_size(playbin_.get(), max_size) : QSize();
+    if (scaled_size.isValid())
+    {
+        gst_caps_set_simple(desired_caps.get(),
+                            "width", G_TYPE_INT, scaled_size.width(),
+                            "height", G_TYPE_INT, scaled_size.height(),
+                            nullptr);
+    }
     GstSample* s;
     g_signal_emit_by_name(playbin_.get(), "convert-sample", desired_caps.get(), &s);
     if (!s)
@@ -295,9 +354,15 @@ bool ThumbnailExtractor::extract_video_frame()
 
 bool ThumbnailExtractor::extract_cover_art()
 {
+    // Audio is not decoded, so we may not see tags on the audio stream. Container-level
+    // tags, which is where embedded artwork lives, are attached to every stream.
     GstTagList* tags = nullptr;
     g_signal_emit_by_name(playbin_.get(), "get-audio-tags", 0, &tags);
     if (!tags)
+    {
+        g_signal_emit_by_name(playbin_.get(), "get-video-tags", 0, &tags);
+    }
+    if (!tags)
     {
         return false;
     }
@@ -361,9 +426,30 @@ gboolean write_to_fd(gchar const* buf, gsize count, GError **error, gpointer dat
     return true;
 }
 
+void write_all(int fd, void const* data, size_t size)
+{
+    char const* p = static_cast<char const*>(data);
+    while (size > 0)
+    {
+        ssize_t rc = write(fd, p, size);
+        if (rc == -1)
+        {
+            // LCOV_EXCL_START
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(string("write_image(): cannot write raw frame: ") + strerror(errno));
+            // LCOV_EXCL_STOP
+        }
+        p += rc;
+        size -= rc;
+    }
+}
+
 }
 
-void ThumbnailExtractor::write_image()
+void ThumbnailExtractor::write_image(FrameFormat frame_format)
 {
     assert(still_frame_ || sample_);
 
@@ -385,14 +471,30 @@ void ThumbnailExtractor::write_image()
             throw runtime_error(msg);
         }
     }
+    // We close only what we opened. A descriptor passed in the URL belongs to the caller.
     auto close_func = [](int fd) { if (fd != -1) ::close(fd); };
-    unity::util::ResourcePtr<int, decltype(close_func)> fd_guard(fd, close_func);  // Don't leak fd.
+    unity::util::ResourcePtr<int, decltype(close_func)> fd_guard(out_url_.scheme() == "fd" ? -1 : fd, close_func);
+
+    if (still_frame_ && frame_format == FrameFormat::raw)
+    {
+        // The thumbnailer maps the pixels straight out of the memfd, so a frame
+        // is written to the kernel exactly once and never encoded or decoded.
+        assert(gdk_pixbuf_get_n_channels(still_frame_.get()) == 3);
+        vs_thumb_protocol::RawFrameHeader hdr;
+        memcpy(hdr.magic, vs_thumb_protocol::RAW_FRAME_MAGIC, sizeof(hdr.magic));
+        hdr.width = gdk_pixbuf_get_width(still_frame_.get());
+        hdr.height = gdk_pixbuf_get_height(still_frame_.get());
+        hdr.rowstride = gdk_pixbuf_get_rowstride(still_frame_.get());
+        write_all(fd, &hdr, sizeof(hdr));
+        write_all(fd, gdk_pixbuf_read_pixels(still_frame_.get()),
+                  size_t(hdr.rowstride) * (hdr.height - 1) + hdr.width * 3);
+        return;
+    }
 
     if (still_frame_)
     {
         // We extracted a still frame from a video. We save as tiff without compression because that is
-        // lossless and efficient. (There is no point avoiding the tiff encoding step because
-        // still frame extraction is so slow that the gain would be insignificant.)
+        // lossless and efficient.
         GError* error = nullptr;
         if (!gdk_pixbuf_save_to_callback(still_frame_.get(), write_to_fd, &fd, "tiff", &error, "compression", "1", nullptr))
         {
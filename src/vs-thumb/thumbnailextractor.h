@@ -108,9 +108,14 @@ public:
     void reset();
     void set_urls(QUrl const& in_url, QUrl const& out_url);
     bool has_video();
-    bool extract_video_frame();
+    bool extract_video_frame(int max_size = 0);
     bool extract_cover_art();
-    void write_image();
+
+    // A still frame is written as uncompressed TIFF or, for the extractor pool,
+    // as raw pixels (see vs_thumb_protocol.h). Cover art is written as is.
+    // For an fd: output URL, the caller keeps ownership of the descriptor.
+    enum class FrameFormat { tiff, raw };
+    void write_image(FrameFormat frame_format = FrameFormat::tiff);
 
     typedef std::unique_ptr<GstSample, decltype(&gst_sample_unref)> SampleUPtr;
     typedef unity::thumbnailer::internal::gobj_ptr<GdkPixbuf> PixbufUPtr;
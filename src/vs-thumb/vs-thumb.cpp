@@ -19,13 +19,21 @@
 
 #include "thumbnailextractor.h"
 
+#include <internal/raii.h>
 #include <internal/trace.h>
+#include <internal/vs_thumb_protocol.h>
 
 #include <QUrl>
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/socket.h>
 
 using namespace std;
 using namespace unity::thumbnailer::internal;
@@ -33,22 +41,120 @@ using namespace unity::thumbnailer::internal;
 namespace
 {
 
-void extract_thumbnail(QUrl const& in_url, QUrl const& out_url)
-{
-    ThumbnailExtractor extractor;
+// Returns false if the file has neither embedded cover art nor a video stream,
+// such as an audio file without artwork.
 
-    extractor.set_urls(in_url, out_url);
+bool extract_image(ThumbnailExtractor& extractor, int max_size = 0)
+{
     if (extractor.extract_cover_art())
     {
-        // Found embedded cover art.
-        extractor.write_image();
-        return;
+        return true;  // Found embedded cover art.
+    }
+    if (!extractor.has_video())
+    {
+        return false;
     }
 
     // Otherwise, extract a still frame.
-    assert(extractor.has_video());
-    extractor.extract_video_frame();
+    extractor.extract_video_frame(max_size);
+    return true;
+}
+
+bool extract_thumbnail(QUrl const& in_url, QUrl const& out_url)
+{
+    ThumbnailExtractor extractor;
+
+    extractor.set_urls(in_url, out_url);
+    if (!extract_image(extractor))
+    {
+        return false;
+    }
     extractor.write_image();
+    return true;
+}
+
+// In worker mode, we receive jobs from the thumbnailer's ExtractorPool over the
+// socket (see vs_thumb_protocol.h) until the pool closes its end. The extractor
+// is re-used for all jobs, so we pay for gst_init() and the pipeline set-up only once.
+
+int run_worker(char const* progname, int sock)
+{
+    using namespace unity::thumbnailer::internal::vs_thumb_protocol;
+
+    // We don't want to pass the socket on to gstreamer helpers, such as gst-plugin-scanner.
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        cerr << progname << ": invalid socket: " << strerror(errno) << endl;
+        return 2;
+    }
+
+    ThumbnailExtractor extractor;
+    std::unique_ptr<char[]> buf(new char[MAX_JOB_SIZE]);
+    for (;;)
+    {
+        int fd;
+        ssize_t len = recv_packet(sock, buf.get(), MAX_JOB_SIZE, &fd);
+        if (len == 0)
+        {
+            return 0;  // The thumbnailer has no more work for us.
+        }
+        if (len == -1)
+        {
+            // LCOV_EXCL_START
+            cerr << progname << ": cannot receive job: " << strerror(errno) << endl;
+            return 2;
+            // LCOV_EXCL_STOP
+        }
+        FdPtr out_fd(fd, do_close);
+
+        char status = success;
+        try
+        {
+            JobHeader hdr;
+            if (size_t(len) < sizeof(hdr))
+            {
+                throw runtime_error("short job packet: " + to_string(len) + " bytes");  // LCOV_EXCL_LINE
+            }
+            memcpy(&hdr, buf.get(), sizeof(hdr));
+            char const* url = buf.get() + sizeof(hdr);
+            size_t url_len = len - sizeof(hdr);
+
+            QUrl in_url(QString::fromUtf8(url, url_len), QUrl::StrictMode);
+            if (!in_url.isValid() || in_url.scheme() != "file")
+            {
+                throw runtime_error("invalid input URL: " + string(url, url_len));  // LCOV_EXCL_LINE
+            }
+            if (out_fd.get() == -1)
+            {
+                throw runtime_error("no output file descriptor");  // LCOV_EXCL_LINE
+            }
+            QUrl out_url;
+            out_url.setScheme("fd");
+            out_url.setPath(QString::number(out_fd.get()));
+
+            extractor.set_urls(in_url, out_url);
+            if (extract_image(extractor, hdr.max_size))
+            {
+                extractor.write_image(ThumbnailExtractor::FrameFormat::raw);
+            }
+            else
+            {
+                status = no_artwork;
+            }
+        }
+        catch (exception const& e)
+        {
+            cerr << progname << ": Error creating thumbnail: " << e.what() << endl;
+            status = extraction_failed;
+        }
+        out_fd.dealloc();  // Must be closed before we reply, so the thumbnailer sees EOF.
+        extractor.reset();  // Don't hang on to the pipeline and image while idle.
+
+        if (send_packet(sock, &status, sizeof(status)) != sizeof(status))
+        {
+            return 2;  // LCOV_EXCL_LINE
+        }
+    }
 }
 
 }  // namespace
@@ -61,6 +167,18 @@ int main(int argc, char** argv)
 
     gst_init(&argc, &argv);
 
+    if (argc == 3 && strcmp(argv[1], "--worker") == 0)
+    {
+        char* end;
+        long sock = strtol(argv[2], &end, 10);
+        if (*argv[2] == '\0' || *end != '\0' || sock < 0)
+        {
+            cerr << progname << ": invalid socket: " << argv[2] << endl;
+            return 2;
+        }
+        return run_worker(progname, int(sock));
+    }
+
     if (argc != 3)
     {
         cerr << "usage: " << progname << " source-file (output-file.tiff | fd:num)" << endl;
@@ -120,7 +238,10 @@ int main(int argc, char** argv)
 
     try
     {
-        extract_thumbnail(in_url, out_url);
+        if (!extract_thumbnail(in_url, out_url))
+        {
+            return 1;  // No artwork.
+        }
     }
     catch (exception const& e)
     {
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/write_behind_queue.h>
+
+#include <cassert>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+void WriteBehindQueue::Batch::swap(Batch& other)
+{
+    // Swapping keeps the iterators in the index valid.
+    entries.swap(other.entries);
+    index.swap(other.index);
+    std::swap(bytes, other.bytes);
+}
+
+void WriteBehindQueue::Batch::clear()
+{
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+WriteBehindQueue::WriteBehindQueue(WriteFunc const& write, int64_t max_bytes)
+    : write_(write)
+    , max_bytes_(max_bytes)
+    , done_(false)
+    , written_(0)
+    , batches_(0)
+    , coalesced_(0)
+    , stalls_(0)
+    , failures_(0)
+{
+    assert(write);
+    assert(max_bytes > 0);
+
+    writer_ = thread(&WriteBehindQueue::run, this);
+}
+
+WriteBehindQueue::~WriteBehindQueue()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        done_ = true;
+    }
+    work_cond_.notify_one();
+    writer_.join();
+}
+
+void WriteBehindQueue::put(string const& key, string const& value)
+{
+    int64_t const size = key.size() + value.size();
+
+    unique_lock<mutex> lock(mutex_);
+
+    // An entry that is larger than the queue still goes in once the queue is empty.
+    auto has_room = [this, size]
+    {
+        return pending_.bytes + writing_.bytes + size <= max_bytes_
+               || (pending_.entries.empty() && writing_.entries.empty());
+    };
+    if (!has_room())
+    {
+        ++stalls_;
+        space_cond_.wait(lock, has_room);
+    }
+
+    auto it = pending_.index.find(key);
+    if (it != pending_.index.end())
+    {
+        pending_.bytes += int64_t(value.size()) - int64_t(it->second->second.size());
+        it->second->second = value;
+        ++coalesced_;
+        return;
+    }
+    pending_.entries.emplace_back(key, value);
+    pending_.index[key] = prev(pending_.entries.end());
+    pending_.bytes += size;
+    work_cond_.notify_one();
+}
+
+core::Optional<string> WriteBehindQueue::get(string const& key) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    // pending_ is more recent than writing_.
+    auto it = pending_.index.find(key);
+    if (it != pending_.index.end())
+    {
+        return it->second->second;
+    }
+    it = writing_.index.find(key);
+    if (it != writing_.index.end())
+    {
+        return it->second->second;
+    }
+    return core::Optional<string>();
+}
+
+void WriteBehindQueue::flush()
+{
+    unique_lock<mutex> lock(mutex_);
+    space_cond_.wait(lock, [this]{ return pending_.entries.empty() && writing_.entries.empty(); });
+}
+
+void WriteBehindQueue::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+    pending_.clear();
+    space_cond_.notify_all();
+}
+
+WriteBehindQueue::Stats WriteBehindQueue::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return Stats{int64_t(pending_.entries.size() + writing_.entries.size()),
+                 pending_.bytes + writing_.bytes,
+                 written_,
+                 batches_,
+                 coalesced_,
+                 stalls_,
+                 failures_};
+}
+
+void WriteBehindQueue::run()
+{
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        work_cond_.wait(lock, [this]{ return done_ || !pending_.entries.empty(); });
+        if (pending_.entries.empty())
+        {
+            break;  // We are done, and everything has been written.
+        }
+
+        // Everyone else only reads writing_, and only while holding the lock,
+        // so we can write the batch without holding it.
+        writing_.swap(pending_);
+        lock.unlock();
+        int64_t failures = 0;
+        for (auto const& entry : writing_.entries)
+        {
+            try
+            {
+                write_(entry.first, entry.second);
+            }
+            catch (...)
+            {
+                ++failures;
+            }
+        }
+        lock.lock();
+
+        written_ += writing_.entries.size();
+        failures_ += failures;
+        ++batches_;
+        writing_.clear();
+        space_cond_.notify_all();
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
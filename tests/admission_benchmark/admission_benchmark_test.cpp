@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/admission_filter.h>
+
+#include <utils/lru_cache_sim.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <regex>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+// Replays a request trace against a plain LRU cache and against the same
+// amount of space split into a window and a main cache with admission filtering,
+// and compares the hit ratios.
+//
+// By default, the trace is synthetic. To replay a recorded trace, run the service
+// with log-level 2 and set THUMBNAILER_TRACE to the file containing its output.
+// THUMBNAILER_TRACE_CACHE_SIZE sets the cache size in bytes for the recorded trace.
+
+namespace
+{
+
+struct Request
+{
+    string key;
+    int64_t size;
+};
+
+typedef vector<Request> Trace;
+
+// Every time the launcher or the music app comes up, it asks for the same few hundred
+// thumbnails. In between, a media scanner or a scroll through a photo library asks
+// for thumbnails of thousands of files once each.
+
+Trace synthetic_trace()
+{
+    int const HOT_KEYS = 600;
+    int const SCAN_KEYS = 20000;
+    int const ROUNDS = 10;
+    int64_t const THUMBNAIL_SIZE = 10 * 1024;
+
+    Trace trace;
+    int scan_key = 0;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        for (int i = 0; i < HOT_KEYS; ++i)
+        {
+            trace.push_back(Request{"hot" + to_string(i), THUMBNAIL_SIZE});
+        }
+        for (int i = 0; i < SCAN_KEYS / ROUNDS; ++i)
+        {
+            trace.push_back(Request{"scan" + to_string(scan_key++), THUMBNAIL_SIZE});
+        }
+    }
+    return trace;
+}
+
+// Extracts the requests from the service log. Each completed request is logged as
+// "thumbnail: <path> (<width>,<height>): <seconds> sec (<status>)" (or album: or artist:).
+// We don't know how large the thumbnails were, so we assume a nominal size per pixel.
+
+Trace recorded_trace(string const& path)
+{
+    static regex const request_re(R"(((?:thumbnail|album|artist): .*) \((\d+),(\d+)\): [0-9.]+(?: \[.*\])? sec)");
+
+    Trace trace;
+    ifstream in(path);
+    string line;
+    while (getline(in, line))
+    {
+        smatch m;
+        if (regex_search(line, m, request_re))
+        {
+            int64_t width = stoll(m[2]);
+            int64_t height = stoll(m[3]);
+            trace.push_back(Request{m[1].str() + " " + m[2].str() + "x" + m[3].str(), max(width * height / 8, int64_t(1024))});
+        }
+    }
+    return trace;
+}
+
+template<typename CacheT>
+double hit_ratio(Trace const& trace, CacheT& cache)
+{
+    int64_t hits = 0;
+    for (auto const& r : trace)
+    {
+        if (cache.get(r.key))
+        {
+            ++hits;
+        }
+        else
+        {
+            cache.put(r.key, string(size_t(r.size), 'x'));
+        }
+    }
+    return trace.empty() ? 0.0 : double(hits) / trace.size();
+}
+
+struct Result
+{
+    double lru;
+    double admission;
+};
+
+Result compare(Trace const& trace, int64_t cache_size, int64_t average_entry_size)
+{
+    LruCacheSim lru(cache_size);
+
+    int64_t window_size = cache_size * AdmissionFilter<LruCacheSim>::WINDOW_PERCENT / 100;
+    LruCacheSim main(cache_size - window_size);
+    LruCacheSim window(window_size);
+    AdmissionFilter<LruCacheSim> filter(main, window, max(cache_size / average_entry_size, int64_t(1)));
+
+    Result r{hit_ratio(trace, lru), hit_ratio(trace, filter)};
+    printf("%zu requests, cache size %lld: LRU hit ratio %.3f, window + admission filter hit ratio %.3f\n",
+           trace.size(), static_cast<long long>(cache_size), r.lru, r.admission);
+    return r;
+}
+
+}  // namespace
+
+TEST(admission_benchmark, synthetic_trace)
+{
+    // The cache holds 1000 thumbnails, so the hot set fits, but not together with the scan.
+    auto r = compare(synthetic_trace(), 1000 * 10 * 1024, 10 * 1024);
+    EXPECT_GT(r.admission, r.lru + 0.1);
+}
+
+TEST(admission_benchmark, recorded_trace)
+{
+    char const* path = getenv("THUMBNAILER_TRACE");
+    if (!path)
+    {
+        printf("THUMBNAILER_TRACE not set, skipping recorded trace\n");
+        return;
+    }
+    auto trace = recorded_trace(path);
+    ASSERT_FALSE(trace.empty()) << "no requests found in " << path;
+
+    // By default, make the cache a tenth of the size needed to hold everything.
+    int64_t total_size = 0;
+    vector<string> keys;
+    for (auto const& r : trace)
+    {
+        keys.push_back(r.key);
+        total_size += r.size;
+    }
+    sort(keys.begin(), keys.end());
+    auto unique_keys = int64_t(unique(keys.begin(), keys.end()) - keys.begin());
+    int64_t average_size = total_size / int64_t(trace.size());
+    int64_t cache_size = max(unique_keys * average_size / 10, average_size);
+    char const* size_str = getenv("THUMBNAILER_TRACE_CACHE_SIZE");
+    if (size_str)
+    {
+        cache_size = stoll(size_str);
+    }
+    compare(trace, cache_size, average_size);
+}
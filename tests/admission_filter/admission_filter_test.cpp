@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/admission_filter.h>
+
+#include <utils/lru_cache_sim.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(frequency_sketch, basic)
+{
+    FrequencySketch s(1000);
+
+    EXPECT_EQ(0, s.frequency("a"));
+    s.record("a");
+    s.record("a");
+    s.record("a");
+    s.record("b");
+    EXPECT_EQ(3, s.frequency("a"));
+    EXPECT_EQ(1, s.frequency("b"));
+    EXPECT_EQ(0, s.frequency("c"));
+    EXPECT_GT(s.size_in_bytes(), 0);
+
+    s.clear();
+    EXPECT_EQ(0, s.frequency("a"));
+    EXPECT_EQ(0, s.frequency("b"));
+}
+
+TEST(frequency_sketch, saturation)
+{
+    FrequencySketch s(1000);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        s.record("a");
+    }
+    EXPECT_EQ(15, s.frequency("a"));
+}
+
+TEST(frequency_sketch, aging)
+{
+    FrequencySketch s(10);  // Counters are halved every 100 records.
+
+    for (int i = 0; i < 8; ++i)
+    {
+        s.record("a");
+    }
+    for (int i = 0; i < 91; ++i)
+    {
+        s.record("other" + to_string(i));
+    }
+    EXPECT_EQ(8, s.frequency("a"));
+    s.record("other");
+    EXPECT_EQ(3, s.frequency("a"));  // The doorkeeper that counted the first request is cleared as well.
+    s.record("a");
+    EXPECT_EQ(4, s.frequency("a"));
+    s.record("a");
+    EXPECT_EQ(5, s.frequency("a"));
+}
+
+TEST(frequency_sketch, serialize)
+{
+    FrequencySketch s(1000);
+    s.record("a");
+    s.record("a");
+    s.record("b");
+
+    string data = s.serialize();
+    FrequencySketch t(1000);
+    EXPECT_TRUE(t.deserialize(data));
+    EXPECT_EQ(2, t.frequency("a"));
+    EXPECT_EQ(1, t.frequency("b"));
+    EXPECT_EQ(0, t.frequency("c"));
+
+    // Data from a sketch with a different capacity or in the wrong format is ignored.
+    FrequencySketch u(10);
+    u.record("a");
+    EXPECT_FALSE(u.deserialize(data));
+    EXPECT_FALSE(u.deserialize(""));
+    EXPECT_FALSE(u.deserialize(data.substr(0, data.size() - 1)));
+    EXPECT_FALSE(u.deserialize("XXXX" + data.substr(4)));
+    EXPECT_EQ(1, u.frequency("a"));
+}
+
+TEST(admission_filter, admits_while_not_full)
+{
+    LruCacheSim main(1000);
+    LruCacheSim window(100);
+    AdmissionFilter<LruCacheSim> f(main, window, 100);
+
+    EXPECT_FALSE(f.get("a"));
+    EXPECT_TRUE(f.put("a", string(99, 'x')));
+    EXPECT_TRUE(main.contains_key("a"));
+    EXPECT_FALSE(window.contains_key("a"));
+    EXPECT_TRUE(f.get("a"));
+
+    auto s = f.stats();
+    EXPECT_EQ(1, s.admitted);
+    EXPECT_EQ(0, s.rejected);
+    EXPECT_EQ(0, s.window_hits);
+    EXPECT_GT(s.sketch_size_in_bytes, 0);
+}
+
+TEST(admission_filter, scan_resistance)
+{
+    LruCacheSim main(1000);
+    LruCacheSim window(200);
+    AdmissionFilter<LruCacheSim> f(main, window, 1000);
+
+    // Fill the main cache with entries that are requested repeatedly.
+    for (int i = 0; i < 10; ++i)
+    {
+        string key = "hot" + to_string(i);
+        f.get(key);
+        f.put(key, string(100 - key.size(), 'x'));
+        f.get(key);
+    }
+    EXPECT_EQ(1000, main.stats().size_in_bytes());
+
+    // A scan over keys that are requested once only churns the window.
+    for (int i = 0; i < 100; ++i)
+    {
+        string key = "scan" + to_string(i);
+        EXPECT_FALSE(f.get(key));
+        f.put(key, string(10, 'x'));
+    }
+    for (int i = 0; i < 10; ++i)
+    {
+        EXPECT_TRUE(main.contains_key("hot" + to_string(i))) << i;
+    }
+    auto s = f.stats();
+    EXPECT_EQ(10, s.admitted);
+    EXPECT_EQ(100, s.rejected);
+
+    // A second request for an entry in the window moves it to the main cache.
+    EXPECT_TRUE(window.contains_key("scan99"));
+    EXPECT_TRUE(f.get("scan99"));
+    EXPECT_FALSE(window.contains_key("scan99"));
+    EXPECT_TRUE(main.contains_key("scan99"));
+    s = f.stats();
+    EXPECT_EQ(1, s.window_hits);
+    EXPECT_EQ(11, s.admitted);
+
+    // Entries that were requested before go straight into the main cache.
+    f.get("scan0");  // Evicted from the window by now.
+    EXPECT_FALSE(window.contains_key("scan0"));
+    f.put("scan0", string(10, 'x'));
+    EXPECT_TRUE(main.contains_key("scan0"));
+
+    f.clear_stats();
+    s = f.stats();
+    EXPECT_EQ(0, s.window_hits);
+    EXPECT_EQ(0, s.admitted);
+    EXPECT_EQ(0, s.rejected);
+
+    // After clear(), nothing has been requested before.
+    f.clear();
+    f.get("scan1");
+    f.put("scan1", string(100, 'x'));
+    EXPECT_FALSE(main.contains_key("scan1"));
+    EXPECT_TRUE(window.contains_key("scan1"));
+}
+
+TEST(admission_filter, deferred_promotion)
+{
+    LruCacheSim main(100);
+    LruCacheSim window(100);
+    AdmissionFilter<LruCacheSim> f(main, window, 100);
+
+    f.get("a");
+    f.put("a", string(99, 'x'));
+    f.get("b");
+    EXPECT_TRUE(f.put("b", string(50, 'x')));
+    EXPECT_TRUE(window.contains_key("b"));
+
+    // The caller gets the value, but the entry stays in the window until the caller puts it.
+    bool promote = false;
+    EXPECT_TRUE(f.get("b", &promote));
+    EXPECT_TRUE(promote);
+    EXPECT_TRUE(window.contains_key("b"));
+    EXPECT_FALSE(main.contains_key("b"));
+    EXPECT_EQ(1, f.stats().window_hits);
+
+    EXPECT_TRUE(f.put("b", string(50, 'x')));
+    EXPECT_FALSE(window.contains_key("b"));
+    EXPECT_TRUE(main.contains_key("b"));
+
+    // Nothing to promote for an entry in the main cache.
+    promote = false;
+    EXPECT_TRUE(f.get("b", &promote));
+    EXPECT_FALSE(promote);
+}
+
+TEST(admission_filter, probe)
+{
+    LruCacheSim main(100);
+    LruCacheSim window(100);
+    AdmissionFilter<LruCacheSim> f(main, window, 100);
+
+    // Probing doesn't count as a request, so the entry doesn't get into the main cache.
+    f.get("a");
+    f.put("a", string(99, 'x'));
+    EXPECT_FALSE(f.probe("b"));
+    EXPECT_TRUE(f.put("b", string(50, 'x')));
+    EXPECT_TRUE(window.contains_key("b"));
+    EXPECT_FALSE(main.contains_key("b"));
+
+    // A request that was answered elsewhere still counts.
+    f.record("c");
+    f.record("c");
+    EXPECT_TRUE(f.put("c", string(50, 'x')));
+    EXPECT_TRUE(main.contains_key("c"));
+}
+
+TEST(admission_filter, serialize)
+{
+    LruCacheSim main(100);
+    LruCacheSim window(100);
+    AdmissionFilter<LruCacheSim> f(main, window, 100);
+    f.get("a");
+    f.get("a");
+
+    LruCacheSim main2(100);
+    LruCacheSim window2(100);
+    AdmissionFilter<LruCacheSim> g(main2, window2, 100);
+    EXPECT_TRUE(g.deserialize(f.serialize()));
+    g.get("b");
+    g.put("b", string(99, 'x'));
+    EXPECT_TRUE(g.put("a", string(50, 'x')));  // a was requested twice before the restart.
+    EXPECT_TRUE(main2.contains_key("a"));
+}
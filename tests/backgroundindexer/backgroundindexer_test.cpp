@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backgroundindexer.h"
+#include "inactivityhandler.h"
+
+#include <internal/file_io.h>
+#include <internal/image.h>
+#include <internal/thumbnailer.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+#include <QCoreApplication>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <testsetup.h>
+
+#include <cstdio>
+#include <functional>
+
+#include <sys/stat.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+using namespace unity::thumbnailer::service;
+
+#define TEST_IMAGE TESTDATADIR "/orientation-1.jpg"
+
+// The thumbnailer uses g_get_user_cache_dir() to get the cache dir, and
+// glib remembers that value, so changing XDG_CACHE_HOME later has no effect.
+
+static auto set_tempdir = []()
+{
+    auto dir = new QTemporaryDir(TESTBINDIR "/test-dir.XXXXXX");
+    setenv("XDG_CACHE_HOME", dir->path().toUtf8().data(), true);
+    return dir;
+};
+static unique_ptr<QTemporaryDir> tempdir(set_tempdir());
+
+namespace
+{
+
+class BackgroundIndexerTest : public ::testing::Test
+{
+public:
+    static string tempdir_path()
+    {
+        return tempdir->path().toStdString();
+    }
+
+    static string watched_path()
+    {
+        return tempdir_path() + "/Pictures";
+    }
+
+protected:
+    virtual void SetUp() override
+    {
+        mkdir(tempdir_path().c_str(), 0700);
+        mkdir(watched_path().c_str(), 0700);
+        thumbnailer_ = make_shared<Thumbnailer>();
+        limiter_ = make_shared<RateLimiter>(1);
+        inactivity_handler_.reset(new InactivityHandler([]{}));
+    }
+
+    virtual void TearDown() override
+    {
+        inactivity_handler_.reset();
+        limiter_.reset();
+        thumbnailer_.reset();
+        boost::filesystem::remove_all(tempdir_path());
+    }
+
+    unique_ptr<BackgroundIndexer> make_indexer()
+    {
+        unique_ptr<BackgroundIndexer> indexer(new BackgroundIndexer(thumbnailer_, limiter_, *inactivity_handler_,
+                                                                    { QString::fromStdString(watched_path()) },
+                                                                    { 64, 128 }));
+        // The watches are added once the event loop runs.
+        wait_until([&indexer]{ return indexer->num_watches() != 0; });
+        return indexer;
+    }
+
+    // Runs the event loop until pred() returns true, or the timeout expires.
+    static bool wait_until(function<bool()> const& pred, int timeout_ms = 5000)
+    {
+        for (int i = 0; i < timeout_ms / 10 && !pred(); ++i)
+        {
+            QTest::qWait(10);
+        }
+        return pred();
+    }
+
+    // Returns true if the thumbnail for path at size is in the cache.
+    bool is_cached(string const& path, int size)
+    {
+        auto request = thumbnailer_->get_thumbnail(path, QSize(size, size));
+        return Image(request->thumbnail()).width() == size
+               && request->status() == ThumbnailRequest::FetchStatus::cache_hit;
+    }
+
+    shared_ptr<Thumbnailer> thumbnailer_;
+    shared_ptr<RateLimiter> limiter_;
+    unique_ptr<InactivityHandler> inactivity_handler_;
+};
+
+}  // namespace
+
+TEST_F(BackgroundIndexerTest, new_file)
+{
+    auto indexer = make_indexer();
+    EXPECT_EQ(1, indexer->num_watches());
+
+    string const file = watched_path() + "/new.jpg";
+    write_file(file, read_file(TEST_IMAGE));
+    ASSERT_TRUE(wait_until([&indexer]{ return indexer->num_indexed() == 1; }));
+    EXPECT_EQ(0, indexer->num_queued());
+    EXPECT_TRUE(is_cached(file, 64));
+    EXPECT_TRUE(is_cached(file, 128));
+
+    // Files that aren't media files are ignored.
+    write_file(watched_path() + "/notes.txt", string("hello"));
+    QTest::qWait(500);
+    EXPECT_EQ(0, indexer->num_queued());
+    EXPECT_EQ(1, indexer->num_indexed());
+}
+
+TEST_F(BackgroundIndexerTest, new_directory)
+{
+    auto indexer = make_indexer();
+
+    // A directory that arrives with files in it is watched, and its files are indexed.
+    string const staging = tempdir_path() + "/staging";
+    mkdir(staging.c_str(), 0700);
+    write_file(staging + "/moved.jpg", read_file(TEST_IMAGE));
+    string const album = watched_path() + "/album";
+    ASSERT_EQ(0, rename(staging.c_str(), album.c_str()));
+
+    ASSERT_TRUE(wait_until([&indexer]{ return indexer->num_indexed() == 1; }));
+    EXPECT_EQ(2, indexer->num_watches());
+    EXPECT_TRUE(is_cached(album + "/moved.jpg", 64));
+
+    // Files created in the new directory later are picked up as well.
+    write_file(album + "/later.jpg", read_file(TEST_IMAGE));
+    ASSERT_TRUE(wait_until([&indexer]{ return indexer->num_indexed() == 2; }));
+    EXPECT_TRUE(is_cached(album + "/later.jpg", 128));
+}
+
+TEST_F(BackgroundIndexerTest, pause_and_resume)
+{
+    auto indexer = make_indexer();
+
+    // While an interactive request is active, new files are queued, but not indexed.
+    inactivity_handler_->request_started();
+    string const file = watched_path() + "/busy.jpg";
+    write_file(file, read_file(TEST_IMAGE));
+    ASSERT_TRUE(wait_until([&indexer]{ return indexer->num_queued() == 1; }));
+    QTest::qWait(1000);
+    EXPECT_EQ(1, indexer->num_queued());
+    EXPECT_EQ(0, indexer->num_indexed());
+
+    // Once we are idle, indexing resumes after a delay.
+    inactivity_handler_->request_completed();
+    QTest::qWait(1000);
+    EXPECT_EQ(0, indexer->num_indexed());
+    ASSERT_TRUE(wait_until([&indexer]{ return indexer->num_indexed() == 1; }));
+    EXPECT_EQ(0, indexer->num_queued());
+    EXPECT_TRUE(is_cached(file, 64));
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    setenv("GSETTINGS_BACKEND", "memory", true);
+    setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
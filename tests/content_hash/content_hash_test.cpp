@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/content_hash.h>
+
+#include <internal/file_io.h>
+
+#include <boost/algorithm/string.hpp>
+#include <gtest/gtest.h>
+#include <testsetup.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+string const FILE1 = TESTBINDIR "/file1";
+string const FILE2 = TESTBINDIR "/file2";
+
+}  // namespace
+
+TEST(content_hash, same_contents)
+{
+    write_file(FILE1, read_file(TESTDATADIR "/orientation-1.jpg"));
+    write_file(FILE2, read_file(TESTDATADIR "/orientation-1.jpg"));
+    auto hash = content_hash(FILE1);
+    EXPECT_EQ(size_t(HASH_SIZE), hash.size());
+    EXPECT_EQ(hash, content_hash(FILE2));
+    EXPECT_NE(hash, content_hash(TESTDATADIR "/orientation-2.jpg"));
+
+    write_file(FILE1, string());
+    write_file(FILE2, string());
+    EXPECT_EQ(content_hash(FILE1), content_hash(FILE2));
+}
+
+TEST(content_hash, small_file)
+{
+    string data(100000, 'x');
+    write_file(FILE1, data);
+    auto hash = content_hash(FILE1);
+
+    // Small files are hashed in full.
+    data[50000] = 'y';
+    write_file(FILE2, data);
+    EXPECT_NE(hash, content_hash(FILE2));
+
+    // Same samples, different size.
+    write_file(FILE2, data + 'x');
+    EXPECT_NE(hash, content_hash(FILE2));
+}
+
+TEST(content_hash, large_file)
+{
+    string const data(1024 * 1024, 'x');
+    write_file(FILE1, data);
+    auto hash = content_hash(FILE1);
+
+    // Changes to the start, middle, or end of the file change the hash.
+    for (size_t pos : { size_t(0), data.size() / 2, data.size() - 1 })
+    {
+        string changed = data;
+        changed[pos] = 'y';
+        write_file(FILE2, changed);
+        EXPECT_NE(hash, content_hash(FILE2)) << pos;
+    }
+
+    // Changes outside the samples don't.
+    string changed = data;
+    changed[100000] = 'y';
+    write_file(FILE2, changed);
+    EXPECT_EQ(hash, content_hash(FILE2));
+}
+
+TEST(content_hash, key_hash)
+{
+    auto hash = key_hash(string("a\0b", 3));
+    EXPECT_EQ(size_t(HASH_SIZE), hash.size());
+    EXPECT_EQ(hash, key_hash(string("a\0b", 3)));
+    EXPECT_NE(hash, key_hash(string("a\0c", 3)));
+    EXPECT_NE(hash, key_hash("a"));
+    EXPECT_EQ(size_t(HASH_SIZE), key_hash("").size());
+}
+
+TEST(content_hash, exceptions)
+{
+    try
+    {
+        content_hash(TESTDATADIR "/no_such_file");
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        EXPECT_TRUE(boost::starts_with(e.what(), "content_hash(): cannot open ")) << e.what();
+    }
+}
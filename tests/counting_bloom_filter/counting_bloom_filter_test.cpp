@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/counting_bloom_filter.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(counting_bloom_filter, basic)
+{
+    CountingBloomFilter f(1000, 0.01);
+
+    EXPECT_FALSE(f.may_contain("a"));
+    f.add("a");
+    EXPECT_TRUE(f.may_contain("a"));
+    EXPECT_FALSE(f.may_contain("b"));
+
+    auto s = f.stats();
+    EXPECT_EQ(1, s.entries);
+    EXPECT_GT(s.size_in_bytes, 0);
+    EXPECT_LT(s.size_in_bytes, 1000 * 10);  // About ten bits per entry for 1%, with four bits per counter.
+    EXPECT_GT(s.false_positive_rate, 0.0);
+
+    f.remove("a");
+    EXPECT_FALSE(f.may_contain("a"));
+    EXPECT_EQ(0, f.stats().entries);
+    EXPECT_EQ(0.0, f.stats().false_positive_rate);
+
+    // Removing a key that isn't there doesn't do anything.
+    f.add("a");
+    f.remove("b");
+    EXPECT_TRUE(f.may_contain("a"));
+    EXPECT_EQ(1, f.stats().entries);
+
+    f.clear();
+    EXPECT_FALSE(f.may_contain("a"));
+    EXPECT_EQ(0, f.stats().entries);
+}
+
+TEST(counting_bloom_filter, no_false_negatives)
+{
+    CountingBloomFilter f(1000, 0.01);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        f.add("key" + to_string(i));
+    }
+    // Remove every other key; the remaining ones must still be found.
+    for (int i = 0; i < 1000; i += 2)
+    {
+        f.remove("key" + to_string(i));
+    }
+    for (int i = 1; i < 1000; i += 2)
+    {
+        EXPECT_TRUE(f.may_contain("key" + to_string(i))) << i;
+    }
+    EXPECT_EQ(500, f.stats().entries);
+}
+
+TEST(counting_bloom_filter, false_positive_rate)
+{
+    CountingBloomFilter f(10000, 0.01);
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        f.add("key" + to_string(i));
+    }
+    double estimate = f.stats().false_positive_rate;
+    EXPECT_GT(estimate, 0.005);
+    EXPECT_LT(estimate, 0.02);
+
+    int false_positives = 0;
+    for (int i = 0; i < 100000; ++i)
+    {
+        if (f.may_contain("other" + to_string(i)))
+        {
+            ++false_positives;
+        }
+    }
+    EXPECT_LT(false_positives, 2000);
+}
+
+TEST(counting_bloom_filter, saturation)
+{
+    CountingBloomFilter f(10, 0.1);
+
+    // Adding the same key more often than a counter can count
+    // must not make it disappear when it is removed again.
+    for (int i = 0; i < 20; ++i)
+    {
+        f.add("a");
+    }
+    for (int i = 0; i < 20; ++i)
+    {
+        f.remove("a");
+    }
+    EXPECT_TRUE(f.may_contain("a"));
+}
+
+TEST(counting_bloom_filter, serialize)
+{
+    CountingBloomFilter f(1000, 0.01);
+    f.add("a");
+    f.add("b");
+    string data = f.serialize();
+
+    CountingBloomFilter g(1000, 0.01);
+    EXPECT_TRUE(g.deserialize(data));
+    EXPECT_TRUE(g.may_contain("a"));
+    EXPECT_TRUE(g.may_contain("b"));
+    EXPECT_FALSE(g.may_contain("c"));
+    EXPECT_EQ(2, g.stats().entries);
+
+    // Filters with different dimensions or bad data are rejected.
+    CountingBloomFilter h(2000, 0.01);
+    EXPECT_FALSE(h.deserialize(data));
+    EXPECT_FALSE(h.may_contain("a"));
+    EXPECT_FALSE(g.deserialize(""));
+    EXPECT_FALSE(g.deserialize(data.substr(0, data.size() - 1)));
+    EXPECT_FALSE(g.deserialize("XXXX" + data.substr(4)));
+    EXPECT_TRUE(g.may_contain("a"));
+}
+
+TEST(counting_bloom_filter, threads)
+{
+    CountingBloomFilter f(8 * 1000, 0.01);
+
+    vector<thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&f, t]
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                f.add(to_string(t) + "/" + to_string(i));
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    EXPECT_EQ(8 * 1000, f.stats().entries);
+    for (int t = 0; t < 8; ++t)
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            ASSERT_TRUE(f.may_contain(to_string(t) + "/" + to_string(i)));
+        }
+    }
+}
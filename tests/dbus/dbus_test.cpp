@@ -26,6 +26,7 @@
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <gtest/gtest.h>
+#include <QFile>
 #include <QProcess>
 #include <QSignalSpy>
 #include <QTemporaryDir>
@@ -33,10 +34,13 @@
 #include <testsetup.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
+#include <map>
 #include <memory>
 #include <string>
 #include <sys/stat.h>
+#include <thread>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -85,6 +89,23 @@ protected:
         return tempdir->path().toStdString();
     }
 
+    // Stats() doesn't wait for queued cache writes, so we poll until the writes are done.
+    QDBusReply<unity::thumbnailer::service::AllStats> stats_after_writes()
+    {
+        QDBusReply<unity::thumbnailer::service::AllStats> reply;
+        for (int i = 0; i < 500; ++i)
+        {
+            reply = dbus_->admin_->Stats();
+            if (!reply.isValid() || (reply.value().full_size_write_queue_stats.queued == 0 &&
+                                     reply.value().thumbnail_write_queue_stats.queued == 0))
+            {
+                break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return reply;
+    }
+
     virtual void TearDown() override
     {
         dbus_.reset();
@@ -136,6 +157,162 @@ TEST_F(DBusTest, thumbnail_image)
     EXPECT_EQ(160, image.height());
 }
 
+TEST_F(DBusTest, thumbnail_image_fd)
+{
+    const char* filename = TESTDATADIR "/testimage.jpg";
+
+    // We do this twice, so we get a cache hit on the second try.
+    for (int i = 0; i < 2; ++i)
+    {
+        QDBusReply<QDBusUnixFileDescriptor> reply =
+            dbus_->thumbnailer_->GetThumbnailFd(filename, QSize(256, 256));
+        assert_no_error(reply);
+        int fd = reply.value().fileDescriptor();
+
+        // The memfd is sealed, so the client cannot modify it.
+        EXPECT_EQ(-1, write(fd, "x", 1));
+        EXPECT_EQ(-1, ftruncate(fd, 0));
+
+        Image image(fd);
+        EXPECT_EQ(256, image.width());
+        EXPECT_EQ(160, image.height());
+    }
+}
+
+TEST_F(DBusTest, album_and_artist_art_fd)
+{
+    QDBusReply<QDBusUnixFileDescriptor> reply =
+        dbus_->thumbnailer_->GetAlbumArtFd("metallica", "load", QSize(24, 24));
+    assert_no_error(reply);
+    Image image(reply.value().fileDescriptor());
+    EXPECT_EQ(24, image.width());
+
+    reply = dbus_->thumbnailer_->GetArtistArtFd("metallica", "load", QSize(24, 24));
+    assert_no_error(reply);
+    image = Image(reply.value().fileDescriptor());
+    EXPECT_EQ(24, image.width());
+}
+
+TEST_F(DBusTest, thumbnail_fd_no_such_file)
+{
+    QDBusReply<QDBusUnixFileDescriptor> reply =
+        dbus_->thumbnailer_->GetThumbnailFd(TESTDATADIR "/no-such-file.jpg", QSize(256, 256));
+    EXPECT_FALSE(reply.isValid());
+    auto message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, " No such file or directory: ")) << message;
+}
+
+TEST_F(DBusTest, thumbnail_with_priority)
+{
+    const char* filename = TESTDATADIR "/testvideo.ogg";
+
+    QDBusReply<QByteArray> reply =
+        dbus_->thumbnailer_->GetThumbnailWithPriority(filename, QSize(256, 256), 2, 0);
+    assert_no_error(reply);
+    Image image(reply.value());
+    EXPECT_EQ(256, image.width());
+    EXPECT_EQ(144, image.height());
+
+    QDBusReply<QDBusUnixFileDescriptor> fd_reply =
+        dbus_->thumbnailer_->GetThumbnailFdWithPriority(filename, QSize(128, 128), 1, 0);
+    assert_no_error(fd_reply);
+    image = Image(fd_reply.value().fileDescriptor());
+    EXPECT_EQ(128, image.width());
+    EXPECT_EQ(72, image.height());
+
+    reply = dbus_->thumbnailer_->GetThumbnailWithPriority(filename, QSize(256, 256), 3, 0);
+    EXPECT_FALSE(reply.isValid());
+    auto message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, "invalid priority: 3")) << message;
+
+    reply = dbus_->thumbnailer_->GetThumbnailWithPriority(filename, QSize(256, 256), -1, 0);
+    EXPECT_FALSE(reply.isValid());
+    message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, "invalid priority: -1")) << message;
+}
+
+TEST_F(DBusTest, cancel_request)
+{
+    // Each copy of the video needs its own extraction.
+    int const N_REQUESTS = 10;
+    QString filenames[N_REQUESTS];
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        filenames[i] = QString::fromStdString(temp_dir()) + "/video" + QString::number(i) + ".ogg";
+        ASSERT_TRUE(QFile::copy(TESTDATADIR "/testvideo.ogg", filenames[i]));
+    }
+
+    QDBusPendingReply<QByteArray> replies[N_REQUESTS];
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        replies[i] = dbus_->thumbnailer_->GetThumbnailWithPriority(filenames[i], QSize(64, 64), 0, i + 1);
+    }
+
+    // Request ids must be unique while a request is in progress.
+    QDBusReply<QByteArray> reply = dbus_->thumbnailer_->GetThumbnailWithPriority(filenames[0], QSize(64, 64), 0, 1);
+    EXPECT_FALSE(reply.isValid());
+    auto message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, "duplicate request id: 1")) << message;
+
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        dbus_->thumbnailer_->CancelRequest(i + 1);
+    }
+    assert_no_error(QDBusReply<void>(dbus_->thumbnailer_->CancelRequest(999)));  // Unknown id is ignored.
+
+    // Each request either completed before the cancellation arrived, or failed.
+    int cancelled = 0;
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        replies[i].waitForFinished();
+        if (!replies[i].isValid())
+        {
+            message = replies[i].error().message().toStdString();
+            EXPECT_TRUE(boost::contains(message, "request cancelled")) << message;
+            ++cancelled;
+        }
+    }
+    EXPECT_GT(cancelled, 0);
+
+    // The admin interface reports the cancellations. The unknown id arrived too late.
+    auto stats = dbus_->admin_->Stats();
+    assert_no_error(stats);
+    auto const& cs = stats.value().cancel_stats;
+    EXPECT_EQ(cancelled, cs.cancelled);
+    EXPECT_LE(cs.downloads_dropped + cs.downloads_aborted, cs.cancelled);
+    EXPECT_EQ(N_REQUESTS - cancelled + 1, cs.too_late);
+
+    // Cancellation must not leave a failure in the cache, and the id can be used again.
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        reply = dbus_->thumbnailer_->GetThumbnailWithPriority(filenames[i], QSize(64, 64), 0, 1);
+        assert_no_error(reply);
+        Image image(reply.value());
+        EXPECT_EQ(64, image.width());
+    }
+}
+
+TEST_F(DBusTest, fd_delivery)
+{
+    auto reply = dbus_->thumbnailer_->FdDelivery();
+    reply.waitForFinished();
+    ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
+    EXPECT_TRUE(reply.value());
+
+    // The ClientConfig() reply keeps the layout of older versions.
+    QDBusMessage config_reply = dbus_->thumbnailer_->call(QStringLiteral("ClientConfig"));
+    ASSERT_EQ(QDBusMessage::ReplyMessage, config_reply.type()) << config_reply.errorMessage().toStdString();
+    EXPECT_EQ(QStringLiteral("(bi)"), config_reply.signature());
+}
+
+TEST_F(DBusTest, request_priorities)
+{
+    auto reply = dbus_->thumbnailer_->RequestPriorities();
+    reply.waitForFinished();
+    ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
+    EXPECT_TRUE(reply.value());
+}
+
 TEST_F(DBusTest, song_image)
 {
     // We do this twice, so we get a cache hit on the second try.
@@ -178,6 +355,127 @@ TEST_F(DBusTest, thumbnail_no_such_file)
     EXPECT_TRUE(boost::contains(message, " No such file or directory: ")) << message;
 }
 
+namespace
+{
+
+// Reads all records from a GetThumbnails() result stream until EOF.
+map<int, pair<bool, QByteArray>> read_batch(int fd)
+{
+    using namespace unity::thumbnailer::service;
+
+    QByteArray data;
+    char buf[4096];
+    ssize_t rc;
+    while ((rc = read(fd, buf, sizeof(buf))) > 0)
+    {
+        data.append(buf, rc);
+    }
+
+    map<int, pair<bool, QByteArray>> results;
+    int offset = 0;
+    while (data.size() - offset >= int(sizeof(BatchRecordHeader)))
+    {
+        BatchRecordHeader hdr;
+        memcpy(&hdr, data.constData() + offset, sizeof(hdr));
+        offset += sizeof(hdr);
+        results[hdr.index] = make_pair(hdr.error == 0, data.mid(offset, hdr.size));
+        offset += hdr.size;
+    }
+    EXPECT_EQ(data.size(), offset);
+    return results;
+}
+
+}  // namespace
+
+TEST_F(DBusTest, batch)
+{
+    using namespace unity::thumbnailer::service;
+
+    BatchItems items;
+    items.append(BatchItem{TESTDATADIR "/testimage.jpg", QSize(256, 256)});
+    items.append(BatchItem{TESTDATADIR "/no-such-file.jpg", QSize(256, 256)});
+    items.append(BatchItem{TESTDATADIR "/testvideo.ogg", QSize(256, 256)});
+    items.append(BatchItem{TESTDATADIR "/testsong.ogg", QSize(256, 256)});
+
+    // We do this twice, so we get cache hits on the second try.
+    for (int i = 0; i < 2; ++i)
+    {
+        QDBusReply<QDBusUnixFileDescriptor> reply = dbus_->thumbnailer_->GetThumbnails(items);
+        assert_no_error(reply);
+
+        auto results = read_batch(reply.value().fileDescriptor());
+        ASSERT_EQ(4u, results.size());
+
+        ASSERT_TRUE(results[0].first);
+        Image image(results[0].second);
+        EXPECT_EQ(256, image.width());
+        EXPECT_EQ(160, image.height());
+
+        EXPECT_FALSE(results[1].first);
+        EXPECT_TRUE(results[1].second.contains(" No such file or directory: ")) << results[1].second.constData();
+
+        ASSERT_TRUE(results[2].first);
+        image = Image(results[2].second);
+        EXPECT_EQ(256, image.width());
+        EXPECT_EQ(144, image.height());
+
+        ASSERT_TRUE(results[3].first);
+        image = Image(results[3].second);
+        EXPECT_EQ(200, image.width());
+        EXPECT_EQ(200, image.height());
+    }
+
+    // Empty batch
+    {
+        QDBusReply<QDBusUnixFileDescriptor> reply = dbus_->thumbnailer_->GetThumbnails(BatchItems());
+        assert_no_error(reply);
+        EXPECT_EQ(0u, read_batch(reply.value().fileDescriptor()).size());
+    }
+}
+
+TEST_F(DBusTest, batch_duplicates)
+{
+    using namespace unity::thumbnailer::service;
+
+    // The same file and size twice, and the same file at another size.
+    BatchItems items;
+    items.append(BatchItem{TESTDATADIR "/testvideo.ogg", QSize(128, 128)});
+    items.append(BatchItem{TESTDATADIR "/testvideo.ogg", QSize(128, 128)});
+    items.append(BatchItem{TESTDATADIR "/testvideo.ogg", QSize(256, 256)});
+    items.append(BatchItem{TESTDATADIR "/testvideo.ogg", QSize(128, 128)});
+
+    QDBusReply<QDBusUnixFileDescriptor> reply = dbus_->thumbnailer_->GetThumbnails(items);
+    assert_no_error(reply);
+
+    auto results = read_batch(reply.value().fileDescriptor());
+    ASSERT_EQ(4u, results.size());
+    for (int i : {0, 1, 3})
+    {
+        ASSERT_TRUE(results[i].first) << i;
+        EXPECT_EQ(results[0].second, results[i].second) << i;
+        EXPECT_EQ(128, Image(results[i].second).width()) << i;
+    }
+    ASSERT_TRUE(results[2].first);
+    Image image(results[2].second);
+    EXPECT_EQ(256, image.width());
+    EXPECT_EQ(144, image.height());
+}
+
+TEST_F(DBusTest, batch_too_large)
+{
+    using namespace unity::thumbnailer::service;
+
+    BatchItems items;
+    for (int i = 0; i <= MAX_BATCH_SIZE; ++i)
+    {
+        items.append(BatchItem{TESTDATADIR "/testimage.jpg", QSize(256, 256)});
+    }
+    QDBusReply<QDBusUnixFileDescriptor> reply = dbus_->thumbnailer_->GetThumbnails(items);
+    EXPECT_FALSE(reply.isValid());
+    auto message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, "too many requests in batch")) << message;
+}
+
 TEST_F(DBusTest, server_error)
 {
     {
@@ -472,9 +770,17 @@ TEST_F(DBusTest, stats)
         EXPECT_EQ(24, image.width());
     }
 
-    reply = dbus_->admin_->Stats();
+    reply = stats_after_writes();
     ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
 
+    {
+        WriteQueueStats s = reply.value().thumbnail_write_queue_stats;
+        EXPECT_EQ(0, s.queued);
+        EXPECT_EQ(0, s.queued_bytes);
+        EXPECT_NE(0, s.written);
+        EXPECT_EQ(0, s.failures);
+    }
+
     {
         CacheStats s = reply.value().full_size_stats;
         EXPECT_EQ(1, s.size);
@@ -536,7 +842,7 @@ TEST_F(DBusTest, stats)
         EXPECT_EQ(24, image.width());
     }
 
-    reply = dbus_->admin_->Stats();
+    reply = stats_after_writes();
     ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
 
     {
@@ -566,7 +872,7 @@ TEST_F(DBusTest, stats)
                 "no_such_artist", "no_such_album", QSize(24, 24));
     }
 
-    reply = dbus_->admin_->Stats();
+    reply = stats_after_writes();
     ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
 
     {
@@ -583,7 +889,7 @@ TEST_F(DBusTest, stats)
                 "no_such_artist", "no_such_album", QSize(24, 24));
     }
 
-    reply = dbus_->admin_->Stats();
+    reply = stats_after_writes();
     ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
 
     {
@@ -620,6 +926,9 @@ int main(int argc, char** argv)
     QCoreApplication app(argc, argv);
     qRegisterMetaType<QProcess::ExitStatus>("QProcess::ExitStatus");  // Avoid noise from signal spy.
     qDBusRegisterMetaType<unity::thumbnailer::service::AllStats>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::ConfigValues>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::BatchItem>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::BatchItems>();
 
     setenv("GSETTINGS_BACKEND", "memory", true);
     setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/disk_cache.h>
+
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define CACHE_DIR TESTBINDIR "/disk_cache"
+
+namespace
+{
+
+int64_t const MB = 1024 * 1024;
+
+class DiskCacheTest : public ::testing::TestWithParam<DiskCache::Backend>
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(CACHE_DIR);
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(CACHE_DIR);
+    }
+};
+
+}  // namespace
+
+TEST_P(DiskCacheTest, basic)
+{
+    auto c = DiskCache::open(GetParam(), CACHE_DIR, 4 * MB, core::CacheDiscardPolicy::lru_only);
+    EXPECT_EQ(GetParam(), c->backend());
+
+    EXPECT_FALSE(c->get("a"));
+    EXPECT_TRUE(c->put("a", "hello"));
+    EXPECT_EQ("hello", *c->get("a"));
+
+    auto s = c->stats();
+    EXPECT_EQ(CACHE_DIR, s.cache_path());
+    EXPECT_TRUE(s.policy() == core::CacheDiscardPolicy::lru_only);
+    EXPECT_EQ(1, s.size());
+    EXPECT_EQ(4 * MB, s.max_size_in_bytes());
+    EXPECT_EQ(1, s.hits());
+    EXPECT_EQ(1, s.misses());
+
+    EXPECT_TRUE(c->contains_key("a"));
+    EXPECT_EQ("hello", *c->take("a"));
+    EXPECT_FALSE(c->contains_key("a"));
+
+    c->put("b", "x");
+    c->invalidate();
+    EXPECT_EQ(0, c->stats().size());
+
+    c->clear_stats();
+    EXPECT_EQ(0, c->stats().hits());
+    EXPECT_EQ(0, c->stats().misses());
+}
+
+TEST_P(DiskCacheTest, expiry)
+{
+    auto c = DiskCache::open(GetParam(), CACHE_DIR, 4 * MB, core::CacheDiscardPolicy::lru_ttl);
+    vector<string> expired;
+    c->set_handler(core::CacheEvent::evict_ttl, [&expired](string const& key, core::CacheEvent)
+                   {
+                       expired.push_back(key);
+                   });
+
+    auto const now = chrono::system_clock::now();
+    c->put("forever", "1");
+    c->put("later", "2", now + chrono::hours(1));
+    c->put("gone", "3", now + chrono::milliseconds(10));
+    this_thread::sleep_for(chrono::milliseconds(50));
+
+    EXPECT_EQ("1", *c->get("forever"));
+    EXPECT_EQ("2", *c->get("later"));
+    EXPECT_FALSE(c->get("gone"));
+    EXPECT_FALSE(c->contains_key("gone"));
+
+    auto s = c->stats();
+    EXPECT_TRUE(s.policy() == core::CacheDiscardPolicy::lru_ttl);
+    EXPECT_EQ(1, s.ttl_evictions());
+    EXPECT_EQ(vector<string>{ "gone" }, expired);
+}
+
+TEST_P(DiskCacheTest, switch_backend)
+{
+    {
+        auto c = DiskCache::open(GetParam(), CACHE_DIR, 4 * MB, core::CacheDiscardPolicy::lru_only);
+        c->put("a", "1");
+    }
+    {
+        // Re-opening with the same backend keeps the entries.
+        auto c = DiskCache::open(GetParam(), CACHE_DIR, 4 * MB, core::CacheDiscardPolicy::lru_only);
+        EXPECT_EQ("1", *c->get("a"));
+    }
+
+    // The other backend starts over.
+    auto const other = GetParam() == DiskCache::Backend::leveldb ? DiskCache::Backend::segments
+                                                                 : DiskCache::Backend::leveldb;
+    auto c = DiskCache::open(other, CACHE_DIR, 4 * MB, core::CacheDiscardPolicy::lru_only);
+    EXPECT_EQ(0, c->stats().size());
+    EXPECT_FALSE(c->get("a"));
+    c->put("b", "2");
+    EXPECT_EQ("2", *c->get("b"));
+}
+
+INSTANTIATE_TEST_CASE_P(Backends,
+                        DiskCacheTest,
+                        ::testing::Values(DiskCache::Backend::leveldb, DiskCache::Backend::segments));
+
+TEST(DiskCache, backend_for_name)
+{
+    EXPECT_EQ(DiskCache::Backend::leveldb, DiskCache::backend_for_name("leveldb"));
+    EXPECT_EQ(DiskCache::Backend::segments, DiskCache::backend_for_name("segments"));
+    try
+    {
+        DiskCache::backend_for_name("bdb");
+        FAIL();
+    }
+    catch (domain_error const& e)
+    {
+        EXPECT_STREQ("DiskCache::backend_for_name(): invalid backend: \"bdb\"", e.what());
+    }
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/downscale.h>
+
+#include <utils/downscale_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(downscale, kernels_agree)
+{
+    // Odd sizes, so we exercise the scalar tail of the SIMD kernels.
+    int const width = 517;
+    int const height = 389;
+    vector<pair<int, int>> const sizes = { {128, 96}, {300, 200}, {1, 1}, {517, 389} };
+
+    for (int channels : { 3, 4 })
+    {
+        auto src = random_image(width, height, channels);
+        for (auto filter : { ScaleFilter::box, ScaleFilter::lanczos3 })
+        {
+            for (auto const& size : sizes)
+            {
+                auto expected = scale(src, width, height, size.first, size.second, channels,
+                                      filter, ScaleKernel::scalar);
+                for (auto kernel : all_kernels)
+                {
+                    if (!scale_kernel_supported(kernel))
+                    {
+                        continue;
+                    }
+                    auto actual = scale(src, width, height, size.first, size.second, channels, filter, kernel);
+                    EXPECT_TRUE(expected == actual) << scale_kernel_name(kernel) << ", " << channels << " channels, "
+                                                    << size.first << "x" << size.second;
+                }
+            }
+        }
+    }
+}
+
+TEST(downscale, solid_colour)
+{
+    int const width = 640;
+    int const height = 480;
+    vector<uint8_t> src(size_t(width) * height * 3);
+    for (size_t i = 0; i < src.size(); i += 3)
+    {
+        src[i] = 10;
+        src[i + 1] = 128;
+        src[i + 2] = 250;
+    }
+    for (auto filter : { ScaleFilter::box, ScaleFilter::lanczos3 })
+    {
+        auto dst = scale(src, width, height, 33, 25, 3, filter);
+        for (size_t i = 0; i < dst.size(); i += 3)
+        {
+            ASSERT_EQ(10, dst[i]);
+            ASSERT_EQ(128, dst[i + 1]);
+            ASSERT_EQ(250, dst[i + 2]);
+        }
+    }
+}
+
+TEST(downscale, box_average)
+{
+    // 4x2 grey image, two pixels per output pixel.
+    vector<uint8_t> src = {   0,   0,   0,  100, 100, 100,  200, 200, 200,  255, 255, 255,
+                             50,  50,  50,  150, 150, 150,   10,  10,  10,   20,  20,  20 };
+    auto dst = scale(src, 4, 2, 2, 1, 3);
+    EXPECT_EQ(75, dst[0]);   // (0 + 100 + 50 + 150) / 4
+    // (200 + 255 + 10 + 20) / 4 is 121.25, but the vertical pass
+    // rounds its intermediate result, so we may be off by one.
+    EXPECT_NEAR(121, dst[3], 1);
+}
+
+TEST(downscale, alpha)
+{
+    // A red opaque pixel next to a fully transparent green one
+    // must average to half-transparent red, not brown.
+    vector<uint8_t> src = { 255, 0, 0, 255,  0, 255, 0, 0 };
+    auto dst = scale(src, 2, 1, 1, 1, 4);
+    EXPECT_EQ(255, dst[0]);
+    EXPECT_EQ(0, dst[1]);
+    EXPECT_EQ(0, dst[2]);
+    EXPECT_EQ(128, dst[3]);
+
+    // Fully transparent stays fully transparent.
+    src = { 255, 255, 255, 0,  255, 255, 255, 0 };
+    dst = scale(src, 2, 1, 1, 1, 4);
+    EXPECT_EQ(0, dst[3]);
+}
+
+TEST(downscale, kernels)
+{
+    EXPECT_TRUE(scale_kernel_supported(ScaleKernel::scalar));
+    EXPECT_TRUE(scale_kernel_supported(ScaleKernel::automatic));
+    EXPECT_TRUE(scale_kernel_supported(best_scale_kernel()));
+    EXPECT_NE(ScaleKernel::automatic, best_scale_kernel());
+    EXPECT_STREQ("scalar", scale_kernel_name(ScaleKernel::scalar));
+    EXPECT_STREQ("sse2", scale_kernel_name(ScaleKernel::sse2));
+    EXPECT_STREQ("avx2", scale_kernel_name(ScaleKernel::avx2));
+    EXPECT_STREQ("neon", scale_kernel_name(ScaleKernel::neon));
+}
+
+TEST(downscale, exceptions)
+{
+    vector<uint8_t> src(100 * 3);
+    vector<uint8_t> dst(100 * 3);
+
+    try
+    {
+        downscale(src.data(), 10, 10, 30, dst.data(), 5, 5, 15, 2);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("downscale(): invalid number of channels: 2", e.what());
+    }
+
+    try
+    {
+        downscale(src.data(), 10, 10, 30, dst.data(), 0, 5, 15, 3);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("downscale(): invalid size: 10x10 -> 0x5", e.what());
+    }
+
+    try
+    {
+        downscale(src.data(), 10, 10, 29, dst.data(), 5, 5, 15, 3);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("downscale(): stride too small", e.what());
+    }
+
+    for (auto kernel : all_kernels)
+    {
+        if (scale_kernel_supported(kernel))
+        {
+            continue;
+        }
+        try
+        {
+            downscale(src.data(), 10, 10, 30, dst.data(), 5, 5, 15, 3, ScaleFilter::box, kernel);
+            FAIL();
+        }
+        catch (invalid_argument const& e)
+        {
+            EXPECT_EQ(string("downscale(): kernel not supported on this machine: ") + scale_kernel_name(kernel),
+                      e.what());
+        }
+    }
+}
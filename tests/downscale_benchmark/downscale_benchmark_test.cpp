@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/downscale.h>
+
+#include <utils/downscale_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(downscale, benchmark)
+{
+    // Typical case: a 12 MP camera image scaled to a thumbnail.
+    int const width = 4000;
+    int const height = 3000;
+    int const iterations = 3;
+
+    for (int channels : { 3, 4 })
+    {
+        auto src = random_image(width, height, channels);
+        for (auto filter : { ScaleFilter::box, ScaleFilter::lanczos3 })
+        {
+            for (auto kernel : all_kernels)
+            {
+                if (!scale_kernel_supported(kernel))
+                {
+                    continue;
+                }
+                auto start = chrono::steady_clock::now();
+                for (int i = 0; i < iterations; ++i)
+                {
+                    scale(src, width, height, 256, 192, channels, filter, kernel);
+                }
+                chrono::duration<double> secs = chrono::steady_clock::now() - start;
+                double mps = double(width) * height * iterations / 1e6 / secs.count();
+                cout << (filter == ScaleFilter::box ? "box" : "lanczos3") << ", "
+                     << (channels == 3 ? "RGB" : "RGBA") << ", " << scale_kernel_name(kernel) << ": "
+                     << int(mps) << " MP/s" << endl;
+            }
+        }
+    }
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/embedded_art.h>
+
+#include <internal/file_io.h>
+#include <internal/image.h>
+
+#include <boost/algorithm/string.hpp>
+#include <gtest/gtest.h>
+#include <testsetup.h>
+
+#include <cstdint>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+string const MKV_FILE = TESTBINDIR "/test.mkv";
+
+// Helpers to put together a Matroska file.
+
+string ebml_id(uint32_t id)
+{
+    string s;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        if (!s.empty() || (id >> shift) != 0)
+        {
+            s += char(id >> shift);
+        }
+    }
+    return s;
+}
+
+string element(uint32_t id, string const& data)
+{
+    string s = ebml_id(id) + '\x01';  // Eight-byte size.
+    for (int shift = 48; shift >= 0; shift -= 8)
+    {
+        s += char(uint64_t(data.size()) >> shift);
+    }
+    return s + data;
+}
+
+string unknown_size_element(uint32_t id, string const& data)
+{
+    return ebml_id(id) + '\xff' + data;
+}
+
+string attached_file(string const& name, string const& mime_type, string const& data)
+{
+    return element(0x61A7, element(0x466E, name) + element(0x4660, mime_type) + element(0x465C, data));
+}
+
+string matroska_file(string const& segment_data)
+{
+    return element(0x1A45DFA3, element(0x4282, "matroska")) + element(0x18538067, segment_data);
+}
+
+// Helpers to put together an MP4 file with cover art.
+
+string mp4_box(char const* type, string const& payload)
+{
+    uint32_t const size = 8 + payload.size();
+    string box{ char(size >> 24), char(size >> 16), char(size >> 8), char(size) };
+    return box + type + payload;
+}
+
+string mp4_cover(int type, string const& cover)
+{
+    return mp4_box("data", string(3, '\0') + char(type) + string(4, '\0') + cover);
+}
+
+string mp4_file(string const& covr_data)
+{
+    string const meta = string(4, '\0') + mp4_box("hdlr", string(25, '\0')) +
+                        mp4_box("ilst", mp4_box("covr", covr_data));
+    return mp4_box("ftyp", "M4V ") + mp4_box("moov", mp4_box("udta", mp4_box("meta", meta)));
+}
+
+}  // namespace
+
+TEST(embedded_art, mp4_cover)
+{
+    auto art = extract_embedded_art(TESTDATADIR "/Forbidden Planet.m4v");
+    Image img(art);
+    EXPECT_EQ(1947, img.width());
+    EXPECT_EQ(3000, img.height());
+
+    art = extract_embedded_art(TESTDATADIR "/testsong.m4a");
+    img = Image(art);
+    EXPECT_EQ(200, img.width());
+    EXPECT_EQ(200, img.height());
+}
+
+TEST(embedded_art, mp4_cover_type)
+{
+    // Only JPEG (13), PNG (14), and BMP (27) data counts as a cover.
+    for (int type : { 13, 14, 27 })
+    {
+        write_file(MKV_FILE, mp4_file(mp4_cover(type, "cover")));
+        EXPECT_EQ("cover", extract_embedded_art(MKV_FILE)) << type;
+    }
+    for (int type : { 0, 1, 21 })
+    {
+        write_file(MKV_FILE, mp4_file(mp4_cover(type, "cover")));
+        EXPECT_EQ("", extract_embedded_art(MKV_FILE)) << type;
+    }
+
+    // Data of another type is skipped.
+    write_file(MKV_FILE, mp4_file(mp4_cover(1, "text") + mp4_cover(14, "cover")));
+    EXPECT_EQ("cover", extract_embedded_art(MKV_FILE));
+}
+
+TEST(embedded_art, no_cover)
+{
+    EXPECT_EQ("", extract_embedded_art(TESTDATADIR "/testvideo.mp4"));
+    EXPECT_EQ("", extract_embedded_art(TESTDATADIR "/testvideo.ogg"));
+    EXPECT_EQ("", extract_embedded_art(TESTDATADIR "/testimage.jpg"));
+    EXPECT_EQ("", extract_embedded_art(TESTDATADIR "/empty"));
+}
+
+TEST(embedded_art, truncated_mp4)
+{
+    string data = read_file(TESTDATADIR "/Forbidden Planet.m4v");
+    auto cover = extract_embedded_art(TESTDATADIR "/Forbidden Planet.m4v");
+    for (size_t len : { size_t(8), size_t(100), data.size() / 2, data.size() - 1 })
+    {
+        write_file(MKV_FILE, data.substr(0, len));
+        auto art = extract_embedded_art(MKV_FILE);
+        EXPECT_TRUE(art.empty() || art == cover) << len;
+    }
+}
+
+TEST(embedded_art, matroska)
+{
+    string const cover = "cover image data";
+    string attachments = element(0x1941A469,
+                                 attached_file("font.ttf", "application/x-truetype-font", "font data") +
+                                 attached_file("small_cover.png", "image/png", "small cover") +
+                                 attached_file("Cover.jpg", "image/jpeg", cover) +
+                                 attached_file("cover_land.jpg", "image/jpeg", "landscape cover"));
+    string cluster = element(0x1F43B675, string(1000, 'x'));
+
+    // Attachments found by scanning the segment.
+    write_file(MKV_FILE, matroska_file(cluster + attachments));
+    EXPECT_EQ(cover, extract_embedded_art(MKV_FILE));
+
+    // Attachments found via the seek head, with a cluster of unknown size in the way.
+    // The seek position is relative to the start of the segment data.
+    auto make_seek_head = [](size_t pos)
+    {
+        string seek_position{ char(pos >> 8), char(pos) };
+        return element(0x114D9B74,
+                       element(0x4DBB, element(0x53AB, ebml_id(0x1941A469)) + element(0x53AC, seek_position)));
+    };
+    string live_cluster = unknown_size_element(0x1F43B675, string(1000, 'x'));
+    string seek_head = make_seek_head(0);
+    seek_head = make_seek_head(seek_head.size() + live_cluster.size());
+    write_file(MKV_FILE, matroska_file(seek_head + live_cluster + attachments));
+    EXPECT_EQ(cover, extract_embedded_art(MKV_FILE));
+
+    // Without the seek head, we can't get past the cluster.
+    write_file(MKV_FILE, matroska_file(live_cluster + attachments));
+    EXPECT_EQ("", extract_embedded_art(MKV_FILE));
+
+    // Only images with one of the cover names count.
+    write_file(MKV_FILE, matroska_file(element(0x1941A469,
+                                               attached_file("font.ttf", "application/x-truetype-font", "font") +
+                                               attached_file("cover.ttf", "application/x-truetype-font", "font") +
+                                               attached_file("screenshot.png", "image/png", "screenshot"))));
+    EXPECT_EQ("", extract_embedded_art(MKV_FILE));
+}
+
+TEST(embedded_art, corrupt_matroska)
+{
+    string file = matroska_file(element(0x1941A469, attached_file("cover.jpg", "image/jpeg", "cover")));
+    for (size_t len = 4; len < file.size(); ++len)
+    {
+        write_file(MKV_FILE, file.substr(0, len));
+        auto art = extract_embedded_art(MKV_FILE);
+        EXPECT_TRUE(art.empty() || boost::starts_with(string("cover"), art)) << len << ": " << art;
+    }
+
+    // Invalid ID and size bytes.
+    write_file(MKV_FILE, matroska_file(string(10, '\0')));
+    EXPECT_EQ("", extract_embedded_art(MKV_FILE));
+    write_file(MKV_FILE, element(0x1A45DFA3, "") + ebml_id(0x18538067) + string(10, '\0'));
+    EXPECT_EQ("", extract_embedded_art(MKV_FILE));
+}
+
+TEST(embedded_art, cover_too_large)
+{
+    string const big(MAX_EMBEDDED_ART_SIZE + 1, 'x');
+
+    write_file(MKV_FILE, mp4_file(mp4_cover(13, big)));
+    EXPECT_EQ("", extract_embedded_art(MKV_FILE));
+
+    // A large Matroska cover is skipped in favour of one we can use.
+    write_file(MKV_FILE, matroska_file(element(0x1941A469,
+                                               attached_file("cover.jpg", "image/jpeg", big) +
+                                               attached_file("small_cover.jpg", "image/jpeg", "small cover"))));
+    EXPECT_EQ("small cover", extract_embedded_art(MKV_FILE));
+}
+
+TEST(embedded_art, exceptions)
+{
+    try
+    {
+        extract_embedded_art(TESTDATADIR "/no_such_file.mp4");
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        EXPECT_TRUE(boost::starts_with(e.what(), "extract_embedded_art(): cannot open ")) << e.what();
+    }
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/env_vars.h>
+#include <internal/extractorpool.h>
+#include <internal/image.h>
+#include <internal/imageextractor.h>
+#include "utils/env_var_guard.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <gtest/gtest.h>
+#include <QCoreApplication>
+#include <QSignalSpy>
+#include <QTest>
+
+#include <testsetup.h>
+
+#include <iostream>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_VIDEO TESTDATADIR "/testvideo.ogg"
+
+namespace
+{
+
+// Runs an extraction to completion. Returns the image, or throws if the extraction failed.
+Image extract(shared_ptr<ExtractorPool> const& pool,
+              string const& filename,
+              chrono::milliseconds timeout = chrono::milliseconds(10000),
+              int max_size = 0)
+{
+    ImageExtractor extractor(filename, timeout, pool);
+    QSignalSpy spy(&extractor, &ImageExtractor::finished);
+    extractor.extract(max_size);
+    if (!spy.wait(15000))
+    {
+        throw runtime_error("extract(): no finished signal");
+    }
+    return extractor.read();
+}
+
+// Waits until all workers have exited.
+bool wait_for_no_workers(ExtractorPool const& pool)
+{
+    for (int i = 0; i < 100 && pool.num_workers() != 0; ++i)
+    {
+        QTest::qWait(50);
+    }
+    return pool.num_workers() == 0;
+}
+
+}  // namespace
+
+TEST(ExtractorPool, reuses_worker)
+{
+    auto pool = make_shared<ExtractorPool>(1);
+
+    auto start = chrono::steady_clock::now();
+    Image image(extract(pool, TEST_VIDEO));
+    auto cold = chrono::steady_clock::now() - start;
+    EXPECT_EQ(1920, image.width());
+    EXPECT_EQ(1080, image.height());
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < 3; ++i)
+    {
+        Image image(extract(pool, TEST_VIDEO));
+        EXPECT_EQ(1920, image.width());
+    }
+    auto warm = (chrono::steady_clock::now() - start) / 3;
+
+    EXPECT_EQ(1, pool->workers_started());
+    EXPECT_EQ(1, pool->num_workers());
+
+    cerr << "cold start: " << chrono::duration_cast<chrono::milliseconds>(cold).count() << " ms, "
+         << "warm worker: " << chrono::duration_cast<chrono::milliseconds>(warm).count() << " ms" << endl;
+}
+
+TEST(ExtractorPool, rotated_frame)
+{
+    auto pool = make_shared<ExtractorPool>(1);
+
+    // vs-thumb rotates the frame before handing over the raw pixels.
+    Image image(extract(pool, TESTDATADIR "/testvideo-90.mp4"));
+    EXPECT_EQ(720, image.width());
+    EXPECT_EQ(1280, image.height());
+}
+
+TEST(ExtractorPool, scaled_frame)
+{
+    auto pool = make_shared<ExtractorPool>(1);
+
+    Image image(extract(pool, TEST_VIDEO, chrono::milliseconds(10000), 256));
+    EXPECT_EQ(256, image.width());
+    EXPECT_EQ(144, image.height());
+
+    // The bounding box applies after rotation.
+    image = extract(pool, TESTDATADIR "/testvideo-90.mp4", chrono::milliseconds(10000), 400);
+    EXPECT_EQ(225, image.width());
+    EXPECT_EQ(400, image.height());
+
+    // Frames are never scaled up.
+    image = extract(pool, TEST_VIDEO, chrono::milliseconds(10000), 4000);
+    EXPECT_EQ(1920, image.width());
+    EXPECT_EQ(1080, image.height());
+}
+
+TEST(ExtractorPool, recycles_worker)
+{
+    auto pool = make_shared<ExtractorPool>(1, 2);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        Image image(extract(pool, TEST_VIDEO));
+        EXPECT_EQ(1920, image.width());
+    }
+    EXPECT_EQ(2, pool->workers_started());
+}
+
+TEST(ExtractorPool, concurrent)
+{
+    auto pool = make_shared<ExtractorPool>(2);
+
+    vector<unique_ptr<ImageExtractor>> extractors;
+    vector<unique_ptr<QSignalSpy>> spies;
+    for (int i = 0; i < 5; ++i)
+    {
+        extractors.emplace_back(new ImageExtractor(TEST_VIDEO, chrono::milliseconds(10000), pool));
+        spies.emplace_back(new QSignalSpy(extractors.back().get(), &ImageExtractor::finished));
+        extractors.back()->extract();
+    }
+    EXPECT_EQ(2, pool->num_workers());  // Remaining jobs are queued.
+    for (size_t i = 0; i < extractors.size(); ++i)
+    {
+        ASSERT_TRUE(spies[i]->count() == 1 || spies[i]->wait(15000));
+        Image image(extractors[i]->read());
+        EXPECT_EQ(1920, image.width());
+    }
+    EXPECT_EQ(2, pool->workers_started());
+}
+
+TEST(ExtractorPool, failure_replaces_worker)
+{
+    auto pool = make_shared<ExtractorPool>(1);
+
+    try
+    {
+        extract(pool, TESTDATADIR "/no-such-file.ogv");
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        string msg = e.what();
+        EXPECT_TRUE(boost::contains(msg, "extractor pipeline failed for ")) << msg;
+    }
+
+    Image image(extract(pool, TEST_VIDEO));
+    EXPECT_EQ(1920, image.width());
+    EXPECT_EQ(2, pool->workers_started());
+}
+
+TEST(ExtractorPool, no_artwork_keeps_worker)
+{
+    auto pool = make_shared<ExtractorPool>(1);
+
+    try
+    {
+        extract(pool, TESTDATADIR "/no-artwork.mp3");
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        string msg = e.what();
+        EXPECT_TRUE(boost::contains(msg, "no artwork for ")) << msg;
+    }
+
+    // A file without artwork is not a failure of the worker, so it is re-used.
+    Image image(extract(pool, TEST_VIDEO));
+    EXPECT_EQ(1920, image.width());
+    EXPECT_EQ(1, pool->workers_started());
+}
+
+TEST(ExtractorPool, timeout)
+{
+    EnvVarGuard ev_guard(UTIL_DIR, TESTSRCDIR "/slow-vs-thumb/slow");
+
+    auto pool = make_shared<ExtractorPool>(1);
+    try
+    {
+        extract(pool, TEST_VIDEO, chrono::milliseconds(500));
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        string msg = e.what();
+        EXPECT_TRUE(boost::contains(msg, " did not return after 500 milliseconds")) << msg;
+    }
+    EXPECT_TRUE(wait_for_no_workers(*pool));
+}
+
+TEST(ExtractorPool, crash)
+{
+    EnvVarGuard ev_guard(UTIL_DIR, TESTSRCDIR "/thumbnailer/vs-thumb-crash");
+
+    auto pool = make_shared<ExtractorPool>(1);
+    try
+    {
+        extract(pool, TEST_VIDEO);
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        string msg = e.what();
+        EXPECT_TRUE(boost::ends_with(msg, "/vs-thumb crashed")) << msg;
+    }
+    EXPECT_EQ(0, pool->num_workers());
+}
+
+TEST(ExtractorPool, exec_failure)
+{
+    EnvVarGuard ev_guard(UTIL_DIR, "no_such_directory");
+
+    auto pool = make_shared<ExtractorPool>(1);
+    try
+    {
+        extract(pool, TEST_VIDEO);
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        string msg = e.what();
+        EXPECT_TRUE(boost::contains(msg, "no_such_directory/vs-thumb")) << msg;
+    }
+    EXPECT_TRUE(wait_for_no_workers(*pool));
+}
+
+TEST(ExtractorPool, cancel)
+{
+    EnvVarGuard ev_guard(UTIL_DIR, TESTSRCDIR "/slow-vs-thumb/slow");
+
+    auto pool = make_shared<ExtractorPool>(1);
+    {
+        ImageExtractor running(TEST_VIDEO, chrono::milliseconds(10000), pool);
+        ImageExtractor queued(TEST_VIDEO, chrono::milliseconds(10000), pool);
+        running.extract();
+        queued.extract();
+        EXPECT_EQ(1, pool->num_workers());
+    }
+    // Destroying the extractors must kill the worker.
+    EXPECT_TRUE(wait_for_no_workers(*pool));
+    EXPECT_EQ(1, pool->workers_started());
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    setenv(UTIL_DIR, TESTBINDIR "/../src/vs-thumb", true);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -110,6 +110,23 @@ TEST_F(ProviderTest, thumbnail_image)
     EXPECT_EQ(QColor("#81FF81").rgb(), image.pixel(127, 95));
 }
 
+TEST_F(ProviderTest, thumbnail_prefetch)
+{
+    const char* filename = TESTDATADIR "/orientation-1.jpg?priority=prefetch";
+
+    ThumbnailGenerator provider(thumbnailer_);
+    unique_ptr<QQuickImageResponse> response(
+        provider.requestImageResponse(filename, QSize(128, 128)));
+    wait(response.get());
+    ASSERT_EQ("", response->errorString());
+
+    unique_ptr<QQuickTextureFactory> factory(response->textureFactory());
+    ASSERT_NE(nullptr, factory.get());
+    QImage image = factory->image();
+    EXPECT_EQ(128, image.width());
+    EXPECT_EQ(96, image.height());
+}
+
 TEST_F(ProviderTest, thumbnail_cancel)
 {
     const char* filename = TESTDATADIR "/orientation-1.jpg";
@@ -27,6 +27,14 @@
 #include <internal/raii.h>
 #include <testsetup.h>
 
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#pragma GCC diagnostic pop
+
+#include <cmath>
+
 #define TESTIMAGE TESTDATADIR "/orientation-1.jpg"
 #define JPEGIMAGE TESTBINDIR "/saved_image.jpg"
 #define BADIMAGE TESTDATADIR "/bad_image.jpg"
@@ -307,6 +315,21 @@ TEST(Image, exceptions)
         }
     }
 
+    {
+        // Same error if we go through the JPEG fast path first.
+        try
+        {
+            string data = read_file(BADIMAGE);
+            Image i(data, QSize(10, 10));
+            FAIL();
+        }
+        catch (std::exception const& e)
+        {
+            string msg = e.what();
+            EXPECT_TRUE(boost::starts_with(msg, "load_image(): cannot close pixbuf loader: ")) << msg;
+        }
+    }
+
     {
         string data = read_file(TESTIMAGE);
         Image i(data);
@@ -389,6 +412,44 @@ TEST(Image, load_fd)
     EXPECT_EQ(480, img.height());
 }
 
+TEST(Image, raw_rgb)
+{
+    // 2x2 pixels, with each row padded to 8 bytes.
+    unsigned char const data[] =
+    {
+        0xff, 0x00, 0x00,  0x00, 0xff, 0x00,  0, 0,
+        0x00, 0x00, 0xff,  0x10, 0x20, 0x30,  0, 0
+    };
+    int released = 0;
+    {
+        Image img(data, 2, 2, 8, [&released]{ ++released; });
+        EXPECT_EQ(2, img.width());
+        EXPECT_EQ(2, img.height());
+        EXPECT_FALSE(img.has_alpha());
+        EXPECT_EQ(0xff0000ff, img.pixel(0, 0));
+        EXPECT_EQ(0x00ff00ff, img.pixel(1, 0));
+        EXPECT_EQ(0x0000ffff, img.pixel(0, 1));
+        EXPECT_EQ(0x102030ff, img.pixel(1, 1));
+
+        Image copy = img;
+        img = Image(data, 1, 1, 3, [&released]{ ++released; });
+        EXPECT_EQ(0, released);  // The copy still refers to the pixels.
+        EXPECT_EQ(0x102030ff, copy.pixel(1, 1));
+    }
+    EXPECT_EQ(2, released);
+
+    try
+    {
+        Image img(data, 3, 2, 8, [&released]{ ++released; });
+        FAIL();
+    }
+    catch (std::exception const& e)
+    {
+        EXPECT_STREQ("Image(): invalid raw image geometry: 3x2, rowstride 8", e.what());
+    }
+    EXPECT_EQ(3, released);
+}
+
 TEST(Image, load_fd_big_image)
 {
     FdPtr fd(open(BIGIMAGE, O_RDONLY), do_close);
@@ -478,3 +539,102 @@ TEST(Image, png_transparency)
     EXPECT_EQ(0xFF0000FF, img.pixel(100, 100));
     EXPECT_TRUE(img.has_alpha());
 }
+
+TEST(Image, jpeg_scaled_load)
+{
+    string data = read_file(BIGIMAGE);
+
+    {
+        Image img(data, QSize(128, 128));
+        EXPECT_EQ(128, img.width());
+        EXPECT_EQ(95, img.height());
+        EXPECT_FALSE(img.has_alpha());
+    }
+
+    {
+        // Too large for any of the libjpeg reductions, so this decodes at full size.
+        Image img(data, QSize(2000, 0));
+        EXPECT_EQ(2000, img.width());
+        EXPECT_EQ(1499, img.height());
+    }
+
+    {
+        // Same thing again, from a file descriptor.
+        FdPtr fd(open(BIGIMAGE, O_RDONLY), do_close);
+        ASSERT_GT(fd.get(), 0);
+        Image img(fd.get(), QSize(0, 256));
+        EXPECT_EQ(341, img.width());
+        EXPECT_EQ(256, img.height());
+    }
+}
+
+namespace
+{
+
+GdkPixbuf* pixbuf_from_data(string const& data)
+{
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+    gdk_pixbuf_loader_write(loader, reinterpret_cast<guchar const*>(data.data()), data.size(), nullptr);
+    gdk_pixbuf_loader_close(loader, nullptr);
+    GdkPixbuf* pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    g_object_ref(pixbuf);
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+// Peak signal-to-noise ratio of the RGB channels of two pixbufs of the same size.
+double psnr(GdkPixbuf* a, GdkPixbuf* b)
+{
+    int const width = gdk_pixbuf_get_width(a);
+    int const height = gdk_pixbuf_get_height(a);
+    EXPECT_EQ(width, gdk_pixbuf_get_width(b));
+    EXPECT_EQ(height, gdk_pixbuf_get_height(b));
+
+    double sum = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        guint8 const* pa = gdk_pixbuf_read_pixels(a) + y * gdk_pixbuf_get_rowstride(a);
+        guint8 const* pb = gdk_pixbuf_read_pixels(b) + y * gdk_pixbuf_get_rowstride(b);
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                double d = double(pa[c]) - pb[c];
+                sum += d * d;
+            }
+            pa += gdk_pixbuf_get_n_channels(a);
+            pb += gdk_pixbuf_get_n_channels(b);
+        }
+    }
+    double mse = sum / (double(width) * height * 3);
+    return mse == 0 ? 100 : 10 * log10(255.0 * 255.0 / mse);
+}
+
+}  // namespace
+
+TEST(Image, scale_matches_gdk_pixbuf)
+{
+    // Image::scale() no longer uses gdk_pixbuf_scale_simple(), but the results
+    // must still be close to what it produces.
+    for (auto filename : { TESTIMAGE, BIGIMAGE, PNG_TRANSPARENT_IMAGE })
+    {
+        string data = read_file(filename);
+        Image img(data);
+        GdkPixbuf* orig = pixbuf_from_data(data);
+
+        for (int size : { 300, 128, 37 })
+        {
+            Image scaled = img.scale(QSize(size, size));
+            GdkPixbuf* ours = pixbuf_from_data(scaled.png_data());
+            GdkPixbuf* theirs = gdk_pixbuf_scale_simple(orig,
+                                                        scaled.width(),
+                                                        scaled.height(),
+                                                        GDK_INTERP_BILINEAR);
+            double db = psnr(ours, theirs);
+            EXPECT_GT(db, 30.0) << filename << " at " << size << "px";
+            g_object_unref(ours);
+            g_object_unref(theirs);
+        }
+        g_object_unref(orig);
+    }
+}
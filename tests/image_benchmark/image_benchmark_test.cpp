@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/image.h>
+
+#include <gtest/gtest.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#pragma GCC diagnostic pop
+
+#include <chrono>
+#include <iostream>
+
+#define BIGIMAGE TESTDATADIR "/big.jpg"
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+// This is what Image used to do for all JPEG images: decode via the
+// pixbuf loader and set the target size in the size-prepared callback.
+void set_size_cb(GdkPixbufLoader* loader, int width, int height, void* user_data)
+{
+    QSize size(width, height);
+    size.scale(*reinterpret_cast<QSize*>(user_data), Qt::KeepAspectRatio);
+    gdk_pixbuf_loader_set_size(loader, size.width(), size.height());
+}
+
+int load_with_pixbuf_loader(string const& data, QSize size)
+{
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(set_size_cb), &size);
+    gdk_pixbuf_loader_write(loader, reinterpret_cast<guchar const*>(data.data()), data.size(), nullptr);
+    gdk_pixbuf_loader_close(loader, nullptr);
+    int width = gdk_pixbuf_get_width(gdk_pixbuf_loader_get_pixbuf(loader));
+    g_object_unref(loader);
+    return width;
+}
+
+}  // namespace
+
+TEST(Image, jpeg_scaled_load_benchmark)
+{
+    string data = read_file(BIGIMAGE);
+    int const iterations = 10;
+
+    for (int size : { 128, 256, 512 })
+    {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            EXPECT_EQ(size, load_with_pixbuf_loader(data, QSize(size, size)));
+        }
+        auto pixbuf_time = chrono::steady_clock::now() - start;
+
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            Image img(data, QSize(size, size));
+            EXPECT_EQ(size, img.width());
+        }
+        auto jpeg_time = chrono::steady_clock::now() - start;
+
+        auto pixbuf_ms = chrono::duration_cast<chrono::milliseconds>(pixbuf_time).count() / iterations;
+        auto jpeg_ms = chrono::duration_cast<chrono::milliseconds>(jpeg_time).count() / iterations;
+        cout << "big.jpg at " << size << "px: gdk-pixbuf loader: " << pixbuf_ms << " ms, "
+             << "libjpeg scaled decode: " << jpeg_ms << " ms" << endl;
+    }
+}
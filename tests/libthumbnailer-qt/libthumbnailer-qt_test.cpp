@@ -373,6 +373,30 @@ TEST_F(LibThumbnailerTest, video_image_sync)
     }
 }
 
+TEST_F(LibThumbnailerTest, video_image_priority)
+{
+    Thumbnailer thumbnailer(dbus_->connection());
+
+    const char* filename = TESTDATADIR "/testvideo.ogg";
+    auto background = thumbnailer.getThumbnail(filename, QSize(64, 64), Priority::Background);
+    auto prefetch = thumbnailer.getThumbnail(filename, QSize(128, 128), Priority::Prefetch);
+    auto interactive = thumbnailer.getThumbnail(filename, QSize(256, 256), Priority::Interactive);
+
+    for (auto const& reply : { background, prefetch, interactive })
+    {
+        if (!reply->isFinished())
+        {
+            QSignalSpy spy(reply.data(), &Request::finished);
+            ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+        }
+        EXPECT_TRUE(reply->isValid()) << reply->errorMessage();
+    }
+    EXPECT_EQ(64, background->image().width());
+    EXPECT_EQ(128, prefetch->image().width());
+    EXPECT_EQ(256, interactive->image().width());
+    EXPECT_EQ(144, interactive->image().height());
+}
+
 TEST_F(LibThumbnailerTest, thumbnail_no_such_file)
 {
     const char* no_such_file = TESTDATADIR "/no-such-file.jpg";
@@ -633,6 +657,106 @@ void pump(int millisecs)
     EXPECT_TRUE(timer_spy.wait(millisecs + 1000));
 }
 
+TEST_F(LibThumbnailerTest, batch)
+{
+    Thumbnailer thumbnailer(dbus_->connection());
+
+    QList<QPair<QString, QSize>> batch;
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/orientation-1.jpg"), QSize(128, 96)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/no-such-file.jpg"), QSize(256, 256)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/testvideo.ogg"), QSize(256, 256)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/testsong.ogg"), QSize(256, 256)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/orientation-1.jpg"), QSize()));
+
+    // We do this twice, so we get cache hits on the second try.
+    for (int i = 0; i < 2; ++i)
+    {
+        auto replies = thumbnailer.getThumbnails(batch);
+        ASSERT_EQ(5, replies.size());
+
+        for (auto const& r : replies)
+        {
+            if (!r->isFinished())
+            {
+                QSignalSpy spy(r.data(), &Request::finished);
+                ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+            }
+        }
+
+        EXPECT_TRUE(replies[0]->isValid());
+        EXPECT_EQ(128, replies[0]->image().width());
+        EXPECT_EQ(96, replies[0]->image().height());
+
+        EXPECT_FALSE(replies[1]->isValid());
+        EXPECT_TRUE(boost::contains(replies[1]->errorMessage(), " No such file or directory: "))
+            << replies[1]->errorMessage();
+
+        EXPECT_TRUE(replies[2]->isValid());
+        EXPECT_EQ(256, replies[2]->image().width());
+        EXPECT_EQ(144, replies[2]->image().height());
+
+        EXPECT_TRUE(replies[3]->isValid());
+        EXPECT_EQ(200, replies[3]->image().width());
+        EXPECT_EQ(200, replies[3]->image().height());
+
+        EXPECT_FALSE(replies[4]->isValid());
+        EXPECT_TRUE(boost::ends_with(replies[4]->errorMessage().toStdString(), ": invalid QSize"))
+            << replies[4]->errorMessage();
+    }
+}
+
+TEST_F(LibThumbnailerTest, batch_sync)
+{
+    Thumbnailer thumbnailer(dbus_->connection());
+
+    QList<QPair<QString, QSize>> batch;
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/testvideo.ogg"), QSize(256, 256)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/orientation-1.jpg"), QSize(128, 96)));
+
+    auto replies = thumbnailer.getThumbnails(batch);
+    ASSERT_EQ(2, replies.size());
+
+    // Wait for the second one first, so we can see that results are independent of each other.
+    replies[1]->waitForFinished();
+    EXPECT_TRUE(replies[1]->isValid()) << replies[1]->errorMessage();
+    EXPECT_EQ(128, replies[1]->image().width());
+
+    replies[0]->waitForFinished();
+    EXPECT_TRUE(replies[0]->isValid()) << replies[0]->errorMessage();
+    EXPECT_EQ(256, replies[0]->image().width());
+}
+
+TEST_F(LibThumbnailerTest, batch_cancel)
+{
+    Thumbnailer thumbnailer(dbus_->connection());
+
+    QList<QPair<QString, QSize>> batch;
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/testvideo.ogg"), QSize(256, 256)));
+    batch.append(qMakePair(QStringLiteral(TESTDATADIR "/orientation-1.jpg"), QSize(128, 96)));
+
+    auto replies = thumbnailer.getThumbnails(batch);
+    replies[0]->cancel();
+    replies[0]->waitForFinished();  // Returns immediately.
+
+    QSignalSpy spy(replies[0].data(), &Request::finished);
+    ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+    EXPECT_TRUE(replies[0]->isCancelled());
+    EXPECT_FALSE(replies[0]->isValid());
+    EXPECT_EQ("Request cancelled", replies[0]->errorMessage());
+
+    replies[1]->waitForFinished();
+    EXPECT_TRUE(replies[1]->isValid()) << replies[1]->errorMessage();
+
+    // Destroying the requests before the batch completes must not cause problems.
+    replies = thumbnailer.getThumbnails(batch);
+    replies.clear();
+    pump(1000);
+
+    replies = thumbnailer.getThumbnails(batch);
+    replies[0]->waitForFinished();
+    EXPECT_TRUE(replies[0]->isValid()) << replies[0]->errorMessage();
+}
+
 TEST_F(LibThumbnailerTest, cancel)
 {
     if (!supports_decoder("audio/mpeg"))
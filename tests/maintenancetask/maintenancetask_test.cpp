@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "inactivityhandler.h"
+#include "maintenancetask.h"
+
+#include <internal/file_io.h>
+#include <internal/image.h>
+#include <internal/thumbnailer.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+#include <QCoreApplication>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <testsetup.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+using namespace unity::thumbnailer::service;
+
+#define TEST_IMAGE TESTDATADIR "/horizontal-strip.jpg"
+
+// The thumbnailer uses g_get_user_cache_dir() to get the cache dir, and
+// glib remembers that value, so changing XDG_CACHE_HOME later has no effect.
+
+static auto set_tempdir = []()
+{
+    auto dir = new QTemporaryDir(TESTBINDIR "/test-dir.XXXXXX");
+    setenv("XDG_CACHE_HOME", dir->path().toUtf8().data(), true);
+    return dir;
+};
+static unique_ptr<QTemporaryDir> tempdir(set_tempdir());
+
+namespace
+{
+
+// More than one slice's worth, so a pass takes several slices.
+int const NUM_FILES = 120;
+
+class MaintenanceTaskTest : public ::testing::Test
+{
+public:
+    static string tempdir_path()
+    {
+        return tempdir->path().toStdString();
+    }
+
+protected:
+    virtual void SetUp() override
+    {
+        mkdir(tempdir_path().c_str(), 0700);
+        thumbnailer_ = make_shared<Thumbnailer>();
+
+        // Make thumbnails for a number of files and then remove the files,
+        // so maintenance has something to collect.
+        for (int i = 0; i < NUM_FILES; ++i)
+        {
+            string const file = tempdir_path() + "/file" + to_string(i) + ".jpg";
+            write_file(file, read_file(TEST_IMAGE));
+            auto request = thumbnailer_->get_thumbnail(file, QSize(32, 32));
+            ASSERT_NE(0, Image(request->thumbnail()).width());
+            ASSERT_EQ(0, ::unlink(file.c_str()));
+        }
+        thumbnailer_->flush();
+    }
+
+    virtual void TearDown() override
+    {
+        thumbnailer_.reset();
+        boost::filesystem::remove_all(tempdir_path());
+    }
+
+    Thumbnailer::GcStats gc_stats() const
+    {
+        return thumbnailer_->stats().gc_stats;
+    }
+
+    // Runs the event loop until at least num_files have been checked.
+    bool wait_for_files_checked(int64_t num_files, int timeout_ms = 5000) const
+    {
+        for (int i = 0; i < timeout_ms / 10 && gc_stats().files_checked < num_files; ++i)
+        {
+            QTest::qWait(10);
+        }
+        return gc_stats().files_checked >= num_files;
+    }
+
+    shared_ptr<Thumbnailer> thumbnailer_;
+};
+
+}  // namespace
+
+TEST_F(MaintenanceTaskTest, pass)
+{
+    InactivityHandler inactivity_handler([]{});
+    MaintenanceTask task(thumbnailer_, inactivity_handler, false);
+
+    // The request that started the service gets a head start.
+    QTest::qWait(1000);
+    EXPECT_EQ(0, gc_stats().files_checked);
+
+    ASSERT_TRUE(wait_for_files_checked(NUM_FILES));
+    auto stats = gc_stats();
+    EXPECT_EQ(NUM_FILES, stats.files_checked);
+    EXPECT_EQ(NUM_FILES, stats.stale_files);
+    EXPECT_LT(0, stats.entries_removed);
+
+    // The next pass is an hour away, and we don't compact unless the service is resident.
+    QTest::qWait(1000);
+    stats = gc_stats();
+    EXPECT_EQ(NUM_FILES, stats.files_checked);
+    EXPECT_EQ(0, stats.compactions);
+}
+
+TEST_F(MaintenanceTaskTest, busy_before_start)
+{
+    InactivityHandler inactivity_handler([]{});
+    MaintenanceTask task(thumbnailer_, inactivity_handler, false);
+
+    inactivity_handler.request_started();
+    QTest::qWait(3000);
+    EXPECT_EQ(0, gc_stats().files_checked);
+
+    // We resume only after a delay.
+    inactivity_handler.request_completed();
+    QTest::qWait(1000);
+    EXPECT_EQ(0, gc_stats().files_checked);
+    ASSERT_TRUE(wait_for_files_checked(NUM_FILES));
+    EXPECT_EQ(NUM_FILES, gc_stats().stale_files);
+}
+
+TEST_F(MaintenanceTaskTest, busy_between_slices)
+{
+    InactivityHandler inactivity_handler([]{});
+    MaintenanceTask task(thumbnailer_, inactivity_handler, false);
+
+    // Pause as soon as the first slice is done, well before the next one is due.
+    ASSERT_TRUE(wait_for_files_checked(1));
+    inactivity_handler.request_started();
+    auto const checked = gc_stats().files_checked;
+    EXPECT_LT(checked, NUM_FILES);
+
+    QTest::qWait(1000);
+    EXPECT_EQ(checked, gc_stats().files_checked);
+
+    // The pass continues where it left off.
+    inactivity_handler.request_completed();
+    QTest::qWait(1000);
+    EXPECT_EQ(checked, gc_stats().files_checked);
+    ASSERT_TRUE(wait_for_files_checked(NUM_FILES));
+    EXPECT_EQ(NUM_FILES, gc_stats().files_checked);
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    setenv("GSETTINGS_BACKEND", "memory", true);
+    setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/memory_cache.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(memory_cache, basic)
+{
+    MemoryCache c(1024 * 1024);
+
+    EXPECT_FALSE(c.get("a"));
+    EXPECT_TRUE(c.put("a", "hello"));
+    auto v = c.get("a");
+    ASSERT_TRUE(v);
+    EXPECT_EQ("hello", *v);
+
+    EXPECT_TRUE(c.put("a", "world"));
+    EXPECT_EQ("world", *c.get("a"));
+
+    auto s = c.stats();
+    EXPECT_EQ(1, s.size);
+    EXPECT_EQ(1024 * 1024, s.max_size_in_bytes);
+    EXPECT_EQ(2, s.hits);
+    EXPECT_EQ(1, s.misses);
+    EXPECT_EQ(0, s.evictions);
+
+    c.invalidate("a");
+    EXPECT_FALSE(c.get("a"));
+    EXPECT_EQ(0, c.stats().size);
+    EXPECT_EQ(0, c.stats().size_in_bytes);
+
+    c.clear_stats();
+    s = c.stats();
+    EXPECT_EQ(0, s.hits);
+    EXPECT_EQ(0, s.misses);
+}
+
+TEST(memory_cache, source_and_hits)
+{
+    MemoryCache c(1024 * 1024);
+
+    c.put("a", "1", chrono::system_clock::time_point(), "source a");
+    c.put("b", "2");
+
+    string source;
+    int64_t hits = 0;
+    EXPECT_TRUE(c.get("a", &source, &hits));
+    EXPECT_EQ("source a", source);
+    EXPECT_EQ(1, hits);
+    EXPECT_TRUE(c.get("a", &source, &hits));
+    EXPECT_EQ(2, hits);
+
+    EXPECT_TRUE(c.get("b", &source, &hits));
+    EXPECT_EQ("", source);
+    EXPECT_EQ(1, hits);
+
+    // Nothing changes on a miss.
+    EXPECT_FALSE(c.get("c", &source, &hits));
+    EXPECT_EQ("", source);
+    EXPECT_EQ(1, hits);
+}
+
+TEST(memory_cache, shares_data)
+{
+    MemoryCache c(1024 * 1024);
+
+    QByteArray data(1000, 'x');
+    c.put("a", data);
+    auto v = c.get("a");
+    ASSERT_TRUE(v);
+    EXPECT_EQ(data.constData(), v->constData());  // No deep copy.
+}
+
+TEST(memory_cache, lru_eviction)
+{
+    // Single shard, so we can predict the eviction order.
+    MemoryCache c(3000, 1);
+
+    QByteArray data(800, 'x');
+    EXPECT_TRUE(c.put("a", data));
+    EXPECT_TRUE(c.put("b", data));
+    EXPECT_TRUE(c.put("c", data));
+    EXPECT_EQ(3, c.stats().size);
+
+    EXPECT_TRUE(c.get("a"));     // "b" is now the least-recently used entry.
+    EXPECT_TRUE(c.put("d", data));
+    EXPECT_TRUE(c.get("a"));
+    EXPECT_FALSE(c.get("b"));
+    EXPECT_TRUE(c.get("c"));
+    EXPECT_TRUE(c.get("d"));
+
+    auto s = c.stats();
+    EXPECT_EQ(3, s.size);
+    EXPECT_EQ(1, s.evictions);
+    EXPECT_LE(s.size_in_bytes, 3000);
+}
+
+TEST(memory_cache, too_large)
+{
+    MemoryCache c(3000, 1);
+
+    EXPECT_TRUE(c.put("a", "small"));
+    EXPECT_FALSE(c.put("a", QByteArray(5000, 'x')));
+    EXPECT_FALSE(c.get("a"));  // Old value must be gone.
+    EXPECT_EQ(0, c.stats().size);
+}
+
+TEST(memory_cache, disabled)
+{
+    MemoryCache c(0);
+
+    EXPECT_FALSE(c.put("a", ""));
+    EXPECT_FALSE(c.get("a"));
+    EXPECT_EQ(0, c.stats().size);
+}
+
+TEST(memory_cache, expiry)
+{
+    MemoryCache c(1024 * 1024);
+
+    auto now = chrono::system_clock::now();
+    c.put("a", "", now + chrono::milliseconds(200));
+    c.put("b", "", now + chrono::hours(1));
+    EXPECT_TRUE(c.get("a"));
+    this_thread::sleep_for(chrono::milliseconds(300));
+    EXPECT_FALSE(c.get("a"));
+    EXPECT_TRUE(c.get("b"));
+
+    auto s = c.stats();
+    EXPECT_EQ(1, s.size);
+    EXPECT_EQ(1, s.evictions);
+}
+
+TEST(memory_cache, invalidate_all)
+{
+    MemoryCache c(1024 * 1024);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        c.put(to_string(i), "x");
+    }
+    EXPECT_EQ(100, c.stats().size);
+    c.invalidate();
+    EXPECT_EQ(0, c.stats().size);
+    EXPECT_EQ(0, c.stats().size_in_bytes);
+    EXPECT_FALSE(c.get("42"));
+}
+
+TEST(memory_cache, invalidate_if)
+{
+    MemoryCache c(1024 * 1024);
+
+    c.put("a1", "x", chrono::system_clock::time_point(), "source 1");
+    c.put("a2", "x", chrono::system_clock::time_point(), "source 2");
+    c.put("b1", "x");
+    c.put("b2", "x", chrono::system_clock::time_point(), "source 2");
+    int64_t const charge = c.stats().size_in_bytes / 4;
+
+    EXPECT_EQ(0, c.invalidate_if([](string const&, string const&) { return false; }));
+    EXPECT_EQ(3, c.invalidate_if([](string const& key, string const& source)
+                                 {
+                                     return key == "b1" || source == "source 2";
+                                 }));
+    EXPECT_TRUE(c.get("a1"));
+    EXPECT_FALSE(c.get("a2"));
+    EXPECT_FALSE(c.get("b1"));
+    EXPECT_FALSE(c.get("b2"));
+    EXPECT_EQ(1, c.stats().size);
+    EXPECT_EQ(charge, c.stats().size_in_bytes);
+}
+
+TEST(memory_cache, snapshot)
+{
+    MemoryCache c(1024 * 1024);
+
+    EXPECT_TRUE(MemoryCache::parse_snapshot(c.snapshot(10)).empty());
+
+    c.put("a", "1", chrono::system_clock::time_point(), "source a");
+    c.put("b", "2", chrono::system_clock::time_point(), "source b");
+    c.put("c", "3", chrono::system_clock::time_point(), "source c");
+    c.put("no source", "4");
+    for (int i = 0; i < 5; ++i)
+    {
+        c.get("b");
+        c.get("no source");
+    }
+    c.get("c");
+
+    // Most frequently used first, entries without a source are left out.
+    auto entries = MemoryCache::parse_snapshot(c.snapshot(10));
+    ASSERT_EQ(3u, entries.size());
+    EXPECT_EQ("b", entries[0].key);
+    EXPECT_EQ("source b", entries[0].source);
+    EXPECT_EQ(5, entries[0].hits);
+    EXPECT_EQ("c", entries[1].key);
+    EXPECT_EQ(1, entries[1].hits);
+    EXPECT_EQ("a", entries[2].key);
+    EXPECT_EQ(0, entries[2].hits);
+
+    entries = MemoryCache::parse_snapshot(c.snapshot(2));
+    ASSERT_EQ(2u, entries.size());
+    EXPECT_EQ("c", entries[1].key);
+
+    // Replacing an entry resets its count.
+    c.put("b", "22", chrono::system_clock::time_point(), "source b");
+    entries = MemoryCache::parse_snapshot(c.snapshot(1));
+    ASSERT_EQ(1u, entries.size());
+    EXPECT_EQ("c", entries[0].key);
+
+    // Damaged snapshots are rejected.
+    string data = c.snapshot(10);
+    EXPECT_TRUE(MemoryCache::parse_snapshot("").empty());
+    EXPECT_TRUE(MemoryCache::parse_snapshot("XXXX" + data.substr(4)).empty());
+    EXPECT_TRUE(MemoryCache::parse_snapshot(data.substr(0, data.size() - 1)).empty());
+    EXPECT_TRUE(MemoryCache::parse_snapshot(data + "x").empty());
+}
+
+TEST(memory_cache, concurrent)
+{
+    MemoryCache c(64 * 1024);
+
+    vector<thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&c, t]
+        {
+            for (int i = 0; i < 2000; ++i)
+            {
+                string key = to_string((i * 7 + t) % 500);
+                if (!c.get(key))
+                {
+                    c.put(key, QByteArray(100, 'x'));
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    auto s = c.stats();
+    EXPECT_EQ(8 * 2000, s.hits + s.misses);
+    EXPECT_LE(s.size_in_bytes, 64 * 1024);
+}
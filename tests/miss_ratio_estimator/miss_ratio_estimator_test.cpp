@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/miss_ratio_estimator.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+// Requests num_keys keys of the given size round-robin, rounds times over.
+// An LRU cache that doesn't fit all of them misses every time.
+
+void loop(MissRatioEstimator& e, int num_keys, int64_t size, int rounds, string const& prefix = "key")
+{
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int k = 0; k < num_keys; ++k)
+        {
+            e.record(prefix + to_string(k), size);
+        }
+    }
+}
+
+}  // namespace
+
+TEST(miss_ratio_estimator, basic)
+{
+    MissRatioEstimator e;
+
+    EXPECT_EQ(1.0, e.miss_ratio(1000000));
+    EXPECT_EQ(-1, e.size_for_miss_ratio(0.5));
+    EXPECT_EQ(1.0, e.sampling_rate());
+
+    // 100 keys of 1000 bytes each, requested ten times. Only the first round misses
+    // with a cache of 100 kB or more.
+    loop(e, 100, 1000, 10);
+    EXPECT_EQ(1000, e.requests());
+    EXPECT_EQ(1.0, e.sampling_rate());
+    EXPECT_EQ(1.0, e.miss_ratio(50000));
+    EXPECT_DOUBLE_EQ(0.1, e.miss_ratio(200000));
+
+    auto size = e.size_for_miss_ratio(0.5);
+    EXPECT_GE(size, 100000);
+    EXPECT_LT(size, 105000);
+
+    // The floor is at 10%, so we can't do better than that, no matter how large the cache.
+    EXPECT_EQ(size, e.size_for_miss_ratio(0.01));
+
+    e.clear();
+    EXPECT_EQ(0, e.requests());
+    EXPECT_EQ(1.0, e.miss_ratio(1000000));
+}
+
+TEST(miss_ratio_estimator, no_reuse)
+{
+    MissRatioEstimator e;
+
+    loop(e, 1000, 1000, 1);
+    EXPECT_EQ(1.0, e.miss_ratio(1000000000));
+
+    // No cache helps, so the smallest one will do.
+    EXPECT_LE(e.size_for_miss_ratio(0.5), 1);
+}
+
+TEST(miss_ratio_estimator, record_repeat)
+{
+    MissRatioEstimator e;
+
+    // Nothing happens for a key we haven't seen.
+    e.record_repeat("key0");
+    EXPECT_EQ(0, e.requests());
+
+    // Repeated requests are counted with the size from the first request.
+    loop(e, 100, 1000, 1);
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 100; ++k)
+        {
+            e.record_repeat("key" + to_string(k));
+        }
+    }
+    EXPECT_EQ(1000, e.requests());
+    EXPECT_EQ(1.0, e.miss_ratio(50000));
+    EXPECT_DOUBLE_EQ(0.1, e.miss_ratio(200000));
+}
+
+TEST(miss_ratio_estimator, sampling)
+{
+    MissRatioEstimator e(1000);
+
+    // 20000 keys of 100 bytes each, so the knee is at 2 MB.
+    loop(e, 20000, 100, 5);
+    EXPECT_LT(e.sampling_rate(), 0.1);
+    EXPECT_GT(e.sampling_rate(), 0.01);
+
+    EXPECT_GT(e.miss_ratio(1500000), 0.9);
+    EXPECT_LT(e.miss_ratio(2500000), 0.3);
+
+    auto size = e.size_for_miss_ratio(0.5);
+    EXPECT_GT(size, 1500000);
+    EXPECT_LT(size, 2500000);
+}
+
+TEST(miss_ratio_estimator, curve)
+{
+    MissRatioEstimator e;
+
+    loop(e, 100, 1000, 5, "a");
+    loop(e, 400, 1000, 5, "b");
+
+    auto points = e.curve(1000000, 20);
+    ASSERT_EQ(20u, points.size());
+    EXPECT_EQ(50000, points.front().size_in_bytes);
+    EXPECT_EQ(1000000, points.back().size_in_bytes);
+    for (size_t i = 1; i < points.size(); ++i)
+    {
+        EXPECT_LE(points[i].miss_ratio, points[i - 1].miss_ratio) << i;
+    }
+    EXPECT_EQ(1.0, points.front().miss_ratio);
+    EXPECT_DOUBLE_EQ(0.2, points.back().miss_ratio);
+}
+
+TEST(miss_ratio_estimator, reuse_distance)
+{
+    MissRatioEstimator e(4);
+
+    // Every request after the first round has a reuse distance of 7000 bytes.
+    // With so few keys, the access times run out and are renumbered many times over.
+    for (int i = 0; i < 1000; ++i)
+    {
+        e.record("a", 1000);
+        e.record("b", 2000);
+        e.record("c", 4000);
+    }
+    EXPECT_EQ(1.0, e.sampling_rate());
+    EXPECT_EQ(1.0, e.miss_ratio(6500));
+    EXPECT_DOUBLE_EQ(0.001, e.miss_ratio(7500));
+
+    // A key that grows counts with its new size.
+    e.record("c", 8000);
+    e.record("a", 1000);
+    e.record("c", 8000);
+    EXPECT_GT(e.miss_ratio(8500), e.miss_ratio(9500));
+}
+
+TEST(miss_ratio_estimator, aging)
+{
+    MissRatioEstimator e;
+
+    // Lots of requests for a small set of keys, followed by a scan, would
+    // leave the curve dominated by the old requests forever without aging.
+    loop(e, 10, 1000, 10000);
+    EXPECT_LT(e.requests(), 64 * 1024);
+    EXPECT_LT(e.miss_ratio(20000), 0.01);
+
+    loop(e, 1000, 1000, 100, "scan");
+    EXPECT_GT(e.miss_ratio(20000), 0.8);
+}
+
+TEST(miss_ratio_estimator, serialize)
+{
+    MissRatioEstimator e(1000);
+    loop(e, 5000, 100, 3);
+
+    string data = e.serialize();
+    MissRatioEstimator e2(1000);
+    EXPECT_TRUE(e2.deserialize(data));
+    EXPECT_EQ(e.requests(), e2.requests());
+    EXPECT_EQ(e.sampling_rate(), e2.sampling_rate());
+    EXPECT_EQ(e.miss_ratio(400000), e2.miss_ratio(400000));
+    EXPECT_EQ(data, e2.serialize());
+
+    // The tracked keys come back in the same order.
+    loop(e, 5000, 100, 1);
+    loop(e2, 5000, 100, 1);
+    EXPECT_EQ(e.serialize(), e2.serialize());
+
+    // Bad data leaves the estimator unchanged.
+    MissRatioEstimator e3(2000);
+    EXPECT_FALSE(e3.deserialize(data));
+    EXPECT_FALSE(e2.deserialize(""));
+    EXPECT_FALSE(e2.deserialize("MRC1"));
+    EXPECT_FALSE(e2.deserialize(data.substr(0, data.size() - 1)));
+    EXPECT_FALSE(e2.deserialize("XXXX" + data.substr(4)));
+    EXPECT_EQ(e.serialize(), e2.serialize());
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <ratelimiter.h>
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer;
+
+typedef RateLimiter::Priority Priority;
+
+TEST(RateLimiter, basic)
+{
+    RateLimiter limiter(1);
+    string order;
+
+    limiter.schedule([&]{ order += 'a'; });
+    EXPECT_EQ("a", order);  // Runs immediately.
+
+    limiter.schedule([&]{ order += 'b'; });
+    limiter.schedule([&]{ order += 'c'; });
+    EXPECT_EQ("a", order);
+
+    // Most recent job runs first.
+    limiter.done();
+    EXPECT_EQ("ac", order);
+    limiter.done();
+    EXPECT_EQ("acb", order);
+    limiter.done();
+    EXPECT_EQ("acb", order);
+}
+
+TEST(RateLimiter, cancel)
+{
+    RateLimiter limiter(1);
+    string order;
+
+    auto cancel_a = limiter.schedule([&]{ order += 'a'; });
+    auto cancel_b = limiter.schedule([&]{ order += 'b'; });
+    auto cancel_c = limiter.schedule([&]{ order += 'c'; });
+    EXPECT_FALSE(cancel_a());  // Already running.
+    EXPECT_TRUE(cancel_c());
+
+    limiter.done();
+    EXPECT_EQ("ab", order);
+    EXPECT_FALSE(cancel_b());  // Already running.
+    limiter.done();
+    EXPECT_EQ("ab", order);
+}
+
+TEST(RateLimiter, priority)
+{
+    RateLimiter limiter(1);
+    string order;
+
+    limiter.schedule([&]{ order += 'a'; });
+    limiter.schedule([&]{ order += 'b'; }, Priority::prefetch);
+    limiter.schedule([&]{ order += 'c'; }, Priority::interactive);
+    limiter.schedule([&]{ order += 'd'; }, Priority::background);
+    limiter.schedule([&]{ order += 'e'; }, Priority::prefetch);
+    limiter.schedule([&]{ order += 'f'; }, Priority::interactive);
+
+    for (int i = 0; i < 6; ++i)
+    {
+        limiter.done();
+    }
+    EXPECT_EQ("afcebd", order);
+}
+
+TEST(RateLimiter, change_priority)
+{
+    RateLimiter limiter(1);
+    string order;
+
+    RateLimiter::PriorityFunc priority_a;
+    RateLimiter::PriorityFunc priority_b;
+    limiter.schedule([&]{ order += 'a'; }, Priority::interactive, priority_a);
+    limiter.schedule([&]{ order += 'b'; }, Priority::background, priority_b);
+    limiter.schedule([&]{ order += 'c'; }, Priority::prefetch);
+    EXPECT_FALSE(priority_a(Priority::background));  // Already running.
+
+    EXPECT_TRUE(priority_b(Priority::interactive));
+    limiter.done();
+    EXPECT_EQ("ab", order);
+    EXPECT_FALSE(priority_b(Priority::background));  // Already running.
+    limiter.done();
+    EXPECT_EQ("abc", order);
+    limiter.done();
+}
+
+TEST(RateLimiter, aging)
+{
+    RateLimiter limiter(1, chrono::milliseconds(100));
+    string order;
+
+    limiter.schedule([&]{ order += 'a'; });
+    limiter.schedule([&]{ order += 'b'; }, Priority::background);
+    limiter.schedule([&]{ order += 'c'; }, Priority::prefetch);
+
+    // After more than 300 ms, b has been promoted by three classes and c by at least three,
+    // so they now beat a newly scheduled interactive job.
+    this_thread::sleep_for(chrono::milliseconds(350));
+    limiter.schedule([&]{ order += 'd'; });
+
+    limiter.done();
+    EXPECT_EQ("ac", order);
+    limiter.done();
+    EXPECT_EQ("acb", order);
+    limiter.done();
+    EXPECT_EQ("acbd", order);
+    limiter.done();
+}
+
+TEST(RateLimiter, aged_jobs_run_oldest_first)
+{
+    RateLimiter limiter(1, chrono::milliseconds(100));
+    string order;
+
+    limiter.schedule([&]{ order += 'a'; });
+    limiter.schedule([&]{ order += 'b'; }, Priority::background);
+    limiter.schedule([&]{ order += 'c'; }, Priority::background);
+
+    // b and c have been promoted, d hasn't. Among promoted jobs, the oldest goes first,
+    // unlike jobs that haven't waited long, where the most recent one goes first.
+    this_thread::sleep_for(chrono::milliseconds(150));
+    limiter.schedule([&]{ order += 'd'; }, Priority::background);
+    limiter.schedule([&]{ order += 'e'; }, Priority::background);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        limiter.done();
+    }
+    EXPECT_EQ("abced", order);
+}
+
+TEST(RateLimiter, large_queue)
+{
+    int const num_jobs = 10000;
+    RateLimiter limiter(1);
+    vector<int> order;
+    vector<RateLimiter::CancelFunc> cancel_funcs;
+    vector<RateLimiter::PriorityFunc> priority_funcs(num_jobs);
+
+    limiter.schedule([]{});
+    for (int i = 0; i < num_jobs; ++i)
+    {
+        cancel_funcs.push_back(limiter.schedule([&order, i]{ order.push_back(i); },
+                                                Priority::background, priority_funcs[i]));
+    }
+    for (int i = 0; i < num_jobs; i += 2)
+    {
+        EXPECT_TRUE(cancel_funcs[i]());
+    }
+    EXPECT_FALSE(cancel_funcs[0]());  // Already cancelled.
+    EXPECT_TRUE(priority_funcs[1](Priority::interactive));
+    EXPECT_FALSE(priority_funcs[2](Priority::interactive));  // Cancelled.
+
+    for (int i = 0; i <= num_jobs / 2; ++i)
+    {
+        limiter.done();
+    }
+    ASSERT_EQ(size_t(num_jobs / 2), order.size());
+    EXPECT_EQ(1, order[0]);
+    EXPECT_EQ(num_jobs - 1, order[1]);
+    EXPECT_EQ(3, order.back());
+    EXPECT_FALSE(cancel_funcs[1]());  // Already run.
+}
+
+TEST(RateLimiter, concurrency)
+{
+    RateLimiter limiter(2);
+    string order;
+
+    limiter.schedule([&]{ order += 'a'; }, Priority::background);
+    limiter.schedule([&]{ order += 'b'; }, Priority::background);
+    limiter.schedule([&]{ order += 'c'; }, Priority::background);
+    limiter.schedule([&]{ order += 'd'; });
+    EXPECT_EQ("ab", order);  // Priority does not matter while below the limit.
+
+    limiter.done();
+    EXPECT_EQ("abd", order);
+    limiter.schedule_now([&]{ order += 'e'; });
+    EXPECT_EQ("abde", order);
+    limiter.done();
+    EXPECT_EQ("abdec", order);
+    limiter.done();
+    limiter.done();
+    limiter.done();
+}
@@ -19,12 +19,14 @@
 #pragma once
 
 #include <core/cache_discard_policy.h>
+#include <core/cache_events.h>
 #include <core/optional.h>
 #include <core/persistent_cache_stats.h>
 
 #include <gmock/gmock.h>
 
 #include <chrono>
+#include <functional>
 #include <system_error>
 
 namespace unity
@@ -43,6 +45,9 @@ class MockCache
 {
 public:
     typedef std::unique_ptr<MockCache> UPtr;
+    typedef std::function<void(std::string const& key,
+                               core::CacheEvent ev,
+                               core::PersistentCacheStats const& stats)> EventCallback;
 
     static UPtr open(std::string const& cache_path,
                      int64_t /* max_size_in_bytes */,
@@ -55,6 +60,8 @@ public:
     MOCK_METHOD1(get, core::Optional<std::string>(std::string const& key));
 
     MOCK_METHOD1(resize, void(int64_t size_in_bytes));  // Needed so template will instantiate in caller.
+    MOCK_METHOD2(set_handler, void(core::CacheEvent events, EventCallback cb));  // Ditto.
+    MOCK_METHOD1(take, core::Optional<std::string>(std::string const& key));  // Ditto.
 
     // Methods below are not Google mocks because the recovery logic reinitializes
     // the cache, thereby replacing the original mock with a new one, and we can't
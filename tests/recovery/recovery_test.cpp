@@ -18,16 +18,173 @@
 
 #include <internal/cachehelper.h>
 #include "MockCache.h"
+#include <internal/file_io.h>
 #include <testsetup.h>
 
+#include <boost/filesystem.hpp>
+
+#include <fstream>
+#include <random>
 #include <system_error>
 
+#include <utime.h>
+
 using namespace std;
 using namespace testing;
 using namespace unity::thumbnailer::internal;
 using namespace unity::thumbnailer::internal::testing;
 
 #define CACHEDIR TESTBINDIR "/cachedir"
+#define REPAIR_DIR TESTBINDIR "/repair"
+
+namespace
+{
+
+// Backend that keeps each entry in a file of the cache directory. The cache is
+// corrupt while the directory contains a file called CORRUPT. Repairing it
+// loses the entries whose key starts with "bad".
+
+class DirCache
+{
+public:
+    typedef unique_ptr<DirCache> UPtr;
+    typedef function<void(string const& key, core::CacheEvent ev, int stats)> EventCallback;
+
+    static UPtr open(string const& cache_path, int64_t, core::CacheDiscardPolicy)
+    {
+        boost::filesystem::create_directories(cache_path);
+        return open(cache_path);
+    }
+
+    static UPtr open(string const& cache_path)
+    {
+        if (!boost::filesystem::is_directory(cache_path))
+        {
+            throw runtime_error("no such cache: " + cache_path);
+        }
+        return UPtr(new DirCache(cache_path));
+    }
+
+    core::Optional<string> get(string const& key) const
+    {
+        check();
+        if (!boost::filesystem::exists(path_ + "/" + key))
+        {
+            return core::Optional<string>();
+        }
+        return read_file(path_ + "/" + key);
+    }
+
+    core::Optional<string> take(string const& key)
+    {
+        auto value = get(key);
+        boost::filesystem::remove(path_ + "/" + key);
+        return value;
+    }
+
+    bool put(string const& key, string const& value, chrono::time_point<chrono::system_clock>)
+    {
+        check();
+        write_file(path_ + "/" + key, value);
+        return true;
+    }
+
+    bool contains_key(string const& key) const
+    {
+        return bool(get(key));
+    }
+
+    int64_t size() const
+    {
+        int64_t n = 0;
+        for (boost::filesystem::directory_iterator it(path_), end; it != end; ++it)
+        {
+            string name = it->path().filename().native();
+            n += name != "CORRUPT" && name != "UNREPAIRABLE";
+        }
+        return n;
+    }
+
+    void clear_stats() {}
+    void compact() {}
+    void resize(int64_t) {}
+    void set_handler(core::CacheEvent, EventCallback) {}
+
+    void invalidate()
+    {
+        boost::filesystem::remove_all(path_);
+        boost::filesystem::create_directories(path_);
+    }
+
+private:
+    DirCache(string const& path)
+        : path_(path)
+    {
+    }
+
+    void check() const
+    {
+        if (boost::filesystem::exists(path_ + "/CORRUPT"))
+        {
+            throw system_error(error_code(666, generic_category()), "corrupt DB");
+        }
+    }
+
+    string const path_;
+};
+
+}  // namespace
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+template<>
+struct CacheRepair<DirCache>
+{
+    static bool supported()
+    {
+        return true;
+    }
+
+    static bool repair(string const& cache_path)
+    {
+        if (boost::filesystem::exists(cache_path + "/UNREPAIRABLE"))
+        {
+            return false;
+        }
+        for (boost::filesystem::directory_iterator it(cache_path), end; it != end; ++it)
+        {
+            string name = it->path().filename().native();
+            if (name == "CORRUPT" || name.compare(0, 3, "bad") == 0)
+            {
+                boost::filesystem::remove(it->path());
+            }
+        }
+        return true;
+    }
+
+    static int64_t count(string const& cache_path)
+    {
+        return DirCache::open(cache_path)->size();
+    }
+
+    static int64_t size(DirCache const& c)
+    {
+        return c.size();
+    }
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
 
 TEST(recovery, system_error_EBADF)
 {
@@ -143,6 +300,258 @@ TEST(recovery, recovery_throws_unknown_exception)
     }
 }
 
+class RepairTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        remove_dirs();
+    }
+
+    void TearDown() override
+    {
+        remove_dirs();
+    }
+
+    static void remove_dirs()
+    {
+        boost::filesystem::remove_all(REPAIR_DIR);
+        boost::filesystem::remove_all(REPAIR_DIR ".salvage");
+        boost::filesystem::remove(REPAIR_DIR ".salvaged");
+    }
+
+    static CacheHelper<DirCache>::UPtr open(core::CacheDiscardPolicy policy = core::CacheDiscardPolicy::lru_only)
+    {
+        return CacheHelper<DirCache>::open(REPAIR_DIR, 1024, policy);
+    }
+
+    // Fills the cache and corrupts it.
+    static void populate(CacheHelper<DirCache>& ch)
+    {
+        ch.put("a", "1");
+        ch.put("b", "2");
+        ch.put("c", "3");
+        ch.put("bad1", "x");
+        ch.put("bad2", "y");
+        write_file(REPAIR_DIR "/CORRUPT", string());
+    }
+};
+
+TEST_F(RepairTest, salvage)
+{
+    auto ch = open();
+    populate(*ch);
+
+    // The corruption is detected, and we carry on with an empty cache.
+    EXPECT_FALSE(ch->get("d"));
+    ch->wait_for_repair();
+    EXPECT_TRUE(boost::filesystem::exists(REPAIR_DIR ".salvaged"));
+
+    auto stats = ch->repair_stats();
+    EXPECT_EQ(1, stats.repairs);
+    EXPECT_EQ(3, stats.entries_salvaged);
+    EXPECT_EQ(2, stats.entries_lost);
+    EXPECT_EQ(0, stats.entries_restored);
+
+    // Salvaged entries move back into the cache on a miss.
+    EXPECT_TRUE(ch->contains_key("a"));
+    EXPECT_EQ("1", *ch->get("a"));
+    EXPECT_EQ("1", read_file(REPAIR_DIR "/a"));
+    EXPECT_EQ(1, ch->repair_stats().entries_restored);
+    EXPECT_FALSE(ch->get("bad1"));
+
+    // A put replaces the salvaged value.
+    ch->put("b", "new");
+    boost::filesystem::remove(REPAIR_DIR "/b");
+    EXPECT_FALSE(ch->get("b"));
+
+    // The salvaged DB goes away once the last entry is gone.
+    EXPECT_EQ("3", *ch->take("c"));
+    EXPECT_FALSE(ch->get("c"));
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvaged"));
+
+    ch->clear_stats();
+    EXPECT_EQ(0, ch->repair_stats().repairs);
+}
+
+TEST_F(RepairTest, unrepairable)
+{
+    auto ch = open();
+    populate(*ch);
+    write_file(REPAIR_DIR "/UNREPAIRABLE", string());
+
+    EXPECT_FALSE(ch->get("a"));
+    ch->wait_for_repair();
+    auto stats = ch->repair_stats();
+    EXPECT_EQ(1, stats.repairs);
+    EXPECT_EQ(0, stats.entries_salvaged);
+    EXPECT_EQ(5, stats.entries_lost);
+    EXPECT_FALSE(ch->get("a"));
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+}
+
+TEST_F(RepairTest, ttl_cache_is_deleted)
+{
+    auto ch = open(core::CacheDiscardPolicy::lru_ttl);
+    populate(*ch);
+
+    EXPECT_FALSE(ch->get("a"));
+    ch->wait_for_repair();
+    EXPECT_EQ(0, ch->repair_stats().repairs);
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR "/a"));
+}
+
+TEST_F(RepairTest, restart)
+{
+    {
+        auto ch = open();
+        populate(*ch);
+        EXPECT_FALSE(ch->get("d"));
+    }
+
+    // The salvaged DB is still used after re-opening the cache.
+    {
+        auto ch = open();
+        ch->wait_for_repair();
+        EXPECT_EQ(0, ch->repair_stats().repairs);
+        EXPECT_EQ("1", *ch->get("a"));
+    }
+
+    // A repair that didn't finish is done again.
+    boost::filesystem::remove(REPAIR_DIR ".salvaged");
+    {
+        auto ch = open();
+        ch->wait_for_repair();
+        EXPECT_EQ(1, ch->repair_stats().repairs);
+        EXPECT_EQ(2, ch->repair_stats().entries_salvaged);
+        EXPECT_EQ("2", *ch->get("b"));
+    }
+
+    // An old salvaged DB is removed.
+    struct utimbuf times = { 0, 0 };
+    ASSERT_EQ(0, utime(REPAIR_DIR ".salvaged", &times));
+    {
+        auto ch = open();
+        ch->wait_for_repair();
+        EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+        EXPECT_FALSE(ch->get("c"));
+    }
+}
+
+namespace
+{
+
+// Overwrites part of the largest leveldb table file in the middle, including
+// at least one complete block, so reading the entries in that block fails.
+
+void corrupt_table_file(string const& cache_path)
+{
+    string table;
+    uintmax_t table_size = 0;
+    for (boost::filesystem::directory_iterator it(cache_path), end; it != end; ++it)
+    {
+        auto ext = it->path().extension();
+        if ((ext == ".ldb" || ext == ".sst") && boost::filesystem::file_size(it->path()) > table_size)
+        {
+            table = it->path().native();
+            table_size = boost::filesystem::file_size(it->path());
+        }
+    }
+    string const junk(32 * 1024, '\xff');
+    ASSERT_GT(table_size, 4 * junk.size());
+
+    fstream f(table, ios::in | ios::out | ios::binary);
+    f.seekp(table_size / 2);
+    f.write(junk.data(), junk.size());
+    ASSERT_TRUE(bool(f));
+}
+
+}  // namespace
+
+TEST_F(RepairTest, corrupt_leveldb_table)
+{
+    int const num_entries = 100;
+
+    // Values that don't compress, so the entries are spread over many blocks.
+    mt19937 rng(42);
+    auto value = [&rng]
+    {
+        string v(10000, '\0');
+        for (auto& c : v)
+        {
+            c = char(rng());
+        }
+        return v;
+    };
+
+    {
+        auto ch = PersistentCacheHelper::open(REPAIR_DIR, 100 * 1024 * 1024, core::CacheDiscardPolicy::lru_only);
+        for (int i = 0; i < num_entries; ++i)
+        {
+            ch->put("key" + to_string(i), value());
+        }
+        ch->compact();  // Moves everything into a table file.
+    }
+    corrupt_table_file(REPAIR_DIR);
+
+    auto ch = PersistentCacheHelper::open(REPAIR_DIR, 100 * 1024 * 1024, core::CacheDiscardPolicy::lru_only);
+    for (int i = 0; i < num_entries; ++i)
+    {
+        ch->get("key" + to_string(i));  // Runs into the corrupt block and starts the repair.
+    }
+    ch->wait_for_repair();
+
+    // The stats that persistent-cache keeps survive the repair, so this checks
+    // that we counted what is really left.
+    auto stats = ch->repair_stats();
+    EXPECT_EQ(1, stats.repairs);
+    EXPECT_GT(stats.entries_lost, 0);
+    EXPECT_GT(stats.entries_salvaged, 0);
+    EXPECT_EQ(num_entries, stats.entries_salvaged + stats.entries_lost);
+
+    // The salvaged DB goes away once every entry that survived has been restored,
+    // even though persistent-cache still counts the lost ones.
+    for (int i = 0; i < num_entries; ++i)
+    {
+        ch->get("key" + to_string(i));
+    }
+    EXPECT_EQ(stats.entries_salvaged, ch->repair_stats().entries_restored);
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvaged"));
+}
+
+TEST_F(RepairTest, count_leveldb_entries)
+{
+    // CacheRepair::count() reads persistent-cache's leveldb records directly,
+    // so this breaks if persistent-cache changes the way it stores entries.
+    {
+        auto ch = PersistentCacheHelper::open(REPAIR_DIR, 1024 * 1024, core::CacheDiscardPolicy::lru_only);
+        ch->put("0", "before A");
+        ch->put("a", "1");
+        ch->put("zzz", "after B");
+        ch->put("a", "2");  // Replaces the first value.
+    }
+    EXPECT_EQ(3, CacheRepair<core::PersistentStringCache>::count(REPAIR_DIR));
+
+    {
+        auto ch = PersistentCacheHelper::open(REPAIR_DIR, 1024 * 1024, core::CacheDiscardPolicy::lru_only);
+        ch->take("a");
+    }
+    EXPECT_EQ(2, CacheRepair<core::PersistentStringCache>::count(REPAIR_DIR));
+}
+
+TEST_F(RepairTest, invalidate)
+{
+    auto ch = open();
+    populate(*ch);
+    EXPECT_FALSE(ch->get("d"));
+    ch->invalidate();
+    EXPECT_FALSE(boost::filesystem::exists(REPAIR_DIR ".salvage"));
+    EXPECT_FALSE(ch->get("a"));
+}
+
 int main(int argc, char** argv)
 {
     // So error string in exceptions come out in English.
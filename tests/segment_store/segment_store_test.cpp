@@ -0,0 +1,503 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/segment_store.h>
+
+#include <internal/cachehelper.h>
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <map>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define STORE_DIR TESTBINDIR "/segment_store"
+
+namespace
+{
+
+int64_t const MB = 1024 * 1024;
+
+string value_for(int i, size_t size)
+{
+    string v = to_string(i) + ":";
+    v.resize(size, char('a' + i % 26));
+    return v;
+}
+
+class SegmentStoreTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(STORE_DIR);
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(STORE_DIR);
+    }
+
+    SegmentStore::UPtr open(int64_t size = 16 * MB)
+    {
+        return SegmentStore::open(STORE_DIR, size, core::CacheDiscardPolicy::lru_only);
+    }
+};
+
+}  // namespace
+
+TEST_F(SegmentStoreTest, basic)
+{
+    auto s = open();
+
+    EXPECT_FALSE(s->get("a"));
+    EXPECT_FALSE(s->contains_key("a"));
+    EXPECT_TRUE(s->put("a", "hello"));
+    EXPECT_TRUE(s->put("b", ""));
+    EXPECT_TRUE(s->contains_key("a"));
+    EXPECT_EQ("hello", *s->get("a"));
+    EXPECT_EQ("", *s->get("b"));
+
+    auto v = s->get_view("a");
+    ASSERT_TRUE(v);
+    EXPECT_EQ("hello", string(v->data(), v->size()));
+    EXPECT_EQ("hello", v->to_string());
+
+    auto stats = s->stats();
+    EXPECT_EQ(STORE_DIR, stats.cache_path);
+    EXPECT_EQ(2, stats.size);
+    EXPECT_EQ(7, stats.size_in_bytes);
+    EXPECT_EQ(16 * MB, stats.max_size_in_bytes);
+    EXPECT_EQ(1, stats.segments);
+    EXPECT_EQ(MB, stats.disk_size_in_bytes);
+    EXPECT_EQ(3, stats.hits);
+    EXPECT_EQ(1, stats.misses);
+
+    // Replacing a value.
+    EXPECT_TRUE(s->put("a", "bye"));
+    EXPECT_EQ("bye", *s->get("a"));
+    EXPECT_EQ("hello", v->to_string());  // The old value is still there.
+    EXPECT_EQ(2, s->stats().size);
+    EXPECT_EQ(5, s->stats().size_in_bytes);
+
+    EXPECT_EQ("bye", *s->take("a"));
+    EXPECT_FALSE(s->take("a"));
+    EXPECT_FALSE(s->contains_key("a"));
+    EXPECT_TRUE(s->contains_key("b"));
+    EXPECT_EQ(1, s->stats().size);
+
+    s->clear_stats();
+    EXPECT_EQ(0, s->stats().hits);
+    EXPECT_EQ(0, s->stats().misses);
+}
+
+TEST_F(SegmentStoreTest, persistence)
+{
+    {
+        auto s = open();
+        for (int i = 0; i < 5000; ++i)  // Enough to make the index grow a few times.
+        {
+            ASSERT_TRUE(s->put("key" + to_string(i), value_for(i, 100)));
+        }
+        s->put("key7", "new value");
+        s->take("key8");
+    }
+
+    // Opening without a size gets the size we had.
+    auto s = SegmentStore::open(STORE_DIR);
+    EXPECT_EQ(16 * MB, s->stats().max_size_in_bytes);
+    EXPECT_EQ(4999, s->stats().size);
+    for (int i = 0; i < 5000; ++i)
+    {
+        if (i != 7 && i != 8)
+        {
+            EXPECT_EQ(value_for(i, 100), *s->get("key" + to_string(i))) << i;
+        }
+    }
+    EXPECT_EQ("new value", *s->get("key7"));
+    EXPECT_FALSE(s->get("key8"));
+}
+
+TEST_F(SegmentStoreTest, rebuild_index)
+{
+    {
+        auto s = open();
+        for (int i = 0; i < 100; ++i)
+        {
+            s->put("key" + to_string(i), value_for(i, 1000));
+        }
+        s->put("key7", "new value");
+    }
+
+    // Without an index, we find the entries by scanning the segments.
+    // The most recent value for a key wins.
+    boost::filesystem::remove(STORE_DIR "/index");
+    {
+        auto s = open();
+        EXPECT_EQ(100, s->stats().size);
+        EXPECT_EQ("new value", *s->get("key7"));
+        EXPECT_EQ(value_for(99, 1000), *s->get("key99"));
+    }
+
+    // Same for an index that is damaged.
+    write_file(STORE_DIR "/index", string(100, 'x'));
+    {
+        auto s = open();
+        EXPECT_EQ(100, s->stats().size);
+        EXPECT_EQ(value_for(0, 1000), *s->get("key0"));
+    }
+
+    // Entries that were taken stay gone, even if they are added and taken again.
+    {
+        auto s = open();
+        s->take("key1");
+        s->put("key2", "again");
+        s->take("key2");
+        s->take("key3");
+        s->put("key3", "back");
+    }
+    boost::filesystem::remove(STORE_DIR "/index");
+    {
+        auto s = open();
+        EXPECT_EQ(98, s->stats().size);
+        EXPECT_FALSE(s->get("key1"));
+        EXPECT_FALSE(s->get("key2"));
+        EXPECT_EQ("back", *s->get("key3"));
+        EXPECT_EQ("new value", *s->get("key7"));
+    }
+
+    // But we need an index to find out the size.
+    boost::filesystem::remove(STORE_DIR "/index");
+    EXPECT_THROW(SegmentStore::open(STORE_DIR), runtime_error);
+}
+
+TEST_F(SegmentStoreTest, eviction)
+{
+    // 4 MB store with 256 KB segments.
+    auto s = open(4 * MB);
+    int const NUM_ENTRIES = 1000;
+    for (int i = 0; i < NUM_ENTRIES; ++i)
+    {
+        ASSERT_TRUE(s->put("key" + to_string(i), value_for(i, 10 * 1024)));
+    }
+
+    auto stats = s->stats();
+    EXPECT_LE(stats.disk_size_in_bytes, 4 * MB);
+    EXPECT_EQ(16, stats.segments);
+    EXPECT_GT(stats.segments_evicted, 0);
+    EXPECT_LT(stats.size, NUM_ENTRIES);
+    EXPECT_EQ(NUM_ENTRIES - stats.size, stats.entries_evicted);
+
+    // The oldest entries went first.
+    EXPECT_FALSE(s->contains_key("key0"));
+    for (int i = NUM_ENTRIES - stats.size; i < NUM_ENTRIES; ++i)
+    {
+        EXPECT_TRUE(s->contains_key("key" + to_string(i))) << i;
+    }
+
+    // Making the store smaller evicts more.
+    s->resize(2 * MB);
+    EXPECT_LE(s->stats().disk_size_in_bytes, 2 * MB);
+    EXPECT_TRUE(s->contains_key("key" + to_string(NUM_ENTRIES - 1)));
+
+    // An entry that doesn't fit into a segment is refused.
+    EXPECT_FALSE(s->put("big", string(256 * 1024, 'x')));
+    EXPECT_FALSE(s->contains_key("big"));
+}
+
+TEST_F(SegmentStoreTest, views_pin_segments)
+{
+    auto s = open(MB);
+    s->put("a", "value of a");
+    auto v = s->get_view("a");
+    ASSERT_TRUE(v);
+
+    // Push the segment with "a" out.
+    for (int i = 0; s->contains_key("a"); ++i)
+    {
+        s->put("key" + to_string(i), value_for(i, 10 * 1024));
+    }
+    EXPECT_EQ("value of a", v->to_string());
+
+    s->invalidate();
+    EXPECT_EQ(0, s->stats().size);
+    EXPECT_EQ(0, s->stats().segments);
+    EXPECT_EQ("value of a", v->to_string());
+}
+
+TEST_F(SegmentStoreTest, compact)
+{
+    auto s = open();
+    for (int round = 0; round < 5; ++round)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            s->put("key" + to_string(i), value_for(i + round, 10 * 1024));
+        }
+    }
+    auto before = s->stats();
+    EXPECT_EQ(100, before.size);
+
+    s->compact();
+    auto after = s->stats();
+    EXPECT_EQ(100, after.size);
+    EXPECT_EQ(before.size_in_bytes, after.size_in_bytes);
+    EXPECT_LT(after.disk_size_in_bytes, before.disk_size_in_bytes);
+    for (int i = 0; i < 100; ++i)
+    {
+        EXPECT_EQ(value_for(i + 4, 10 * 1024), *s->get("key" + to_string(i))) << i;
+    }
+
+    // Still there after re-opening.
+    s.reset();
+    s = open();
+    EXPECT_EQ(100, s->stats().size);
+    EXPECT_EQ(value_for(4, 10 * 1024), *s->get("key0"));
+}
+
+TEST_F(SegmentStoreTest, compact_failure)
+{
+    auto s = open();
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            s->put("key" + to_string(i), value_for(i + round, 10 * 1024));
+        }
+    }
+    auto before = s->stats();
+
+    // Make creating a new segment fail, as it would with a full disk.
+    struct rlimit old_limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+    auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = MB / 2;
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+    EXPECT_THROW(s->compact(), runtime_error);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+
+    // Nothing was lost.
+    auto after = s->stats();
+    EXPECT_EQ(before.size, after.size);
+    EXPECT_EQ(before.segments, after.segments);
+    EXPECT_EQ(before.disk_size_in_bytes, after.disk_size_in_bytes);
+    for (int i = 0; i < 100; ++i)
+    {
+        EXPECT_EQ(value_for(i + 2, 10 * 1024), *s->get("key" + to_string(i))) << i;
+    }
+    EXPECT_EQ(before.segments, count_if(boost::filesystem::directory_iterator(STORE_DIR),
+                                        boost::filesystem::directory_iterator(),
+                                        [](boost::filesystem::directory_entry const& e)
+                                        {
+                                            return e.path().filename().native().compare(0, 8, "segment-") == 0;
+                                        }));
+
+    // And compaction works once there is space again.
+    s->compact();
+    EXPECT_LT(s->stats().disk_size_in_bytes, before.disk_size_in_bytes);
+    EXPECT_EQ(value_for(2, 10 * 1024), *s->get("key0"));
+}
+
+TEST_F(SegmentStoreTest, scan)
+{
+    auto s = open();
+    uint64_t cursor = 0;
+    EXPECT_TRUE(s->scan(cursor, 10).empty());
+    EXPECT_EQ(0u, cursor);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        s->put("key" + to_string(i), value_for(i, 100));
+    }
+    s->take("key7");
+
+    map<string, string> seen;
+    int calls = 0;
+    do
+    {
+        auto entries = s->scan(cursor, 10);
+        EXPECT_LE(entries.size(), 10u);
+        for (auto const& e : entries)
+        {
+            EXPECT_TRUE(seen.insert(e).second) << e.first;
+        }
+        ++calls;
+    }
+    while (cursor != 0);
+    EXPECT_GE(calls, 10);
+    ASSERT_EQ(99u, seen.size());
+    EXPECT_EQ(0u, seen.count("key7"));
+    EXPECT_EQ(value_for(42, 100), seen["key42"]);
+}
+
+TEST_F(SegmentStoreTest, handler)
+{
+    auto s = open();
+    vector<pair<string, core::CacheEvent>> events;
+    s->set_handler(core::CacheEvent::put | core::CacheEvent::miss,
+                   [&events](string const& key, core::CacheEvent ev, SegmentStore::Stats const&)
+                   {
+                       events.emplace_back(key, ev);
+                   });
+    s->put("a", "1");
+    s->get("a");
+    s->get("b");
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ("a", events[0].first);
+    EXPECT_TRUE(events[0].second == core::CacheEvent::put);
+    EXPECT_EQ("b", events[1].first);
+    EXPECT_TRUE(events[1].second == core::CacheEvent::miss);
+}
+
+TEST_F(SegmentStoreTest, evict_handler)
+{
+    auto s = open(4 * MB);
+    vector<string> evicted;
+    s->set_handler(core::CacheEvent::evict_lru,
+                   [&evicted](string const& key, core::CacheEvent ev, SegmentStore::Stats const&)
+                   {
+                       EXPECT_TRUE(ev == core::CacheEvent::evict_lru);
+                       evicted.push_back(key);
+                   });
+    for (int i = 0; i < 1000; ++i)
+    {
+        ASSERT_TRUE(s->put("key" + to_string(i), value_for(i, 10 * 1024)));
+    }
+
+    // Each entry in a deleted segment is reported. Those are the oldest entries.
+    ASSERT_EQ(size_t(s->stats().entries_evicted), evicted.size());
+    ASSERT_FALSE(evicted.empty());
+    for (size_t i = 0; i < evicted.size(); ++i)
+    {
+        EXPECT_EQ(1u, count(evicted.begin(), evicted.end(), "key" + to_string(i))) << i;
+    }
+}
+
+TEST_F(SegmentStoreTest, cache_helper)
+{
+    {
+        auto ch = CacheHelper<SegmentStore>::open(STORE_DIR, 16 * MB, core::CacheDiscardPolicy::lru_only);
+        ch->put("a", "1");
+        EXPECT_EQ("1", *ch->get("a"));
+        EXPECT_EQ("1", ch->get_view("a")->to_string());
+        EXPECT_EQ(1, ch->stats().size);
+    }
+
+    // Overwrite the header of the segment. The store reports that as corruption,
+    // and CacheHelper starts over with an empty store.
+    write_file(STORE_DIR "/segment-1", string(1024, '\0'));
+    auto ch = CacheHelper<SegmentStore>::open(STORE_DIR, 8 * MB, core::CacheDiscardPolicy::lru_only);
+    EXPECT_EQ(0, ch->stats().size);
+    EXPECT_EQ(8 * MB, ch->stats().max_size_in_bytes);
+    ch->put("a", "2");
+    EXPECT_EQ("2", *ch->get("a"));
+}
+
+TEST_F(SegmentStoreTest, lock)
+{
+    auto s = open();
+    s->put("a", "1");
+    try
+    {
+        SegmentStore::open(STORE_DIR);
+        FAIL();
+    }
+    catch (runtime_error const& e)
+    {
+        EXPECT_EQ(string("SegmentStore: cannot open ") + STORE_DIR + ": store is in use by another process", e.what());
+    }
+
+    // Another process is locked out too.
+    pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (pid == 0)
+    {
+        try
+        {
+            SegmentStore::open(STORE_DIR, 16 * MB, core::CacheDiscardPolicy::lru_only);
+            _exit(1);
+        }
+        catch (runtime_error const&)
+        {
+            _exit(0);
+        }
+    }
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Once the store is closed, it can be opened again.
+    s.reset();
+    s = open();
+    EXPECT_EQ("1", *s->get("a"));
+}
+
+TEST_F(SegmentStoreTest, exceptions)
+{
+    try
+    {
+        SegmentStore::open(STORE_DIR, MB, core::CacheDiscardPolicy::lru_ttl);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("SegmentStore::open(): only lru_only is supported", e.what());
+    }
+
+    try
+    {
+        SegmentStore::open(STORE_DIR, 0, core::CacheDiscardPolicy::lru_only);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("SegmentStore::open(): invalid max_size_in_bytes: 0", e.what());
+    }
+
+    auto s = open();
+    try
+    {
+        s->put("a", "1", chrono::system_clock::now() + chrono::hours(1));
+        FAIL();
+    }
+    catch (logic_error const& e)
+    {
+        EXPECT_STREQ("SegmentStore::put(): expiry times are not supported", e.what());
+    }
+
+    try
+    {
+        s->resize(-1);
+        FAIL();
+    }
+    catch (invalid_argument const& e)
+    {
+        EXPECT_STREQ("SegmentStore::resize(): invalid size_in_bytes: -1", e.what());
+    }
+}
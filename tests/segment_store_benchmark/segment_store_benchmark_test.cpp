@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/segment_store.h>
+
+#include <core/persistent_string_cache.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+// Fills a leveldb cache (core::PersistentStringCache) and a SegmentStore with the
+// same 100,000 thumbnail-sized entries, and times random lookups in each.
+// We report the median and 99th percentile latency of get(), and how much the
+// resident set grows while reading. For the SegmentStore, the resident set
+// includes the pages of the segment files that we touched.
+
+namespace
+{
+
+int const NUM_ENTRIES = 100000;
+size_t const VALUE_SIZE = 2048;
+int const NUM_LOOKUPS = 200000;
+int64_t const CACHE_SIZE = int64_t(1024) * 1024 * 1024;  // Large enough that nothing is evicted.
+
+string const BENCHMARK_DIR = TESTBINDIR "/segment_store_benchmark";
+
+string key_for(int i)
+{
+    return "/home/user/Pictures/IMG_" + to_string(i) + ".jpg" + '\0' + "128" + '\0' + "128";
+}
+
+string value_for(int i)
+{
+    string v(VALUE_SIZE, char(i));
+    v.replace(0, to_string(i).size(), to_string(i));
+    return v;
+}
+
+// Returns the resident set size in KB.
+
+int64_t rss_kb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+        {
+            return stoll(line.substr(6));
+        }
+    }
+    return -1;  // LCOV_EXCL_LINE
+}
+
+struct Result
+{
+    double p50_us;
+    double p99_us;
+    int64_t rss_growth_kb;
+};
+
+// Calls lookup for NUM_LOOKUPS random keys. lookup returns the size of the value it found.
+
+template<typename F>
+Result run_lookups(F lookup)
+{
+    mt19937 gen(42);
+    uniform_int_distribution<int> dist(0, NUM_ENTRIES - 1);
+    vector<double> latencies;
+    latencies.reserve(NUM_LOOKUPS);
+
+    int64_t const rss_before = rss_kb();
+    for (int i = 0; i < NUM_LOOKUPS; ++i)
+    {
+        string const key = key_for(dist(gen));
+        auto start = chrono::steady_clock::now();
+        size_t size = lookup(key);
+        auto end = chrono::steady_clock::now();
+        EXPECT_EQ(VALUE_SIZE, size);
+        latencies.push_back(chrono::duration<double, micro>(end - start).count());
+    }
+    int64_t const rss_after = rss_kb();
+
+    sort(latencies.begin(), latencies.end());
+    return Result{latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], rss_after - rss_before};
+}
+
+void print(char const* name, Result const& r)
+{
+    printf("%-26s p50 %7.2f us, p99 %7.2f us, RSS growth %7lld KB\n",
+           name, r.p50_us, r.p99_us, static_cast<long long>(r.rss_growth_kb));
+}
+
+}  // namespace
+
+TEST(segment_store_benchmark, get_latency)
+{
+    boost::filesystem::remove_all(BENCHMARK_DIR);
+
+    auto leveldb = core::PersistentStringCache::open(BENCHMARK_DIR + "/leveldb", CACHE_SIZE,
+                                                     core::CacheDiscardPolicy::lru_only);
+    auto store = SegmentStore::open(BENCHMARK_DIR + "/segments", CACHE_SIZE, core::CacheDiscardPolicy::lru_only);
+    for (int i = 0; i < NUM_ENTRIES; ++i)
+    {
+        string const key = key_for(i);
+        string const value = value_for(i);
+        leveldb->put(key, value);
+        ASSERT_TRUE(store->put(key, value));
+    }
+    ASSERT_EQ(NUM_ENTRIES, leveldb->size());
+    ASSERT_EQ(NUM_ENTRIES, store->stats().size);
+
+    auto leveldb_result = run_lookups([&](string const& key)
+    {
+        auto v = leveldb->get(key);
+        return v ? v->size() : 0;
+    });
+    auto copy_result = run_lookups([&](string const& key)
+    {
+        auto v = store->get(key);
+        return v ? v->size() : 0;
+    });
+    auto view_result = run_lookups([&](string const& key)
+    {
+        auto v = store->get_view(key);
+        if (!v)
+        {
+            return size_t(0);
+        }
+        volatile char last = v->data()[v->size() - 1];  // Touch the data, as a reader would.
+        (void)last;
+        return v->size();
+    });
+
+    printf("%d entries of %zu bytes, %d random lookups\n", NUM_ENTRIES, VALUE_SIZE, NUM_LOOKUPS);
+    print("leveldb get():", leveldb_result);
+    print("SegmentStore get():", copy_result);
+    print("SegmentStore get_view():", view_result);
+
+    EXPECT_LT(view_result.p50_us, leveldb_result.p50_us);
+
+    leveldb.reset();
+    store.reset();
+    boost::filesystem::remove_all(BENCHMARK_DIR);
+}
@@ -32,6 +32,7 @@
 
 #include <unistd.h>
 
+using namespace std;
 using namespace unity::thumbnailer;
 using namespace unity::thumbnailer::internal;
 
@@ -43,6 +44,17 @@ TEST(Settings, defaults_from_schema)
     EXPECT_EQ(50, settings.full_size_cache_size());
     EXPECT_EQ(100, settings.thumbnail_cache_size());
     EXPECT_EQ(2, settings.failure_cache_size());
+    EXPECT_EQ("leveldb", settings.full_size_cache_backend());
+    EXPECT_EQ("leveldb", settings.thumbnail_cache_backend());
+    EXPECT_EQ("leveldb", settings.failure_cache_backend());
+    EXPECT_EQ(8, settings.memory_cache_size());
+    EXPECT_EQ(256, settings.warm_restart_entries());
+    EXPECT_EQ(0, settings.target_hit_rate());
+    EXPECT_EQ(10, settings.full_size_cache_min_size());
+    EXPECT_EQ(200, settings.full_size_cache_max_size());
+    EXPECT_EQ(20, settings.thumbnail_cache_min_size());
+    EXPECT_EQ(400, settings.thumbnail_cache_max_size());
+    EXPECT_EQ(0, settings.thumbnail_size_ladder());
     EXPECT_EQ(7200, settings.retry_error_max_seconds());
     EXPECT_EQ(8, settings.max_downloads());
     EXPECT_EQ(0, settings.max_extractions());
@@ -50,6 +62,8 @@ TEST(Settings, defaults_from_schema)
     EXPECT_EQ(10, settings.max_backlog());
     EXPECT_FALSE(settings.trace_client());
     EXPECT_EQ(1, settings.log_level());
+    EXPECT_FALSE(settings.background_indexing());
+    EXPECT_EQ(vector<int>({ 128, 256 }), settings.background_indexing_sizes());
 }
 
 TEST(Settings, missing_schema)
@@ -64,7 +78,18 @@ TEST(Settings, missing_schema)
     EXPECT_EQ(50, settings.full_size_cache_size());
     EXPECT_EQ(100, settings.thumbnail_cache_size());
     EXPECT_EQ(2, settings.failure_cache_size());
+    EXPECT_EQ("leveldb", settings.full_size_cache_backend());
+    EXPECT_EQ("leveldb", settings.thumbnail_cache_backend());
+    EXPECT_EQ("leveldb", settings.failure_cache_backend());
+    EXPECT_EQ(8, settings.memory_cache_size());
+    EXPECT_EQ(256, settings.warm_restart_entries());
+    EXPECT_EQ(0, settings.target_hit_rate());
+    EXPECT_EQ(10, settings.full_size_cache_min_size());
+    EXPECT_EQ(200, settings.full_size_cache_max_size());
+    EXPECT_EQ(20, settings.thumbnail_cache_min_size());
+    EXPECT_EQ(400, settings.thumbnail_cache_max_size());
     EXPECT_EQ(1920, settings.max_thumbnail_size());
+    EXPECT_EQ(0, settings.thumbnail_size_ladder());
     EXPECT_EQ(168, settings.retry_not_found_hours());
     EXPECT_EQ(7200, settings.retry_error_max_seconds());
     EXPECT_EQ(8, settings.max_downloads());
@@ -73,6 +98,8 @@ TEST(Settings, missing_schema)
     EXPECT_EQ(10, settings.max_backlog());
     EXPECT_FALSE(settings.trace_client());
     EXPECT_EQ(1, settings.log_level());
+    EXPECT_FALSE(settings.background_indexing());
+    EXPECT_EQ(vector<int>({ 128, 256 }), settings.background_indexing_sizes());
 }
 
 TEST(Settings, changed_settings)
@@ -82,6 +109,17 @@ TEST(Settings, changed_settings)
     g_settings_set_int(gsettings.get(), "full-size-cache-size", 41);
     g_settings_set_int(gsettings.get(), "thumbnail-cache-size", 42);
     g_settings_set_int(gsettings.get(), "failure-cache-size", 43);
+    g_settings_set_string(gsettings.get(), "full-size-cache-backend", "segments");
+    g_settings_set_string(gsettings.get(), "thumbnail-cache-backend", "segments");
+    g_settings_set_string(gsettings.get(), "failure-cache-backend", "segments");
+    g_settings_set_int(gsettings.get(), "memory-cache-size", 0);
+    g_settings_set_int(gsettings.get(), "warm-restart-entries", 0);
+    g_settings_set_int(gsettings.get(), "target-hit-rate", 90);
+    g_settings_set_int(gsettings.get(), "full-size-cache-min-size", 11);
+    g_settings_set_int(gsettings.get(), "full-size-cache-max-size", 12);
+    g_settings_set_int(gsettings.get(), "thumbnail-cache-min-size", 13);
+    g_settings_set_int(gsettings.get(), "thumbnail-cache-max-size", 14);
+    g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", 150);
     g_settings_set_int(gsettings.get(), "retry-error-hours", 1);
     g_settings_set_int(gsettings.get(), "max-downloads", 5);
     g_settings_set_int(gsettings.get(), "max-extractions", 7);
@@ -89,12 +127,25 @@ TEST(Settings, changed_settings)
     g_settings_set_int(gsettings.get(), "max-backlog", 30);
     g_settings_set_boolean(gsettings.get(), "trace-client", true);
     g_settings_set_int(gsettings.get(), "log-level", 2);
+    g_settings_set_boolean(gsettings.get(), "background-indexing", true);
+    g_settings_set_string(gsettings.get(), "background-indexing-sizes", "64, 512 ,1024");
 
     Settings settings;
     EXPECT_EQ("foo", settings.art_api_key());
     EXPECT_EQ(41, settings.full_size_cache_size());
     EXPECT_EQ(42, settings.thumbnail_cache_size());
     EXPECT_EQ(43, settings.failure_cache_size());
+    EXPECT_EQ("segments", settings.full_size_cache_backend());
+    EXPECT_EQ("segments", settings.thumbnail_cache_backend());
+    EXPECT_EQ("segments", settings.failure_cache_backend());
+    EXPECT_EQ(0, settings.memory_cache_size());
+    EXPECT_EQ(0, settings.warm_restart_entries());
+    EXPECT_EQ(90, settings.target_hit_rate());
+    EXPECT_EQ(11, settings.full_size_cache_min_size());
+    EXPECT_EQ(12, settings.full_size_cache_max_size());
+    EXPECT_EQ(13, settings.thumbnail_cache_min_size());
+    EXPECT_EQ(14, settings.thumbnail_cache_max_size());
+    EXPECT_EQ(150, settings.thumbnail_size_ladder());
     EXPECT_EQ(3600, settings.retry_error_max_seconds());
     EXPECT_EQ(5, settings.max_downloads());
     EXPECT_EQ(7, settings.max_extractions());
@@ -102,11 +153,24 @@ TEST(Settings, changed_settings)
     EXPECT_EQ(30, settings.max_backlog());
     EXPECT_TRUE(settings.trace_client());
     EXPECT_EQ(2, settings.log_level());
+    EXPECT_TRUE(settings.background_indexing());
+    EXPECT_EQ(vector<int>({ 64, 512, 1024 }), settings.background_indexing_sizes());
 
     g_settings_reset(gsettings.get(), "dash-ubuntu-com-key");
     g_settings_reset(gsettings.get(), "full-size-cache-size");
     g_settings_reset(gsettings.get(), "thumbnail-cache-size");
     g_settings_reset(gsettings.get(), "failure-cache-size");
+    g_settings_reset(gsettings.get(), "full-size-cache-backend");
+    g_settings_reset(gsettings.get(), "thumbnail-cache-backend");
+    g_settings_reset(gsettings.get(), "failure-cache-backend");
+    g_settings_reset(gsettings.get(), "memory-cache-size");
+    g_settings_reset(gsettings.get(), "warm-restart-entries");
+    g_settings_reset(gsettings.get(), "target-hit-rate");
+    g_settings_reset(gsettings.get(), "full-size-cache-min-size");
+    g_settings_reset(gsettings.get(), "full-size-cache-max-size");
+    g_settings_reset(gsettings.get(), "thumbnail-cache-min-size");
+    g_settings_reset(gsettings.get(), "thumbnail-cache-max-size");
+    g_settings_reset(gsettings.get(), "thumbnail-size-ladder");
     g_settings_reset(gsettings.get(), "retry-error-hours");
     g_settings_reset(gsettings.get(), "max-downloads");
     g_settings_reset(gsettings.get(), "max-extractions");
@@ -114,6 +178,8 @@ TEST(Settings, changed_settings)
     g_settings_reset(gsettings.get(), "max-backlog");
     g_settings_reset(gsettings.get(), "trace-client");
     g_settings_reset(gsettings.get(), "log-level");
+    g_settings_reset(gsettings.get(), "background-indexing");
+    g_settings_reset(gsettings.get(), "background-indexing-sizes");
 }
 
 TEST(Settings, adjusted_error_max_seconds)
@@ -186,6 +252,79 @@ TEST(Settings, negative_int)
     g_settings_reset(gsettings.get(), "max-extractions");
 }
 
+TEST(Settings, bad_background_indexing_sizes)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+
+    Settings settings;
+    for (auto const& list : { "128,abc", "128,0", "-5", "12x", "128,,256" })
+    {
+        g_settings_set_string(gsettings.get(), "background-indexing-sizes", list);
+        try
+        {
+            settings.background_indexing_sizes();
+            FAIL() << list;
+        }
+        catch (std::domain_error const& e)
+        {
+            EXPECT_EQ(string("Settings::background_indexing_sizes(): invalid value for background-indexing-sizes: \"")
+                      + list + "\" in schema com.canonical.Unity.Thumbnailer",
+                      e.what());
+        }
+    }
+
+    g_settings_reset(gsettings.get(), "background-indexing-sizes");
+}
+
+TEST(Settings, bad_thumbnail_size_ladder)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+
+    Settings settings;
+    for (int step : { 1, 100 })
+    {
+        g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", step);
+        try
+        {
+            settings.thumbnail_size_ladder();
+            FAIL() << step;
+        }
+        catch (std::domain_error const& e)
+        {
+            EXPECT_EQ(string("Settings::thumbnail_size_ladder(): invalid value for thumbnail-size-ladder: ")
+                      + to_string(step) + " (must be 0 or greater than 100) in schema com.canonical.Unity.Thumbnailer",
+                      e.what());
+        }
+    }
+    g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", 101);
+    EXPECT_EQ(101, settings.thumbnail_size_ladder());
+
+    g_settings_reset(gsettings.get(), "thumbnail-size-ladder");
+}
+
+TEST(Settings, bad_target_hit_rate)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+
+    Settings settings;
+    g_settings_set_int(gsettings.get(), "target-hit-rate", 100);
+    try
+    {
+        settings.target_hit_rate();
+        FAIL();
+    }
+    catch (std::domain_error const& e)
+    {
+        EXPECT_EQ(string("Settings::target_hit_rate(): invalid value for target-hit-rate: 100 "
+                         "(must be less than 100) in schema com.canonical.Unity.Thumbnailer"),
+                  e.what());
+    }
+    g_settings_set_int(gsettings.get(), "target-hit-rate", 99);
+    EXPECT_EQ(99, settings.target_hit_rate());
+
+    g_settings_reset(gsettings.get(), "target-hit-rate");
+}
+
 TEST(Settings, log_level_env_override)
 {
     EnvVarGuard ev_guard(LOG_LEVEL, "0");
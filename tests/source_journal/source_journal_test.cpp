@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/source_journal.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <set>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define JOURNAL_DIR TESTBINDIR "/source_journal"
+
+namespace
+{
+
+int64_t const MB = 1024 * 1024;
+
+class SourceJournalTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(JOURNAL_DIR);
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(JOURNAL_DIR);
+    }
+};
+
+// Sweeps the whole journal, with files in current being current.
+
+vector<SourceJournal::Garbage> sweep_all(SourceJournal& j, set<string> const& current, int* checked = nullptr)
+{
+    auto is_current = [&current](string const& identity)
+    {
+        return current.find(identity) != current.end();
+    };
+    vector<SourceJournal::Garbage> garbage;
+    SourceJournal::SweepResult r;
+    do
+    {
+        r = j.sweep(10, is_current);
+        EXPECT_LE(r.sources_checked, 10);
+        if (checked)
+        {
+            *checked += r.sources_checked;
+        }
+        garbage.insert(garbage.end(), r.garbage.begin(), r.garbage.end());
+    }
+    while (!r.pass_complete);
+    return garbage;
+}
+
+}  // namespace
+
+TEST_F(SourceJournalTest, basic)
+{
+    SourceJournal j(JOURNAL_DIR, 4 * MB);
+
+    j.add_source("s1", "file1", "content1");
+    j.add_source("s2", "file2", "content2");
+    j.add_entry("content1", "content1-small");
+    j.add_entry("content1", "content1-large");
+    j.add_entry("content1", "content1-small");  // Recorded once only.
+    j.add_entry("content2", "content2-small");
+    j.add_entry("content3", "content3-small");  // No source, ignored.
+
+    int checked = 0;
+    EXPECT_TRUE(sweep_all(j, { "file1", "file2" }, &checked).empty());
+    EXPECT_EQ(2, checked);
+
+    auto garbage = sweep_all(j, { "file2" });
+    ASSERT_EQ(1u, garbage.size());
+    EXPECT_EQ("s1", garbage[0].source_key);
+    EXPECT_EQ("content1", garbage[0].cache_key);
+    EXPECT_TRUE(garbage[0].last_source);
+    EXPECT_EQ((vector<string>{ "content1-small", "content1-large" }), garbage[0].entry_keys);
+
+    // s1 is gone now.
+    checked = 0;
+    EXPECT_TRUE(sweep_all(j, {}, &checked).size() == 1);
+    EXPECT_EQ(1, checked);
+    EXPECT_TRUE(sweep_all(j, {}).empty());
+}
+
+TEST_F(SourceJournalTest, shared_contents)
+{
+    SourceJournal j(JOURNAL_DIR, 4 * MB);
+
+    // Two copies of the same file.
+    j.add_source("s1", "file1", "content");
+    j.add_source("s1", "file1", "content");  // Counted once only.
+    j.add_source("s2", "copy of file1", "content");
+    j.add_entry("content", "content-small");
+
+    auto garbage = sweep_all(j, { "copy of file1" });
+    ASSERT_EQ(1u, garbage.size());
+    EXPECT_EQ("s1", garbage[0].source_key);
+    EXPECT_FALSE(garbage[0].last_source);
+    EXPECT_TRUE(garbage[0].entry_keys.empty());
+
+    garbage = sweep_all(j, {});
+    ASSERT_EQ(1u, garbage.size());
+    EXPECT_EQ("s2", garbage[0].source_key);
+    EXPECT_TRUE(garbage[0].last_source);
+    EXPECT_EQ(vector<string>{ "content-small" }, garbage[0].entry_keys);
+}
+
+TEST_F(SourceJournalTest, cursor)
+{
+    int const NUM_SOURCES = 100;
+    {
+        SourceJournal j(JOURNAL_DIR, 4 * MB);
+        for (int i = 0; i < NUM_SOURCES; ++i)
+        {
+            j.add_source("s" + to_string(i), "file" + to_string(i), "content" + to_string(i));
+        }
+
+        // Check a few sources, none of which are current.
+        auto r = j.sweep(30, [](string const&) { return false; });
+        EXPECT_FALSE(r.pass_complete);
+        EXPECT_EQ(size_t(r.sources_checked), r.garbage.size());
+        EXPECT_GT(r.sources_checked, 0);
+    }
+
+    // After re-opening, we continue where we left off, so we don't see the
+    // sources we removed already, and we get to the end before seeing them all.
+    SourceJournal j(JOURNAL_DIR, 4 * MB);
+    set<string> seen;
+    SourceJournal::SweepResult r;
+    do
+    {
+        r = j.sweep(30, [&seen](string const& identity) { seen.insert(identity); return true; });
+    }
+    while (!r.pass_complete);
+    EXPECT_LT(seen.size(), size_t(NUM_SOURCES));
+    EXPECT_GT(seen.size(), 0u);
+
+    // The next pass starts at the beginning.
+    int checked = 0;
+    sweep_all(j, seen, &checked);
+    EXPECT_EQ(int(seen.size()), checked);
+}
+
+TEST_F(SourceJournalTest, clear)
+{
+    SourceJournal j(JOURNAL_DIR, 4 * MB);
+    j.add_source("s1", "file1", "content1");
+    j.clear();
+    EXPECT_TRUE(sweep_all(j, {}).empty());
+
+    // Sources that are cleared can be added again.
+    j.add_source("s1", "file1", "content1");
+    EXPECT_EQ(1u, sweep_all(j, {}).size());
+}
+
+TEST_F(SourceJournalTest, damaged)
+{
+    {
+        SourceJournal j(JOURNAL_DIR, 4 * MB);
+        j.add_source("s1", "file1", "content1");
+    }
+
+    // A damaged segment makes us start over.
+    for (auto it = boost::filesystem::directory_iterator(JOURNAL_DIR); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        write_file(it->path().native(), string(100, 'x'));
+    }
+    SourceJournal j(JOURNAL_DIR, 4 * MB);
+    EXPECT_TRUE(sweep_all(j, {}).empty());
+    j.add_source("s1", "file1", "content1");
+    EXPECT_EQ(1u, sweep_all(j, {}).size());
+}
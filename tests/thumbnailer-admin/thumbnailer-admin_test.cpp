@@ -27,6 +27,9 @@
 #include <boost/algorithm/string/predicate.hpp>
 #include <gtest/gtest.h>
 
+#include <regex>
+#include <thread>
+
 using namespace std;
 using namespace boost;
 using namespace unity::thumbnailer::internal;
@@ -100,6 +103,22 @@ public:
         return stderr_;
     }
 
+    // The service writes to its caches in the background, and "stats" doesn't
+    // wait for that, so we poll until nothing is queued any more.
+    void wait_for_writes()
+    {
+        for (int i = 0; i < 500; ++i)
+        {
+            EXPECT_EQ(0, run(QStringList{"stats"}));
+            if (!regex_search(stdout_, regex("Queued: +[1-9]")))
+            {
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        FAIL() << "cache writes still queued: " << stdout_;
+    }
+
 private:
     unique_ptr<QProcess> process_;
     string stdout_;
@@ -114,6 +133,17 @@ TEST_F(AdminTest, no_args)
     EXPECT_TRUE(output.find("Image cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("Thumbnail cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("Failure cache:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Alias cache:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Deduplication:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Bytes saved:           0") != string::npos) << output;
+    EXPECT_TRUE(output.find("Garbage collection:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Bytes reclaimed:       0") != string::npos) << output;
+    EXPECT_TRUE(output.find("Repair:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Entries lost:          0") != string::npos) << output;
+    EXPECT_TRUE(output.find("Cancellation:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Cancelled requests:    0") != string::npos) << output;
+    EXPECT_TRUE(output.find("Write queue:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Queued bytes:          0") != string::npos) << output;
     EXPECT_FALSE(output.find("Histogram:") != string::npos) << output;
 }
 
@@ -126,6 +156,11 @@ TEST_F(AdminTest, image_stats)
     EXPECT_TRUE(output.find("lru_only") != string::npos) << output;
     EXPECT_FALSE(output.find("Thumbnail cache:") != string::npos) << output;
     EXPECT_FALSE(output.find("Failure cache:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Failure filter:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Deduplication:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Garbage collection:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Repair:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Cancellation:") != string::npos) << output;
     EXPECT_FALSE(output.find("Histogram:") != string::npos) << output;
 }
 
@@ -150,6 +185,8 @@ TEST_F(AdminTest, failure_stats)
     EXPECT_FALSE(output.find("Thumbnail cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("Failure cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("lru_ttl") != string::npos) << output;
+    EXPECT_TRUE(output.find("Failure filter:") != string::npos) << output;
+    EXPECT_TRUE(output.find("False positive rate:   0.0000") != string::npos) << output;
     EXPECT_FALSE(output.find("Histogram:") != string::npos) << output;
 }
 
@@ -166,6 +203,7 @@ TEST_F(AdminTest, histogram)
 
     // Add a file to the cache
     EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/orientation-1.jpg"}));
+    ar.wait_for_writes();
     EXPECT_EQ(0, ar.run(QStringList{"stats", "-v", "t"}));
     output = ar.stdout();
     EXPECT_TRUE(output.find("Size:                  1") != string::npos) << output;
@@ -173,6 +211,7 @@ TEST_F(AdminTest, histogram)
 
     // Add a small file to the cache
     EXPECT_EQ(0, ar.run(QStringList{"get", "--size=32", TESTDATADIR "/orientation-1.jpg"}));
+    ar.wait_for_writes();
     EXPECT_EQ(0, ar.run(QStringList{"stats", "-v", "t"}));
     output = ar.stdout();
     EXPECT_TRUE(output.find("Size:                  2") != string::npos) << output;
@@ -183,6 +222,32 @@ TEST_F(AdminTest, histogram)
     EXPECT_TRUE(output.find("8000-8999: 1") != string::npos) << output;
 }
 
+TEST_F(AdminTest, miss_ratio_curve)
+{
+    AdminRunner ar;
+
+    EXPECT_EQ(0, ar.run(QStringList{"stats", "i"}));
+    EXPECT_FALSE(ar.stdout().find("Miss ratio curve:") != string::npos) << ar.stdout();
+
+    // Nothing requested yet, so everything misses.
+    EXPECT_EQ(0, ar.run(QStringList{"stats", "-m", "t"}));
+    auto output = ar.stdout();
+    EXPECT_TRUE(output.find("Miss ratio curve:") != string::npos) << output;
+    EXPECT_TRUE(output.find("209715200: 1.000") != string::npos) << output;
+
+    // The second request for the same thumbnail hits at any size.
+    EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/orientation-1.jpg"}));
+    EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/orientation-1.jpg"}));
+    EXPECT_EQ(0, ar.run(QStringList{"stats", "--miss-ratio", "t"}));
+    output = ar.stdout();
+    EXPECT_TRUE(output.find("209715200: 0.500") != string::npos) << output;
+
+    EXPECT_EQ(0, ar.run(QStringList{"stats", "-m"}));
+    output = ar.stdout();
+    EXPECT_TRUE(output.find("Image cache:") != string::npos) << output;
+    EXPECT_TRUE(output.find(" 104857600: 1.000") != string::npos) << output;
+}
+
 TEST_F(AdminTest, cmd_parsing)
 {
     AdminRunner ar;
@@ -311,6 +376,7 @@ TEST_F(AdminTest, clear_and_clear_stats)
     EXPECT_EQ(1, ar.run(QStringList{"get", TESTDATADIR "/empty"}));
     // Again, so we get a hit on the failure cache.
     EXPECT_EQ(1, ar.run(QStringList{"get", TESTDATADIR "/empty"}));
+    ar.wait_for_writes();
 
     // Check that each of the three caches is non-empty.
 
@@ -18,6 +18,7 @@
 
 #include <internal/thumbnailer.h>
 
+#include <internal/cachehelper.h>
 #include <internal/env_vars.h>
 #include <internal/file_io.h>
 #include <internal/image.h>
@@ -42,6 +43,7 @@
 
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #define TEST_IMAGE TESTDATADIR "/orientation-1.jpg"
 #define BAD_IMAGE TESTDATADIR "/bad_image.jpg"
@@ -53,6 +55,8 @@
 
 #define TEST_VIDEO TESTDATADIR "/testvideo.ogg"
 #define TEST_SONG TESTDATADIR "/testsong.ogg"
+#define TEST_VIDEO_WITH_COVER TESTDATADIR "/Forbidden Planet.m4v"
+#define TEST_MP4_VIDEO TESTDATADIR "/testvideo.mp4"
 
 using namespace std;
 using namespace unity::thumbnailer::internal;
@@ -88,6 +92,14 @@ protected:
     }
 };
 
+// Thumbnailer::stats() doesn't count the cache writes that are still queued,
+// so we wait for them first.
+static Thumbnailer::AllStats flushed_stats(Thumbnailer& tn)
+{
+    tn.flush();
+    return tn.stats();
+}
+
 TEST_F(ThumbnailerTest, basic)
 {
     Thumbnailer tn;
@@ -95,19 +107,19 @@ TEST_F(ThumbnailerTest, basic)
     QByteArray thumb;
     Image img;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
     thumb = request->thumbnail();
     EXPECT_EQ("", thumb);
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 
     // Again, this time we get the answer from the failure cache.
-    old_stats = tn.stats();
+    old_stats = flushed_stats(tn);
     request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
     thumb = request->thumbnail();
     EXPECT_EQ("", thumb);
-    new_stats = tn.stats();
+    new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.hits() + 1, new_stats.failure_stats.hits());
 
     request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
@@ -118,15 +130,26 @@ TEST_F(ThumbnailerTest, basic)
     EXPECT_EQ(480, img.height());
 
     // Again, for coverage. This time the thumbnail comes from the cache.
-    old_stats = tn.stats();
+    old_stats = flushed_stats(tn);
     request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
     thumb = request->thumbnail();
     img = Image(thumb);
     EXPECT_EQ(640, img.width());
     EXPECT_EQ(480, img.height());
-    new_stats = tn.stats();
+    new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, new_stats.thumbnail_stats.hits());
 
+    // Third time round, the thumbnail comes from the in-memory tier.
+    old_stats = flushed_stats(tn);
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
+    thumb = request->thumbnail();
+    img = Image(thumb);
+    EXPECT_EQ(640, img.width());
+    EXPECT_EQ(480, img.height());
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_stats.hits(), new_stats.thumbnail_stats.hits());
+    EXPECT_EQ(old_stats.thumbnail_memory_stats.hits + 1, new_stats.thumbnail_memory_stats.hits);
+
     request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
     thumb = request->thumbnail();
     img = Image(thumb);
@@ -180,14 +203,14 @@ TEST_F(ThumbnailerTest, changed_size)
 {
     {
         Thumbnailer tn;
-        EXPECT_EQ(100 * 1024 * 1024, tn.stats().thumbnail_stats.max_size_in_bytes());
+        EXPECT_EQ(100 * 1024 * 1024, flushed_stats(tn).thumbnail_stats.max_size_in_bytes());
     }
 
     {
         gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
         g_settings_set_int(gsettings.get(), "thumbnail-cache-size", 1);
         Thumbnailer tn;
-        EXPECT_EQ(1024 * 1024, tn.stats().thumbnail_stats.max_size_in_bytes());
+        EXPECT_EQ(1024 * 1024, flushed_stats(tn).thumbnail_stats.max_size_in_bytes());
     }
 }
 
@@ -221,6 +244,9 @@ TEST_F(ThumbnailerTest, clear)
             ASSERT_NE("", request->thumbnail());
         }
 
+        // The previous thumbnail may still be on its way to disk.
+        tn.flush();
+
         {
             // Load same song again at same size, so we get a hit on thumbnail cache.
             auto request = tn.get_thumbnail(TEST_SONG, QSize(20, 20));
@@ -272,7 +298,7 @@ TEST_F(ThumbnailerTest, clear)
     fill_cache();
 
     // Just to show that fill_cache() does put things into the cache and the stats are as expected.
-    auto stats = tn.stats();
+    auto stats = flushed_stats(tn);
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(3, stats.thumbnail_stats.size());
     EXPECT_EQ(1, stats.failure_stats.size());
@@ -282,7 +308,7 @@ TEST_F(ThumbnailerTest, clear)
 
     // Clear all caches and check that they are empty.
     tn.clear(Thumbnailer::CacheSelector::all);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(0, stats.full_size_stats.size());
     EXPECT_EQ(0, stats.thumbnail_stats.size());
     EXPECT_EQ(0, stats.failure_stats.size());
@@ -290,7 +316,7 @@ TEST_F(ThumbnailerTest, clear)
     // Clear full-size cache only.
     fill_cache();
     tn.clear(Thumbnailer::CacheSelector::full_size_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(0, stats.full_size_stats.size());
     EXPECT_EQ(3, stats.thumbnail_stats.size());
     EXPECT_EQ(1, stats.failure_stats.size());
@@ -299,7 +325,7 @@ TEST_F(ThumbnailerTest, clear)
     tn.clear(Thumbnailer::CacheSelector::all);
     fill_cache();
     tn.clear(Thumbnailer::CacheSelector::thumbnail_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(0, stats.thumbnail_stats.size());
     EXPECT_EQ(1, stats.failure_stats.size());
@@ -308,14 +334,14 @@ TEST_F(ThumbnailerTest, clear)
     tn.clear(Thumbnailer::CacheSelector::all);
     fill_cache();
     tn.clear(Thumbnailer::CacheSelector::failure_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(3, stats.thumbnail_stats.size());
     EXPECT_EQ(0, stats.failure_stats.size());
 
     // Clear all stats.
     tn.clear_stats(Thumbnailer::CacheSelector::all);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(0, stats.full_size_stats.hits());
     EXPECT_EQ(0, stats.thumbnail_stats.hits());
     EXPECT_EQ(0, stats.failure_stats.hits());
@@ -325,7 +351,7 @@ TEST_F(ThumbnailerTest, clear)
     tn.clear_stats(Thumbnailer::CacheSelector::all);
     fill_cache();
     tn.clear_stats(Thumbnailer::CacheSelector::full_size_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(0, stats.full_size_stats.hits());
     EXPECT_EQ(1, stats.thumbnail_stats.hits());
     EXPECT_EQ(1, stats.failure_stats.hits());
@@ -335,7 +361,7 @@ TEST_F(ThumbnailerTest, clear)
     tn.clear_stats(Thumbnailer::CacheSelector::all);
     fill_cache();
     tn.clear_stats(Thumbnailer::CacheSelector::thumbnail_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(0, stats.thumbnail_stats.hits());
     EXPECT_EQ(1, stats.failure_stats.hits());
@@ -345,7 +371,7 @@ TEST_F(ThumbnailerTest, clear)
     tn.clear_stats(Thumbnailer::CacheSelector::all);
     fill_cache();
     tn.clear_stats(Thumbnailer::CacheSelector::failure_cache);
-    stats = tn.stats();
+    stats = flushed_stats(tn);
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(1, stats.thumbnail_stats.hits());
     EXPECT_EQ(0, stats.failure_stats.hits());
@@ -363,45 +389,350 @@ TEST_F(ThumbnailerTest, thumbnail_video)
     request->download(chrono::milliseconds(15000));
     ASSERT_TRUE(spy.wait(20000));
     {
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         QByteArray thumb = request->thumbnail();
         ASSERT_NE("", thumb);
         Image img(thumb);
         EXPECT_EQ(1920, img.width());
         EXPECT_EQ(1080, img.height());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.full_size_stats.size() + 1, new_stats.full_size_stats.size());
     }
 
     {
         // Fetch the thumbnail again with the same size.
         // That causes it to come from the thumbnail cache.
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_thumbnail(TEST_VIDEO, QSize(1920, 1920));
         QByteArray thumb = request->thumbnail();
         ASSERT_NE("", thumb);
         Image img(thumb);
         EXPECT_EQ(1920, img.width());
         EXPECT_EQ(1080, img.height());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, new_stats.thumbnail_stats.hits());
     }
 
     {
         // Fetch the thumbnail again with a different size.
         // That causes it to be scaled from the full-size cache.
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_thumbnail(TEST_VIDEO, QSize(500, 500));
         QByteArray thumb = request->thumbnail();
         ASSERT_NE("", thumb);
         Image img(thumb);
         EXPECT_EQ(500, img.width());
         EXPECT_EQ(281, img.height());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.full_size_stats.hits() + 1, new_stats.full_size_stats.hits());
     }
 }
 
+TEST_F(ThumbnailerTest, coalesce)
+{
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(BIG_IMAGE, QSize(128, 128));
+    auto same_size = tn.get_thumbnail(BIG_IMAGE, QSize(128, 128));
+    auto large = tn.get_thumbnail(BIG_IMAGE, QSize(512, 512));
+    auto tall = tn.get_thumbnail(BIG_IMAGE, QSize(0, 256));
+    EXPECT_TRUE(request->coalesce(*same_size));
+    EXPECT_TRUE(request->coalesce(*large));
+    EXPECT_TRUE(request->coalesce(*tall));
+
+    // One decode produces all three sizes. Because the image is decoded at a size that
+    // covers all requests and then scaled, the rounding can differ by a pixel from
+    // what we'd get by decoding at each size separately.
+    auto old_stats = flushed_stats(tn);
+    Image img(request->thumbnail());
+    EXPECT_EQ(128, img.width());
+    EXPECT_NEAR(95, img.height(), 1);
+    auto new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_stats.size() + 3, new_stats.thumbnail_stats.size());
+
+    // Too late to attach now.
+    auto late = tn.get_thumbnail(BIG_IMAGE, QSize(64, 64));
+    EXPECT_FALSE(request->coalesce(*late));
+
+    // The attached requests find their thumbnails in memory.
+    old_stats = flushed_stats(tn);
+    img = Image(large->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, large->status());
+    EXPECT_EQ(512, img.width());
+    EXPECT_NEAR(383, img.height(), 1);
+    img = Image(tall->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, tall->status());
+    EXPECT_EQ(341, img.width());
+    EXPECT_EQ(256, img.height());
+    img = Image(same_size->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, same_size->status());
+    EXPECT_EQ(128, img.width());
+    EXPECT_NEAR(95, img.height(), 1);
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_memory_stats.hits + 2, new_stats.thumbnail_memory_stats.hits);
+    EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, new_stats.thumbnail_stats.hits());
+}
+
+TEST_F(ThumbnailerTest, uncoalesce)
+{
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(BIG_IMAGE, QSize(128, 128));
+    auto large = tn.get_thumbnail(BIG_IMAGE, QSize(512, 512));
+    auto large_too = tn.get_thumbnail(BIG_IMAGE, QSize(512, 512));
+    auto tall = tn.get_thumbnail(BIG_IMAGE, QSize(0, 256));
+    EXPECT_TRUE(request->coalesce(*large));
+    EXPECT_TRUE(request->coalesce(*large_too));
+    EXPECT_TRUE(request->coalesce(*tall));
+
+    // tall is withdrawn. large_too still wants the large size after large is withdrawn.
+    request->uncoalesce(*tall);
+    request->uncoalesce(*large);
+    auto old_stats = flushed_stats(tn);
+    Image img(request->thumbnail());
+    EXPECT_EQ(128, img.width());
+    auto new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_stats.size() + 2, new_stats.thumbnail_stats.size());
+
+    old_stats = flushed_stats(tn);
+    img = Image(large_too->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, large_too->status());
+    EXPECT_EQ(512, img.width());
+    img = Image(tall->thumbnail());
+    EXPECT_EQ(256, img.height());
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_memory_stats.hits + 1, new_stats.thumbnail_memory_stats.hits);
+
+    // Too late to withdraw once the request has decoded the image.
+    request->uncoalesce(*large_too);
+}
+
+TEST_F(ThumbnailerTest, coalesce_video)
+{
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(TEST_VIDEO, QSize(1920, 1920));
+    auto small = tn.get_thumbnail(TEST_VIDEO, QSize(500, 500));
+    ASSERT_EQ("", request->thumbnail());
+
+    // The extraction hasn't happened yet, so we can still attach.
+    EXPECT_TRUE(request->coalesce(*small));
+
+    QSignalSpy spy(request.get(), &ThumbnailRequest::downloadFinished);
+    request->download(chrono::milliseconds(15000));
+    ASSERT_TRUE(spy.wait(20000));
+    Image img(request->thumbnail());
+    EXPECT_EQ(1920, img.width());
+    EXPECT_EQ(1080, img.height());
+
+    img = Image(small->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, small->status());
+    EXPECT_EQ(500, img.width());
+    EXPECT_EQ(281, img.height());
+}
+
+TEST_F(ThumbnailerTest, duplicate_files)
+{
+    string const copy = tempdir_path() + "/copy.jpg";
+    string const link = tempdir_path() + "/link.jpg";
+    write_file(copy, read_file(TEST_IMAGE));
+    ASSERT_EQ(0, ::link(copy.c_str(), link.c_str()));
+
+    Thumbnailer tn;
+
+    auto old_stats = flushed_stats(tn);
+    auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_EQ(160, Image(request->thumbnail()).width());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    auto new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_stats.size() + 1, new_stats.thumbnail_stats.size());
+    EXPECT_EQ(0, new_stats.dedup_stats.duplicate_files);
+
+    // The copy and the link have the same contents, so they share the cache entry.
+    for (auto const& filename : { copy, link })
+    {
+        request = tn.get_thumbnail(filename, QSize(160, 160));
+        EXPECT_TRUE(boost::starts_with(request->key(), filename)) << request->key();
+        EXPECT_EQ(160, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    }
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(old_stats.thumbnail_stats.size() + 1, new_stats.thumbnail_stats.size());
+    EXPECT_EQ(2, new_stats.dedup_stats.duplicate_files);
+    EXPECT_EQ(2, new_stats.dedup_stats.duplicate_hits);
+    EXPECT_GT(new_stats.dedup_stats.bytes_saved, 0);
+
+    // The second time around, the thumbnail comes from memory and the alias cache tells
+    // us that the copy is a duplicate without looking at its contents again.
+    auto alias_misses = new_stats.alias_stats.misses();
+    request = tn.get_thumbnail(copy, QSize(160, 160));
+    request->thumbnail();
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request = tn.get_thumbnail(copy, QSize(100, 100));
+    EXPECT_EQ(100, Image(request->thumbnail()).width());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(alias_misses, new_stats.alias_stats.misses());
+    EXPECT_EQ(2, new_stats.dedup_stats.duplicate_files);
+    EXPECT_EQ(2, new_stats.dedup_stats.duplicate_hits);
+
+    // Once the copy is modified, it no longer shares anything with the original.
+    write_file(copy, read_file(RGB_IMAGE));
+    request = tn.get_thumbnail(copy, QSize(160, 160));
+    EXPECT_EQ(48, Image(request->thumbnail()).width());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+
+    tn.clear_stats(Thumbnailer::CacheSelector::all);
+    new_stats = flushed_stats(tn);
+    EXPECT_EQ(0, new_stats.dedup_stats.duplicate_files);
+    EXPECT_EQ(0, new_stats.dedup_stats.duplicate_hits);
+    EXPECT_EQ(0, new_stats.dedup_stats.bytes_saved);
+}
+
+TEST_F(ThumbnailerTest, size_ladder)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", 150);
+
+    {
+        Thumbnailer tn;
+
+        // With a max size of 1920, the ladder is 1920, 1280, 853, 569, 379, 253, 169, 112, 75, ...
+        // All three sizes are cached as 169x169.
+        auto old_stats = flushed_stats(tn);
+        auto request = tn.get_thumbnail(BIG_IMAGE, QSize(127, 127));
+        Image img(request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+        EXPECT_EQ(127, img.width());
+        auto new_stats = flushed_stats(tn);
+        EXPECT_EQ(old_stats.thumbnail_stats.size() + 1, new_stats.thumbnail_stats.size());
+
+        for (int size : { 128, 130, 169 })
+        {
+            request = tn.get_thumbnail(BIG_IMAGE, QSize(size, size));
+            img = Image(request->thumbnail());
+            EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status()) << size;
+            EXPECT_EQ(size, img.width());
+            EXPECT_NEAR(size * 3 / 4, img.height(), 1);
+        }
+        new_stats = flushed_stats(tn);
+        EXPECT_EQ(old_stats.thumbnail_stats.size() + 1, new_stats.thumbnail_stats.size());
+
+        // 64 goes on the 75 rung, which we don't have yet. We scale down the 169 thumbnail
+        // instead of decoding the image again.
+        request = tn.get_thumbnail(BIG_IMAGE, QSize(64, 64));
+        img = Image(request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_larger, request->status());
+        EXPECT_EQ(64, img.width());
+        EXPECT_EQ(48, img.height());
+        new_stats = flushed_stats(tn);
+        EXPECT_EQ(old_stats.thumbnail_stats.size() + 2, new_stats.thumbnail_stats.size());
+
+        request = tn.get_thumbnail(BIG_IMAGE, QSize(70, 70));
+        img = Image(request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(70, img.width());
+    }
+
+    g_settings_reset(gsettings.get(), "thumbnail-size-ladder");
+}
+
+TEST_F(ThumbnailerTest, size_ladder_scales_from_window)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", 150);
+    g_settings_set_int(gsettings.get(), "thumbnail-cache-size", 1);
+
+    {
+        Thumbnailer tn;
+
+        // Fill the thumbnail cache with thumbnails of different images, until
+        // new thumbnails go into the admission window instead.
+        string const big_image = read_file(BIG_IMAGE);
+        string filename;
+        for (int i = 0; flushed_stats(tn).thumbnail_admission_stats.rejected == 0; ++i)
+        {
+            ASSERT_LT(i, 1000);
+            filename = tempdir_path() + "/big" + to_string(i) + ".jpg";
+            write_file(filename, big_image + string(i + 1, ' '));  // Different contents for each file.
+            auto request = tn.get_thumbnail(filename, QSize(160, 160));
+            EXPECT_EQ(160, Image(request->thumbnail()).width());
+        }
+        auto stats = flushed_stats(tn);
+        EXPECT_EQ(1, stats.thumbnail_window_stats.size());
+
+        // 64 goes on the 75 rung. We find the last 169 thumbnail in the window and scale it down.
+        auto request = tn.get_thumbnail(filename, QSize(64, 64));
+        Image img(request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_larger, request->status());
+        EXPECT_EQ(64, img.width());
+        EXPECT_EQ(stats.thumbnail_admission_stats.window_hits + 1, flushed_stats(tn).thumbnail_admission_stats.window_hits);
+    }
+
+    g_settings_reset(gsettings.get(), "thumbnail-size-ladder");
+    g_settings_reset(gsettings.get(), "thumbnail-cache-size");
+}
+
+TEST_F(ThumbnailerTest, thumbnail_video_cover)
+{
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(TEST_VIDEO_WITH_COVER, QSize(400, 400));
+    ASSERT_NE(nullptr, request.get());
+    // The cover is read from the container, so no extraction is needed.
+    QByteArray thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    Image img(thumb);
+    EXPECT_NEAR(260, img.width(), 1);
+    EXPECT_EQ(400, img.height());
+}
+
+namespace
+{
+
+string mp4_box(char const* type, string const& payload)
+{
+    uint32_t const size = 8 + payload.size();
+    string box{ char(size >> 24), char(size >> 16), char(size >> 8), char(size) };
+    return box + type + payload;
+}
+
+// Returns the MP4 file mp4 with a cover of the given type added to its metadata.
+// The moov box of mp4 must come last, so the offsets into mdat stay the same.
+string add_mp4_cover(string const& mp4, int type, string const& cover)
+{
+    size_t pos = 0;
+    while (mp4.compare(pos + 4, 4, "moov") != 0)
+    {
+        pos += uint32_t(uint8_t(mp4[pos])) << 24 | uint8_t(mp4[pos + 1]) << 16 |
+               uint8_t(mp4[pos + 2]) << 8 | uint8_t(mp4[pos + 3]);
+    }
+    string const data = string(3, '\0') + char(type) + string(4, '\0') + cover;
+    string const meta = string(4, '\0') + mp4_box("hdlr", string(25, '\0')) +
+                        mp4_box("ilst", mp4_box("covr", mp4_box("data", data)));
+    string const moov = mp4.substr(pos + 8) + mp4_box("udta", mp4_box("meta", meta));
+    return mp4.substr(0, pos) + mp4_box("moov", moov);
+}
+
+}  // namespace
+
+TEST_F(ThumbnailerTest, thumbnail_video_bad_cover)
+{
+    // A cover that doesn't decode doesn't count as a failure. We get a frame from vs-thumb instead.
+    string const filename = tempdir_path() + "/bad-cover.mp4";
+    write_file(filename, add_mp4_cover(read_file(TEST_MP4_VIDEO), 13, "not a JPEG image"));
+
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(filename, QSize(256, 256));
+    ASSERT_NE(nullptr, request.get());
+    ASSERT_EQ("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::needs_download, request->status());
+
+    QSignalSpy spy(request.get(), &ThumbnailRequest::downloadFinished);
+    request->download(chrono::milliseconds(15000));
+    ASSERT_TRUE(spy.wait(20000));
+    QByteArray thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    EXPECT_EQ(256, Image(thumb).width());
+}
+
 TEST_F(ThumbnailerTest, thumbnail_song)
 {
     Thumbnailer tn;
@@ -420,7 +751,9 @@ TEST_F(ThumbnailerTest, exceptions)
     ASSERT_EQ(0, chmod(cache_dir.c_str(), 0000));
     try
     {
+        // The caches are opened in the background, so the error turns up on first use.
         Thumbnailer tn;
+        tn.stats();
         FAIL();
     }
     catch (runtime_error const& e)
@@ -458,10 +791,10 @@ TEST_F(ThumbnailerTest, vs_thumb_exec_failure)
     request->download();
     ASSERT_TRUE(spy.wait(15000));
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -472,7 +805,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_1)
 
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TEST_VIDEO, QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -482,7 +815,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_1)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -493,7 +826,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_2)
 
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TEST_VIDEO, QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -503,7 +836,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_2)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -514,7 +847,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_99)
 
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TEST_VIDEO, QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -524,7 +857,7 @@ TEST_F(ThumbnailerTest, vs_thumb_exit_99)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -535,7 +868,7 @@ TEST_F(ThumbnailerTest, vs_thumb_crash)
 
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TEST_VIDEO, QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -545,7 +878,7 @@ TEST_F(ThumbnailerTest, vs_thumb_crash)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -568,7 +901,7 @@ TEST_F(ThumbnailerTest, check_client_access)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TEST_IMAGE, QSize(10, 10));
     ASSERT_NE(nullptr, request.get());
     // Check succeeds for correct user ID and valid label
@@ -581,7 +914,7 @@ TEST_F(ThumbnailerTest, check_client_access)
     catch (std::exception const& e)
     {
         EXPECT_TRUE(boost::contains(e.what(), "Request comes from a different user ID")) << e.what();
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
     }
 }
@@ -606,11 +939,11 @@ TEST_F(ThumbnailerTest, bad_image)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(BAD_IMAGE, QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -618,7 +951,7 @@ TEST_F(ThumbnailerTest, empty_file)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_thumbnail(TESTSRCDIR "/thumbnailer/empty.mp3", QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -639,7 +972,7 @@ TEST_F(ThumbnailerTest, empty_file)
         EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
         thumbnail_failed = true;
     }
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 
     // Change in glib 2.22: previously, g_file_query_info(..., G_FILE_ATTRIBUTE_STANDARD_FAST_CONTENT_TYPE, ...)
@@ -652,9 +985,503 @@ TEST_F(ThumbnailerTest, empty_file)
     }
 }
 
+TEST_F(ThumbnailerTest, failure_filter)
+{
+    string const filter_file = tempdir_path() + "/unity-thumbnailer/failure-filter";
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        auto stats = flushed_stats(tn).failure_filter_stats;
+        EXPECT_EQ(1, stats.entries);
+        EXPECT_GT(stats.size_in_bytes, 0);
+        EXPECT_GT(stats.false_positive_rate, 0.0);
+        EXPECT_EQ(1, stats.lookups_skipped);
+
+        // A file that never failed doesn't get looked up in the failure cache.
+        auto old_stats = flushed_stats(tn);
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        auto new_stats = flushed_stats(tn);
+        EXPECT_EQ(old_stats.failure_filter_stats.lookups_skipped + 1, new_stats.failure_filter_stats.lookups_skipped);
+        EXPECT_EQ(old_stats.failure_stats.hits() + old_stats.failure_stats.misses(),
+                  new_stats.failure_stats.hits() + new_stats.failure_stats.misses());
+
+        tn.clear_stats(Thumbnailer::CacheSelector::failure_cache);
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(filter_file));
+
+    // The filter is restored after a restart, so the failure is still remembered.
+    {
+        Thumbnailer tn;
+        EXPECT_FALSE(boost::filesystem::exists(filter_file));
+        EXPECT_EQ(1, flushed_stats(tn).failure_filter_stats.entries);
+
+        auto old_stats = flushed_stats(tn);
+        auto request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
+        EXPECT_EQ(old_stats.failure_stats.hits() + 1, flushed_stats(tn).failure_stats.hits());
+    }
+
+    // Without the filter, every lookup goes to the failure cache until the filter has been rebuilt.
+    boost::filesystem::remove(filter_file);
+    {
+        Thumbnailer tn;
+        auto stats = flushed_stats(tn);
+        EXPECT_EQ(0, stats.failure_filter_stats.entries);
+        EXPECT_EQ(3, stats.failure_stats.size());
+
+        auto request = tn.get_thumbnail(RGB_IMAGE, QSize(32, 32));
+        EXPECT_NE("", request->thumbnail());
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+        EXPECT_EQ(stats.failure_stats.misses() + 1, flushed_stats(tn).failure_stats.misses());
+
+        // The failure is still remembered, and finding it completes the filter.
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
+        EXPECT_EQ(1, flushed_stats(tn).failure_filter_stats.entries);
+
+        request = tn.get_thumbnail(SMALL_GIF, QSize(16, 16));
+        EXPECT_NE("", request->thumbnail());
+        EXPECT_EQ(1, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(filter_file));
+
+    // A filter that is still being rebuilt is saved as such, so the next start
+    // carries on with the rebuild, and the failure is still reported.
+    boost::filesystem::remove(filter_file);
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.entries);
+
+        auto request = tn.get_thumbnail(LARGE_GIF, QSize(8, 8));
+        EXPECT_NE("", request->thumbnail());
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+
+        tn.flush();
+        EXPECT_TRUE(boost::filesystem::exists(filter_file));
+    }
+    {
+        Thumbnailer tn;
+        EXPECT_FALSE(boost::filesystem::exists(filter_file));
+
+        auto request = tn.get_thumbnail(BIG_IMAGE, QSize(8, 8));
+        EXPECT_NE("", request->thumbnail());
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
+
+        tn.clear(Thumbnailer::CacheSelector::failure_cache);
+        EXPECT_EQ(0, flushed_stats(tn).failure_filter_stats.entries);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(filter_file));
+}
+
+TEST_F(ThumbnailerTest, failure_filter_with_other_entries)
+{
+    string const cache_dir = tempdir_path() + "/unity-thumbnailer";
+    {
+        Thumbnailer tn;
+    }
+
+    // An entry with a key that we never look up via the filter, such as one that
+    // version 2 wrote, doesn't hold up the rebuild.
+    {
+        auto failures = PersistentCacheHelper::open(cache_dir + "/failures");
+        failures->put(string("artist") + '\0' + "album", "");
+    }
+    write_file(cache_dir + "/thumbnailer-cache-version", string("2"));
+    boost::filesystem::remove(cache_dir + "/failure-filter");
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(3, flushed_stats(tn).failure_stats.size());
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(1, flushed_stats(tn).failure_filter_stats.lookups_skipped);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(cache_dir + "/failure-filter"));
+}
+
+TEST_F(ThumbnailerTest, warm_restart)
+{
+    string const warm_set_file = tempdir_path() + "/unity-thumbnailer/warm-set";
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(0, tn.wait_for_prefetch());
+
+        // The second request puts the thumbnail into the memory cache, the third finds it there.
+        for (int i = 0; i < 3; ++i)
+        {
+            auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+            EXPECT_EQ(64, Image(request->thumbnail()).width());
+        }
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_memory_stats.hits);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(warm_set_file));
+
+    // After the restart, the first request is answered from memory.
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(1, tn.wait_for_prefetch());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_memory_stats.size);
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_memory_stats.hits);
+    }
+
+    // Clearing the caches also forgets the popular thumbnails.
+    {
+        Thumbnailer tn;
+        tn.clear(Thumbnailer::CacheSelector::all);
+    }
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(0, tn.wait_for_prefetch());
+    }
+
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_int(gsettings.get(), "warm-restart-entries", 0);
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(0, tn.wait_for_prefetch());
+    }
+    EXPECT_FALSE(boost::filesystem::exists(warm_set_file));
+    g_settings_reset(gsettings.get(), "warm-restart-entries");
+}
+
+TEST_F(ThumbnailerTest, adaptive_size)
+{
+    string const mrc_file = tempdir_path() + "/unity-thumbnailer/thumbnail-mrc";
+    {
+        Thumbnailer tn;
+
+        // Too few requests to go by, so nothing changes.
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        auto points = tn.miss_ratio_curve(Thumbnailer::CacheSelector::thumbnail_cache, 4);
+        ASSERT_EQ(4u, points.size());
+        EXPECT_EQ(200 * 1024 * 1024, points.back().size_in_bytes);
+        EXPECT_DOUBLE_EQ(0.5, points.back().miss_ratio);
+
+        // The third request is answered from memory, but still counts.
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_memory_stats.hits);
+        points = tn.miss_ratio_curve(Thumbnailer::CacheSelector::thumbnail_cache, 4);
+        EXPECT_DOUBLE_EQ(1.0 / 3, points.back().miss_ratio);
+        EXPECT_THROW(tn.miss_ratio_curve(Thumbnailer::CacheSelector::failure_cache, 4), invalid_argument);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(mrc_file));
+
+    // 2000 thumbnails of 10 kB, each requested five times, need a 20 MB cache.
+    MissRatioEstimator mrc;
+    for (int round = 0; round < 5; ++round)
+    {
+        for (int i = 0; i < 2000; ++i)
+        {
+            mrc.record("key" + to_string(i), 10000);
+        }
+    }
+    write_file(mrc_file, mrc.serialize());
+
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_int(gsettings.get(), "target-hit-rate", 70);
+    {
+        Thumbnailer tn;
+        auto size = flushed_stats(tn).thumbnail_stats.max_size_in_bytes();
+        EXPECT_GE(size, 20 * 1000 * 1000);
+        EXPECT_LE(size, 22 * 1024 * 1024);
+        EXPECT_EQ(50 * 1024 * 1024, flushed_stats(tn).full_size_stats.max_size_in_bytes());
+    }
+
+    // The size stays within the bounds.
+    write_file(mrc_file, mrc.serialize());
+    g_settings_set_int(gsettings.get(), "thumbnail-cache-max-size", 5);
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(5 * 1024 * 1024, flushed_stats(tn).thumbnail_stats.max_size_in_bytes());
+    }
+
+    g_settings_reset(gsettings.get(), "target-hit-rate");
+    g_settings_reset(gsettings.get(), "thumbnail-cache-max-size");
+    {
+        Thumbnailer tn;
+        EXPECT_EQ(100 * 1024 * 1024, flushed_stats(tn).thumbnail_stats.max_size_in_bytes());
+    }
+}
+
+TEST_F(ThumbnailerTest, admission)
+{
+    Thumbnailer tn;
+
+    auto stats = flushed_stats(tn);
+    EXPECT_EQ(stats.thumbnail_stats.max_size_in_bytes() * PersistentAdmissionFilter::WINDOW_PERCENT / 100,
+              stats.thumbnail_window_stats.max_size_in_bytes());
+    EXPECT_EQ(stats.full_size_stats.max_size_in_bytes() * PersistentAdmissionFilter::WINDOW_PERCENT / 100,
+              stats.full_size_window_stats.max_size_in_bytes());
+    EXPECT_GT(stats.thumbnail_admission_stats.sketch_size_in_bytes, 0);
+    EXPECT_GT(stats.full_size_admission_stats.sketch_size_in_bytes, 0);
+
+    // While the main cache has room, everything is admitted.
+    auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+    EXPECT_EQ(64, Image(request->thumbnail()).width());
+    stats = flushed_stats(tn);
+    EXPECT_EQ(1, stats.thumbnail_admission_stats.admitted);
+    EXPECT_EQ(0, stats.thumbnail_admission_stats.rejected);
+    EXPECT_EQ(0, stats.thumbnail_window_stats.size());
+    EXPECT_EQ(1, stats.thumbnail_stats.size());
+
+    tn.clear_stats(Thumbnailer::CacheSelector::thumbnail_cache);
+    EXPECT_EQ(0, flushed_stats(tn).thumbnail_admission_stats.admitted);
+}
+
+TEST_F(ThumbnailerTest, write_behind)
+{
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+
+        // Whether or not the thumbnail has been written yet, we find it.
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+
+        tn.flush();
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_stats.size());
+
+        // Queued writes happen before the destructor returns.
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(32, 32));
+        EXPECT_EQ(32, Image(request->thumbnail()).width());
+    }
+
+    Thumbnailer tn;
+    EXPECT_EQ(2, flushed_stats(tn).thumbnail_stats.size());
+    auto request = tn.get_thumbnail(TEST_IMAGE, QSize(32, 32));
+    EXPECT_EQ(32, Image(request->thumbnail()).width());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+}
+
+TEST_F(ThumbnailerTest, collect_garbage)
+{
+    string const file = tempdir_path() + "/file.jpg";
+    string const copy = tempdir_path() + "/copy.jpg";
+    write_file(file, read_file(TEST_IMAGE));
+    write_file(copy, read_file(TEST_IMAGE));
+
+    Thumbnailer tn;
+    auto num_thumbnails = [&tn]
+    {
+        auto stats = flushed_stats(tn);
+        return stats.thumbnail_stats.size() + stats.thumbnail_window_stats.size();
+    };
+
+    for (auto const& filename : { file, copy })
+    {
+        for (int size : { 160, 64 })
+        {
+            auto request = tn.get_thumbnail(filename, QSize(size, size));
+            EXPECT_EQ(size, Image(request->thumbnail()).width());
+        }
+    }
+    tn.flush();
+    EXPECT_EQ(2, num_thumbnails());
+
+    // Nothing has changed, so there is nothing to collect.
+    while (tn.collect_garbage(10))
+    {
+    }
+    auto stats = flushed_stats(tn);
+    EXPECT_EQ(2, stats.gc_stats.files_checked);
+    EXPECT_EQ(0, stats.gc_stats.stale_files);
+    EXPECT_EQ(0, stats.gc_stats.entries_removed);
+    EXPECT_FALSE(tn.compact_garbage());
+    EXPECT_EQ(0, flushed_stats(tn).gc_stats.compactions);
+
+    // The copy still needs the thumbnails after the original is gone.
+    ASSERT_EQ(0, ::unlink(file.c_str()));
+    while (tn.collect_garbage(10))
+    {
+    }
+    stats = flushed_stats(tn);
+    EXPECT_EQ(4, stats.gc_stats.files_checked);
+    EXPECT_EQ(1, stats.gc_stats.stale_files);
+    EXPECT_EQ(1, stats.gc_stats.entries_removed);  // The alias for the original.
+    EXPECT_EQ(0, stats.gc_stats.compactions);      // Only when asked for.
+    EXPECT_EQ(2, num_thumbnails());
+    EXPECT_FALSE(tn.compact_garbage());
+    EXPECT_EQ(1, flushed_stats(tn).gc_stats.compactions);
+
+    // The copy was served from the disk cache, so its thumbnails are in memory.
+    EXPECT_GT(flushed_stats(tn).thumbnail_memory_stats.size, 0);
+
+    // Once the copy is modified, nothing refers to the thumbnails anymore.
+    write_file(copy, read_file(RGB_IMAGE));
+    while (tn.collect_garbage(10))
+    {
+    }
+    while (tn.compact_garbage())
+    {
+    }
+    stats = flushed_stats(tn);
+    EXPECT_EQ(5, stats.gc_stats.files_checked);
+    EXPECT_EQ(2, stats.gc_stats.stale_files);
+    EXPECT_GE(stats.gc_stats.entries_removed, 5);
+    EXPECT_GT(stats.gc_stats.bytes_reclaimed, 0);
+    EXPECT_GT(stats.gc_stats.compactions, 1);
+    EXPECT_EQ(0, num_thumbnails());
+    EXPECT_EQ(0, stats.thumbnail_memory_stats.size);
+
+    auto request = tn.get_thumbnail(copy, QSize(160, 160));
+    EXPECT_EQ(48, Image(request->thumbnail()).width());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+
+    // If the directory is gone as well, the file may be on removable media that isn't mounted.
+    string const dir = tempdir_path() + "/media";
+    string const media_file = dir + "/file.jpg";
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+    write_file(media_file, read_file(TEST_IMAGE));
+    request = tn.get_thumbnail(media_file, QSize(160, 160));
+    EXPECT_EQ(160, Image(request->thumbnail()).width());
+    tn.flush();
+    boost::filesystem::remove_all(dir);
+    while (tn.collect_garbage(10))
+    {
+    }
+    EXPECT_EQ(2, flushed_stats(tn).gc_stats.stale_files);
+    EXPECT_EQ(2, num_thumbnails());
+
+    tn.clear_stats(Thumbnailer::CacheSelector::all);
+    stats = flushed_stats(tn);
+    EXPECT_EQ(0, stats.gc_stats.files_checked);
+    EXPECT_EQ(0, stats.gc_stats.stale_files);
+    EXPECT_EQ(0, stats.gc_stats.entries_removed);
+    EXPECT_EQ(0, stats.gc_stats.bytes_reclaimed);
+    EXPECT_EQ(0, stats.gc_stats.compactions);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"  // For calls to system().
 
+TEST_F(ThumbnailerTest, migrate_version_2_keys)
+{
+    string const cache_dir = tempdir_path() + "/unity-thumbnailer";
+    {
+        Thumbnailer tn;
+    }
+
+    // Put a thumbnail and a full-size image into the caches with the keys that version 2 used.
+    // The values are different from what we'd produce ourselves, so we can tell where they came from.
+    string const filename = boost::filesystem::canonical(TEST_IMAGE).native();
+    struct stat st;
+    ASSERT_EQ(0, stat(filename.c_str(), &st));
+    string key = filename + '\0' + to_string(st.st_ino)
+                 + '\0' + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec)
+                 + '\0' + to_string(st.st_ctim.tv_sec) + "." + to_string(st.st_ctim.tv_nsec);
+    {
+        auto thumbnails = PersistentCacheHelper::open(cache_dir + "/thumbnails");
+        thumbnails->put(key + '\0' + "160" + '\0' + "160", read_file(RGB_IMAGE));
+        auto images = PersistentCacheHelper::open(cache_dir + "/images");
+        images->put(string("artist") + '\0' + "album" + '\0' + "album", read_file(SMALL_GIF));
+        auto failures = PersistentCacheHelper::open(cache_dir + "/failures");
+        failures->put(key, "");
+    }
+    string cache_version_file = cache_dir + "/thumbnailer-cache-version";
+    write_file(cache_version_file, string("2"));
+
+    {
+        Thumbnailer tn;
+
+        // The old failure entry is gone. Only the backoff state and the migration deadline are left.
+        EXPECT_EQ(3, flushed_stats(tn).failure_stats.size());
+
+        // The entries survived the upgrade and are moved to the new keys.
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        EXPECT_EQ(48, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_stats.size());
+
+        request = tn.get_album_art("artist", "album", QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_fullsize, request->status());
+        EXPECT_EQ(1, flushed_stats(tn).full_size_stats.size());
+    }
+
+    // Still there after a restart, without the old entries.
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        EXPECT_EQ(48, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(2, flushed_stats(tn).thumbnail_stats.size());
+        EXPECT_EQ(1, flushed_stats(tn).full_size_stats.size());
+    }
+}
+
+TEST_F(ThumbnailerTest, migrate_version_2_keys_with_size_ladder)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_int(gsettings.get(), "thumbnail-size-ladder", 150);
+
+    string const cache_dir = tempdir_path() + "/unity-thumbnailer";
+    {
+        Thumbnailer tn;
+    }
+
+    // Version 2 stored the thumbnail at the requested size, 160, which is not on the ladder.
+    string const filename = boost::filesystem::canonical(TEST_IMAGE).native();
+    struct stat st;
+    ASSERT_EQ(0, stat(filename.c_str(), &st));
+    string key = filename + '\0' + to_string(st.st_ino)
+                 + '\0' + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec)
+                 + '\0' + to_string(st.st_ctim.tv_sec) + "." + to_string(st.st_ctim.tv_nsec);
+    {
+        auto thumbnails = PersistentCacheHelper::open(cache_dir + "/thumbnails");
+        thumbnails->put(key + '\0' + "160" + '\0' + "160", read_file(RGB_IMAGE));
+    }
+    write_file(cache_dir + "/thumbnailer-cache-version", string("2"));
+
+    {
+        Thumbnailer tn;
+
+        // We use the old entry as it is.
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        EXPECT_EQ(48, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_stats.size());
+
+        // Another size on the same rung needs a thumbnail at the ladder size.
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(150, 150));
+        EXPECT_EQ(150, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+        EXPECT_EQ(2, flushed_stats(tn).thumbnail_stats.size());
+    }
+
+    // Once we have that, it takes precedence over the old entry.
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        EXPECT_EQ(160, Image(request->thumbnail()).width());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    }
+
+    g_settings_reset(gsettings.get(), "thumbnail-size-ladder");
+}
+
 TEST_F(ThumbnailerTest, clear_if_old_cache_version)
 {
     {
@@ -664,7 +1491,7 @@ TEST_F(ThumbnailerTest, clear_if_old_cache_version)
         auto request = tn.get_thumbnail(TEST_SONG, QSize(200, 200));
         ASSERT_NE(nullptr, request.get());
         request->thumbnail();
-        auto stats = tn.stats().thumbnail_stats;
+        auto stats = flushed_stats(tn).thumbnail_stats;
         EXPECT_EQ(1, stats.size());
     }
 
@@ -672,7 +1499,7 @@ TEST_F(ThumbnailerTest, clear_if_old_cache_version)
     {
         Thumbnailer tn;
 
-        auto stats = tn.stats().thumbnail_stats;
+        auto stats = flushed_stats(tn).thumbnail_stats;
         EXPECT_EQ(1, stats.size());
     }
 
@@ -684,7 +1511,7 @@ TEST_F(ThumbnailerTest, clear_if_old_cache_version)
     {
         Thumbnailer tn;
 
-        auto stats = tn.stats().thumbnail_stats;
+        auto stats = flushed_stats(tn).thumbnail_stats;
         EXPECT_EQ(0, stats.size());
     }
 }
@@ -768,7 +1595,7 @@ TEST_F(RemoteServer, no_such_album)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_album_art("no_such_artist", "no_such_album", QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -777,7 +1604,7 @@ TEST_F(RemoteServer, no_such_album)
     ASSERT_TRUE(spy.wait(15000));
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::not_found, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -785,7 +1612,7 @@ TEST_F(RemoteServer, decode_fails)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_album_art("empty", "empty", QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
     request->download();
@@ -795,7 +1622,7 @@ TEST_F(RemoteServer, decode_fails)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
 }
 
@@ -803,7 +1630,7 @@ TEST_F(RemoteServer, no_such_local_image)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     try
     {
         auto request = tn.get_thumbnail("/no_such_file", QSize(10, 10));
@@ -815,7 +1642,7 @@ TEST_F(RemoteServer, no_such_local_image)
         EXPECT_TRUE(boost::starts_with(msg,
                                        "unity::ResourceException: Thumbnailer::get_thumbnail():\n"
                                        "    boost::filesystem::canonical: No such file or directory: ")) << msg;
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
     }
 }
@@ -824,7 +1651,7 @@ TEST_F(RemoteServer, relative_path)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     try
     {
         auto request = tn.get_thumbnail("xxx", QSize(10, 10));
@@ -836,7 +1663,7 @@ TEST_F(RemoteServer, relative_path)
         EXPECT_TRUE(boost::starts_with(msg,
                                        "unity::ResourceException: Thumbnailer::get_thumbnail():\n"
                                        "    LocalThumbnailRequest(): xxx: file name must be an absolute path")) << msg;
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
     }
 }
@@ -848,7 +1675,7 @@ TEST_F(RemoteServer, bad_request)
     // We do this twice because 400 is not a retryable error. This
     // verifies that a 400 response does add an entry to the failure cache.
     {
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_artist_art("error", "400", QSize(10, 10));
         EXPECT_EQ("", request->thumbnail());
 
@@ -857,17 +1684,17 @@ TEST_F(RemoteServer, bad_request)
         ASSERT_TRUE(spy.wait(15000));
         EXPECT_EQ("", request->thumbnail());
         EXPECT_EQ(ThumbnailRequest::FetchStatus::hard_error, request->status());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size() + 1, new_stats.failure_stats.size());
     }
 
     {
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_artist_art("error", "400", QSize(10, 10));
         EXPECT_EQ("", request->thumbnail());
 
         EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.hits() + 1, new_stats.failure_stats.hits());
     }
 }
@@ -878,7 +1705,7 @@ TEST_F(RemoteServer, temporary_error)
 
     // 402 (Payment Required) is a retryable error. This
     // verifies that a 402 response does not add an entry to the failure cache.
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_artist_art("error", "402", QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
 
@@ -887,7 +1714,7 @@ TEST_F(RemoteServer, temporary_error)
     ASSERT_TRUE(spy.wait(15000));
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::temporary_error, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
 }
 
@@ -927,7 +1754,7 @@ TEST_F(RemoteServer, timeout)
 {
     Thumbnailer tn;
 
-    auto old_stats = tn.stats();
+    auto old_stats = flushed_stats(tn);
     auto request = tn.get_album_art("sleep", "3", QSize(10, 10));
     EXPECT_EQ("", request->thumbnail());
     request->download(chrono::seconds(1));
@@ -937,7 +1764,7 @@ TEST_F(RemoteServer, timeout)
 
     EXPECT_EQ("", request->thumbnail());
     EXPECT_EQ(ThumbnailRequest::FetchStatus::timeout, request->status());
-    auto new_stats = tn.stats();
+    auto new_stats = flushed_stats(tn);
     EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
 }
 
@@ -948,7 +1775,7 @@ TEST_F(RemoteServer, server_error)
     // We do this twice, so we get coverage on the transient network error handling.
     for (int i = 0; i < 2; ++i)
     {
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_album_art("error", "429", QSize(10, 10));
         EXPECT_EQ("", request->thumbnail());
 
@@ -957,7 +1784,7 @@ TEST_F(RemoteServer, server_error)
         ASSERT_TRUE(spy.wait(15000));
 
         EXPECT_EQ("", request->thumbnail());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
     }
 }
@@ -968,7 +1795,7 @@ TEST_F(RemoteServer, network_error)
 
     art_server_->block_access();
     {
-        auto old_stats = tn.stats();
+        auto old_stats = flushed_stats(tn);
         auto request = tn.get_album_art("metallica", "load", QSize(10, 10));
         EXPECT_EQ("", request->thumbnail());
 
@@ -979,7 +1806,7 @@ TEST_F(RemoteServer, network_error)
         // Still fails
         EXPECT_EQ("", request->thumbnail());
         EXPECT_EQ(ThumbnailRequest::FetchStatus::temporary_error, request->status());
-        auto new_stats = tn.stats();
+        auto new_stats = flushed_stats(tn);
         EXPECT_EQ(old_stats.failure_stats.size(), new_stats.failure_stats.size());
     }
 
@@ -1027,6 +1854,46 @@ TEST_F(RemoteServer, dead_server)
     EXPECT_EQ(ThumbnailRequest::FetchStatus::network_down, request->status());
 }
 
+TEST_F(ThumbnailerTest, segment_backend)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+    g_settings_set_string(gsettings.get(), "thumbnail-cache-backend", "segments");
+    g_settings_set_string(gsettings.get(), "failure-cache-backend", "segments");
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        auto old_stats = flushed_stats(tn);
+        EXPECT_EQ(1, old_stats.failure_stats.size());
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        auto new_stats = flushed_stats(tn);
+        EXPECT_EQ(old_stats.failure_stats.hits() + 1, new_stats.failure_stats.hits());
+        EXPECT_TRUE(new_stats.failure_stats.policy() == core::CacheDiscardPolicy::lru_ttl);
+
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(1, flushed_stats(tn).thumbnail_stats.size());
+    }
+    {
+        // The thumbnail is still there after a restart.
+        Thumbnailer tn;
+        auto old_stats = flushed_stats(tn);
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(64, 64));
+        EXPECT_EQ(64, Image(request->thumbnail()).width());
+        EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, flushed_stats(tn).thumbnail_stats.hits());
+    }
+    g_settings_reset(gsettings.get(), "thumbnail-cache-backend");
+    g_settings_reset(gsettings.get(), "failure-cache-backend");
+    {
+        // Back on leveldb, the caches start out empty.
+        Thumbnailer tn;
+        EXPECT_EQ(0, flushed_stats(tn).thumbnail_stats.size());
+        EXPECT_EQ(0, flushed_stats(tn).failure_stats.size());
+    }
+}
+
 int main(int argc, char** argv)
 {
     QCoreApplication app(argc, argv);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/downscale.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Helpers for the downscale tests and benchmarks.
+
+// Returns an image of the given size filled with noise. The noise is the same for every call.
+
+inline std::vector<uint8_t> random_image(int width, int height, int channels)
+{
+    std::mt19937 rng(42);
+    std::vector<uint8_t> image(size_t(width) * height * channels);
+    for (auto& v : image)
+    {
+        v = uint8_t(rng());
+    }
+    return image;
+}
+
+// Scales a tightly packed image and returns the tightly packed result.
+
+inline std::vector<uint8_t> scale(std::vector<uint8_t> const& src, int src_width, int src_height,
+                                  int dst_width, int dst_height, int channels,
+                                  unity::thumbnailer::internal::ScaleFilter filter =
+                                      unity::thumbnailer::internal::ScaleFilter::box,
+                                  unity::thumbnailer::internal::ScaleKernel kernel =
+                                      unity::thumbnailer::internal::ScaleKernel::automatic)
+{
+    std::vector<uint8_t> dst(size_t(dst_width) * dst_height * channels);
+    unity::thumbnailer::internal::downscale(src.data(), src_width, src_height, src_width * channels,
+                                            dst.data(), dst_width, dst_height, dst_width * channels,
+                                            channels, filter, kernel);
+    return dst;
+}
+
+std::vector<unity::thumbnailer::internal::ScaleKernel> const all_kernels =
+{
+    unity::thumbnailer::internal::ScaleKernel::scalar,
+    unity::thumbnailer::internal::ScaleKernel::sse2,
+    unity::thumbnailer::internal::ScaleKernel::avx2,
+    unity::thumbnailer::internal::ScaleKernel::neon
+};
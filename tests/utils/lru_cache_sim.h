@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <core/optional.h>
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// In-memory LRU cache with the subset of the PersistentCacheHelper interface
+// that AdmissionFilter uses, so we can replay request traces quickly.
+
+class LruCacheSim final
+{
+public:
+    struct Stats
+    {
+        int64_t size_in_bytes_;
+        int64_t max_size_in_bytes_;
+
+        int64_t size_in_bytes() const
+        {
+            return size_in_bytes_;
+        }
+        int64_t max_size_in_bytes() const
+        {
+            return max_size_in_bytes_;
+        }
+    };
+
+    explicit LruCacheSim(int64_t max_size_in_bytes)
+        : max_size_in_bytes_(max_size_in_bytes)
+        , size_in_bytes_(0)
+    {
+    }
+
+    LruCacheSim(LruCacheSim const&) = delete;
+    LruCacheSim& operator=(LruCacheSim const&) = delete;
+
+    core::Optional<std::string> get(std::string const& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+        {
+            return core::Optional<std::string>();
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    core::Optional<std::string> take(std::string const& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+        {
+            return core::Optional<std::string>();
+        }
+        std::string value = it->second->second;
+        erase(it->second);
+        return value;
+    }
+
+    bool put(std::string const& key,
+             std::string const& value,
+             std::chrono::system_clock::time_point = std::chrono::system_clock::time_point())
+    {
+        int64_t charge = int64_t(key.size() + value.size());
+        if (charge > max_size_in_bytes_)
+        {
+            return false;
+        }
+        auto it = index_.find(key);
+        if (it != index_.end())
+        {
+            erase(it->second);
+        }
+        while (size_in_bytes_ + charge > max_size_in_bytes_)
+        {
+            erase(std::prev(lru_.end()));
+        }
+        lru_.emplace_front(key, value);
+        index_[key] = lru_.begin();
+        size_in_bytes_ += charge;
+        return true;
+    }
+
+    bool contains_key(std::string const& key) const
+    {
+        return index_.find(key) != index_.end();
+    }
+
+    Stats stats() const
+    {
+        return Stats{size_in_bytes_, max_size_in_bytes_};
+    }
+
+private:
+    typedef std::list<std::pair<std::string, std::string>> LRUList;
+
+    void erase(LRUList::iterator it)
+    {
+        size_in_bytes_ -= int64_t(it->first.size() + it->second.size());
+        index_.erase(it->first);
+        lru_.erase(it);
+    }
+
+    int64_t const max_size_in_bytes_;
+    int64_t size_in_bytes_;
+    LRUList lru_;
+    std::unordered_map<std::string, LRUList::iterator> index_;
+};
@@ -164,6 +164,25 @@ TEST_F(ExtractorTest, extract_mp4_rotate_90)
     EXPECT_EQ(1280, gdk_pixbuf_get_height(image.get()));
 }
 
+TEST_F(ExtractorTest, extract_mp4_scaled)
+{
+    if (!supports_decoder("video/x-h264"))
+    {
+        fprintf(stderr, "No support for H.264 decoder\n");
+        return;
+    }
+
+    ThumbnailExtractor extractor;
+    std::string outfile = tempdir + "/out.tiff";
+    extractor.set_urls(QUrl::fromLocalFile(MP4_ROTATE_90_TEST_FILE), QUrl::fromLocalFile(outfile.c_str()));
+    ASSERT_TRUE(extractor.extract_video_frame(640));
+    extractor.write_image();
+
+    auto image = load_image(outfile);
+    EXPECT_EQ(360, gdk_pixbuf_get_width(image.get()));
+    EXPECT_EQ(640, gdk_pixbuf_get_height(image.get()));
+}
+
 TEST_F(ExtractorTest, extract_mp4_rotate_180)
 {
     if (!supports_decoder("video/x-h264"))
@@ -241,6 +260,7 @@ TEST_F(ExtractorTest, can_write_to_fd)
     ASSERT_TRUE(extractor.extract_cover_art());
 
     extractor.write_image();
+    EXPECT_EQ(0, close(fd));  // The descriptor still belongs to us.
 
     auto image = load_image(outfile);
     EXPECT_EQ(1947, gdk_pixbuf_get_width(image.get()));
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/thumbnailer.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+#include <QCoreApplication>
+#include <QTemporaryDir>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+// Measures the time from the start of the thumbnailer until the first screenful
+// of thumbnails has been answered, with and without the popular thumbnails from
+// the previous run being loaded in the background. Before each start, we drop the
+// cache files from the page cache, as happens on a phone when the service has not
+// run for a while.
+
+#define TEST_IMAGE TESTDATADIR "/orientation-1.jpg"
+
+namespace
+{
+
+int const NUM_FILES = 200;  // Thumbnails in the cache.
+int const GRID_SIZE = 24;   // Thumbnails on the first screen, requested after every start.
+int const ROUNDS = 5;
+
+// The thumbnailer uses g_get_user_cache_dir() to get the cache dir, and
+// glib remembers that value, so we have to set XDG_CACHE_HOME before anything else.
+
+auto set_tempdir = []()
+{
+    auto dir = new QTemporaryDir(TESTBINDIR "/test-dir.XXXXXX");
+    setenv("XDG_CACHE_HOME", dir->path().toUtf8().data(), true);
+    return dir;
+};
+unique_ptr<QTemporaryDir> tempdir(set_tempdir());
+
+string cache_dir()
+{
+    return tempdir->path().toStdString() + "/unity-thumbnailer";
+}
+
+void drop_page_cache(string const& dir)
+{
+    for (boost::filesystem::recursive_directory_iterator it(dir), end; it != end; ++it)
+    {
+        if (boost::filesystem::is_regular_file(it->path()))
+        {
+            int fd = open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+            ASSERT_NE(-1, fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+double time_to_first_grid(vector<string> const& files)
+{
+    drop_page_cache(cache_dir());
+    auto const start = chrono::steady_clock::now();
+    Thumbnailer tn;
+    for (int i = 0; i < GRID_SIZE; ++i)
+    {
+        auto request = tn.get_thumbnail(files[i], QSize(128, 128));
+        EXPECT_FALSE(request->thumbnail().isEmpty());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+double median(vector<double> v)
+{
+    sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+}  // namespace
+
+TEST(warm_restart_benchmark, time_to_first_grid)
+{
+    // Each file has different contents, so each has its own thumbnail.
+    string const image = read_file(TEST_IMAGE);
+    string const image_dir = tempdir->path().toStdString() + "/images";
+    boost::filesystem::create_directories(image_dir);
+    vector<string> files;
+    for (int i = 0; i < NUM_FILES; ++i)
+    {
+        files.push_back(image_dir + "/image" + to_string(i) + ".jpg");
+        write_file(files.back(), image + to_string(i));  // Decoders ignore data after the image.
+    }
+
+    // The grid is requested over and over, the other thumbnails once.
+    {
+        Thumbnailer tn;
+        for (int i = 0; i < NUM_FILES; ++i)
+        {
+            int const requests = i < GRID_SIZE ? 3 : 1;
+            for (int j = 0; j < requests; ++j)
+            {
+                EXPECT_FALSE(tn.get_thumbnail(files[i], QSize(128, 128))->thumbnail().isEmpty());
+            }
+        }
+    }
+
+    vector<double> cold;
+    vector<double> warm;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        // Every run saves the grid again when it exits.
+        warm.push_back(time_to_first_grid(files));
+        ASSERT_EQ(0, ::unlink((cache_dir() + "/warm-set").c_str()));
+        cold.push_back(time_to_first_grid(files));
+    }
+    printf("time to first %d thumbnails, median of %d starts: without prefetch %.2f ms, with prefetch %.2f ms\n",
+           GRID_SIZE, ROUNDS, median(cold), median(warm));
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    setenv("GSETTINGS_BACKEND", "memory", true);
+    setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/write_behind_queue.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+// Stands in for the cache. While the store is blocked, the writer thread
+// waits in write(), so we can fill the queue behind its back.
+
+class Store
+{
+public:
+    Store()
+        : blocked_(false)
+        , writes_in_progress_(0)
+    {
+    }
+
+    WriteBehindQueue::WriteFunc write_func()
+    {
+        return [this](string const& key, string const& value)
+        {
+            unique_lock<mutex> lock(mutex_);
+            ++writes_in_progress_;
+            cond_.notify_all();
+            cond_.wait(lock, [this]{ return !blocked_; });
+            --writes_in_progress_;
+            if (key == "bad")
+            {
+                throw runtime_error("bad key");
+            }
+            values_[key] = value;
+            keys_.push_back(key);
+        };
+    }
+
+    void block()
+    {
+        lock_guard<mutex> lock(mutex_);
+        blocked_ = true;
+    }
+
+    void unblock()
+    {
+        lock_guard<mutex> lock(mutex_);
+        blocked_ = false;
+        cond_.notify_all();
+    }
+
+    // Waits until the writer is stuck in write().
+    void wait_for_writer()
+    {
+        unique_lock<mutex> lock(mutex_);
+        cond_.wait(lock, [this]{ return writes_in_progress_ > 0; });
+    }
+
+    map<string, string> values()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return values_;
+    }
+
+    vector<string> keys()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return keys_;
+    }
+
+private:
+    mutex mutex_;
+    condition_variable cond_;
+    bool blocked_;
+    int writes_in_progress_;
+    map<string, string> values_;
+    vector<string> keys_;
+};
+
+}  // namespace
+
+TEST(write_behind_queue, basic)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 1000);
+
+    EXPECT_FALSE(q.get("a"));
+    q.put("a", "1");
+    q.put("b", "2");
+    q.flush();
+
+    auto values = store.values();
+    ASSERT_EQ(2u, values.size());
+    EXPECT_EQ("1", values["a"]);
+    EXPECT_EQ("2", values["b"]);
+    EXPECT_FALSE(q.get("a"));  // Written, so no longer queued.
+
+    auto s = q.stats();
+    EXPECT_EQ(0, s.queued);
+    EXPECT_EQ(0, s.queued_bytes);
+    EXPECT_EQ(2, s.written);
+    EXPECT_LE(1, s.batches);
+    EXPECT_EQ(0, s.coalesced);
+    EXPECT_EQ(0, s.stalls);
+    EXPECT_EQ(0, s.failures);
+}
+
+TEST(write_behind_queue, queued_entries_are_visible)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 1000);
+
+    store.block();
+    q.put("a", "1");
+    store.wait_for_writer();  // "a" is being written.
+    q.put("b", "2");
+    q.put("c", "3");
+
+    EXPECT_EQ("1", *q.get("a"));
+    EXPECT_EQ("2", *q.get("b"));
+    EXPECT_EQ("3", *q.get("c"));
+    EXPECT_TRUE(store.values().empty());
+
+    auto s = q.stats();
+    EXPECT_EQ(3, s.queued);
+    EXPECT_EQ(6, s.queued_bytes);
+
+    // A new value for a key that is being written goes into the next batch, and get() returns the new value.
+    q.put("a", "4");
+    EXPECT_EQ("4", *q.get("a"));
+
+    store.unblock();
+    q.flush();
+    EXPECT_EQ("4", store.values()["a"]);
+    EXPECT_EQ((vector<string>{ "a", "b", "c", "a" }), store.keys());
+    EXPECT_EQ(2, q.stats().batches);
+}
+
+TEST(write_behind_queue, coalescing)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 1000);
+
+    store.block();
+    q.put("x", "");
+    store.wait_for_writer();
+    for (int i = 0; i < 10; ++i)
+    {
+        q.put("a", to_string(i));
+        q.put("b", "b" + to_string(i));
+    }
+    EXPECT_EQ(3, q.stats().queued);
+    EXPECT_EQ("9", *q.get("a"));
+
+    store.unblock();
+    q.flush();
+    EXPECT_EQ((vector<string>{ "x", "a", "b" }), store.keys());
+    EXPECT_EQ("9", store.values()["a"]);
+    EXPECT_EQ("b9", store.values()["b"]);
+
+    auto s = q.stats();
+    EXPECT_EQ(3, s.written);
+    EXPECT_EQ(18, s.coalesced);
+}
+
+TEST(write_behind_queue, bounded)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 100);
+
+    store.block();
+    q.put("a", string(49, 'a'));
+    store.wait_for_writer();
+    q.put("b", string(49, 'b'));  // Queue is full now.
+
+    auto f = async(launch::async, [&q]{ q.put("c", string(49, 'c')); });
+    EXPECT_EQ(future_status::timeout, f.wait_for(chrono::milliseconds(200)));
+    EXPECT_EQ(1, q.stats().stalls);
+    EXPECT_FALSE(q.get("c"));
+
+    store.unblock();
+    f.get();
+    q.flush();
+    EXPECT_EQ(3u, store.values().size());
+
+    // An entry that doesn't fit still goes through if the queue is empty.
+    q.put("big", string(1000, 'x'));
+    q.flush();
+    EXPECT_EQ(string(1000, 'x'), store.values()["big"]);
+    EXPECT_EQ(1, q.stats().stalls);
+}
+
+TEST(write_behind_queue, clear)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 1000);
+
+    store.block();
+    q.put("a", "1");
+    store.wait_for_writer();
+    q.put("b", "2");
+    q.clear();
+    EXPECT_FALSE(q.get("b"));
+    EXPECT_EQ("1", *q.get("a"));  // Already being written.
+
+    store.unblock();
+    q.flush();
+    EXPECT_EQ((vector<string>{ "a" }), store.keys());
+}
+
+TEST(write_behind_queue, write_failure)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 1000);
+
+    q.put("bad", "1");
+    q.put("good", "2");
+    q.flush();
+    EXPECT_EQ((vector<string>{ "good" }), store.keys());
+    EXPECT_EQ(1, q.stats().failures);
+}
+
+TEST(write_behind_queue, destructor_drains_queue)
+{
+    Store store;
+    {
+        WriteBehindQueue q(store.write_func(), 1000);
+        store.block();
+        q.put("a", "1");
+        store.wait_for_writer();
+        q.put("b", "2");
+        q.put("c", "3");
+        store.unblock();
+    }
+    EXPECT_EQ((vector<string>{ "a", "b", "c" }), store.keys());
+}
+
+TEST(write_behind_queue, concurrent_puts)
+{
+    Store store;
+    WriteBehindQueue q(store.write_func(), 500);
+
+    vector<future<void>> futures;
+    for (int t = 0; t < 4; ++t)
+    {
+        futures.emplace_back(async(launch::async, [&q, t]
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                string key = to_string(t) + "-" + to_string(i % 50);
+                q.put(key, to_string(i));
+                auto value = q.get(key);
+                EXPECT_TRUE(!value || stoi(*value) <= i) << key;
+            }
+        }));
+    }
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+    q.flush();
+
+    auto values = store.values();
+    ASSERT_EQ(200u, values.size());
+    for (int t = 0; t < 4; ++t)
+    {
+        for (int k = 0; k < 50; ++k)
+        {
+            EXPECT_EQ(to_string(950 + k), values[to_string(t) + "-" + to_string(k)]);
+        }
+    }
+}